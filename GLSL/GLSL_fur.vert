@@ -14,6 +14,10 @@ layout(std140, set= DSET_GLOBAL , binding= BINDING_MATRIX ) uniform matrixBuffer
    mat4 mV;
    mat4 mP;
 } matrix;
+// MatrixBufferObject of renderer_base.h: in the uniform ring, like matrix
+layout(std140, set= DSET_OBJECT , binding= BINDING_MATRIXOBJ ) uniform matrixObjBuffer {
+   mat4 mO;
+} object;
 
 layout(location=0) in  vec3 P;
 layout(location=1) in  vec3 N;
@@ -25,8 +29,8 @@ out gl_PerVertex {
 };
 void main()
 {
-   gl_Position = matrix.mP * (matrix.mV * ( vec4(P, 1.0)));
-   vec3 NV = (matrix.mV * ( vec4(N, 0.0))).xyz;
+   gl_Position = matrix.mP * (matrix.mV * (object.mO * vec4(P, 1.0)));
+   vec3 NV = (matrix.mV * (object.mO * vec4(N, 0.0))).xyz;
    float diff = abs(NV.x);
    outCol = vec4(diff * col.rgb, col.a);
 }
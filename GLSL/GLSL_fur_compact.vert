@@ -0,0 +1,75 @@
+#version 440 core
+#extension GL_ARB_separate_shader_objects : enable
+
+#define DSET_GLOBAL  0
+#   define BINDING_MATRIX 0
+#   define BINDING_LIGHT  1
+#   define BINDING_STRANDATTR 2
+#   define BINDING_STRANDCTRL 3
+
+#define DSET_OBJECT  1
+#   define BINDING_MATRIXOBJ   0
+#   define BINDING_MATERIAL    1
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+layout(std140, set= DSET_GLOBAL , binding= BINDING_MATRIX ) uniform matrixBuffer {
+   mat4 mV;
+   mat4 mP;
+   vec4 furCenter;
+   vec4 furHalfExtent;
+   ivec4 furInfo; // x: vertices per strand; y: nsteps
+} matrix;
+// MatrixBufferObject of renderer_base.h: in the uniform ring, like matrix
+layout(std140, set= DSET_OBJECT , binding= BINDING_MATRIXOBJ ) uniform matrixObjBuffer {
+   mat4 mO;
+} object;
+
+struct StrandAttr {
+   vec4 n;   // w: thickness
+   vec4 col;
+};
+layout(std430, set= DSET_GLOBAL , binding= BINDING_STRANDATTR ) readonly buffer strandAttrBuffer {
+   StrandAttr strands[];
+};
+
+layout(location=0) in  vec4 Pq; // 16 bits snorm in the fur bounds
+layout(location=0) out vec4 outCol;
+
+out gl_PerVertex {
+    vec4  gl_Position;
+};
+void main()
+{
+   int vertsPerStrand = matrix.furInfo.x;
+   int nsteps = matrix.furInfo.y;
+   // rows of 2 vertices, the tip belongs to the last row
+   int strand = gl_VertexIndex / vertsPerStrand;
+   int row = min((gl_VertexIndex % vertsPerStrand) / 2, nsteps);
+   float alpha = 1.0 - float(row) / float(nsteps);
+
+   vec3 P = matrix.furCenter.xyz + Pq.xyz * matrix.furHalfExtent.xyz;
+   vec3 N = strands[strand].n.xyz;
+   gl_Position = matrix.mP * (matrix.mV * (object.mO * vec4(P, 1.0)));
+   vec3 NV = (matrix.mV * (object.mO * vec4(N, 0.0))).xyz;
+   float diff = abs(NV.x);
+   outCol = vec4(diff * strands[strand].col.rgb, alpha);
+}
+
+/*
+ * Copyright (c) 2016-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2016-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
\ No newline at end of file
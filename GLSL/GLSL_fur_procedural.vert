@@ -0,0 +1,114 @@
+#version 440 core
+#extension GL_ARB_separate_shader_objects : enable
+
+#define DSET_GLOBAL  0
+#   define BINDING_MATRIX 0
+#   define BINDING_LIGHT  1
+#   define BINDING_STRANDATTR 2
+#   define BINDING_STRANDCTRL 3
+
+#define DSET_OBJECT  1
+#   define BINDING_MATRIXOBJ   0
+#   define BINDING_MATERIAL    1
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+layout(std140, set= DSET_GLOBAL , binding= BINDING_MATRIX ) uniform matrixBuffer {
+   mat4 mV;
+   mat4 mP;
+   vec4 furCenter;
+   vec4 furHalfExtent;
+   ivec4 furInfo; // y: nsteps (of the LOD level); z: nsteps of level 0
+} matrix;
+// MatrixBufferObject of renderer_base.h: in the uniform ring, like matrix
+layout(std140, set= DSET_OBJECT , binding= BINDING_MATRIXOBJ ) uniform matrixObjBuffer {
+   mat4 mO;
+} object;
+
+struct StrandCtrl {
+   vec4 pos;  // w: curve (degrees)
+   vec4 dvec; // w: length
+   vec4 nvec; // w: thickness
+   vec4 col;
+};
+layout(std430, set= DSET_GLOBAL , binding= BINDING_STRANDCTRL ) readonly buffer strandCtrlBuffer {
+   StrandCtrl strands[];
+};
+
+layout(location=0) out vec4 outCol;
+
+out gl_PerVertex {
+    vec4  gl_Position;
+};
+
+// same as glm's quat * vec3
+vec3 rotate(vec4 q, vec3 v)
+{
+   vec3 uv = cross(q.xyz, v);
+   vec3 uuv = cross(q.xyz, uv);
+   return v + ((uv * q.w) + uuv) * 2.0;
+}
+//
+// One instance per strand; (nsteps+1) segments of 2 triangles, in the order
+// of buildStrand(). See furProceduralPosition() for the CPU version
+//
+void main()
+{
+   const int   cornerRow[6]  = int[6](0, 0, 1, 0, 1, 1);
+   const float cornerSide[6] = float[6](1.0, -1.0, 1.0, -1.0, -1.0, 1.0);
+   int nsteps = matrix.furInfo.y;
+   int segment = gl_VertexIndex / 6;
+   int corner = gl_VertexIndex % 6;
+   StrandCtrl s = strands[gl_InstanceIndex];
+
+   vec3 pos = s.pos.xyz;
+   vec3 dvec = s.dvec.xyz;
+   vec3 nvec = s.nvec.xyz;
+   float szx = s.nvec.w;
+   float szy = s.dvec.w / float(nsteps);
+   // inverse(angleAxis(curve, nvec)); fewer steps at lower LOD bend more each
+   float halfAngle = radians(s.pos.w * float(matrix.furInfo.z) / float(nsteps)) * 0.5;
+   vec4 q = vec4(nvec * sin(halfAngle), cos(halfAngle));
+   q = vec4(-q.xyz, q.w) / dot(q, q);
+   for(int i = 0; i < segment; i++)
+   {
+      szx *= 0.8;
+      pos = pos + dvec * szy;
+      dvec = rotate(q, dvec);
+   }
+   vec3 tvec = cross(dvec, nvec) * szx;
+   szx *= 0.8;
+   vec3 pos2 = pos + dvec * szy;
+   dvec = rotate(q, dvec);
+   vec3 P;
+   if(cornerRow[corner] == 0)
+      P = pos + tvec * cornerSide[corner];
+   else if(segment == nsteps)
+      P = pos + dvec * szy;
+   else
+      P = pos2 + cross(dvec, nvec) * szx * cornerSide[corner];
+
+   float alpha = 1.0 - float(segment) / float(nsteps);
+   gl_Position = matrix.mP * (matrix.mV * (object.mO * vec4(P, 1.0)));
+   vec3 NV = (matrix.mV * (object.mO * vec4(nvec, 0.0))).xyz;
+   float diff = abs(NV.x);
+   outCol = vec4(diff * s.col.rgb, alpha);
+}
+
+/*
+ * Copyright (c) 2016-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2016-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
\ No newline at end of file
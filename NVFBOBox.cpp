@@ -83,7 +83,10 @@ NVFBOBox::NVFBOBox() :
   //color_texture_ms(0),
   pngData(NULL),
   pngDataTile(NULL),
-  pngDataSz(0)
+  pngDataSz(0),
+  rtCacheBytes(0),
+  rtCacheBudget(NVFBOBOX_CACHE_BUDGET),
+  rtCacheHits(0), rtCacheMisses(0)
 {
 }
 NVFBOBox::~NVFBOBox()
@@ -125,6 +128,66 @@ void NVFBOBox::Finish()
 
 	depth_texture_ms=0;
 	depth_texture=0;
+	rtKeys.clear();
+	flushTextureCache(0);
+}
+/*-------------------------------------------------------------------------
+  the most recently released texture with the same key, else a new one
+  -------------------------------------------------------------------------*/
+GLuint NVFBOBox::acquireTexture(bool depth, int w, int h, int samples, int coverageSamples)
+{
+	RTKey key = { w, h, samples, coverageSamples, depth };
+	GLuint tex = 0;
+	for(int i=(int)rtCache.size()-1; i>=0; i--)
+	{
+		if(rtCache[i].key == key)
+		{
+			tex = rtCache[i].texture;
+			rtCacheBytes -= rtCache[i].bytes;
+			rtCache.erase(rtCache.begin() + i);
+			break;
+		}
+	}
+	if(tex)
+		rtCacheHits++;
+	else
+	{
+		rtCacheMisses++;
+		tex = depth ? texture::createDST(w, h, samples, coverageSamples) : texture::createRGBA8(w, h, samples, coverageSamples);
+	}
+	rtKeys[tex] = key;
+	return tex;
+}
+/*-------------------------------------------------------------------------
+  RGBA8 and D24S8: 4 bytes per sample
+  -------------------------------------------------------------------------*/
+void NVFBOBox::releaseTexture(GLuint tex)
+{
+	std::map<GLuint, RTKey>::iterator it = rtKeys.find(tex);
+	if(it == rtKeys.end())
+	{
+		texture::deleteTexture(tex);
+		return;
+	}
+	CachedTexture c = { it->second, tex, (size_t)it->second.w * it->second.h * 4 * (it->second.samples > 1 ? it->second.samples : 1) };
+	rtKeys.erase(it);
+	rtCache.push_back(c);
+	rtCacheBytes += c.bytes;
+	flushTextureCache(rtCacheBudget);
+}
+/*-------------------------------------------------------------------------
+  deletes the least recently released textures, down to budget bytes
+  -------------------------------------------------------------------------*/
+void NVFBOBox::flushTextureCache(size_t budget)
+{
+	size_t n = 0;
+	while(n < rtCache.size() && rtCacheBytes > budget)
+	{
+		rtCacheBytes -= rtCache[n].bytes;
+		texture::deleteTexture(rtCache[n].texture);
+		n++;
+	}
+	rtCache.erase(rtCache.begin(), rtCache.begin() + n);
 }
 /*-------------------------------------------------------------------------
 
@@ -144,7 +207,7 @@ bool NVFBOBox::initRT()
 		//
 		// init the texture that will also be the buffer to render to
 		//
-        tileData[i].color_texture = texture::createRGBA8(bufw, bufh, 1);
+        tileData[i].color_texture = acquireTexture(false, bufw, bufh, 1, 0);
         tileData[i].fb = fbo::create();
         fbo::attachTexture2D(tileData[i].fb, tileData[i].color_texture, 0, 1);
 		//
@@ -155,12 +218,12 @@ bool NVFBOBox::initRT()
             //now handle the FBO in MS resolution
             tileData[i].fbms = fbo::create();
 			// initialize color texture
-            tileData[i].color_texture_ms = texture::createRGBA8(bufw, bufh, depthSamples, coverageSamples);
+            tileData[i].color_texture_ms = acquireTexture(false, bufw, bufh, depthSamples, coverageSamples);
             fbo::attachTexture2D(tileData[i].fbms, tileData[i].color_texture_ms, 0, depthSamples);
 
 			// bind the multisampled depth buffer
 			if(depth_texture_ms == 0)
-                depth_texture_ms = texture::createDST(bufw, bufh, depthSamples, bCSAA ? coverageSamples:0);
+                depth_texture_ms = acquireTexture(true, bufw, bufh, depthSamples, bCSAA ? coverageSamples:0);
             fbo::attachDSTTexture2D(tileData[i].fbms, depth_texture_ms, depthSamples);
 			fbo::CheckStatus();
 
@@ -170,7 +233,7 @@ bool NVFBOBox::initRT()
 			// Create it one for many FBOs
 			if(depth_texture == 0)
 			{
-                depth_texture = texture::createDST(bufw, bufh, 1, 0);
+                depth_texture = acquireTexture(true, bufw, bufh, 1, 0);
 			}
             fbo::attachDSTTexture2D(tileData[i].fb, depth_texture, 1);
 		}
@@ -203,22 +266,9 @@ bool NVFBOBox::resize(int w, int h, float ssfact, int depthSamples_, int coverag
 	bool csaa = (coverageSamples > depthSamples) && (has_GL_NV_texture_multisample);
 	bool ret = true;
 
-	if(depth_texture)
-	{
-        texture::deleteTexture(depth_texture);
-        depth_texture = 0;
-	}
-	if(depth_texture_ms)
-    {
-        texture::deleteTexture(depth_texture_ms);
-        depth_texture_ms = 0;
-    }
-	//loop in tiles
+	// the textures go to the cache: the FBOs must let go of them first
 	for(unsigned int i=0; i<tileData.size(); i++)
 	{
-        if(tileData[i].color_texture_ms)
-            texture::deleteTexture(tileData[i].color_texture_ms);
-        texture::deleteTexture(tileData[i].color_texture);
         if(tileData[i].fbms)
         {
             fbo::detachColorTexture(tileData[i].fbms, 0, depthSamples);
@@ -229,15 +279,34 @@ bool NVFBOBox::resize(int w, int h, float ssfact, int depthSamples_, int coverag
             fbo::detachColorTexture(tileData[i].fb, 0, depthSamples);
             fbo::detachDSTTexture(tileData[i].fb, depthSamples);
         }
-        tileData[i].color_texture = texture::createRGBA8(bufw, bufh, 1);
+        if(tileData[i].color_texture_ms)
+            releaseTexture(tileData[i].color_texture_ms);
+        tileData[i].color_texture_ms = 0;
+        releaseTexture(tileData[i].color_texture);
+        tileData[i].color_texture = 0;
+	}
+	if(depth_texture)
+	{
+        releaseTexture(depth_texture);
+        depth_texture = 0;
+	}
+	if(depth_texture_ms)
+    {
+        releaseTexture(depth_texture_ms);
+        depth_texture_ms = 0;
+    }
+	//loop in tiles
+	for(unsigned int i=0; i<tileData.size(); i++)
+	{
+        tileData[i].color_texture = acquireTexture(false, bufw, bufh, 1, 0);
         fbo::attachTexture2D(tileData[i].fb, tileData[i].color_texture, 0, 1);
 		if (multisample) 
 		{
 			// initialize color texture
-            tileData[i].color_texture_ms = texture::createRGBA8(bufw, bufh, depthSamples, coverageSamples);
+            tileData[i].color_texture_ms = acquireTexture(false, bufw, bufh, depthSamples, coverageSamples);
             fbo::attachTexture2D(tileData[i].fbms, tileData[i].color_texture_ms, 0, depthSamples);
 	        if(depth_texture_ms == 0)
-                depth_texture_ms = texture::createDST(bufw, bufh, depthSamples, bCSAA ? coverageSamples:0);
+                depth_texture_ms = acquireTexture(true, bufw, bufh, depthSamples, bCSAA ? coverageSamples:0);
             fbo::attachDSTTexture2D(tileData[i].fbms, depth_texture_ms, depthSamples);
 			fbo::CheckStatus();
 
@@ -245,12 +314,14 @@ bool NVFBOBox::resize(int w, int h, float ssfact, int depthSamples_, int coverag
 		else // Depth buffer created without the need to resolve MSAA
 		{
 	        if(depth_texture == 0)
-                depth_texture = texture::createDST(bufw, bufh, 1, 0);
+                depth_texture = acquireTexture(true, bufw, bufh, 1, 0);
             fbo::attachDSTTexture2D(tileData[i].fb, depth_texture, 1);
 			fbo::CheckStatus();
 		}
 			
 	} // for i
+	LOGI("Render-target cache: %d hits, %d misses so far; %d textures (%.2f MB) kept\n",
+		rtCacheHits, rtCacheMisses, (int)rtCache.size(), rtCacheBytes / (1024.0 * 1024.0));
 	return ret; // TODO: return false if failed...
 }
 /*-------------------------------------------------------------------------
@@ -354,29 +425,34 @@ bool NVFBOBox::Initialize(int w, int h, float ssfact, int depthSamples_, int cov
 
 void NVFBOBox::MakeResourcesResident()
 {
+    // textures coming back from the cache are resident already
     GLuint64 handle;
 	for(unsigned int i=0; i<tileData.size(); i++)
 	{
 		if(tileData[i].color_texture_ms)
         {
             handle = glGetTextureHandleARB(tileData[i].color_texture_ms);
-            glMakeTextureHandleResidentARB(handle);
+            if(!glIsTextureHandleResidentARB(handle))
+                glMakeTextureHandleResidentARB(handle);
         }
 		if(tileData[i].color_texture)
         {
             handle = glGetTextureHandleARB(tileData[i].color_texture);
-            glMakeTextureHandleResidentARB(handle);
+            if(!glIsTextureHandleResidentARB(handle))
+                glMakeTextureHandleResidentARB(handle);
         }
 	}
 	if(depth_texture_ms) 
     {
         handle = glGetTextureHandleARB(depth_texture_ms);
-        glMakeTextureHandleResidentARB(handle);
+        if(!glIsTextureHandleResidentARB(handle))
+            glMakeTextureHandleResidentARB(handle);
     }
 	if(depth_texture)
     {
         handle = glGetTextureHandleARB(depth_texture);
-        glMakeTextureHandleResidentARB(handle);
+        if(!glIsTextureHandleResidentARB(handle))
+            glMakeTextureHandleResidentARB(handle);
     }
 }
 
@@ -43,6 +43,12 @@
 // Copyright (c) NVIDIA Corporation. All rights reserved.
 //--------------------------------------------------------------------------------------
 #include "GLSLShader.h"
+#include <map>
+
+// render-targets kept for later once released, at most that many bytes
+#ifndef NVFBOBOX_CACHE_BUDGET
+#define NVFBOBOX_CACHE_BUDGET (1024ull << 20)
+#endif
 
 #ifndef GL_FRAMEBUFFER_EXT
 #	define GL_FRAMEBUFFER_EXT				0x8D40
@@ -67,6 +73,8 @@ public:
     virtual bool resize(int w, int h, float ssfact=-1, int depthSamples_=-1, int coverageSamples_=-1);
     virtual void MakeResourcesResident();
 	virtual void Finish();
+	// bytes of released textures kept for reuse (NVFBOBOX_CACHE_BUDGET)
+	void setCacheBudget(size_t bytes) { rtCacheBudget = bytes; }
 
 	virtual int getTilesW();
 	virtual int getTilesH();
@@ -116,6 +124,33 @@ protected:
 	  GLuint		color_texture;
   };
   std::vector<TileData> tileData;
+  //
+  // textures released by resize(), least recently released first. Toggling
+  // SS or MSAA finds the previous ones back here
+  //
+  struct RTKey
+  {
+	  int		w, h;
+	  int		samples, coverageSamples;
+	  bool		depth;
+	  bool operator==(const RTKey &k) const {
+		  return w == k.w && h == k.h && samples == k.samples && coverageSamples == k.coverageSamples && depth == k.depth;
+	  }
+  };
+  struct CachedTexture
+  {
+	  RTKey		key;
+	  GLuint	texture;
+	  size_t	bytes;
+  };
+  std::vector<CachedTexture>	rtCache;
+  std::map<GLuint, RTKey>		rtKeys;		// of the textures in use
+  size_t		rtCacheBytes;
+  size_t		rtCacheBudget;
+  int			rtCacheHits, rtCacheMisses;
+  GLuint		acquireTexture(bool depth, int w, int h, int samples, int coverageSamples);
+  void			releaseTexture(GLuint texture);
+  void			flushTextureCache(size_t budget);
 
 	GLint  pngDataSz;	  // size of allocated memory
 	GLubyte *pngData;	  // temporary data for the full image (many tiles)
@@ -75,6 +75,7 @@ std::string vsPassthrough;
 /////////////////////////////////////////////
 
 NVFBOBoxVK::NVFBOBoxVK() : 
+  m_pnvk(NULL),
   bOneFBOPerTile(false),
   scaleFactor(1.0),
   depthSamples(0), coverageSamples(0),
@@ -86,7 +87,16 @@ NVFBOBoxVK::NVFBOBoxVK() :
   curtilex(0), curtiley(0),
   pngData(NULL),
   pngDataTile(NULL),
-  pngDataSz(0)
+  pngDataSz(0),
+  m_depthSampleView(NULL),
+  m_descPool(NULL),
+  m_outputs(1),
+  m_transientColor(false),
+  m_transientDepth(false),
+  m_cacheBytes(0),
+  m_cacheBudget(NVFBOBOX_CACHE_BUDGET),
+  m_cacheHits(0),
+  m_cacheMisses(0)
 {
 }
 NVFBOBoxVK::~NVFBOBoxVK()
@@ -112,7 +122,12 @@ void NVFBOBoxVK::Finish()
     // Free Vulkan resources
     //
     deleteRenderPass();
+    deleteDownsamplePass();
     deleteFramebufferAndRelated();
+    flushTargetCache(0);
+    // the device is idle: what got retired goes now, before m_cmdPool
+    if(m_pnvk)
+        m_pnvk->utCollectRetired(~0ull);
     if(m_sampler)
         m_pnvk->destroySampler(m_sampler);
     m_sampler = NULL;
@@ -123,14 +138,7 @@ void NVFBOBoxVK::Finish()
     if(m_descriptorSetLayout)
         vkDestroyDescriptorSetLayout(m_pnvk->m_device, m_descriptorSetLayout, NULL); // general layout and objects layout
     m_descriptorSetLayout = 0;
-    // Not calling it because VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT not set at creation time
-    //if(m_descriptorSet)
-    //    vkFreeDescriptorSets(m_pnvk->m_device, m_descPool, 1, &m_descriptorSet); // no really necessary: we will destroy the pool after that
-    m_descriptorSet = NULL;
-
-    if(m_descPool)
-        vkDestroyDescriptorPool(m_pnvk->m_device, m_descPool, NULL);
-    m_descPool = NULL;
+    // m_descPool and m_descriptorSet went with deleteFramebufferAndRelated()
 
     if(m_pipelineLayout)
         vkDestroyPipelineLayout(m_pnvk->m_device, m_pipelineLayout, NULL);
@@ -144,17 +152,22 @@ void NVFBOBoxVK::Finish()
 -------------------------------------------------------------------------*/
 bool NVFBOBoxVK::deleteRenderPass()
 {
+  // frames in flight may still use it
   if (m_scenePass)
-    vkDestroyRenderPass(m_pnvk->m_device, m_scenePass, NULL);
+    m_pnvk->utRetire(VK_OBJECT_TYPE_RENDER_PASS, (uint64_t)m_scenePass);
   m_scenePass = NULL;
+  return true;
+}
+bool NVFBOBoxVK::deleteDownsamplePass()
+{
   if (m_downsamplePass)
-    vkDestroyRenderPass(m_pnvk->m_device, m_downsamplePass, NULL);
+    m_pnvk->utRetire(VK_OBJECT_TYPE_RENDER_PASS, (uint64_t)m_downsamplePass);
   m_downsamplePass = NULL;
 
   for (int i = 0; i<3; i++)
   {
     if(m_pipelines[i])
-      m_pnvk->destroyPipeline(m_pipelines[i], NULL);
+      m_pnvk->utRetire(VK_OBJECT_TYPE_PIPELINE, (uint64_t)m_pipelines[i]);
     m_pipelines[i] = NULL;
   }
   return true;
@@ -162,11 +175,9 @@ bool NVFBOBoxVK::deleteRenderPass()
 /*-------------------------------------------------------------------------
 
 -------------------------------------------------------------------------*/
-bool NVFBOBoxVK::initRenderPass()
+VkRenderPass NVFBOBoxVK::createScenePass(int samples)
 {
-  deleteRenderPass();
-
-  bool multisample = depthSamples > 1;
+  bool multisample = samples > 1;
   //
   // Create the render passes for the scene-render
   //
@@ -180,16 +191,19 @@ bool NVFBOBoxVK::initRenderPass()
     //
     // Multisample case: have a color buffer as the resolve-target
     //
+    // transient attachments: only the resolved color leaves the pass
+    VkAttachmentStoreOp colorStore = m_transientColor ? VK_ATTACHMENT_STORE_OP_DONT_CARE : VK_ATTACHMENT_STORE_OP_STORE;
+    VkAttachmentStoreOp depthStore = m_transientDepth ? VK_ATTACHMENT_STORE_OP_DONT_CARE : VK_ATTACHMENT_STORE_OP_STORE;
     rpinfo = NVK::RenderPassCreateInfo(
       NVK::AttachmentDescription
-      (VK_FORMAT_R8G8B8A8_UNORM, (VkSampleCountFlagBits)depthSamples,                             //format, samples
-        VK_ATTACHMENT_LOAD_OP_CLEAR, VK_ATTACHMENT_STORE_OP_STORE,          //loadOp, storeOp
+      (VK_FORMAT_R8G8B8A8_UNORM, (VkSampleCountFlagBits)samples,                                  //format, samples
+        VK_ATTACHMENT_LOAD_OP_CLEAR, colorStore,                            //loadOp, storeOp
         VK_ATTACHMENT_LOAD_OP_DONT_CARE, VK_ATTACHMENT_STORE_OP_DONT_CARE,  //stencilLoadOp, stencilStoreOp
         VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL //initialLayout, finalLayout
       )
-      (VK_FORMAT_D24_UNORM_S8_UINT, (VkSampleCountFlagBits)depthSamples,
-        VK_ATTACHMENT_LOAD_OP_CLEAR, VK_ATTACHMENT_STORE_OP_STORE,
-        VK_ATTACHMENT_LOAD_OP_CLEAR, VK_ATTACHMENT_STORE_OP_STORE,
+      (VK_FORMAT_D24_UNORM_S8_UINT, (VkSampleCountFlagBits)samples,
+        VK_ATTACHMENT_LOAD_OP_CLEAR, depthStore,
+        VK_ATTACHMENT_LOAD_OP_CLEAR, depthStore,
         VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL
         )
         (VK_FORMAT_R8G8B8A8_UNORM, (VkSampleCountFlagBits)1,                                        //format, samples
@@ -237,11 +251,29 @@ bool NVFBOBoxVK::initRenderPass()
       NVK::SubpassDependency(/*NONE*/)
     );
   }
-  m_scenePass = m_pnvk->createRenderPass(rpinfo);
+  return m_pnvk->createRenderPass(rpinfo);
+}
+/*-------------------------------------------------------------------------
+
+-------------------------------------------------------------------------*/
+bool NVFBOBoxVK::initRenderPass()
+{
+  deleteRenderPass();
+  m_scenePass = createScenePass(depthSamples);
+  return m_scenePass != NULL;
+}
+/*-------------------------------------------------------------------------
+
+-------------------------------------------------------------------------*/
+bool NVFBOBoxVK::initDownsamplePass()
+{
+  deleteDownsamplePass();
   //
-  // Create the render pass for downsampling step: just a color buffer
+  // Create the render pass for downsampling step: just a color buffer. It
+  // doesn't depend on MSAA: setMSAA() keeps it, with its pipelines
   //
-  rpinfo = NVK::RenderPassCreateInfo(
+  NVK::AttachmentReference color(0/*attachment*/, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL/*layout*/);
+  NVK::RenderPassCreateInfo rpinfo(
     NVK::AttachmentDescription
     (VK_FORMAT_R8G8B8A8_UNORM, VK_SAMPLE_COUNT_1_BIT,                                        //format, samples
       VK_ATTACHMENT_LOAD_OP_CLEAR, VK_ATTACHMENT_STORE_OP_STORE,          //loadOp, storeOp
@@ -266,12 +298,14 @@ bool NVFBOBoxVK::initRenderPass()
     NVK::Rect2DArray(0.0f, 0.0f, (float)width, (float)height)
   );
   //
-  // GRID gfx pipelines
+  // GRID gfx pipelines: they only differ by their fragment shader, the first
+  // one is the base of the 2 others
   //
   for(int i=0; i<3; i++)
   {
+      VkPipelineCreateFlags flags = i == 0 ? VK_PIPELINE_CREATE_ALLOW_DERIVATIVES_BIT : VK_PIPELINE_CREATE_DERIVATIVE_BIT;
       m_pipelines[i] = m_pnvk->createGraphicsPipeline(NVK::GraphicsPipelineCreateInfo
-          (m_pipelineLayout, m_downsamplePass,/*subpass*/0,/*basePipelineHandle*/0,/*basePipelineIndex*/0,/*flags*/0)
+          (m_pipelineLayout, m_downsamplePass,/*subpass*/0,/*basePipelineHandle*/i == 0 ? VK_NULL_HANDLE : m_pipelines[0],/*basePipelineIndex*/-1,flags)
           (NVK::PipelineVertexInputStateCreateInfo(
               NVK::VertexInputBindingDescription    (0/*binding*/, 2*sizeof(glm::vec3)/*stride*/, VK_VERTEX_INPUT_RATE_VERTEX),
               NVK::VertexInputAttributeDescription  (0/*location*/, 0/*binding*/, VK_FORMAT_R32G32B32_SFLOAT, 0            /*offset*/ ) // pos
@@ -296,35 +330,53 @@ bool NVFBOBoxVK::initRenderPass()
   -------------------------------------------------------------------------*/
 bool NVFBOBoxVK::deleteFramebufferAndRelated()
 {
+    //
+    // nothing is destroyed right away: the frames in flight may still use it.
+    // It is retired, the images go back to the cache once they are done
     //
     //loop in tiles
     //
     for(unsigned int i=0; i<m_tileData.size(); i++)
     {
         if(m_tileData[i].FBSS)
-            vkDestroyFramebuffer(m_pnvk->m_device, m_tileData[i].FBSS, NULL);
+            m_pnvk->utRetire(VK_OBJECT_TYPE_FRAMEBUFFER, (uint64_t)m_tileData[i].FBSS);
         m_tileData[i].FBSS = NULL;
-        if(m_tileData[i].FBDS)
-            vkDestroyFramebuffer(m_pnvk->m_device, m_tileData[i].FBDS, NULL);
-        m_tileData[i].FBDS = NULL;
-        if(m_tileData[i].color_texture_DS.img)
-            release(m_tileData[i].color_texture_DS);
+        for(int o=0; o<NVFBOBOX_MAX_OUTPUTS; o++)
+        {
+            if(m_tileData[i].FBDS[o])
+                m_pnvk->utRetire(VK_OBJECT_TYPE_FRAMEBUFFER, (uint64_t)m_tileData[i].FBDS[o]);
+            m_tileData[i].FBDS[o] = NULL;
+            if(m_tileData[i].color_texture_DS[o].img)
+                releaseTarget(m_tileData[i].color_texture_DS[o]);
+        }
         if(m_tileData[i].color_texture_SS.img)
-            release(m_tileData[i].color_texture_SS);
+            releaseTarget(m_tileData[i].color_texture_SS);
         if(m_tileData[i].color_texture_SSMS.img)
-            release(m_tileData[i].color_texture_SSMS);
+            releaseTarget(m_tileData[i].color_texture_SSMS);
     }
+    if(m_depthSampleView)
+        m_pnvk->utRetire(VK_OBJECT_TYPE_IMAGE_VIEW, (uint64_t)m_depthSampleView);
+    m_depthSampleView = NULL;
     if(m_depth_texture_SSMS.img)
-        release(m_depth_texture_SSMS);
+        releaseTarget(m_depth_texture_SSMS);
     if(m_depth_texture_SS.img)
-        release(m_depth_texture_SS);
+        releaseTarget(m_depth_texture_SS);
 
-    for(int i=0; i<3; i++)
+    for(int o=0; o<NVFBOBOX_MAX_OUTPUTS; o++)
     {
-        if(m_cmdDownsample[i])
-            m_cmdPool.utFreeCommandBuffer(m_cmdDownsample[i]);
-        m_cmdDownsample[i] = NULL;
+        for(int i=0; i<3; i++)
+        {
+            if(m_cmdDownsample[o][i])
+                m_pnvk->utRetire(&m_cmdPool, m_cmdDownsample[o][i]);
+            m_cmdDownsample[o][i] = NULL;
+        }
     }
+    // the descriptor set can't be updated while the downsampling of a frame
+    // in flight reads it: each framebuffer setup gets a pool of its own
+    if(m_descPool)
+        m_pnvk->utRetire(VK_OBJECT_TYPE_DESCRIPTOR_POOL, (uint64_t)m_descPool);
+    m_descPool = NULL;
+    m_descriptorSet = NULL;
 
     return true;
 }
@@ -350,41 +402,18 @@ bool NVFBOBoxVK::initFramebufferAndRelated()
         //
         // init the texture that will also be the buffer to render to
         //
-        m_tileData[i].color_texture_SS.img        = m_pnvk->utCreateImage2D(bufw, bufh, m_tileData[i].color_texture_SS.imgMem, VK_FORMAT_R8G8B8A8_UNORM);
-        m_tileData[i].color_texture_SS.imgView    = m_pnvk->createImageView(NVK::ImageViewCreateInfo(
-            m_tileData[i].color_texture_SS.img, // image
-            VK_IMAGE_VIEW_TYPE_2D, //viewType
-            VK_FORMAT_R8G8B8A8_UNORM, //format
-            NVK::ComponentMapping(),//channels
-            NVK::ImageSubresourceRange()//subresourceRange
-            ) );
+        acquireTarget(m_tileData[i].color_texture_SS, bufw, bufh, VK_FORMAT_R8G8B8A8_UNORM, 1, false, VK_IMAGE_ASPECT_COLOR_BIT);
         //
         // Handle multisample FBO's first
         //
         if (multisample) 
         {
             // initialize color texture
-            m_tileData[i].color_texture_SSMS.img        = m_pnvk->utCreateImage2D(bufw, bufh, m_tileData[i].color_texture_SSMS.imgMem, VK_FORMAT_R8G8B8A8_UNORM, (VkSampleCountFlagBits)depthSamples, (VkSampleCountFlagBits)coverageSamples);
-            m_tileData[i].color_texture_SSMS.imgView    = m_pnvk->createImageView(NVK::ImageViewCreateInfo(
-                m_tileData[i].color_texture_SSMS.img, // image
-                VK_IMAGE_VIEW_TYPE_2D, //viewType
-                VK_FORMAT_R8G8B8A8_UNORM, //format
-                NVK::ComponentMapping(),//channels
-                NVK::ImageSubresourceRange()//subresourceRange
-                ) );
+            acquireTarget(m_tileData[i].color_texture_SSMS, bufw, bufh, VK_FORMAT_R8G8B8A8_UNORM, depthSamples, m_transientColor, VK_IMAGE_ASPECT_COLOR_BIT);
 
             // bind the multisampled depth buffer
             if(m_depth_texture_SSMS.img == 0)
-            {
-                m_depth_texture_SSMS.img      = m_pnvk->utCreateImage2D(bufw, bufh, m_depth_texture_SSMS.imgMem, VK_FORMAT_D24_UNORM_S8_UINT, (VkSampleCountFlagBits)depthSamples, (VkSampleCountFlagBits)(bCSAA ? coverageSamples:0));
-                m_depth_texture_SSMS.imgView  = m_pnvk->createImageView(NVK::ImageViewCreateInfo(
-                    m_depth_texture_SSMS.img, // image
-                    VK_IMAGE_VIEW_TYPE_2D, //viewType
-                    VK_FORMAT_D24_UNORM_S8_UINT, //format
-                    NVK::ComponentMapping(),//channels
-                    NVK::ImageSubresourceRange(VK_IMAGE_ASPECT_DEPTH_BIT|VK_IMAGE_ASPECT_STENCIL_BIT)//subresourceRange
-                    ) );
-            }
+                acquireTarget(m_depth_texture_SSMS, bufw, bufh, VK_FORMAT_D24_UNORM_S8_UINT, depthSamples, m_transientDepth, VK_IMAGE_ASPECT_DEPTH_BIT|VK_IMAGE_ASPECT_STENCIL_BIT);
             //
             // create the framebuffer
             //
@@ -401,16 +430,7 @@ bool NVFBOBoxVK::initFramebufferAndRelated()
         {
             // Create it one for many FBOs
             if(m_depth_texture_SS.img == NULL)
-            {
-                m_depth_texture_SS.img      = m_pnvk->utCreateImage2D(bufw, bufh, m_depth_texture_SS.imgMem, VK_FORMAT_D24_UNORM_S8_UINT);
-                m_depth_texture_SS.imgView  = m_pnvk->createImageView(NVK::ImageViewCreateInfo(
-                    m_depth_texture_SS.img, // image
-                    VK_IMAGE_VIEW_TYPE_2D, //viewType
-                    VK_FORMAT_D24_UNORM_S8_UINT, //format
-                    NVK::ComponentMapping(),//channels
-                    NVK::ImageSubresourceRange()//subresourceRange
-                    ) );
-            }
+                acquireTarget(m_depth_texture_SS, bufw, bufh, VK_FORMAT_D24_UNORM_S8_UINT, 1, false, VK_IMAGE_ASPECT_DEPTH_BIT|VK_IMAGE_ASPECT_STENCIL_BIT);
             //
             // create the framebuffer
             //
@@ -423,26 +443,73 @@ bool NVFBOBoxVK::initFramebufferAndRelated()
             );
         }
         //
-        // create the framebuffer for downsampling
+        // create the framebuffers for downsampling: one per output
         //
-        m_tileData[i].color_texture_DS.img        = m_pnvk->utCreateImage2D(width, height, m_tileData[i].color_texture_DS.imgMem, VK_FORMAT_R8G8B8A8_UNORM);
-        m_tileData[i].color_texture_DS.imgView    = m_pnvk->createImageView(NVK::ImageViewCreateInfo(
-            m_tileData[i].color_texture_DS.img, // image
+        for(int o=0; o<m_outputs; o++)
+        {
+            ImgO &color_texture_DS = m_tileData[i].color_texture_DS[o];
+            acquireTarget(color_texture_DS, width, height, VK_FORMAT_R8G8B8A8_UNORM, 1, false, VK_IMAGE_ASPECT_COLOR_BIT);
+            m_tileData[i].FBDS[o] = m_pnvk->createFramebuffer(
+                NVK::FramebufferCreateInfo
+                (   m_downsamplePass,       //renderPass
+                    width, height, 1,          //width, height, layers
+                    (color_texture_DS.imgView)
+                )
+            );
+        }
+            
+    } // for i
+    //
+    // view of the depth alone, for shaders to sample it (hierarchical-Z...)
+    //
+    VkImage depthImage = getDepthImage();
+    if(depthImage && !(multisample && m_transientDepth) && m_pnvk->utFormatSampled(VK_FORMAT_D24_UNORM_S8_UINT))
+    {
+        m_depthSampleView = m_pnvk->createImageView(NVK::ImageViewCreateInfo(
+            depthImage, // image
             VK_IMAGE_VIEW_TYPE_2D, //viewType
-            VK_FORMAT_R8G8B8A8_UNORM, //format
+            VK_FORMAT_D24_UNORM_S8_UINT, //format
             NVK::ComponentMapping(),//channels
-            NVK::ImageSubresourceRange()//subresourceRange
+            NVK::ImageSubresourceRange(VK_IMAGE_ASPECT_DEPTH_BIT)//subresourceRange
             ) );
-        m_tileData[i].FBDS = m_pnvk->createFramebuffer(
-            NVK::FramebufferCreateInfo
-            (   m_downsamplePass,       //renderPass
-                width, height, 1,          //width, height, layers
-                (m_tileData[i].color_texture_DS.imgView)
-            )
-        );
-            
-    } // for i
+    }
 
+    //
+    // memory of the MSAA attachments, and how much of it the transient ones
+    // spare by being lazily allocated
+    //
+    if(multisample)
+    {
+        VkDeviceSize msaaBytes = 0;
+        VkDeviceSize lazyBytes = 0;
+        for(unsigned int i=0; i<m_tileData.size(); i++)
+        {
+            NVK::Allocation* mem = m_tileData[i].color_texture_SSMS.imgMem;
+            msaaBytes += mem->size;
+            lazyBytes += m_pnvk->utLazilyAllocated(mem) ? mem->size : 0;
+        }
+        msaaBytes += m_depth_texture_SSMS.imgMem->size;
+        lazyBytes += m_pnvk->utLazilyAllocated(m_depth_texture_SSMS.imgMem) ? m_depth_texture_SSMS.imgMem->size : 0;
+        LOGI("MSAA attachments %dx%d %dx (transient color %d, depth %d): %.2f MB, %.2f MB of them lazily allocated\n",
+            bufw, bufh, depthSamples, m_transientColor, m_transientDepth,
+            msaaBytes / (1024.0 * 1024.0), lazyBytes / (1024.0 * 1024.0));
+    }
+    LOGI("Render-target cache: %d hits, %d misses so far; %d images (%.2f MB) kept\n",
+        m_cacheHits, m_cacheMisses, (int)m_targetCache.size(), m_cacheBytes / (1024.0 * 1024.0));
+
+    //
+    // Descriptor Pool: size is 3 to have enough for global; object and ...
+    // TODO: try other VkDescriptorType
+    //
+    m_descPool = m_pnvk->createDescriptorPool(NVK::DescriptorPoolCreateInfo(
+        2, NVK::DescriptorPoolSize
+            (VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 2)
+            (VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 2) )
+        );
+    //
+    // DescriptorSet allocation
+    //
+    m_pnvk->allocateDescriptorSets( NVK::DescriptorSetAllocateInfo(m_descPool,1, &m_descriptorSetLayout), &m_descriptorSet);
     //
     // update the descriptorset used for Global
     // later we will update the ones local to objects
@@ -462,36 +529,101 @@ bool NVFBOBoxVK::initFramebufferAndRelated()
     // command buffer
     // Warning: depends on the render-pass and frame-buffers
     //
-    for(int i=0; i<3; i++)
+    for(int o=0; o<m_outputs; o++)
     {
-        if(m_cmdDownsample[i])
-            m_cmdPool.utFreeCommandBuffer(m_cmdDownsample[i]);
-        m_cmdDownsample[i] = m_cmdPool.utAllocateCommandBuffer(true);
+        for(int i=0; i<3; i++)
         {
-            m_cmdDownsample[i].beginCommandBuffer(false, NVK::CommandBufferInheritanceInfo(m_downsamplePass, 0, m_tileData[0].FBDS, 0/*occlusionQueryEnable*/, 0/*queryFlags*/, 0/*pipelineStatistics*/) );
-
-            VkRect2D viewRect = NVK::Rect2D(NVK::Offset2D(0,0), NVK::Extent2D(width, height));
-            float v2[2] = {1.0f/(float)bufw, 1.0f/(float)bufh };
-            vkCmdUpdateBuffer       (m_cmdDownsample[i], m_texInfo.buffer, 0, sizeof(float)*2, (uint32_t*)&v2[0]);
-            vkCmdBeginRenderPass    (m_cmdDownsample[i],
-                NVK::RenderPassBeginInfo(m_downsamplePass, m_tileData[0].FBDS, viewRect,
-                    NVK::ClearValue(NVK::ClearColorValue(0.8f,0.2f,0.2f,0.0f)) ), 
-                VK_SUBPASS_CONTENTS_INLINE );
-            vkCmdBindPipeline(m_cmdDownsample[i], VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelines[i]); 
-            vkCmdSetViewport(m_cmdDownsample[i], 0, 1, NVK::Viewport(0,0,width, height, 0.0f, 1.0f) );
-            vkCmdSetScissor( m_cmdDownsample[i], 0, 1, NVK::Rect2D(0.0,0.0, width, height) );
-            VkDeviceSize vboffsets[1] = {0};
-            vkCmdBindVertexBuffers(m_cmdDownsample[i], 0, 1, &m_quadBuffer.buffer, vboffsets);
-            uint32_t offsets = 0;
-            vkCmdBindDescriptorSets(m_cmdDownsample[i], VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineLayout, 0, 1, &m_descriptorSet, 0, &offsets);
-            vkCmdDraw(m_cmdDownsample[i], 4, 1, 0, 0);
-            vkCmdEndRenderPass(m_cmdDownsample[i]);
-            vkEndCommandBuffer(m_cmdDownsample[i]);
+            if(m_cmdDownsample[o][i])
+                m_cmdPool.utFreeCommandBuffer(m_cmdDownsample[o][i]);
+            m_cmdDownsample[o][i] = m_cmdPool.utAllocateCommandBuffer(true);
+            {
+                m_cmdDownsample[o][i].beginCommandBuffer(false, NVK::CommandBufferInheritanceInfo(m_downsamplePass, 0, m_tileData[0].FBDS[o], 0/*occlusionQueryEnable*/, 0/*queryFlags*/, 0/*pipelineStatistics*/) );
+
+                VkRect2D viewRect = NVK::Rect2D(NVK::Offset2D(0,0), NVK::Extent2D(width, height));
+                float v2[2] = {1.0f/(float)bufw, 1.0f/(float)bufh };
+                vkCmdUpdateBuffer       (m_cmdDownsample[o][i], m_texInfo.buffer, 0, sizeof(float)*2, (uint32_t*)&v2[0]);
+                vkCmdBeginRenderPass    (m_cmdDownsample[o][i],
+                    NVK::RenderPassBeginInfo(m_downsamplePass, m_tileData[0].FBDS[o], viewRect,
+                        NVK::ClearValue(NVK::ClearColorValue(0.8f,0.2f,0.2f,0.0f)) ), 
+                    VK_SUBPASS_CONTENTS_INLINE );
+                vkCmdBindPipeline(m_cmdDownsample[o][i], VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelines[i]); 
+                vkCmdSetViewport(m_cmdDownsample[o][i], 0, 1, NVK::Viewport(0,0,width, height, 0.0f, 1.0f) );
+                vkCmdSetScissor( m_cmdDownsample[o][i], 0, 1, NVK::Rect2D(0.0,0.0, width, height) );
+                VkDeviceSize vboffsets[1] = {0};
+                vkCmdBindVertexBuffers(m_cmdDownsample[o][i], 0, 1, &m_quadBuffer.buffer, vboffsets);
+                uint32_t offsets = 0;
+                vkCmdBindDescriptorSets(m_cmdDownsample[o][i], VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineLayout, 0, 1, &m_descriptorSet, 0, &offsets);
+                vkCmdDraw(m_cmdDownsample[o][i], 4, 1, 0, 0);
+                vkCmdEndRenderPass(m_cmdDownsample[o][i]);
+                vkEndCommandBuffer(m_cmdDownsample[o][i]);
+            }
         }
     }
 
     return ret;
 }
+/*-------------------------------------------------------------------------
+  the most recently released image with the same key, else a new one
+  -------------------------------------------------------------------------*/
+void NVFBOBoxVK::acquireTarget(ImgO &imgo, int w, int h, VkFormat format, int samples, bool transient, VkImageAspectFlags aspect)
+{
+    TargetKey key = { w, h, format, samples, transient, aspect };
+    for(int i=(int)m_targetCache.size()-1; i>=0; i--)
+    {
+        // a frame in flight may still use it
+        if(m_targetCache[i].key == key && m_targetCache[i].serial <= m_pnvk->utCompletedSerial())
+        {
+            imgo = m_targetCache[i];
+            m_cacheBytes -= imgo.Sz;
+            m_targetCache.erase(m_targetCache.begin() + i);
+            m_cacheHits++;
+            return;
+        }
+    }
+    m_cacheMisses++;
+    imgo.img        = m_pnvk->utCreateImage2D(w, h, imgo.imgMem, format, (VkSampleCountFlagBits)samples, (VkSampleCountFlagBits)samples, 1, false, transient);
+    imgo.imgView    = m_pnvk->createImageView(NVK::ImageViewCreateInfo(
+        imgo.img, // image
+        VK_IMAGE_VIEW_TYPE_2D, //viewType
+        format, //format
+        NVK::ComponentMapping(),//channels
+        NVK::ImageSubresourceRange(aspect)//subresourceRange
+        ) );
+    imgo.Sz         = imgo.imgMem ? (size_t)imgo.imgMem->size : 0;
+    imgo.key        = key;
+}
+/*-------------------------------------------------------------------------
+  reusable once the next frame submission is complete
+  -------------------------------------------------------------------------*/
+void NVFBOBoxVK::releaseTarget(ImgO &imgo)
+{
+    imgo.serial = m_pnvk->utRetireSerial();
+    m_targetCache.push_back(imgo);
+    m_cacheBytes += imgo.Sz;
+    memset(&imgo, 0, sizeof(ImgO));
+    flushTargetCache(m_cacheBudget);
+}
+/*-------------------------------------------------------------------------
+  destroys the least recently released images, down to budget bytes
+  -------------------------------------------------------------------------*/
+void NVFBOBoxVK::flushTargetCache(VkDeviceSize budget)
+{
+    size_t n = 0;
+    while(n < m_targetCache.size() && m_cacheBytes > budget)
+    {
+        m_cacheBytes -= m_targetCache[n].Sz;
+        retire(m_targetCache[n]);
+        n++;
+    }
+    m_targetCache.erase(m_targetCache.begin(), m_targetCache.begin() + n);
+}
+/*-------------------------------------------------------------------------
+
+  -------------------------------------------------------------------------*/
+void NVFBOBoxVK::setOutputs(int n)
+{
+    m_outputs = n < 1 ? 1 : (n > NVFBOBOX_MAX_OUTPUTS ? NVFBOBOX_MAX_OUTPUTS : n);
+}
 /*-------------------------------------------------------------------------
 
   -------------------------------------------------------------------------*/
@@ -521,7 +653,7 @@ bool NVFBOBoxVK::setMSAA(int depthSamples_, int coverageSamples_)
   if (coverageSamples_ >= 0)
     coverageSamples = coverageSamples_;
   //
-  // New MSAA requires to re-create the render-passes
+  // New MSAA requires to re-create the scene render-pass
   // New renderpasses requires re-creating render-targets
   //
   if (!initRenderPass() )               return false;
@@ -668,19 +800,6 @@ bool NVFBOBoxVK::Initialize(NVK &nvk, int w, int h, float ssfact, int depthSampl
     }
 
 
-    //
-    // Descriptor Pool: size is 3 to have enough for global; object and ...
-    // TODO: try other VkDescriptorType
-    //
-    m_descPool = nvk.createDescriptorPool(NVK::DescriptorPoolCreateInfo(
-        2, NVK::DescriptorPoolSize
-            (VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 2)
-            (VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 2) )
-        );
-    //
-    // DescriptorSet allocation
-    //
-    nvk.allocateDescriptorSets( NVK::DescriptorSetAllocateInfo(m_descPool,1, &m_descriptorSetLayout), &m_descriptorSet);
     //
     // Buffers for general UBOs
     //
@@ -703,6 +822,7 @@ bool NVFBOBoxVK::Initialize(NVK &nvk, int w, int h, float ssfact, int depthSampl
     //
     // FBO and related resources
     //
+    initDownsamplePass();
     initRenderPass();
     initFramebufferAndRelated();
 
@@ -713,7 +833,7 @@ bool NVFBOBoxVK::Initialize(NVK &nvk, int w, int h, float ssfact, int depthSampl
 /*-------------------------------------------------------------------------
 
   -------------------------------------------------------------------------*/
-VkCommandBuffer NVFBOBoxVK::Draw(DownSamplingTechnique technique, int tilex, int tiley)//, int windowW, int windowH, float *offset)
+VkCommandBuffer NVFBOBoxVK::Draw(DownSamplingTechnique technique, int tilex, int tiley, int output)//, int windowW, int windowH, float *offset)
 {
     if(tilex < 0)
         tilex = curtilex;
@@ -726,7 +846,7 @@ VkCommandBuffer NVFBOBoxVK::Draw(DownSamplingTechnique technique, int tilex, int
 
     if((scaleFactor > 1.0) || (tilesw > 1) || (tilesh > 1))
     {
-      return m_cmdDownsample[technique].m_cmdbuffer;
+      return m_cmdDownsample[output][technique].m_cmdbuffer;
     }
     return VK_NULL_HANDLE;
 }
@@ -750,13 +870,13 @@ VkRect2D        NVFBOBoxVK::getViewRect()
     r.offset.y = 0;
     return r;
 }
-VkImage         NVFBOBoxVK::getColorImage()
+VkImage         NVFBOBoxVK::getColorImage(int output)
 {
     // if ever there was NO super-sampling, let's take directly the resolved image
     if(scaleFactor == 1.0)
         return m_tileData[0].color_texture_SS.img;
     // otherwise, take the result of down-sampling
-    return m_tileData[0].color_texture_DS.img;
+    return m_tileData[0].color_texture_DS[output].img;
 }
 VkImage         NVFBOBoxVK::getColorImageSSMS()
 {
@@ -767,8 +887,17 @@ VkImage         NVFBOBoxVK::getDSTImageSSMS()
     return m_depth_texture_SSMS.img;
 }
 
+VkImage         NVFBOBoxVK::getDepthImage()
+{
+    return depthSamples > 1 ? m_depth_texture_SSMS.img : m_depth_texture_SS.img;
+}
+VkImageView     NVFBOBoxVK::getDepthSampleView()
+{
+    return m_depthSampleView;
+}
+
 VkFramebuffer NVFBOBoxVK::GetFBO(int i)
 {
-    return depthSamples > 1 ? m_tileData[i].FBSS : m_tileData[i].FBDS;
+    return depthSamples > 1 ? m_tileData[i].FBSS : m_tileData[i].FBDS[0];
 }
 
@@ -22,19 +22,41 @@
 typedef unsigned int GLenum;
 #endif
 
+// most downsampled images: one per frame in flight, so that the one being
+// displayed isn't overwritten by the next frame
+#define NVFBOBOX_MAX_OUTPUTS 4
+// render-targets kept for later once released, at most that many bytes
+#ifndef NVFBOBOX_CACHE_BUDGET
+#define NVFBOBOX_CACHE_BUDGET (1024ull << 20)
+#endif
+
 class NVFBOBoxVK
 {
 protected:
     NVK  *m_pnvk;
+    // what makes two render-targets interchangeable
+    struct TargetKey {
+        int                 width, height;
+        VkFormat            format;
+        int                 samples;
+        bool                transient;
+        VkImageAspectFlags  aspect; // of the view
+        bool operator==(const TargetKey &k) const {
+            return width == k.width && height == k.height && format == k.format && samples == k.samples
+                && transient == k.transient && aspect == k.aspect;
+        }
+    };
     struct ImgO {
         VkImage          img;
         VkImageView      imgView;
-        VkDeviceMemory   imgMem;
+        NVK::Allocation* imgMem;
         size_t           Sz;
+        TargetKey        key;
+        uint64_t         serial; // in the cache: reusable once this frame submission is complete
     };
     struct BufO {
         VkBuffer        buffer;
-        VkDeviceMemory  bufferMem;
+        NVK::Allocation* bufferMem;
         size_t          Sz;
     };
     void release(ImgO &imgo) { 
@@ -44,6 +66,13 @@ protected:
           m_pnvk->freeMemory(imgo.imgMem);
         memset(&imgo, 0, sizeof(ImgO));
     }
+    // destroyed once the frames in flight are done with it
+    void retire(ImgO &imgo) {
+        m_pnvk->utRetire(VK_OBJECT_TYPE_IMAGE_VIEW, (uint64_t)imgo.imgView);
+        m_pnvk->utRetire(VK_OBJECT_TYPE_IMAGE, (uint64_t)imgo.img);
+        m_pnvk->utRetire(imgo.imgMem);
+        memset(&imgo, 0, sizeof(ImgO));
+    }
     void release(BufO &bufo) { 
         if(bufo.buffer)       vkDestroyBuffer(m_pnvk->m_device, bufo.buffer, NULL);
         if(bufo.bufferMem)    
@@ -71,6 +100,17 @@ public:
     virtual bool setMSAA(int depthSamples_ = -1, int coverageSamples_ = -1);
     virtual bool resize(int w, int h, float ssfact=-1);
     virtual void Finish();
+    // amount of downsampled images, taken into account by the next
+    // Initialize(), resize() or setMSAA()
+    void setOutputs(int n);
+    int  getOutputs() { return m_outputs; }
+    // MSAA attachments only used inside the scene pass: transient images with
+    // DONT_CARE store, in lazily allocated memory when the device has some. A
+    // transient depth can't be sampled (getDepthSampleView() is NULL). Taken
+    // into account by the next Initialize() or setMSAA()
+    void setTransient(bool color, bool depth) { m_transientColor = color; m_transientDepth = depth; }
+    // bytes of released render-targets kept for reuse (NVFBOBOX_CACHE_BUDGET)
+    void setCacheBudget(VkDeviceSize bytes) { m_cacheBudget = bytes; }
 
     virtual int getWidth() { return width; }
     virtual int getHeight() { return height; }
@@ -79,14 +119,20 @@ public:
     virtual float getSSFactor() { return scaleFactor; }
 
     VkRenderPass    getScenePass();
+    // a new pass compatible with the scene pass for this amount of samples,
+    // to create pipelines ahead of the setMSAA() needing them. The caller
+    // owns it
+    VkRenderPass    createScenePass(int samples);
     VkFramebuffer   getFramebuffer();
     VkRect2D        getViewRect();
-    VkImage         getColorImage();
+    VkImage         getColorImage(int output=0);
     VkImage         getColorImageSSMS();
     VkImage         getDSTImageSSMS();
+    VkImage         getDepthImage();      // the depth-stencil the scene gets rendered into
+    VkImageView     getDepthSampleView(); // its depth aspect, to sample it. NULL if the format can't be sampled
     VkCommandBuffer getCmdBufferDownSample();
     //virtual void Activate(int tilex=0, int tiley=0, float m_frustum[][4]=NULL);
-    virtual VkCommandBuffer Draw(DownSamplingTechnique technique, int tilex=0, int tiley=0);
+    virtual VkCommandBuffer Draw(DownSamplingTechnique technique, int tilex=0, int tiley=0, int output=0);
 
     virtual VkFramebuffer GetFBO(int i=0);
 
@@ -109,9 +155,12 @@ protected:
     //
     VkRenderPass                m_scenePass;        // pass for rendering into the super-sampled buffers
     VkRenderPass                m_downsamplePass;   // pass for the downsampling step
-    NVK::CommandBuffer            m_cmdDownsample[3]; // command for the downsampling step
+    NVK::CommandBuffer            m_cmdDownsample[NVFBOBOX_MAX_OUTPUTS][3]; // command for the downsampling step, per output
+    int                         m_outputs;
+    bool                        m_transientColor;
+    bool                        m_transientDepth;
     NVK::CommandPool            m_cmdPool;
-    VkDescriptorPool            m_descPool;
+    VkDescriptorPool            m_descPool;         // one per framebuffer setup, see deleteFramebufferAndRelated()
 
     VkDescriptorSetLayout       m_descriptorSetLayout; // general layout and objects layout
     VkDescriptorSet             m_descriptorSet;    // descriptor set for general part
@@ -126,23 +175,38 @@ protected:
     BufO                        m_texInfo;      // buffer for uniforms to pass to shaders for downsampling
     ImgO                        m_depth_texture_SS;    // DST texture after downsampling
     ImgO                        m_depth_texture_SSMS; // DST texture where the scene gets rendered
+    VkImageView                 m_depthSampleView;    // depth aspect only of the one in use, for shaders
     //ImgO                        m_testTex;
     VkSampler                   m_sampler;
     struct TileData
     {
-        VkFramebuffer   FBDS;
+        VkFramebuffer   FBDS[NVFBOBOX_MAX_OUTPUTS];
         VkFramebuffer   FBSS;
-        ImgO    color_texture_DS;
+        ImgO    color_texture_DS[NVFBOBOX_MAX_OUTPUTS];
         ImgO    color_texture_SS;
         ImgO    color_texture_SSMS;
     };
     std::vector<TileData> m_tileData;   // images where the scene gets rendered
+    //
+    // render-targets released by deleteFramebufferAndRelated(), least recently
+    // released first. Toggling SS or MSAA finds the previous ones back here
+    //
+    std::vector<ImgO>           m_targetCache;
+    VkDeviceSize                m_cacheBytes;
+    VkDeviceSize                m_cacheBudget;
+    int                         m_cacheHits;
+    int                         m_cacheMisses;
+    void    acquireTarget(ImgO &imgo, int w, int h, VkFormat format, int samples, bool transient, VkImageAspectFlags aspect);
+    void    releaseTarget(ImgO &imgo);
+    void    flushTargetCache(VkDeviceSize budget);
 
     int      pngDataSz;      // size of allocated memory
     unsigned char *pngData;      // temporary data for the full image (many tiles)
     unsigned char *pngDataTile; // temporary data from a tile
     bool    initFramebufferAndRelated();
     bool    initRenderPass();
+    bool    initDownsamplePass();
     bool    deleteFramebufferAndRelated();
     bool    deleteRenderPass();
+    bool    deleteDownsamplePass();
 };
@@ -37,7 +37,13 @@
 #include <math.h>
 
 #include <string.h>
+#include <stdio.h>
 #include <vector>
+#include <algorithm>
+#include <chrono>
+#ifdef _MSC_VER
+#  include <intrin.h>
+#endif
 
 //------------------------------------------------------------------------------
 // VULKAN: NVK.h > fnptrinline.h > vulkannv.h > vulkan.h
@@ -131,6 +137,22 @@ void NVK::unmapMemory(VkDeviceMemory mem)
     vkUnmapMemory(m_device, mem);
 }
 //------------------------------------------------------------------------------
+// allocations are released to m_allocator. Their host-visible blocks are mapped
+// once for good: Vulkan doesn't allow mapping a VkDeviceMemory twice
+//------------------------------------------------------------------------------
+void NVK::freeMemory(Allocation* mem)
+{
+    m_allocator.free(mem);
+}
+void* NVK::mapMemory(Allocation* mem, VkDeviceSize offset, VkDeviceSize size, VkMemoryMapFlags flags)
+{
+    assert(mem->ptr && "memory not host-visible");
+    return (uint8_t*)mem->ptr + offset;
+}
+void NVK::unmapMemory(Allocation* mem)
+{
+}
+//------------------------------------------------------------------------------
 //
 //------------------------------------------------------------------------------
 void NVK::utMemcpy(VkDeviceMemory dstMem, const void * srcData, VkDeviceSize size)
@@ -142,6 +164,73 @@ void NVK::utMemcpy(VkDeviceMemory dstMem, const void * srcData, VkDeviceSize siz
     }
     vkUnmapMemory(m_device, dstMem);
 }
+void NVK::utMemcpy(Allocation* dstMem, const void * srcData, VkDeviceSize size)
+{
+    ::memcpy(mapMemory(dstMem, 0, size, 0), srcData, size);
+}
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+void NVK::utGetMemoryStats(MemoryStats &stats) const
+{
+    m_allocator.getStats(stats);
+}
+bool NVK::utLazilyAllocated(const Allocation* mem) const
+{
+    return mem && (m_gpu.memoryProperties.memoryTypes[mem->memType].propertyFlags & VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT);
+}
+//------------------------------------------------------------------------------
+// objects are destroyed in the order they were retired: views before their
+// image, the image before its memory
+//------------------------------------------------------------------------------
+void NVK::utRetire(VkObjectType type, uint64_t handle)
+{
+    if(handle == 0)
+        return;
+    Retired r = { utRetireSerial(), type, handle, NULL, NULL };
+    m_retired.push_back(r);
+}
+void NVK::utRetire(Allocation* mem)
+{
+    if(mem == NULL)
+        return;
+    Retired r = { utRetireSerial(), VK_OBJECT_TYPE_DEVICE_MEMORY, 0, mem, NULL };
+    m_retired.push_back(r);
+}
+void NVK::utRetire(CommandPool* cmdPool, VkCommandBuffer cmd)
+{
+    if(cmd == NULL)
+        return;
+    Retired r = { utRetireSerial(), VK_OBJECT_TYPE_COMMAND_BUFFER, (uint64_t)cmd, NULL, cmdPool };
+    m_retired.push_back(r);
+}
+void NVK::utCollectRetired(uint64_t serial)
+{
+    // idle: even what gets retired before the next submission is safe
+    if(serial > m_completedSerial)
+        m_completedSerial = serial == ~0ull ? m_submitSerial + 1 : serial;
+    size_t n = 0;
+    for(; n < m_retired.size() && m_retired[n].serial <= serial; n++)
+    {
+        const Retired &r = m_retired[n];
+        switch(r.type)
+        {
+        case VK_OBJECT_TYPE_DEVICE_MEMORY:  freeMemory(r.mem); break;
+        case VK_OBJECT_TYPE_COMMAND_BUFFER: r.cmdPool->utFreeCommandBuffer((VkCommandBuffer)r.handle); break;
+        case VK_OBJECT_TYPE_BUFFER:         vkDestroyBuffer(m_device, (VkBuffer)r.handle, NULL); break;
+        case VK_OBJECT_TYPE_IMAGE:          vkDestroyImage(m_device, (VkImage)r.handle, NULL); break;
+        case VK_OBJECT_TYPE_IMAGE_VIEW:     vkDestroyImageView(m_device, (VkImageView)r.handle, NULL); break;
+        case VK_OBJECT_TYPE_FRAMEBUFFER:    vkDestroyFramebuffer(m_device, (VkFramebuffer)r.handle, NULL); break;
+        case VK_OBJECT_TYPE_RENDER_PASS:    vkDestroyRenderPass(m_device, (VkRenderPass)r.handle, NULL); break;
+        case VK_OBJECT_TYPE_PIPELINE:       vkDestroyPipeline(m_device, (VkPipeline)r.handle, NULL); break;
+        case VK_OBJECT_TYPE_DESCRIPTOR_POOL: vkDestroyDescriptorPool(m_device, (VkDescriptorPool)r.handle, NULL); break;
+        default:
+            LOGE("utCollectRetired: object type %d can't be retired\n", (int)r.type);
+            break;
+        }
+    }
+    m_retired.erase(m_retired.begin(), m_retired.begin() + n);
+}
 
 //------------------------------------------------------------------------------
 //
@@ -407,19 +496,19 @@ VkResult NVK::createCommandPool(const VkCommandPoolCreateInfo* pCreateInfo, cons
 //------------------------------------------------------------------------------
 void    NVK::CommandPool::utFreeCommandBuffers(VkCommandBuffer *pcmd, int n)
 {
-  if ((pcmd == NULL) || n == 0)
+  // frame-scoped: utRecycle() takes them all back
+  if ((pcmd == NULL) || n == 0 || m_frameScoped)
     return;
   vkFreeCommandBuffers(m_device, m_cmdPool, n, pcmd);
+  // primary or secondary: each one is forgotten from its own level
   for(int j=0; j<n; j++)
   {
     for (int i = 0; i<2; i++)
     {
-      std::set<VkCommandBuffer>::iterator it = m_allocatedCmdBuffers[0].find(pcmd[j]);
-      if (it != m_allocatedCmdBuffers[i].end())
+      if (m_allocatedCmdBuffers[i].erase(pcmd[j]))
       {
-        m_allocatedCmdBuffers[i].erase(it);
         m_currentCmdBuffer[i] = m_allocatedCmdBuffers[i].end();
-        return;
+        break;
       }
     }
   }
@@ -429,15 +518,13 @@ void    NVK::CommandPool::utFreeCommandBuffers(VkCommandBuffer *pcmd, int n)
 //------------------------------------------------------------------------------
 void    NVK::CommandPool::utFreeCommandBuffer(VkCommandBuffer cmd)
 {
-    if(cmd == NULL)
+    if((cmd == NULL) || m_frameScoped)
         return;
     vkFreeCommandBuffers(m_device, m_cmdPool, 1, &cmd);
-    m_currentCmdBuffer[0] = m_allocatedCmdBuffers[0].find(cmd);
     for(int i=0; i<2; i++)
     {
-        if(m_currentCmdBuffer[i] != m_allocatedCmdBuffers[i].end() )
+        if(m_allocatedCmdBuffers[i].erase(cmd))
         {
-            m_allocatedCmdBuffers[i].erase(m_currentCmdBuffer[i]);
             m_currentCmdBuffer[i]  = m_allocatedCmdBuffers[i].end();
             return;
         }
@@ -448,8 +535,10 @@ void    NVK::CommandPool::utFreeCommandBuffer(VkCommandBuffer cmd)
 //------------------------------------------------------------------------------
 NVK::CommandPool::CommandPool(VkDevice device, VkCommandPool cmdPool) : 
     m_device(device), 
-    m_cmdPool(cmdPool) 
+    m_cmdPool(cmdPool),
+    m_frameScoped(false)
 {
+    m_frameUsed[0] = m_frameUsed[1] = 0;
 }
 //------------------------------------------------------------------------------
 //
@@ -463,6 +552,12 @@ NVK::CommandPool::CommandPool(const CommandPool &srcPool)
     m_currentCmdBuffer[0] = srcPool.m_currentCmdBuffer[0];
     m_allocatedCmdBuffers[1] = srcPool.m_allocatedCmdBuffers[1];
     m_currentCmdBuffer[1] = srcPool.m_currentCmdBuffer[1];
+    m_frameScoped = srcPool.m_frameScoped;
+    for(int i=0; i<2; i++)
+    {
+        m_frameCmdBuffers[i] = srcPool.m_frameCmdBuffers[i];
+        m_frameUsed[i] = srcPool.m_frameUsed[i];
+    }
 }
 //------------------------------------------------------------------------------
 //
@@ -512,6 +607,17 @@ void NVK::CommandPool::resetCommandPool(VkCommandPoolResetFlags flags)
     CHECK(vkResetCommandPool(m_device, m_cmdPool, flags) );
     m_allocatedCmdBuffers[0].clear();
     m_allocatedCmdBuffers[1].clear();
+    // the frame-scoped ones stay allocated: handed out again
+    m_frameUsed[0] = m_frameUsed[1] = 0;
+}
+//------------------------------------------------------------------------------
+// frame-scoped mode: one reset for all the command-buffers of the frame, no
+// free and no bookkeeping per command-buffer
+//------------------------------------------------------------------------------
+void NVK::CommandPool::utRecycle()
+{
+    CHECK(vkResetCommandPool(m_device, m_cmdPool, 0) );
+    m_frameUsed[0] = m_frameUsed[1] = 0;
 }
 //------------------------------------------------------------------------------
 //
@@ -534,6 +640,11 @@ void NVK::CommandPool::destroyCommandPool()
     m_cmdPool = VK_NULL_HANDLE;
     m_allocatedCmdBuffers[0].clear();
     m_allocatedCmdBuffers[1].clear();
+    for(int i=0; i<2; i++)
+    {
+        m_frameCmdBuffers[i].clear();
+        m_frameUsed[i] = 0;
+    }
 }
 
 VkCommandBuffer NVK::CommandPool::utUseNextAvailableCmdBuffer(bool primary)
@@ -551,6 +662,22 @@ VkCommandBuffer NVK::CommandPool::utUseNextAvailableCmdBuffer(bool primary)
 
 VkCommandBuffer NVK::CommandPool::utRequestCmdBuffer(bool primary)
 {
+    if(m_frameScoped)
+    {
+        // the arrays only grow up to what the busiest frame needed
+        int p = primary?0:1;
+        if(m_frameUsed[p] == m_frameCmdBuffers[p].size())
+        {
+            VkCommandBufferAllocateInfo allocInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO };
+            allocInfo.commandPool = m_cmdPool;
+            allocInfo.level = primary ? VK_COMMAND_BUFFER_LEVEL_PRIMARY : VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+            allocInfo.commandBufferCount = 1;
+            VkCommandBuffer cmd;
+            CHECK(vkAllocateCommandBuffers(m_device, &allocInfo, &cmd) );
+            m_frameCmdBuffers[p].push_back(cmd);
+        }
+        return m_frameCmdBuffers[p][m_frameUsed[p]++];
+    }
     VkCommandBuffer cmd = utUseNextAvailableCmdBuffer(primary);
     if(cmd)
         return cmd;
@@ -621,7 +748,7 @@ VkRenderPass NVK::createRenderPass(NVK::RenderPassCreateInfo &rpinfo)
 //------------------------------------------------------------------------------
 VkImage NVK::utCreateImage1D(
     int width,
-    VkDeviceMemory &colorMemory, 
+    Allocation* &colorMemory, 
     VkFormat format, 
     VkSampleCountFlagBits depthSamples, 
     VkSampleCountFlagBits colorSamples,
@@ -667,11 +794,11 @@ VkImage NVK::utCreateImage1D(
 //------------------------------------------------------------------------------
 VkImage NVK::utCreateImage2D(
     int width, int height, 
-    VkDeviceMemory &colorMemory, 
+    Allocation* &colorMemory, 
     VkFormat format, 
     VkSampleCountFlagBits depthSamples, 
     VkSampleCountFlagBits colorSamples,
-    int mipLevels, bool asAttachment)
+    int mipLevels, bool asAttachment, bool transient)
 {
     VkImage                     colorImage;
     // color texture & view
@@ -696,24 +823,53 @@ VkImage NVK::utCreateImage2D(
     case VK_FORMAT_D24_UNORM_S8_UINT:
     case VK_FORMAT_D32_SFLOAT_S8_UINT:
         cbImageInfo.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
+        // depth can be read back by shaders (e.g. for a hierarchical-Z) when the format allows it
+        if(utFormatSampled(format))
+            cbImageInfo.usage |= VK_IMAGE_USAGE_SAMPLED_BIT;
         break;
     default:
         // THIS FLAG VK_IMAGE_USAGE_SAMPLED_BIT wasted me almost a DAY to understand why nothing was working !!!
         cbImageInfo.usage = VK_IMAGE_USAGE_SAMPLED_BIT |VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
         if(asAttachment) cbImageInfo.usage |= VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
     }
+    if(transient)
+    {
+        // its content doesn't outlive the render-pass: no other usage allowed
+        cbImageInfo.usage &= VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
+        cbImageInfo.usage |= VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT;
+    }
     cbImageInfo.flags = 0;
 
     CHECK(vkCreateImage(m_device, &cbImageInfo, NULL, &colorImage) );
-    colorMemory = utAllocMemAndBindImage(colorImage, VK_MEMORY_HEAP_DEVICE_LOCAL_BIT);
+    colorMemory = NULL;
+    if(transient)
+    {
+        // lazily allocated memory only gets backed if the attachment must
+        // leave the tile memory. Desktop GPUs have none: device-local then
+        VkMemoryRequirements memReqs;
+        vkGetImageMemoryRequirements(m_device, colorImage, &memReqs);
+        if(m_allocator.findMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT) != MemoryAllocator::NIL)
+            colorMemory = utAllocMemAndBindImage(colorImage, VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT);
+    }
+    if(!colorMemory)
+        colorMemory = utAllocMemAndBindImage(colorImage, VK_MEMORY_HEAP_DEVICE_LOCAL_BIT);
     return colorImage;
 }
 //------------------------------------------------------------------------------
+// true when images of this format and optimal tiling can be sampled
+//------------------------------------------------------------------------------
+bool NVK::utFormatSampled(VkFormat format)
+{
+    VkFormatProperties props;
+    vkGetPhysicalDeviceFormatProperties(m_gpu.device, format, &props);
+    return (props.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT) ? true : false;
+}
+//------------------------------------------------------------------------------
 //
 //------------------------------------------------------------------------------
 VkImage NVK::utCreateImage3D(
     int width, int height, int depth,
-    VkDeviceMemory &colorMemory, 
+    Allocation* &colorMemory, 
     VkFormat format, 
     VkSampleCountFlagBits depthSamples, 
     VkSampleCountFlagBits colorSamples,
@@ -755,11 +911,39 @@ VkImage NVK::utCreateImage3D(
     return colorImage;
 }
 //------------------------------------------------------------------------------
+// image written by compute shaders (imageStore) and sampled afterward
+//------------------------------------------------------------------------------
+VkImage NVK::utCreateStorageImage2D(
+    int width, int height,
+    Allocation* &colorMemory,
+    VkFormat format,
+    int mipLevels)
+{
+    VkImage                     storageImage;
+    VkImageCreateInfo imageInfo = { VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO };
+    imageInfo.flags = 0;
+    imageInfo.imageType = VK_IMAGE_TYPE_2D;
+    imageInfo.format = format;
+    imageInfo.extent.width = width;
+    imageInfo.extent.height = height;
+    imageInfo.extent.depth = 1;
+    imageInfo.mipLevels = mipLevels;
+    imageInfo.arrayLayers = 1;
+    imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+    imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+    imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    imageInfo.usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+
+    CHECK(vkCreateImage(m_device, &imageInfo, NULL, &storageImage) );
+    colorMemory = utAllocMemAndBindImage(storageImage, VK_MEMORY_HEAP_DEVICE_LOCAL_BIT);
+    return storageImage;
+}
+//------------------------------------------------------------------------------
 //
 //------------------------------------------------------------------------------
 VkImage NVK::utCreateImageCube(
     int width,
-    VkDeviceMemory &colorMemory, 
+    Allocation* &colorMemory, 
     VkFormat format, 
     VkSampleCountFlagBits depthSamples, 
     VkSampleCountFlagBits colorSamples,
@@ -909,9 +1093,13 @@ VkBool32 dbgFunc(
 //------------------------------------------------------------------------------
 //
 //------------------------------------------------------------------------------
-bool NVK::utInitialize(WindowSurface* pWindowSurface)
+bool NVK::utInitialize(WindowSurface* pWindowSurface, const char* pipelineCacheDir)
 {
     m_swapChain = NULL;
+    // nothing submitted nor retired yet
+    m_retired.clear();
+    m_submitSerial = 0;
+    m_completedSerial = 0;
     if (pWindowSurface)
     {
       nvvk::Context* pContext = pWindowSurface->getContext();
@@ -935,6 +1123,9 @@ bool NVK::utInitialize(WindowSurface* pWindowSurface)
       m_gpu.queueProperties = pContext->m_physicalInfo.queueProperties;
       //m_gpu.graphics_queue_family_index = pwinInternalVK->m_gpu.graphics_queue_family_index;
       m_queue = pContext->m_queueGCT;
+      m_deviceBlocks.nvk = this;
+      m_allocator.init(&m_deviceBlocks, m_gpu.memoryProperties, m_gpu.properties.limits.bufferImageGranularity);
+      utInitPipelineCache(pipelineCacheDir);
       //m_surface = pwinInternalVK->m_surface;
       //m_surfFormat = pwinInternalVK->m_surfFormat;
       //m_swap_chain = pwinInternalVK->m_swap_chain;
@@ -1193,11 +1384,22 @@ bool NVK::utInitialize(WindowSurface* pWindowSurface)
     std::vector<char*> chosenDeviceExtensions(device_extension_names[chosenDevice].size());
     for (int i = 0; i < device_extension_names[chosenDevice].size(); i++) chosenDeviceExtensions[i] = device_extension_names[chosenDevice][i].data();
     devInfo.ppEnabledExtensionNames = chosenDeviceExtensions.data();
+    // the fur clusters are drawn with one vkCmdDrawIndexedIndirect per block when possible.
+    // Pipeline statistics count the fragments of the fur (overdraw), also when
+    // its draws are in secondary command-buffers (inherited queries)
+    VkPhysicalDeviceFeatures enabledFeatures = {};
+    enabledFeatures.multiDrawIndirect = m_gpu.features2.features.multiDrawIndirect;
+    enabledFeatures.pipelineStatisticsQuery = m_gpu.features2.features.pipelineStatisticsQuery;
+    enabledFeatures.inheritedQueries = m_gpu.features2.features.inheritedQueries;
+    devInfo.pEnabledFeatures = &enabledFeatures;
     result = vkCreateDevice(m_gpu.device, &devInfo, NULL, &m_device);
     if (result != VK_SUCCESS) {
         return false;
     }
     vkGetDeviceQueue(m_device, 0, 0, &m_queue);
+    m_deviceBlocks.nvk = this;
+    m_allocator.init(&m_deviceBlocks, m_gpu.memoryProperties, m_gpu.properties.limits.bufferImageGranularity);
+    utInitPipelineCache(pipelineCacheDir);
     //
     // Debug Markers, eventually
     //
@@ -1219,6 +1421,9 @@ bool NVK::utDestroy()
     ++it;
   }
   m_shaderModules.clear();
+  utCollectRetired(~0ull);
+  m_allocator.deinit();
+  utSavePipelineCache();
 
   if(!m_deviceExternal)
         vkDestroyDevice(m_device, NULL);
@@ -1232,106 +1437,243 @@ bool NVK::utDestroy()
     return true;
 }
 //------------------------------------------------------------------------------
+// the file name has what the header of the data must match: vendor, device and
+// pipelineCacheUUID. The driver version is in it too, so that an update starts
+// a new file rather than overwriting the one of the previous driver
+//------------------------------------------------------------------------------
+void NVK::utInitPipelineCache(const char* dir)
+{
+    memset(&m_pipelineStats, 0, sizeof(PipelineStats));
+    m_pipelineCache = VK_NULL_HANDLE;
+    m_pipelineCachePath.clear();
+    if(dir == NULL)
+    {
+        LOGI("Pipeline cache: none\n");
+        return;
+    }
+    std::vector<uint8_t> data;
+    const VkPhysicalDeviceProperties &props = m_gpu.properties;
+    if(dir[0])
+    {
+        char name[128];
+        int n = snprintf(name, sizeof(name), "pipelines_%08x_%08x_%08x_", props.vendorID, props.deviceID, props.driverVersion);
+        for(int i=0; i<VK_UUID_SIZE; i++)
+            n += snprintf(name + n, sizeof(name) - n, "%02x", props.pipelineCacheUUID[i]);
+        snprintf(name + n, sizeof(name) - n, ".bin");
+        m_pipelineCachePath = std::string(dir) + "/" + name;
+        FILE *fd = fopen(m_pipelineCachePath.c_str(), "rb");
+        if(fd)
+        {
+            fseek(fd, 0, SEEK_END);
+            long sz = ftell(fd);
+            fseek(fd, 0, SEEK_SET);
+            if(sz > 0)
+            {
+                data.resize((size_t)sz);
+                if(fread(&data[0], 1, data.size(), fd) != data.size())
+                    data.clear();
+            }
+            fclose(fd);
+        }
+        //
+        // VkPipelineCacheHeaderVersionOne: the driver would reject a mismatch,
+        // but it tells why the start is cold
+        //
+        const size_t headerSz = 16 + VK_UUID_SIZE;
+        if(!data.empty())
+        {
+            uint32_t header[4];
+            memcpy(header, &data[0], std::min(data.size(), sizeof(header)));
+            if(data.size() < headerSz || header[0] < headerSz || header[1] != VK_PIPELINE_CACHE_HEADER_VERSION_ONE
+                || header[2] != props.vendorID || header[3] != props.deviceID || memcmp(&data[16], props.pipelineCacheUUID, VK_UUID_SIZE))
+            {
+                LOGW("Pipeline cache: %s doesn't match the device, ignored\n", m_pipelineCachePath.c_str());
+                data.clear();
+            }
+        }
+    }
+    VkPipelineCacheCreateInfo info = { VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO };
+    info.initialDataSize = data.size();
+    info.pInitialData = data.empty() ? NULL : &data[0];
+    if(vkCreatePipelineCache(m_device, &info, NULL, &m_pipelineCache) != VK_SUCCESS)
+    {
+        // corrupted data: start empty
+        info.initialDataSize = 0;
+        info.pInitialData = NULL;
+        data.clear();
+        CHECK(vkCreatePipelineCache(m_device, &info, NULL, &m_pipelineCache));
+    }
+    m_pipelineStats.loadedBytes = data.size();
+    LOGI("Pipeline cache: %s, %.1f KB loaded\n", m_pipelineCachePath.empty() ? "in memory" : m_pipelineCachePath.c_str(), data.size() / 1024.0);
+}
+//------------------------------------------------------------------------------
+// written aside then renamed: an interrupted save leaves the previous file
+//------------------------------------------------------------------------------
+void NVK::utSavePipelineCache()
+{
+    if(!m_pipelineCache)
+        return;
+    size_t sz = 0;
+    std::vector<uint8_t> data;
+    if(!m_pipelineCachePath.empty() && vkGetPipelineCacheData(m_device, m_pipelineCache, &sz, NULL) == VK_SUCCESS && sz > 0)
+    {
+        data.resize(sz);
+        if(vkGetPipelineCacheData(m_device, m_pipelineCache, &sz, &data[0]) != VK_SUCCESS)
+            sz = 0;
+    }
+    if(sz > 0)
+    {
+        std::string tmpPath = m_pipelineCachePath + ".tmp";
+        FILE *fd = fopen(tmpPath.c_str(), "wb");
+        bool ok = fd && (fwrite(&data[0], 1, sz, fd) == sz);
+        if(fd)
+            ok = (fclose(fd) == 0) && ok;
+        if(ok)
+        {
+#ifdef _WIN32
+            remove(m_pipelineCachePath.c_str()); // rename() doesn't replace on Windows
+#endif
+            ok = rename(tmpPath.c_str(), m_pipelineCachePath.c_str()) == 0;
+        }
+        if(ok)
+            LOGI("Pipeline cache: %.1f KB saved to %s\n", sz / 1024.0, m_pipelineCachePath.c_str());
+        else
+        {
+            remove(tmpPath.c_str());
+            LOGW("Pipeline cache: failed writing %s\n", m_pipelineCachePath.c_str());
+        }
+    }
+    vkDestroyPipelineCache(m_device, m_pipelineCache, NULL);
+    m_pipelineCache = VK_NULL_HANDLE;
+}
+//------------------------------------------------------------------------------
+// the cache is internally synchronized, the stats aren't: worker threads may
+// create pipelines at the same time
+//------------------------------------------------------------------------------
+static void addPipelineStats(NVK::PipelineStats &stats, std::mutex &mutex, double ms, double msUncached)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    stats.ms += ms;
+    stats.created++;
+    if(msUncached >= 0.0)
+    {
+        stats.msUncached += msUncached;
+        stats.compared++;
+    }
+}
+NVK::PipelineStats NVK::utGetPipelineStats()
+{
+    std::lock_guard<std::mutex> lock(m_pipelineStatsMutex);
+    return m_pipelineStats;
+}
+//------------------------------------------------------------------------------
+// m_pipelineCacheCompare: the pipeline is first created without the cache, so
+// that the driver doesn't find it in its own caches from the cached creation
+//------------------------------------------------------------------------------
+VkPipeline NVK::createGraphicsPipeline(GraphicsPipelineCreateInfo &gp)
+{
+    VkPipeline p;
+    double msUncached = -1.0;
+    if(m_pipelineCacheCompare && m_pipelineCache)
+    {
+        std::chrono::high_resolution_clock::time_point t0 = std::chrono::high_resolution_clock::now();
+        CHECK(vkCreateGraphicsPipelines(m_device, VK_NULL_HANDLE, 1, gp, NULL, &p) );
+        msUncached = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - t0).count();
+        vkDestroyPipeline(m_device, p, NULL);
+    }
+    std::chrono::high_resolution_clock::time_point t0 = std::chrono::high_resolution_clock::now();
+    CHECK(vkCreateGraphicsPipelines(m_device, m_pipelineCache, 1, gp, NULL, &p) );
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - t0).count();
+    addPipelineStats(m_pipelineStats, m_pipelineStatsMutex, ms, msUncached);
+    return p;
+}
+VkPipeline NVK::createComputePipeline(VkPipelineLayout layout, const PipelineShaderStageCreateInfo &stage, VkPipelineCreateFlags flags)
+{
+    VkComputePipelineCreateInfo cp = { VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO };
+    cp.flags = flags;
+    cp.stage = *stage.getItemCst();
+    cp.layout = layout;
+    cp.basePipelineHandle = VK_NULL_HANDLE;
+    cp.basePipelineIndex = -1;
+    VkPipeline p;
+    double msUncached = -1.0;
+    if(m_pipelineCacheCompare && m_pipelineCache)
+    {
+        std::chrono::high_resolution_clock::time_point t0 = std::chrono::high_resolution_clock::now();
+        CHECK(vkCreateComputePipelines(m_device, VK_NULL_HANDLE, 1, &cp, NULL, &p) );
+        msUncached = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - t0).count();
+        vkDestroyPipeline(m_device, p, NULL);
+    }
+    std::chrono::high_resolution_clock::time_point t0 = std::chrono::high_resolution_clock::now();
+    CHECK(vkCreateComputePipelines(m_device, m_pipelineCache, 1, &cp, NULL, &p) );
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - t0).count();
+    addPipelineStats(m_pipelineStats, m_pipelineStatsMutex, ms, msUncached);
+    return p;
+}
+//------------------------------------------------------------------------------
 //
 //------------------------------------------------------------------------------
-VkDeviceMemory NVK::utAllocMemAndBindBuffer(VkBuffer obj, VkFlags memProps)
+NVK::Allocation* NVK::utAllocMemAndBindBuffer(VkBuffer obj, VkFlags memProps)
 {
     VkResult result;
-    VkDeviceMemory deviceMem;
     VkMemoryRequirements  memReqs;
     vkGetBufferMemoryRequirements(m_device, obj, &memReqs);
 
     if (!memReqs.size){
-      return VK_NULL_HANDLE;
+      return NULL;
     }
-    //
-    // Find an available memory type that satifies the requested properties.
-    //
-    uint32_t memoryTypeIndex;
-    for (memoryTypeIndex = 0; memoryTypeIndex < m_gpu.memoryProperties.memoryTypeCount; ++memoryTypeIndex) {
-      if (( memReqs.memoryTypeBits & (1<<memoryTypeIndex)) &&
-        ( m_gpu.memoryProperties.memoryTypes[memoryTypeIndex].propertyFlags & memProps) == memProps) 
-      {
-        break;
-      }
-    }
-    if (memoryTypeIndex >= m_gpu.memoryProperties.memoryTypeCount) {
-      assert(0 && "memoryTypeIndex not found");
-      return VK_NULL_HANDLE;
+    Allocation* allocation = m_allocator.alloc(memReqs, memProps, true);
+    if (!allocation) {
+      return NULL;
     }
 
-    VkMemoryAllocateInfo memInfo = {
-      VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,             // sType
-      0,                                               // pNext
-      memReqs.size,                                    // allocationSize
-      memoryTypeIndex,                                 // memoryTypeIndex
-    };
-
-    //LOGW("allocating memory: memReqs.memoryTypeBits=%d memProps=%d memoryTypeIndex=%d Size=%d\n", memReqs.memoryTypeBits, memProps, memoryTypeIndex, memReqs.size);
-
-    result = vkAllocateMemory(m_device, &memInfo, NULL, &deviceMem);
+    result = bindBufferMemory(obj, allocation->mem, allocation->offset);
     if (result != VK_SUCCESS) {
-      return VK_NULL_HANDLE;
+      m_allocator.free(allocation);
+      return NULL;
     }
 
-    result = bindBufferMemory(obj, deviceMem, 0);
-    if (result != VK_SUCCESS) {
-      return VK_NULL_HANDLE;
-    }
+    return allocation;
+}
 
-    return deviceMem;
+//------------------------------------------------------------------------------
+// true when a memory type has all of memProps: utAllocMemAndBind...() would
+// assert otherwise
+//------------------------------------------------------------------------------
+bool NVK::utHasMemoryType(VkFlags memProps)
+{
+    for (uint32_t i = 0; i < m_gpu.memoryProperties.memoryTypeCount; ++i) {
+      if ((m_gpu.memoryProperties.memoryTypes[i].propertyFlags & memProps) == memProps)
+        return true;
+    }
+    return false;
 }
 
 //------------------------------------------------------------------------------
 //
 //------------------------------------------------------------------------------
-VkDeviceMemory NVK::utAllocMemAndBindImage(VkImage obj, VkFlags memProps)
+NVK::Allocation* NVK::utAllocMemAndBindImage(VkImage obj, VkFlags memProps)
 {
     VkResult result;
-    VkDeviceMemory deviceMem;
     VkMemoryRequirements  memReqs;
     vkGetImageMemoryRequirements(m_device, obj, &memReqs);
 
     if (!memReqs.size){
-      return VK_NULL_HANDLE;
+      return NULL;
     }
-
-    //
-    // Find an available memory type that satifies the requested properties.
-    //
-    uint32_t memoryTypeIndex;
-    for (memoryTypeIndex = 0; memoryTypeIndex < m_gpu.memoryProperties.memoryTypeCount; ++memoryTypeIndex) {
-      if (( memReqs.memoryTypeBits & (1<<memoryTypeIndex)) &&
-        ( m_gpu.memoryProperties.memoryTypes[memoryTypeIndex].propertyFlags & memProps) == memProps) 
-      {
-        break;
-      }
+    // the images of NVK are all created with VK_IMAGE_TILING_OPTIMAL
+    Allocation* allocation = m_allocator.alloc(memReqs, memProps, false);
+    if (!allocation) {
+      return NULL;
     }
-    if (memoryTypeIndex >= m_gpu.memoryProperties.memoryTypeCount) {
-      assert(0 && "memoryTypeIndex not found");
-      return VK_NULL_HANDLE;
-    }
-
-    VkMemoryAllocateInfo memInfo = {
-      VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,             // sType
-      0,                                               // pNext
-      memReqs.size,                                    // allocationSize
-      memoryTypeIndex,                                 // memoryTypeIndex
-    };
-
-    //LOGW("allocating memory: memReqs.memoryTypeBits=%d memProps=%d memoryTypeIndex=%d Size=%d\n", memReqs.memoryTypeBits, memProps, memoryTypeIndex, memReqs.size);
 
-    result = vkAllocateMemory(m_device, &memInfo, NULL, &deviceMem);
+    result = vkBindImageMemory(m_device, obj, allocation->mem, allocation->offset);
     if (result != VK_SUCCESS) {
-      return VK_NULL_HANDLE;
+      m_allocator.free(allocation);
+      return NULL;
     }
 
-    result = vkBindImageMemory(m_device, obj, deviceMem, 0);
-    if (result != VK_SUCCESS) {
-      return VK_NULL_HANDLE;
-    }
-
-    return deviceMem;
+    return allocation;
 }
 //------------------------------------------------------------------------------
 //
@@ -1349,7 +1691,7 @@ VkResult NVK::utFillBuffer(NVK::CommandPool *cmdPool, size_t size, VkResult resu
     //
     // Allocate and bind to the buffer
     //
-    VkDeviceMemory bufferStageMem;
+    Allocation* bufferStageMem;
     bufferStageMem = utAllocMemAndBindBuffer(bufferStage, (VkFlags)VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
 
     utMemcpy(bufferStageMem, data, size);
@@ -1376,7 +1718,7 @@ VkResult NVK::utFillBuffer(NVK::CommandPool *cmdPool, size_t size, VkResult resu
     //
     cmdPool->utFreeCommandBuffer(cmd);
     destroyBuffer(bufferStage);
-    vkFreeMemory(m_device, bufferStageMem, NULL);
+    freeMemory(bufferStageMem);
     //obsolete: QueueRemoveMemReferences(m_queue, 1, &bufferStageMem);
     return result;
 }
@@ -1397,7 +1739,7 @@ void NVK::utFillImage(NVK::CommandPool *cmdPool, BufferImageCopy &bufferImageCop
     //
     // Allocate and bind to the buffer
     //
-    VkDeviceMemory bufferStageMem;
+    Allocation* bufferStageMem;
     bufferStageMem = utAllocMemAndBindBuffer(bufferStage, (VkFlags)VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
 
     utMemcpy(bufferStageMem, data, dataSz);
@@ -1438,14 +1780,14 @@ void NVK::utFillImage(NVK::CommandPool *cmdPool, BufferImageCopy &bufferImageCop
     //
     cmdPool->utFreeCommandBuffer(cmd);
     destroyBuffer(bufferStage);
-    vkFreeMemory(m_device, bufferStageMem, NULL);
+    freeMemory(bufferStageMem);
 }
 
 
 //------------------------------------------------------------------------------
 //
 //------------------------------------------------------------------------------
-VkBuffer NVK::utCreateAndFillBuffer(NVK::CommandPool *cmdPool, size_t size, const void* data, VkFlags usage, VkDeviceMemory &bufferMem, VkFlags memProps)
+VkBuffer NVK::utCreateAndFillBuffer(NVK::CommandPool *cmdPool, size_t size, const void* data, VkFlags usage, Allocation* &bufferMem, VkFlags memProps)
 {
     VkResult result = VK_SUCCESS;
     VkBuffer buffer;
@@ -1950,3 +2292,618 @@ void NVK::CommandBuffer::utCmdSetImageLayout(
         1, &imageMemoryBarrier);
 }
 
+
+//------------------------------------------------------------------------------
+// MemoryAllocator
+//------------------------------------------------------------------------------
+static inline uint32_t bitScanReverse(uint64_t v)
+{
+#ifdef _MSC_VER
+    unsigned long i;
+    _BitScanReverse64(&i, v);
+    return (uint32_t)i;
+#else
+    return 63 - (uint32_t)__builtin_clzll(v);
+#endif
+}
+static inline uint32_t bitScanForward(uint64_t v)
+{
+#ifdef _MSC_VER
+    unsigned long i;
+    _BitScanForward64(&i, v);
+    return (uint32_t)i;
+#else
+    return (uint32_t)__builtin_ctzll(v);
+#endif
+}
+static inline VkDeviceSize alignUp(VkDeviceSize v, VkDeviceSize alignment)
+{
+    return (v + alignment - 1) & ~(alignment - 1);
+}
+//
+// size class of the free lists: first level is the power of 2, second level
+// splits it in SL_COUNT linear ranges
+//
+static inline void tlsfMapping(VkDeviceSize size, uint32_t &fl, uint32_t &sl)
+{
+    fl = bitScanReverse(size);
+    sl = (uint32_t)(size >> (fl - NVK::MemoryAllocator::SL_BITS)) & (NVK::MemoryAllocator::SL_COUNT - 1);
+}
+
+NVK::MemoryAllocator::MemoryAllocator()
+{
+    m_source = NULL;
+    memset(&m_memProps, 0, sizeof(m_memProps));
+    m_blockSize = 0;
+    m_separateKinds = false;
+    m_allocations = 0;
+    m_used = 0;
+}
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+void NVK::MemoryAllocator::init(BlockSource* source, const VkPhysicalDeviceMemoryProperties &memProps, VkDeviceSize bufferImageGranularity, VkDeviceSize blockSize)
+{
+    m_source = source;
+    m_memProps = memProps;
+    m_blockSize = alignUp(blockSize, GRANULE);
+    // with offsets and sizes multiple of GRANULE, a coarser granularity is the
+    // only way for a buffer and an image to share a page
+    m_separateKinds = bufferImageGranularity > GRANULE;
+    m_allocations = 0;
+    m_used = 0;
+}
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+void NVK::MemoryAllocator::deinit()
+{
+    if(m_allocations)
+        LOGW("MemoryAllocator: %d allocations not freed (%.2f MB)\n", m_allocations, m_used / (1024.0 * 1024.0));
+    for(uint32_t i = 0; i < m_blocks.size(); i++)
+        if(m_blocks[i])
+            destroyBlock(i);
+    m_blocks.clear();
+    m_allocations = 0;
+    m_used = 0;
+}
+//------------------------------------------------------------------------------
+// first memory type with all of memProps, as utAllocMemAndBind...() always did
+//------------------------------------------------------------------------------
+uint32_t NVK::MemoryAllocator::findMemoryType(uint32_t memoryTypeBits, VkFlags memProps) const
+{
+    for(uint32_t i = 0; i < m_memProps.memoryTypeCount; ++i) {
+        if((memoryTypeBits & (1 << i)) && (m_memProps.memoryTypes[i].propertyFlags & memProps) == memProps)
+            return i;
+    }
+    return NIL;
+}
+//------------------------------------------------------------------------------
+// small heaps (e.g. the host-visible part of the video memory) get smaller
+// blocks, so that a few of them don't exhaust it
+//------------------------------------------------------------------------------
+VkDeviceSize NVK::MemoryAllocator::blockSizeFor(uint32_t memType) const
+{
+    VkDeviceSize heapSize = m_memProps.memoryHeaps[m_memProps.memoryTypes[memType].heapIndex].size;
+    VkDeviceSize size = m_blockSize;
+    if(heapSize / 8 < size)
+        size = heapSize / 8;
+    size &= ~(VkDeviceSize)(GRANULE - 1);
+    return size < GRANULE * SL_COUNT ? GRANULE * SL_COUNT : size;
+}
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+uint32_t NVK::MemoryAllocator::createBlock(uint32_t memType, bool linear, VkDeviceSize size, bool dedicated)
+{
+    VkDeviceMemory mem = m_source->allocateBlock(memType, size);
+    if(!mem)
+        return NIL;
+    Block* b = new Block;
+    b->mem = mem;
+    b->size = size;
+    b->ptr = NULL;
+    if(m_memProps.memoryTypes[memType].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+        b->ptr = (uint8_t*)m_source->mapBlock(mem, size);
+    b->memType = memType;
+    b->linear = linear;
+    b->dedicated = dedicated;
+    b->allocations = 0;
+    b->freeBytes = size;
+    b->flBitmap = 0;
+    memset(b->slBitmap, 0, sizeof(b->slBitmap));
+    for(uint32_t fl = 0; fl < FL_COUNT; fl++)
+        for(uint32_t sl = 0; sl < SL_COUNT; sl++)
+            b->heads[fl][sl] = NIL;
+    if(!dedicated)
+    {
+        // one free range covering the whole block
+        uint32_t n = newNode(*b);
+        Node &node = b->nodes[n];
+        node.offset = 0;
+        node.size = size;
+        node.prevPhys = node.nextPhys = NIL;
+        insertFree(*b, n);
+    }
+    uint32_t i = 0;
+    while(i < m_blocks.size() && m_blocks[i])
+        i++;
+    if(i == m_blocks.size())
+        m_blocks.push_back(b);
+    else
+        m_blocks[i] = b;
+    return i;
+}
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+void NVK::MemoryAllocator::destroyBlock(uint32_t block)
+{
+    // freeing the memory unmaps it
+    m_source->freeBlock(m_blocks[block]->mem);
+    delete m_blocks[block];
+    m_blocks[block] = NULL;
+}
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+uint32_t NVK::MemoryAllocator::newNode(Block &b)
+{
+    uint32_t n;
+    if(b.unusedNodes.empty())
+    {
+        n = (uint32_t)b.nodes.size();
+        b.nodes.push_back(Node());
+    } else {
+        n = b.unusedNodes.back();
+        b.unusedNodes.pop_back();
+    }
+    b.nodes[n].free = false;
+    b.nodes[n].prevFree = b.nodes[n].nextFree = NIL;
+    return n;
+}
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+void NVK::MemoryAllocator::insertFree(Block &b, uint32_t n)
+{
+    uint32_t fl, sl;
+    tlsfMapping(b.nodes[n].size, fl, sl);
+    uint32_t head = b.heads[fl][sl];
+    b.nodes[n].free = true;
+    b.nodes[n].prevFree = NIL;
+    b.nodes[n].nextFree = head;
+    if(head != NIL)
+        b.nodes[head].prevFree = n;
+    b.heads[fl][sl] = n;
+    b.flBitmap |= 1ull << fl;
+    b.slBitmap[fl] |= 1u << sl;
+}
+void NVK::MemoryAllocator::removeFree(Block &b, uint32_t n)
+{
+    uint32_t fl, sl;
+    tlsfMapping(b.nodes[n].size, fl, sl);
+    Node &node = b.nodes[n];
+    if(node.prevFree != NIL)
+        b.nodes[node.prevFree].nextFree = node.nextFree;
+    else
+        b.heads[fl][sl] = node.nextFree;
+    if(node.nextFree != NIL)
+        b.nodes[node.nextFree].prevFree = node.prevFree;
+    if(b.heads[fl][sl] == NIL)
+    {
+        b.slBitmap[fl] &= ~(1u << sl);
+        if(!b.slBitmap[fl])
+            b.flBitmap &= ~(1ull << fl);
+    }
+    node.free = false;
+    node.prevFree = node.nextFree = NIL;
+}
+//------------------------------------------------------------------------------
+// the size is rounded up to the next size class: any range of the class found
+// is large enough, without walking the list (good fit)
+//------------------------------------------------------------------------------
+uint32_t NVK::MemoryAllocator::findFree(Block &b, VkDeviceSize size)
+{
+    size += (1ull << (bitScanReverse(size) - SL_BITS)) - 1;
+    uint32_t fl, sl;
+    tlsfMapping(size, fl, sl);
+    if(fl >= FL_COUNT)
+        return NIL;
+    uint32_t slMap = b.slBitmap[fl] & (~0u << sl);
+    if(!slMap)
+    {
+        uint64_t flMap = fl + 1 < FL_COUNT ? b.flBitmap & (~0ull << (fl + 1)) : 0;
+        if(!flMap)
+            return NIL;
+        fl = bitScanForward(flMap);
+        slMap = b.slBitmap[fl];
+    }
+    sl = bitScanForward(slMap);
+    return b.heads[fl][sl];
+}
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+uint32_t NVK::MemoryAllocator::allocFromBlock(Block &b, VkDeviceSize size, VkDeviceSize alignment)
+{
+    // free ranges start on a GRANULE: that much padding at most to align them
+    VkDeviceSize search = size + alignment - GRANULE;
+    if(search > b.freeBytes)
+        return NIL;
+    uint32_t n = findFree(b, search);
+    if(n == NIL)
+        return NIL;
+    removeFree(b, n);
+    VkDeviceSize pad = alignUp(b.nodes[n].offset, alignment) - b.nodes[n].offset;
+    if(pad)
+    {
+        // the padding stays free. Its previous neighbour is in use: free
+        // ranges are always merged
+        uint32_t f = newNode(b);
+        b.nodes[f].offset = b.nodes[n].offset;
+        b.nodes[f].size = pad;
+        b.nodes[f].prevPhys = b.nodes[n].prevPhys;
+        b.nodes[f].nextPhys = n;
+        if(b.nodes[f].prevPhys != NIL)
+            b.nodes[b.nodes[f].prevPhys].nextPhys = f;
+        b.nodes[n].prevPhys = f;
+        b.nodes[n].offset += pad;
+        b.nodes[n].size -= pad;
+        insertFree(b, f);
+    }
+    if(b.nodes[n].size > size)
+    {
+        uint32_t r = newNode(b);
+        b.nodes[r].offset = b.nodes[n].offset + size;
+        b.nodes[r].size = b.nodes[n].size - size;
+        b.nodes[r].prevPhys = n;
+        b.nodes[r].nextPhys = b.nodes[n].nextPhys;
+        if(b.nodes[r].nextPhys != NIL)
+            b.nodes[b.nodes[r].nextPhys].prevPhys = r;
+        b.nodes[n].nextPhys = r;
+        b.nodes[n].size = size;
+        insertFree(b, r);
+    }
+    b.freeBytes -= size;
+    b.allocations++;
+    return n;
+}
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+void NVK::MemoryAllocator::freeInBlock(Block &b, uint32_t n)
+{
+    b.freeBytes += b.nodes[n].size;
+    b.allocations--;
+    uint32_t prev = b.nodes[n].prevPhys;
+    if(prev != NIL && b.nodes[prev].free)
+    {
+        removeFree(b, prev);
+        b.nodes[prev].size += b.nodes[n].size;
+        b.nodes[prev].nextPhys = b.nodes[n].nextPhys;
+        if(b.nodes[n].nextPhys != NIL)
+            b.nodes[b.nodes[n].nextPhys].prevPhys = prev;
+        b.unusedNodes.push_back(n);
+        n = prev;
+    }
+    uint32_t next = b.nodes[n].nextPhys;
+    if(next != NIL && b.nodes[next].free)
+    {
+        removeFree(b, next);
+        b.nodes[n].size += b.nodes[next].size;
+        b.nodes[n].nextPhys = b.nodes[next].nextPhys;
+        if(b.nodes[next].nextPhys != NIL)
+            b.nodes[b.nodes[next].nextPhys].prevPhys = n;
+        b.unusedNodes.push_back(next);
+    }
+    insertFree(b, n);
+}
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+NVK::Allocation* NVK::MemoryAllocator::alloc(const VkMemoryRequirements &memReqs, VkFlags memProps, bool linear)
+{
+    if(!memReqs.size)
+        return NULL;
+    uint32_t memType = findMemoryType(memReqs.memoryTypeBits, memProps);
+    if(memType == NIL) {
+        assert(0 && "memoryTypeIndex not found");
+        return NULL;
+    }
+    VkDeviceSize size = alignUp(memReqs.size, GRANULE);
+    VkDeviceSize alignment = memReqs.alignment > GRANULE ? memReqs.alignment : GRANULE;
+    if(!m_separateKinds)
+        linear = true;
+    VkDeviceSize blockSize = blockSizeFor(memType);
+    uint32_t block = NIL;
+    uint32_t node = NIL;
+    if(size + alignment - GRANULE <= blockSize / 2)
+    {
+        for(uint32_t i = 0; i < m_blocks.size() && node == NIL; i++)
+        {
+            Block* b = m_blocks[i];
+            if(b && !b->dedicated && b->memType == memType && b->linear == linear)
+            {
+                node = allocFromBlock(*b, size, alignment);
+                block = i;
+            }
+        }
+        if(node == NIL)
+        {
+            block = createBlock(memType, linear, blockSize, false);
+            if(block != NIL)
+                node = allocFromBlock(*m_blocks[block], size, alignment);
+        }
+    }
+    if(node == NIL)
+    {
+        // too large to share a block, or no room left for a new one
+        block = createBlock(memType, linear, size, true);
+        if(block == NIL)
+            return NULL;
+        m_blocks[block]->freeBytes = 0;
+        m_blocks[block]->allocations = 1;
+    }
+    Block* b = m_blocks[block];
+    Allocation* allocation = new Allocation;
+    allocation->mem = b->mem;
+    allocation->offset = node != NIL ? b->nodes[node].offset : 0;
+    allocation->size = memReqs.size;
+    allocation->ptr = b->ptr ? b->ptr + allocation->offset : NULL;
+    allocation->memType = memType;
+    allocation->block = block;
+    allocation->node = node;
+    m_allocations++;
+    m_used += size;
+    return allocation;
+}
+//------------------------------------------------------------------------------
+// empty blocks go back to the device
+//------------------------------------------------------------------------------
+void NVK::MemoryAllocator::free(Allocation* allocation)
+{
+    if(!allocation)
+        return;
+    Block* b = m_blocks[allocation->block];
+    m_allocations--;
+    m_used -= alignUp(allocation->size, GRANULE);
+    if(b->dedicated)
+        b->allocations = 0;
+    else
+        freeInBlock(*b, allocation->node);
+    if(!b->allocations)
+        destroyBlock(allocation->block);
+    delete allocation;
+}
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+void NVK::MemoryAllocator::getStats(MemoryStats &stats) const
+{
+    memset(&stats, 0, sizeof(stats));
+    stats.allocations = m_allocations;
+    stats.used = m_used;
+    VkDeviceSize freeBytes = 0;
+    for(uint32_t i = 0; i < m_blocks.size(); i++)
+    {
+        const Block* b = m_blocks[i];
+        if(!b)
+            continue;
+        stats.blocks++;
+        stats.allocated += b->size;
+        if(b->dedicated)
+        {
+            stats.dedicated++;
+            continue;
+        }
+        // the nodes of unusedNodes aren't free either
+        for(uint32_t n = 0; n < b->nodes.size(); n++)
+        {
+            if(!b->nodes[n].free)
+                continue;
+            stats.freeRanges++;
+            freeBytes += b->nodes[n].size;
+            if(b->nodes[n].size > stats.largestFree)
+                stats.largestFree = b->nodes[n].size;
+        }
+    }
+    stats.fragmentation = freeBytes ? 1.0f - (float)((double)stats.largestFree / (double)freeBytes) : 0.0f;
+}
+//------------------------------------------------------------------------------
+// NVK gets the blocks from the device
+//------------------------------------------------------------------------------
+VkDeviceMemory NVK::DeviceBlocks::allocateBlock(uint32_t memType, VkDeviceSize size)
+{
+    VkMemoryAllocateInfo memInfo = { VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO };
+    memInfo.allocationSize = size;
+    memInfo.memoryTypeIndex = memType;
+    VkDeviceMemory mem;
+    if(vkAllocateMemory(nvk->m_device, &memInfo, NULL, &mem) != VK_SUCCESS)
+        return VK_NULL_HANDLE;
+    return mem;
+}
+void NVK::DeviceBlocks::freeBlock(VkDeviceMemory mem)
+{
+    vkFreeMemory(nvk->m_device, mem, NULL);
+}
+void* NVK::DeviceBlocks::mapBlock(VkDeviceMemory mem, VkDeviceSize size)
+{
+    void* ptr = NULL;
+    CHECK(vkMapMemory(nvk->m_device, mem, 0, VK_WHOLE_SIZE, 0, &ptr) );
+    return ptr;
+}
+
+//------------------------------------------------------------------------------
+// selfTest: fake handles counted by the source, host-visible blocks are real
+// host memory so that the mapped pointers can be written
+//------------------------------------------------------------------------------
+class FakeBlocks : public NVK::MemoryAllocator::BlockSource
+{
+public:
+    std::map<VkDeviceMemory, std::vector<uint8_t> > host;
+    uint64_t    next;
+    int         live;
+    int         failAbove; // fails the allocations larger than this, to test the fallback
+    FakeBlocks() : next(1), live(0), failAbove(0) {}
+    VkDeviceMemory allocateBlock(uint32_t memType, VkDeviceSize size)
+    {
+        if(failAbove && size > (VkDeviceSize)failAbove)
+            return VK_NULL_HANDLE;
+        live++;
+        return (VkDeviceMemory)(next++ * 0x1000);
+    }
+    void freeBlock(VkDeviceMemory mem)
+    {
+        live--;
+        host.erase(mem);
+    }
+    void* mapBlock(VkDeviceMemory mem, VkDeviceSize size)
+    {
+        host[mem].resize((size_t)size);
+        return host[mem].data();
+    }
+};
+
+#define ALLOC_CHECK(cond, ...) if(!(cond)) { LOGE("MemoryAllocator self-test: " __VA_ARGS__); return false; }
+
+static bool allocatorStress(NVK::MemoryAllocator &allocator, FakeBlocks &source, bool separateKinds)
+{
+    std::vector<NVK::Allocation*> live;
+    std::vector<bool> liveLinear;
+    uint32_t seed = 12345;
+    for(int step = 0; step < 20000; step++)
+    {
+        seed = seed * 1664525u + 1013904223u;
+        uint32_t r = seed >> 8;
+        if(live.empty() || (live.size() < 300 && (r % 100) < 55))
+        {
+            VkMemoryRequirements memReqs;
+            // mostly small, some of a few MB, a few larger than half a block
+            uint32_t kind = r % 64;
+            memReqs.size = kind < 52 ? 1 + (r % 65536) : kind < 63 ? (r % (2 << 20)) + 1 : (9 << 20) + (r % (4 << 20));
+            memReqs.alignment = 1ull << (4 + (r >> 4) % 13); // 16 B to 64 KB
+            memReqs.memoryTypeBits = (r & 1) ? 1 : 6;
+            bool linear = ((r >> 2) & 1) != 0;
+            NVK::Allocation* a = allocator.alloc(memReqs, (r & 1) ? VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT : VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, linear);
+            ALLOC_CHECK(a, "allocation %d of %d bytes failed\n", step, (int)memReqs.size);
+            ALLOC_CHECK((a->offset % memReqs.alignment) == 0, "offset %d not aligned on %d\n", (int)a->offset, (int)memReqs.alignment);
+            ALLOC_CHECK(((r & 1) != 0) == (a->ptr == NULL), "device-local memory mapped, or host-visible memory not mapped\n");
+            if(a->ptr)
+                memset(a->ptr, 0xAB, (size_t)a->size);
+            live.push_back(a);
+            liveLinear.push_back(linear);
+        } else {
+            uint32_t i = r % live.size();
+            allocator.free(live[i]);
+            live[i] = live.back();
+            live.pop_back();
+            liveLinear[i] = liveLinear.back();
+            liveLinear.pop_back();
+        }
+        if((step % 1000) != 999)
+            continue;
+        // no overlap, and buffers never next to images in the same block
+        std::vector<size_t> order(live.size());
+        for(size_t i = 0; i < order.size(); i++)
+            order[i] = i;
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return live[a]->mem != live[b]->mem ? live[a]->mem < live[b]->mem : live[a]->offset < live[b]->offset; });
+        VkDeviceSize used = 0;
+        for(size_t i = 0; i < order.size(); i++)
+        {
+            NVK::Allocation* a = live[order[i]];
+            used += (a->size + NVK::MemoryAllocator::GRANULE - 1) & ~(VkDeviceSize)(NVK::MemoryAllocator::GRANULE - 1);
+            if(i == 0 || live[order[i - 1]]->mem != a->mem)
+                continue;
+            NVK::Allocation* p = live[order[i - 1]];
+            ALLOC_CHECK(p->offset + p->size <= a->offset, "allocations overlap at %d\n", (int)a->offset);
+            ALLOC_CHECK(!separateKinds || liveLinear[order[i - 1]] == liveLinear[order[i]], "buffer and image in the same block\n");
+        }
+        NVK::MemoryStats stats;
+        allocator.getStats(stats);
+        ALLOC_CHECK(stats.allocations == live.size() && stats.used == used, "stats: %d allocations, %d bytes; expected %d, %d\n",
+            stats.allocations, (int)stats.used, (int)live.size(), (int)used);
+        ALLOC_CHECK(stats.blocks == (uint32_t)source.live, "stats: %d blocks; %d allocated\n", stats.blocks, source.live);
+        ALLOC_CHECK(stats.fragmentation >= 0.0f && stats.fragmentation <= 1.0f, "fragmentation %f\n", stats.fragmentation);
+    }
+    NVK::MemoryStats stats;
+    allocator.getStats(stats);
+    LOGI("MemoryAllocator self-test: %d allocations in %d blocks (%d dedicated), %.2f MB used of %.2f MB, %d free ranges, fragmentation %.2f\n",
+        stats.allocations, stats.blocks, stats.dedicated, stats.used / (1024.0 * 1024.0), stats.allocated / (1024.0 * 1024.0), stats.freeRanges, stats.fragmentation);
+    for(size_t i = 0; i < live.size(); i++)
+        allocator.free(live[i]);
+    allocator.getStats(stats);
+    ALLOC_CHECK(stats.allocations == 0 && stats.used == 0, "%d allocations left\n", stats.allocations);
+    ALLOC_CHECK(source.live == 0 && stats.blocks == 0, "%d blocks not released\n", source.live);
+    return true;
+}
+
+bool NVK::MemoryAllocator::selfTest()
+{
+    // 8 GB of video memory, 256 MB of it host-visible, and system memory
+    VkPhysicalDeviceMemoryProperties memProps = {};
+    memProps.memoryHeapCount = 3;
+    memProps.memoryHeaps[0].size = 8ull << 30;
+    memProps.memoryHeaps[0].flags = VK_MEMORY_HEAP_DEVICE_LOCAL_BIT;
+    memProps.memoryHeaps[1].size = 16ull << 30;
+    memProps.memoryHeaps[2].size = 256ull << 20;
+    memProps.memoryHeaps[2].flags = VK_MEMORY_HEAP_DEVICE_LOCAL_BIT;
+    memProps.memoryTypeCount = 3;
+    memProps.memoryTypes[0].heapIndex = 0;
+    memProps.memoryTypes[0].propertyFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+    memProps.memoryTypes[1].heapIndex = 1;
+    memProps.memoryTypes[1].propertyFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT;
+    memProps.memoryTypes[2].heapIndex = 2;
+    memProps.memoryTypes[2].propertyFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+
+    // the memory type: first one with the properties, among the allowed ones
+    MemoryAllocator allocator;
+    FakeBlocks source;
+    allocator.init(&source, memProps, 1024);
+    ALLOC_CHECK(allocator.findMemoryType(7, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) == 1, "host-visible type\n");
+    ALLOC_CHECK(allocator.findMemoryType(5, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) == 2, "host-visible type without type 1\n");
+    ALLOC_CHECK(allocator.findMemoryType(2, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) == NIL, "no device-local type\n");
+    // neighbours merge back into one range: a single block, empty then released
+    {
+        VkMemoryRequirements memReqs = { 1000, 256, 1 };
+        Allocation* a[4];
+        for(int i = 0; i < 4; i++)
+            a[i] = allocator.alloc(memReqs, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, true);
+        ALLOC_CHECK(a[0]->mem == a[3]->mem && a[1]->offset == 1024 && a[3]->offset == 3072, "allocations not packed\n");
+        allocator.free(a[1]);
+        allocator.free(a[3]);
+        MemoryStats stats;
+        allocator.getStats(stats);
+        ALLOC_CHECK(stats.freeRanges == 2 && stats.fragmentation > 0.0f, "free ranges %d, fragmentation %f\n", stats.freeRanges, stats.fragmentation);
+        Allocation* b = allocator.alloc(memReqs, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, true);
+        ALLOC_CHECK(b->offset == 1024, "hole at 1024 not reused (%d)\n", (int)b->offset);
+        allocator.free(b);
+        allocator.free(a[0]);
+        allocator.free(a[2]);
+        ALLOC_CHECK(source.live == 0, "empty block not released\n");
+    }
+    // no room for a new block: the allocation gets its exact size
+    {
+        source.failAbove = 1 << 20;
+        VkMemoryRequirements memReqs = { 4096, 256, 1 };
+        Allocation* a = allocator.alloc(memReqs, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, true);
+        MemoryStats stats;
+        allocator.getStats(stats);
+        ALLOC_CHECK(a && stats.dedicated == 1 && stats.allocated == 4096, "no fallback to a dedicated allocation\n");
+        allocator.free(a);
+        source.failAbove = 0;
+    }
+    allocator.deinit();
+    // with a coarse bufferImageGranularity, and with a fine one
+    allocator.init(&source, memProps, 1024, 16 << 20);
+    if(!allocatorStress(allocator, source, true))
+        return false;
+    allocator.deinit();
+    allocator.init(&source, memProps, 1, 16 << 20);
+    if(!allocatorStress(allocator, source, false))
+        return false;
+    allocator.deinit();
+    LOGI("MemoryAllocator self-test passed\n");
+    return true;
+}
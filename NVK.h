@@ -67,6 +67,7 @@
 #include <map>
 #include <set>
 #include <string>
+#include <mutex>
 #include <vulkan/vulkan.h>
 
 #include <nvvk/swapchain_vk.hpp>
@@ -104,6 +105,9 @@ public:
     PFN_vkCmdDebugMarkerInsertEXT       pfnCmdDebugMarkerInsertEXT;
 
     class MemoryChunk;
+    struct Allocation;
+    struct MemoryStats;
+    class MemoryAllocator;
     class BufferImageCopy;
     class BufferCreateInfo;
     class FramebufferCreateInfo;
@@ -235,6 +239,12 @@ public:
         // if none, utAllocateCommandBuffer will be invoked
         VkCommandBuffer       utRequestCmdBuffer(bool primary);
         void                  utRestart(bool primary);
+        // frame-scoped mode: command-buffers come from flat arrays and are never
+        // freed one by one. utRecycle() resets them all with the pool, once the
+        // fence of the frame that used them is passed
+        void                  utSetFrameScoped(bool frameScoped) { m_frameScoped = frameScoped; }
+        bool                  utIsFrameScoped() const { return m_frameScoped; }
+        void                  utRecycle();
 
         operator VkCommandPool  () { return m_cmdPool; }
         operator const VkCommandPool () const { return m_cmdPool; }
@@ -248,6 +258,11 @@ public:
         // be reset and should be reused rather than allocating new ones. Otherwise it leads to memory leak
         std::set<VkCommandBuffer> m_allocatedCmdBuffers[2];
         std::set<VkCommandBuffer>::iterator m_currentCmdBuffer[2];
+        // frame-scoped mode: all the command-buffers allocated so far, the first
+        // m_frameUsed[] of them handed out since the last utRecycle()
+        bool          m_frameScoped;
+        std::vector<VkCommandBuffer> m_frameCmdBuffers[2];
+        size_t        m_frameUsed[2];
     };
 
     bool              m_deviceExternal;
@@ -282,23 +297,44 @@ public:
     //
     // Initialization utilities
     //
-    bool utInitialize(WindowSurface* pWindowSurface = NULL);
+    // pipelineCacheDir: where m_pipelineCache is loaded from, and saved to by
+    // utDestroy(). "": in memory only; NULL: pipelines are made without a cache
+    bool utInitialize(WindowSurface* pWindowSurface = NULL, const char* pipelineCacheDir = "");
     bool utDestroy();
     //
     // ut... : methods that don't really correspond to VK API
     //
     //VkDeviceMemory        utAllocMemAndBindObject(VkObject obj, VkObjectType type, VkFlags memProps = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-    VkDeviceMemory        utAllocMemAndBindBuffer(VkBuffer obj, VkFlags memProps=VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-    VkDeviceMemory        utAllocMemAndBindImage(VkImage obj, VkFlags memProps=VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    // sub-allocated from the blocks of m_allocator; release with freeMemory()
+    Allocation*           utAllocMemAndBindBuffer(VkBuffer obj, VkFlags memProps=VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    bool                  utHasMemoryType(VkFlags memProps);
+    Allocation*           utAllocMemAndBindImage(VkImage obj, VkFlags memProps=VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
     MemoryChunk           utAllocateMemory(size_t size, VkFlags usage, VkFlags memProps=VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
     VkResult              utFillBuffer(CommandPool *cmdPool,  size_t size, VkResult result, const void* data, VkBuffer buffer, VkDeviceSize offset = 0);
     void                  utFillImage(CommandPool *cmdPool, BufferImageCopy &bufferImageCopy, const void* data, VkDeviceSize dataSz, VkImage image);
-    VkBuffer              utCreateAndFillBuffer(CommandPool *cmdPool, size_t size, const void* data, VkFlags usage, VkDeviceMemory &bufferMem, VkFlags memProps=VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-    VkImage               utCreateImage1D(int width, VkDeviceMemory &colorMemory, VkFormat format, VkSampleCountFlagBits depthSamples=VK_SAMPLE_COUNT_1_BIT, VkSampleCountFlagBits colorSamples=VK_SAMPLE_COUNT_1_BIT, int mipLevels = 1, bool asAttachment=false);
-    VkImage               utCreateImage2D(int width, int height, VkDeviceMemory &colorMemory, VkFormat format, VkSampleCountFlagBits depthSamples=VK_SAMPLE_COUNT_1_BIT, VkSampleCountFlagBits colorSamples=VK_SAMPLE_COUNT_1_BIT, int mipLevels = 1, bool asAttachment=false);
-    VkImage               utCreateImage3D(int width, int height, int depth, VkDeviceMemory &colorMemory, VkFormat format, VkSampleCountFlagBits depthSamples=VK_SAMPLE_COUNT_1_BIT, VkSampleCountFlagBits colorSamples=VK_SAMPLE_COUNT_1_BIT, int mipLevels = 1, bool asAttachment=false);
-    VkImage               utCreateImageCube(int width, VkDeviceMemory &colorMemory, VkFormat format, VkSampleCountFlagBits depthSamples=VK_SAMPLE_COUNT_1_BIT, VkSampleCountFlagBits colorSamples=VK_SAMPLE_COUNT_1_BIT, int mipLevels = 1, bool asAttachment=false);
+    VkBuffer              utCreateAndFillBuffer(CommandPool *cmdPool, size_t size, const void* data, VkFlags usage, Allocation* &bufferMem, VkFlags memProps=VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    VkImage               utCreateImage1D(int width, Allocation* &colorMemory, VkFormat format, VkSampleCountFlagBits depthSamples=VK_SAMPLE_COUNT_1_BIT, VkSampleCountFlagBits colorSamples=VK_SAMPLE_COUNT_1_BIT, int mipLevels = 1, bool asAttachment=false);
+    // transient: only ever an attachment, in lazily allocated memory when the device has some
+    VkImage               utCreateImage2D(int width, int height, Allocation* &colorMemory, VkFormat format, VkSampleCountFlagBits depthSamples=VK_SAMPLE_COUNT_1_BIT, VkSampleCountFlagBits colorSamples=VK_SAMPLE_COUNT_1_BIT, int mipLevels = 1, bool asAttachment=false, bool transient=false);
+    VkImage               utCreateImage3D(int width, int height, int depth, Allocation* &colorMemory, VkFormat format, VkSampleCountFlagBits depthSamples=VK_SAMPLE_COUNT_1_BIT, VkSampleCountFlagBits colorSamples=VK_SAMPLE_COUNT_1_BIT, int mipLevels = 1, bool asAttachment=false);
+    VkImage               utCreateStorageImage2D(int width, int height, Allocation* &colorMemory, VkFormat format, int mipLevels = 1);
+    bool                  utFormatSampled(VkFormat format);
+    VkImage               utCreateImageCube(int width, Allocation* &colorMemory, VkFormat format, VkSampleCountFlagBits depthSamples=VK_SAMPLE_COUNT_1_BIT, VkSampleCountFlagBits colorSamples=VK_SAMPLE_COUNT_1_BIT, int mipLevels = 1, bool asAttachment=false);
     void                  utMemcpy(VkDeviceMemory dstMem, const void * srcData, VkDeviceSize size);
+    void                  utMemcpy(Allocation* dstMem, const void * srcData, VkDeviceSize size);
+    void                  utGetMemoryStats(MemoryStats &stats) const;
+    bool                  utLazilyAllocated(const Allocation* mem) const;
+    // deferred destruction: what frames in flight may still use is retired
+    // rather than destroyed. It goes with the next frame submission and gets
+    // destroyed by utCollectRetired() once that submission is complete
+    void                  utRetire(VkObjectType type, uint64_t handle);
+    void                  utRetire(Allocation* mem);
+    void                  utRetire(CommandPool* cmdPool, VkCommandBuffer cmd);
+    uint64_t              utFrameSubmitted() { return ++m_submitSerial; } // serial of the submission just made
+    uint64_t              utRetireSerial() const { return m_submitSerial + 1; } // what is retired now is safe after it
+    uint64_t              utCompletedSerial() const { return m_completedSerial; }
+    // destroys what is safe once the submission 'serial' is complete. ~0: everything, the device is idle
+    void                  utCollectRetired(uint64_t serial);
     //
     // VULKAN function Overrides: similar to Vulkan API but simplified arguments (using structs...)
     // NON-EXHAUSTIVE LIST: need to add missing ones when needed
@@ -312,6 +348,10 @@ public:
     void                  freeMemory(VkDeviceMemory mem);
     void*                 mapMemory(VkDeviceMemory mem, VkDeviceSize offset, VkDeviceSize size, VkMemoryMapFlags flags);
     void                  unmapMemory(VkDeviceMemory mem);
+    // allocations: host-visible blocks stay mapped, unmapMemory() does nothing
+    void                  freeMemory(Allocation* mem);
+    void*                 mapMemory(Allocation* mem, VkDeviceSize offset, VkDeviceSize size, VkMemoryMapFlags flags);
+    void                  unmapMemory(Allocation* mem);
 
     void                  destroyBufferView(VkBufferView bufferView);
     void                  destroyBuffer(VkBuffer buffer);
@@ -930,7 +970,7 @@ public:
             return *this;
         }
         inline int size() const { return (int)bindings.size(); }
-        inline VkVertexInputBindingDescription* getItem(int n=0) { return &(bindings[n]); }
+        inline VkVertexInputBindingDescription* getItem(int n=0) { return bindings.empty() ? NULL : &(bindings[n]); }
         inline const VkVertexInputBindingDescription* getItemCst(int n=0) const { return &(bindings[n]); }
     private:
         std::vector<VkVertexInputBindingDescription> bindings;
@@ -952,7 +992,7 @@ public:
             return *this;
         }
         inline int size() const { return (int)ia.size(); }
-        inline VkVertexInputAttributeDescription* getItem(int n=0) { return &(ia[n]); }
+        inline VkVertexInputAttributeDescription* getItem(int n=0) { return ia.empty() ? NULL : &(ia[n]); }
         inline const VkVertexInputAttributeDescription* getItemCst(int n=0) const { return &(ia[n]); }
     private:
         std::vector<VkVertexInputAttributeDescription> ia;
@@ -1613,12 +1653,11 @@ public:
         friend class NVK::GraphicsPipelineCreateInfo& operator<<(NVK::GraphicsPipelineCreateInfo& os, NVK::PipelineBaseCreateInfo& dt);
     };
     //----------------------------------------------------------------------------
-    inline VkPipeline createGraphicsPipeline(GraphicsPipelineCreateInfo &gp)
-    {
-        VkPipeline p;
-        CHECK(vkCreateGraphicsPipelines(m_device, VK_NULL_HANDLE, 1, gp, NULL, &p) );
-        return p;
-    }
+    // both go through m_pipelineCache, and are timed in m_pipelineStats. They
+    // can be called from several threads at once
+    VkPipeline createGraphicsPipeline(GraphicsPipelineCreateInfo &gp);
+    //----------------------------------------------------------------------------
+    VkPipeline createComputePipeline(VkPipelineLayout layout, const PipelineShaderStageCreateInfo &stage, VkPipelineCreateFlags flags = 0);
     //----------------------------------------------------------------------------
     class ImageMemoryBarrier
     {
@@ -2270,6 +2309,111 @@ public:
         friend class NVK;
     };
 
+    //
+    // Piece of a block of device memory handed out by MemoryAllocator
+    //
+    struct Allocation
+    {
+        VkDeviceMemory  mem;
+        VkDeviceSize    offset;
+        VkDeviceSize    size;
+        void*           ptr;     // mapped address of offset; NULL if not host-visible
+        uint32_t        memType;
+        uint32_t        block;
+        uint32_t        node;
+    };
+    struct MemoryStats
+    {
+        uint32_t        blocks;      // VkDeviceMemory allocated, dedicated ones included
+        uint32_t        dedicated;
+        uint32_t        allocations;
+        uint32_t        freeRanges;
+        VkDeviceSize    allocated;   // bytes of all the blocks
+        VkDeviceSize    used;        // bytes handed out
+        VkDeviceSize    largestFree;
+        float           fragmentation; // 1 - largestFree / free bytes: 0 when the free space is in one piece
+    };
+    //
+    // Gets large blocks per memory type and sub-allocates them with two-level
+    // segregated free lists (TLSF): O(1) allocation and free, with the freed
+    // ranges merged to their neighbours. Buffers and optimal images get their
+    // own blocks when bufferImageGranularity is coarser than the granule, so
+    // they never share a page. Allocations larger than half a block get their
+    // own VkDeviceMemory. Not thread-safe.
+    //
+    class MemoryAllocator
+    {
+    public:
+        enum {
+            GRANULE = 256,  // every offset and size is a multiple of it
+            SL_BITS = 4,
+            SL_COUNT = 1 << SL_BITS,
+            FL_COUNT = 48,
+            NIL = ~0u
+        };
+        // where the blocks come from: the device for NVK, fake handles for selfTest()
+        class BlockSource
+        {
+        public:
+            virtual ~BlockSource() {}
+            virtual VkDeviceMemory allocateBlock(uint32_t memType, VkDeviceSize size) = 0;
+            virtual void           freeBlock(VkDeviceMemory mem) = 0;
+            virtual void*          mapBlock(VkDeviceMemory mem, VkDeviceSize size) = 0;
+        };
+        MemoryAllocator();
+        void        init(BlockSource* source, const VkPhysicalDeviceMemoryProperties &memProps, VkDeviceSize bufferImageGranularity, VkDeviceSize blockSize = 64 * 1024 * 1024);
+        void        deinit();
+        // linear: buffers (and linear images); false: optimal images
+        Allocation* alloc(const VkMemoryRequirements &memReqs, VkFlags memProps, bool linear);
+        void        free(Allocation* allocation);
+        void        getStats(MemoryStats &stats) const;
+        uint32_t    findMemoryType(uint32_t memoryTypeBits, VkFlags memProps) const;
+        // checks the allocator on the CPU, against a fake memory-properties table
+        static bool selfTest();
+    private:
+        struct Node
+        {
+            VkDeviceSize  offset;
+            VkDeviceSize  size;
+            uint32_t      prevPhys, nextPhys; // neighbours in the block
+            uint32_t      prevFree, nextFree; // free list of the size class
+            bool          free;
+        };
+        struct Block
+        {
+            VkDeviceMemory      mem;
+            VkDeviceSize        size;
+            uint8_t*            ptr;
+            uint32_t            memType;
+            bool                linear;
+            bool                dedicated;
+            uint32_t            allocations;
+            VkDeviceSize        freeBytes;
+            uint64_t            flBitmap;
+            uint32_t            slBitmap[FL_COUNT];
+            uint32_t            heads[FL_COUNT][SL_COUNT];
+            std::vector<Node>   nodes;
+            std::vector<uint32_t> unusedNodes;
+        };
+        VkDeviceSize blockSizeFor(uint32_t memType) const;
+        uint32_t    createBlock(uint32_t memType, bool linear, VkDeviceSize size, bool dedicated);
+        void        destroyBlock(uint32_t block);
+        uint32_t    allocFromBlock(Block &b, VkDeviceSize size, VkDeviceSize alignment);
+        void        freeInBlock(Block &b, uint32_t node);
+        uint32_t    newNode(Block &b);
+        void        insertFree(Block &b, uint32_t node);
+        void        removeFree(Block &b, uint32_t node);
+        uint32_t    findFree(Block &b, VkDeviceSize size);
+
+        BlockSource*                        m_source;
+        VkPhysicalDeviceMemoryProperties    m_memProps;
+        VkDeviceSize                        m_blockSize;
+        bool                                m_separateKinds;
+        std::vector<Block*>                 m_blocks;  // NULL : slot available
+        uint32_t                            m_allocations;
+        VkDeviceSize                        m_used;
+    };
+
     class SubmitInfo {
     public:
         SubmitInfo(
@@ -2313,5 +2457,52 @@ public:
     private:
         std::vector<VkSubmitInfo> s;
     };
+    //
+    // device memory of the ut... methods
+    //
+    class DeviceBlocks : public MemoryAllocator::BlockSource
+    {
+    public:
+        NVK* nvk;
+        VkDeviceMemory allocateBlock(uint32_t memType, VkDeviceSize size);
+        void           freeBlock(VkDeviceMemory mem);
+        void*          mapBlock(VkDeviceMemory mem, VkDeviceSize size);
+    };
+    DeviceBlocks    m_deviceBlocks;
+    MemoryAllocator m_allocator;
+    //
+    // retired objects, in the order of their serial
+    //
+    struct Retired
+    {
+        uint64_t        serial;
+        VkObjectType    type;
+        uint64_t        handle;
+        Allocation*     mem;        // VK_OBJECT_TYPE_DEVICE_MEMORY
+        CommandPool*    cmdPool;    // VK_OBJECT_TYPE_COMMAND_BUFFER
+    };
+    std::vector<Retired> m_retired;
+    uint64_t        m_submitSerial;     // frame submissions so far
+    uint64_t        m_completedSerial;  // the last one known to be complete
+    //
+    // pipeline cache: the file is specific to the device and its driver, see
+    // utInitPipelineCache()
+    //
+    struct PipelineStats
+    {
+        int         created;
+        double      ms;             // spent creating them
+        int         compared;       // also created without m_pipelineCache
+        double      msUncached;     // spent on these
+        size_t      loadedBytes;    // of the cache file; 0: cold start
+    };
+    VkPipelineCache m_pipelineCache;
+    std::string     m_pipelineCachePath;    // empty: not saved
+    bool            m_pipelineCacheCompare; // every pipeline is created a second time without the cache, to time it
+    PipelineStats   m_pipelineStats;
+    std::mutex      m_pipelineStatsMutex;   // pipelines may be created by worker threads
+    PipelineStats   utGetPipelineStats();
+    void            utInitPipelineCache(const char* dir);
+    void            utSavePipelineCache();
 }; // NVK
 #endif //_NVK_H_
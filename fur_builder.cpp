@@ -0,0 +1,334 @@
+/*
+ * Copyright (c) 2016-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2016-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <float.h>
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include "nvh/nvprint.hpp"
+#include "fur_builder.h"
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+void buildFurRange(Vertex* data, const FurParams& params, int first, int count, FurKernelType kernel)
+{
+  if(kernel == FUR_KERNEL_BEST)
+    kernel = furBestKernel();
+  // strands descriptors are made in small batches that stay in cache
+  const int batch = 64;
+  FurStrand strands[batch];
+  size_t    vertsPerStrand = furVerticesPerStrand(params.nsteps);
+  for(int i = first; i < first + count; i += batch)
+  {
+    int n = std::min(batch, first + count - i);
+    for(int s = 0; s < n; s++)
+      strands[s] = furMakeStrand(params, (uint32_t)(i + s));
+    buildStrands(data + vertsPerStrand * (i - first), strands, n, params.nsteps, kernel);
+  }
+}
+
+void buildFur(Vertex* data, const FurParams& params, int first, int count, int numThreads, FurKernelType kernel)
+{
+  if(count <= 0)
+    return;
+  if(kernel == FUR_KERNEL_BEST)
+    kernel = furBestKernel();
+  size_t vertsPerStrand = furVerticesPerStrand(params.nsteps);
+  furParallel(count, numThreads, [=, &params](int offset, int n) {
+    buildFurRange(data + vertsPerStrand * offset, params, first + offset, n, kernel);
+  });
+}
+
+void buildFur(std::vector<Vertex>& data, const FurParams& params, int numThreads, FurKernelType kernel)
+{
+  if(kernel == FUR_KERNEL_BEST)
+    kernel = furBestKernel();
+  auto   t0             = std::chrono::high_resolution_clock::now();
+  size_t vertsPerStrand = furVerticesPerStrand(params.nsteps);
+  data.resize(vertsPerStrand * params.numStrands);
+  if(params.numStrands <= 0)
+    return;
+
+  if(numThreads <= 0)
+    numThreads = std::max(1u, std::thread::hardware_concurrency());
+  numThreads = std::min(numThreads, params.numStrands);
+  buildFur(&data[0], params, 0, params.numStrands, numThreads, kernel);
+
+  auto t1 = std::chrono::high_resolution_clock::now();
+  LOGI("Fur: %d strands, %d steps, %d vertices built in %.2f ms (%d threads, %s kernel)\n", params.numStrands,
+       params.nsteps, (int)data.size(), std::chrono::duration<double, std::milli>(t1 - t0).count(), numThreads,
+       furKernelName(kernel));
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+uint32_t* buildFurIndices(uint32_t* indices, int nsteps, int first, int count)
+{
+  uint32_t vertsPerStrand = (uint32_t)furVerticesPerStrand(nsteps);
+  for(int i = first; i < first + count; i++)
+  {
+    for(uint32_t v = 0; v < vertsPerStrand; v++)
+      *indices++ = vertsPerStrand * i + v;
+    *indices++ = FUR_PRIMITIVE_RESTART;
+  }
+  return indices;
+}
+void buildFurIndices(std::vector<uint32_t>& indices, const FurParams& params)
+{
+  indices.resize(furIndicesPerStrand(params.nsteps) * params.numStrands);
+  if(params.numStrands > 0)
+    buildFurIndices(&indices[0], params.nsteps, 0, params.numStrands);
+}
+
+//------------------------------------------------------------------------------
+// LOD
+//------------------------------------------------------------------------------
+void furLodStrands(std::vector<uint32_t>& strands, const FurParams& params, int level)
+{
+  strands.clear();
+  for(int i = 0; i < params.numStrands; i++)
+  {
+    if(furLodKeep(params, (uint32_t)i, level))
+      strands.push_back((uint32_t)i);
+  }
+}
+
+void buildFurLod(Vertex* data, const FurParams& params, int level, const uint32_t* strands, int count, int numThreads, FurKernelType kernel)
+{
+  if(count <= 0)
+    return;
+  if(kernel == FUR_KERNEL_BEST)
+    kernel = furBestKernel();
+  int    nsteps         = furLodSteps(params.nsteps, level);
+  size_t vertsPerStrand = furVerticesPerStrand(nsteps);
+  furParallel(count, numThreads, [=, &params](int offset, int n) {
+    const int batch = 64;
+    FurStrand batchStrands[batch];
+    for(int i = offset; i < offset + n; i += batch)
+    {
+      int b = std::min(batch, offset + n - i);
+      for(int s = 0; s < b; s++)
+        batchStrands[s] = furMakeLodStrand(params, strands[i + s], level);
+      buildStrands(data + vertsPerStrand * i, batchStrands, b, nsteps, kernel);
+    }
+  });
+}
+
+//------------------------------------------------------------------------------
+// the strands grow from a sphere of params.radius at the origin and are at
+// most 2 long (see furMakeStrand()). Below each threshold (in pixels of the
+// render target) the next level is used
+//------------------------------------------------------------------------------
+static const float s_furLodPixels[FUR_LOD_LEVELS - 1] = {600.0f, 200.0f};
+
+int furSelectLod(const FurParams& params, const glm::mat4& view, const glm::mat4& proj, float targetHeight)
+{
+  float     radius = params.radius + 2.0f;
+  glm::vec4 center = view * glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+  float     dist   = -center.z;
+  if(dist <= radius)
+    return 0; // the camera is in the fur
+  // proj[1][1] is 1/tan(fovy/2), negated when the viewport is flipped
+  float pixels = fabsf(proj[1][1]) * radius / dist * targetHeight;
+  int   level  = 0;
+  while((level < FUR_LOD_LEVELS - 1) && (pixels < s_furLodPixels[level]))
+    level++;
+  return level;
+}
+
+//------------------------------------------------------------------------------
+// positions become 16 bits snorm in the bounding box; the rest of the vertex is
+// the same for the whole strand, so it is taken from the first vertex
+//------------------------------------------------------------------------------
+void buildFurCompact(const Vertex* data, size_t numVertices, const FurParams& params, std::vector<VertexCompact>& vertices,
+                     std::vector<FurStrandAttr>& attribs, FurBounds& bounds)
+{
+  glm::vec3 bmin(FLT_MAX);
+  glm::vec3 bmax(-FLT_MAX);
+  for(size_t i = 0; i < numVertices; i++)
+  {
+    bmin = glm::min(bmin, data[i].pos);
+    bmax = glm::max(bmax, data[i].pos);
+  }
+  if(numVertices == 0)
+    bmin = bmax = glm::vec3(0);
+  bounds.center     = (bmin + bmax) * 0.5f;
+  bounds.halfExtent = glm::max((bmax - bmin) * 0.5f, glm::vec3(1e-6f));
+
+  vertices.resize(numVertices);
+  for(size_t i = 0; i < numVertices; i++)
+  {
+    glm::vec3 p = (data[i].pos - bounds.center) / bounds.halfExtent;
+    for(int c = 0; c < 3; c++)
+      vertices[i].pos[c] = (int16_t)glm::clamp(floorf(p[c] * 32767.0f + 0.5f), -32767.0f, 32767.0f);
+    vertices[i].pos[3] = 0;
+  }
+
+  size_t vertsPerStrand = furVerticesPerStrand(params.nsteps);
+  attribs.resize(params.numStrands);
+  for(int i = 0; i < params.numStrands; i++)
+  {
+    const Vertex* v = &data[vertsPerStrand * i];
+    // first row is pos +/- tangent * thickness, tangent being a unit vector
+    attribs[i].n   = glm::vec4(v[0].n, 0.5f * glm::length(v[0].pos - v[1].pos));
+    attribs[i].col = glm::vec4(v[0].col.x, v[0].col.y, v[0].col.z, 1.0f);
+  }
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+FurStrandControl furMakeStrandControl(const FurStrand& s)
+{
+  FurStrandControl c;
+  c.pos  = glm::vec4(s.pos, s.curve);
+  c.dvec = glm::vec4(s.dvec, s.length);
+  c.nvec = glm::vec4(s.nvec, s.thick);
+  c.col  = glm::vec4(s.color, 1.0f);
+  return c;
+}
+void buildFurControl(std::vector<FurStrandControl>& controls, const FurParams& params)
+{
+  controls.resize(params.numStrands);
+  for(int i = 0; i < params.numStrands; i++)
+    controls[i] = furMakeStrandControl(furMakeStrand(params, (uint32_t)i));
+}
+
+//------------------------------------------------------------------------------
+// must stay in sync with GLSL_fur_procedural.vert
+//------------------------------------------------------------------------------
+glm::vec3 furProceduralPosition(const FurStrandControl& c, int nsteps, int vertexIndex)
+{
+  // corners of the 2 triangles of a segment, in buildStrand() order (0,1,2,1,3,2)
+  static const int   cornerRow[6]  = {0, 0, 1, 0, 1, 1};
+  static const float cornerSide[6] = {1.0f, -1.0f, 1.0f, -1.0f, -1.0f, 1.0f};
+  int                segment       = vertexIndex / 6;
+  int                corner        = vertexIndex % 6;
+
+  glm::vec3 pos  = glm::vec3(c.pos.x, c.pos.y, c.pos.z);
+  glm::vec3 dvec = glm::vec3(c.dvec.x, c.dvec.y, c.dvec.z);
+  glm::vec3 nvec = glm::vec3(c.nvec.x, c.nvec.y, c.nvec.z);
+  float     szx  = c.nvec.w;
+  float     szy  = c.dvec.w / (float)nsteps;
+  // dvec * q in glm rotates by inverse(q)
+  glm::quat q = glm::inverse(glm::angleAxis(c.pos.w * glm::pi<float>() / 180.0f, nvec));
+  for(int i = 0; i < segment; i++)
+  {
+    szx *= 0.8f;
+    pos  = pos + dvec * szy;
+    dvec = q * dvec;
+  }
+  glm::vec3 tvec = cross(dvec, nvec) * szx;
+  szx *= 0.8f;
+  glm::vec3 pos2 = pos + dvec * szy;
+  dvec           = q * dvec;
+  if(cornerRow[corner] == 0)
+    return pos + tvec * cornerSide[corner];
+  if(segment == nsteps)
+    return pos + dvec * szy;
+  glm::vec3 tvec2 = cross(dvec, nvec) * szx;
+  return pos2 + tvec2 * cornerSide[corner];
+}
+
+bool furValidateProcedural(const FurParams& params, float tolerance)
+{
+  std::vector<Vertex> reference;
+  buildFur(reference, params, 0, FUR_KERNEL_REFERENCE);
+  size_t stripVerts = furVerticesPerStrand(params.nsteps);
+  int    procVerts  = (int)furProceduralVerticesPerStrand(params.nsteps);
+  float  maxErr     = 0.0f;
+  for(int s = 0; s < params.numStrands; s++)
+  {
+    FurStrandControl c     = furMakeStrandControl(furMakeStrand(params, (uint32_t)s));
+    const Vertex*    strip = &reference[stripVerts * s];
+    for(int v = 0; v < procVerts; v++)
+    {
+      // same vertex in the strip layout: 2 per row, then the tip
+      static const int cornerRow[6]   = {0, 0, 1, 0, 1, 1};
+      static const int cornerRight[6] = {0, 1, 0, 1, 1, 0};
+      int              row            = v / 6 + cornerRow[v % 6];
+      size_t           idx            = (row > params.nsteps) ? stripVerts - 1 : size_t(row * 2 + cornerRight[v % 6]);
+      glm::vec3        d              = furProceduralPosition(c, params.nsteps, v) - strip[idx].pos;
+      maxErr = std::max(maxErr, std::max(fabsf(d.x), std::max(fabsf(d.y), fabsf(d.z))));
+    }
+  }
+  if(maxErr > tolerance)
+  {
+    LOGE("Fur procedural expansion: max error %g (tolerance %g)\n", maxErr, tolerance);
+    return false;
+  }
+  LOGOK("Fur procedural expansion: max error %g\n", maxErr);
+  return true;
+}
+
+bool furValidateGenerated(const FurParams& params, const uint32_t* randomWords, const Vertex* vertices,
+                          const uint32_t* indices, float tolerance)
+{
+  bool ok = true;
+  for(int s = 0; s < params.numStrands && ok; s++)
+  {
+    for(uint32_t c = 0; c < FUR_RANDOM_PER_STRAND; c++)
+    {
+      if(randomWords[s * FUR_RANDOM_PER_STRAND + c] != furRandom(params.seed, (uint32_t)s, c))
+      {
+        LOGE("Fur GPU generation: random word %d of strand %d is 0x%08x instead of 0x%08x\n", c, s,
+             randomWords[s * FUR_RANDOM_PER_STRAND + c], furRandom(params.seed, (uint32_t)s, c));
+        ok = false;
+        break;
+      }
+    }
+  }
+  std::vector<uint32_t> refIndices;
+  buildFurIndices(refIndices, params);
+  if(!refIndices.empty() && memcmp(&refIndices[0], indices, refIndices.size() * sizeof(uint32_t)))
+  {
+    LOGE("Fur GPU generation: indices differ\n");
+    ok = false;
+  }
+  std::vector<Vertex> reference;
+  buildFur(reference, params, 0, FUR_KERNEL_REFERENCE);
+  float  maxErr = 0.0f;
+  size_t worst  = 0;
+  for(size_t i = 0; i < reference.size(); i++)
+  {
+    glm::vec3 dp = vertices[i].pos - reference[i].pos;
+    glm::vec3 dn = vertices[i].n - reference[i].n;
+    glm::vec4 dc = vertices[i].col - reference[i].col;
+    float     e  = std::max(fabsf(dp.x), std::max(fabsf(dp.y), fabsf(dp.z)));
+    e            = std::max(e, std::max(fabsf(dn.x), std::max(fabsf(dn.y), fabsf(dn.z))));
+    e            = std::max(e, std::max(std::max(fabsf(dc.x), fabsf(dc.y)), std::max(fabsf(dc.z), fabsf(dc.w))));
+    if(e > maxErr)
+    {
+      maxErr = e;
+      worst  = i;
+    }
+  }
+  if(maxErr > tolerance)
+  {
+    LOGE("Fur GPU generation: max error %g at vertex %d (tolerance %g)\n", maxErr, (int)worst, tolerance);
+    ok = false;
+  }
+  else if(ok)
+    LOGOK("Fur GPU generation: random words and indices identical, max error %g\n", maxErr);
+  return ok;
+}
@@ -0,0 +1,349 @@
+/*
+ * Copyright (c) 2016-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2016-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+//--------------------------------------------------------------------
+// Fur generation
+//
+// Every strand only depends on its own index: random values come from a
+// counter-based generator (hash of seed, strand index and draw counter)
+// rather than from a shared rand() stream. This allows to build any range
+// of strands independently, on as many threads as we want, and still get
+// bit-identical results.
+//--------------------------------------------------------------------
+#pragma once
+#include <stdint.h>
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+struct Vertex
+{
+  glm::vec3 pos;
+  glm::vec3 n;
+  glm::vec4 col;
+};
+
+//
+// Compact layout: only the position is per-vertex, quantized to 16 bits snorm
+// relative to the fur bounds. Normal, color and thickness are per strand and
+// alpha comes from the row of the vertex in its strand
+//
+enum FurVertexFormat
+{
+  FUR_FORMAT_FULL = 0, // Vertex, 40 bytes
+  FUR_FORMAT_COMPACT,  // VertexCompact + FurStrandAttr, 8 bytes
+  FUR_FORMAT_PROCEDURAL, // FurStrandControl only, expanded by the vertex shader (Vulkan)
+};
+//
+// Where the vertices and indices of FUR_FORMAT_FULL are built
+//
+enum FurGenerator
+{
+  FUR_GEN_CPU = 0, // buildFur(), then uploaded
+  FUR_GEN_GPU,     // GLSL_fur_gen.comp writes the buffers in place (Vulkan)
+};
+struct VertexCompact
+{
+  int16_t pos[4]; // w unused
+};
+struct FurStrandAttr
+{
+  glm::vec4 n;   // w: thickness
+  glm::vec4 col; // a unused
+};
+//
+// Procedural layout: what the vertex shader needs to rebuild a strand
+//
+struct FurStrandControl
+{
+  glm::vec4 pos;  // w: curve (degrees)
+  glm::vec4 dvec; // w: length
+  glm::vec4 nvec; // w: thickness
+  glm::vec4 col;
+};
+struct FurBounds
+{
+  glm::vec3 center;
+  glm::vec3 halfExtent;
+};
+
+//
+// Parameters from which the whole fur is derived
+//
+struct FurParams
+{
+  uint32_t seed;
+  int      numStrands;
+  int      nsteps;
+  float    radius; // of the sphere the strands grow from
+  FurParams()
+      : seed(10)
+      , numStrands(10000)
+      , nsteps(20)
+      , radius(0.1f)
+  {
+  }
+};
+
+//
+// Root description of a strand: everything buildStrand() needs
+//
+struct FurStrand
+{
+  glm::vec3 pos;
+  glm::vec3 dvec;
+  glm::vec3 nvec;
+  glm::vec3 color;
+  float     curve;
+  float     length;
+  float     thick;
+};
+
+//
+// A strand is a triangle strip: one row of 2 vertices per step (pos +/- the
+// tangent) and the tip. Two consecutive segments share the row in between.
+// Strands are separated in the index buffer by FUR_PRIMITIVE_RESTART
+//
+#define FUR_PRIMITIVE_RESTART 0xFFFFFFFF
+
+inline size_t furVerticesPerStrand(int nsteps)
+{
+  return size_t(nsteps + 1) * 2 + 1;
+}
+inline size_t furIndicesPerStrand(int nsteps)
+{
+  return furVerticesPerStrand(nsteps) + 1;
+}
+
+//------------------------------------------------------------------------------
+// counter-based random numbers (PCG hash). Only 32 bits integer operations so
+// that the same values can be computed anywhere
+//------------------------------------------------------------------------------
+inline uint32_t furHash(uint32_t v)
+{
+  uint32_t state = v * 747796405u + 2891336453u;
+  uint32_t word  = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+  return (word >> 22u) ^ word;
+}
+inline uint32_t furRandom(uint32_t seed, uint32_t strand, uint32_t counter)
+{
+  return furHash(furHash(furHash(seed) + strand) + counter);
+}
+// amount of furRandom() counters furMakeStrand() uses
+#define FUR_RANDOM_PER_STRAND 8
+
+//------------------------------------------------------------------------------
+// Random parameters of strand #i
+//------------------------------------------------------------------------------
+inline FurStrand furMakeStrand(const FurParams& params, uint32_t i)
+{
+  FurStrand s;
+  uint32_t  c     = 0;
+  float     alpha = glm::two_pi<float>() * float(furRandom(params.seed, i, c++) & 0x1FFF) / (float)0x1FFF;
+  float     beta  = glm::two_pi<float>() * float(furRandom(params.seed, i, c++) & 0x1FFF) / (float)0x1FFF;
+  s.curve         = 10.0 * (float(furRandom(params.seed, i, c++) & 0x1F) / (float)0x1F) - 5.0;
+  s.length        = 2.0 * (float(furRandom(params.seed, i, c++) & 0x1F) / (float)0x1F);
+  s.thick         = 0.03 * (float(furRandom(params.seed, i, c++) & 0x1F) / (float)0x1F);
+  s.color.x       = 0.5 + 0.5 * float(furRandom(params.seed, i, c++) & 0x1F) / (float)0x1F;
+  s.color.y       = 0.5 + 0.5 * float(furRandom(params.seed, i, c++) & 0x1F) / (float)0x1F;
+  s.color.z       = 0.5 + 0.5 * float(furRandom(params.seed, i, c++) & 0x1F) / (float)0x1F;
+  float r         = cos(beta);
+  s.pos.x         = r * cos(alpha);
+  s.pos.z         = r * sin(alpha);
+  s.pos.y         = sin(beta);
+  s.dvec          = s.pos;
+  s.pos *= params.radius;
+  s.nvec = normalize(cross(s.dvec, glm::vec3(0, 1, 0)));
+  return s;
+}
+
+//------------------------------------------------------------------------------
+// writes furVerticesPerStrand(nsteps) vertices to data and returns the end
+//------------------------------------------------------------------------------
+inline Vertex* buildStrand(Vertex* data, glm::vec3 pos, glm::vec3 dvec, glm::vec3 nvec, glm::vec2& sz, int nsteps, float curve, glm::vec3& color)
+{
+  for(int i = 0; i <= nsteps; i++)
+  {
+    float     alpha = 1.0 - ((float)i / (float)nsteps);
+    glm::vec3 tvec  = cross(dvec, nvec);
+    tvec *= sz.x;
+    sz.x *= 0.8;
+    glm::vec3 pos2 = pos + (dvec * sz.y);
+
+
+    glm::quat q = glm::angleAxis(curve * glm::pi<float>() / 180.0f, nvec);
+    dvec        = dvec * q;
+
+    Vertex vtx;
+    vtx.n   = nvec;
+    vtx.col = glm::vec4(color, alpha);
+    vtx.pos = pos + tvec;
+    *data++ = vtx;
+    vtx.pos = pos - tvec;
+    *data++ = vtx;
+    if(i == nsteps)
+    {
+      vtx.pos = pos + dvec * sz.y;
+      *data++ = vtx;
+    }
+    pos = pos2;
+  }
+  return data;
+}
+inline void buildStrand(std::vector<Vertex>& data, glm::vec3 pos, glm::vec3 dvec, glm::vec3 nvec, glm::vec2& sz, int nsteps, float curve, glm::vec3& color)
+{
+  size_t offset = data.size();
+  data.resize(offset + furVerticesPerStrand(nsteps));
+  buildStrand(&data[offset], pos, dvec, nvec, sz, nsteps, curve, color);
+}
+
+//------------------------------------------------------------------------------
+// Strand expansion kernels (fur_builder_simd.cpp)
+// REFERENCE is buildStrand() above; SCALAR is the SoA kernel with 1 lane
+//------------------------------------------------------------------------------
+enum FurKernelType
+{
+  FUR_KERNEL_BEST = -1,
+  FUR_KERNEL_REFERENCE,
+  FUR_KERNEL_SCALAR,
+  FUR_KERNEL_SSE,
+  FUR_KERNEL_NEON,
+  FUR_KERNEL_AVX,
+  FUR_KERNEL_COUNT
+};
+const char*   furKernelName(FurKernelType kernel);
+bool          furKernelAvailable(FurKernelType kernel);
+FurKernelType furBestKernel();
+// expands count strands into count * furVerticesPerStrand(nsteps) vertices
+void buildStrands(Vertex* data, const FurStrand* strands, int count, int nsteps, FurKernelType kernel);
+// checks every available kernel against the reference. Positions may differ by
+// tolerance, normals and colors must be identical
+bool furValidateKernels(const FurParams& params, float tolerance);
+
+//------------------------------------------------------------------------------
+// runs buildRange(offset, n) over [0, count) in contiguous slices, one per
+// thread (numThreads == 0 : all the cores). Each thread writes its slice
+// straight at its final place in a pre-sized buffer: no locking, no merging
+//------------------------------------------------------------------------------
+template <typename BuildRange>
+void furParallel(int count, int numThreads, BuildRange buildRange)
+{
+  if(numThreads <= 0)
+    numThreads = std::max(1u, std::thread::hardware_concurrency());
+  numThreads = std::min(numThreads, count);
+
+  int                      perThread = (count + numThreads - 1) / numThreads;
+  std::vector<std::thread> threads;
+  for(int t = 1; t < numThreads; t++)
+  {
+    int offset = t * perThread;
+    int n      = std::min(perThread, count - offset);
+    if(n <= 0)
+      break;
+    threads.push_back(std::thread(buildRange, offset, n));
+  }
+  // the calling thread takes the first slice
+  buildRange(0, std::min(perThread, count));
+  for(auto& th : threads)
+    th.join();
+}
+
+//------------------------------------------------------------------------------
+// builds strands [first, first+count) into data (which must hold
+// count * furVerticesPerStrand() vertices)
+//------------------------------------------------------------------------------
+void buildFurRange(Vertex* data, const FurParams& params, int first, int count, FurKernelType kernel = FUR_KERNEL_BEST);
+
+//------------------------------------------------------------------------------
+// builds the whole fur. numThreads == 0 : use all the cores
+// The result doesn't depend on numThreads
+//------------------------------------------------------------------------------
+void buildFur(std::vector<Vertex>& data, const FurParams& params = FurParams(), int numThreads = 0, FurKernelType kernel = FUR_KERNEL_BEST);
+// same for strands [first, first+count) only, into data sized for them. Meant
+// for streaming the fur chunk by chunk, hence quiet
+void buildFur(Vertex* data, const FurParams& params, int first, int count, int numThreads = 0,
+              FurKernelType kernel = FUR_KERNEL_BEST);
+// strip indices for strands [first, first+count), restart index after each one
+uint32_t* buildFurIndices(uint32_t* indices, int nsteps, int first, int count);
+void      buildFurIndices(std::vector<uint32_t>& indices, const FurParams& params = FurParams());
+
+//------------------------------------------------------------------------------
+// Level of detail. Level l has furLodSteps() steps per strand and only keeps a
+// random half of the strands of level l-1, drawn twice as wide so that they
+// cover about the same area. Subsets are nested and, like everything else,
+// only depend on the strand index. Level 0 is the fur itself
+//------------------------------------------------------------------------------
+#define FUR_LOD_LEVELS 3
+
+inline int furLodSteps(int nsteps, int level)
+{
+  return (nsteps >> level) > 0 ? (nsteps >> level) : 1;
+}
+inline bool furLodKeep(const FurParams& params, uint32_t strand, int level)
+{
+  // first counter after the ones of furMakeStrand()
+  return (furRandom(params.seed, strand, FUR_RANDOM_PER_STRAND) & 0xFFFF) < (0x10000u >> level);
+}
+inline FurStrand furMakeLodStrand(const FurParams& params, uint32_t i, int level)
+{
+  FurStrand s = furMakeStrand(params, i);
+  s.thick *= float(1 << level);
+  // fewer but longer steps: same overall bend
+  s.curve *= float(params.nsteps) / float(furLodSteps(params.nsteps, level));
+  return s;
+}
+// indices of the strands kept at level
+void furLodStrands(std::vector<uint32_t>& strands, const FurParams& params, int level);
+// builds strands[0..count) as seen at level into data (which must hold
+// count * furVerticesPerStrand(furLodSteps()) vertices)
+void buildFurLod(Vertex* data, const FurParams& params, int level, const uint32_t* strands, int count, int numThreads = 0,
+                 FurKernelType kernel = FUR_KERNEL_BEST);
+// level for the fur seen through view and proj, from the height in pixels of
+// its bounding sphere in a render target of targetHeight pixels
+int furSelectLod(const FurParams& params, const glm::mat4& view, const glm::mat4& proj, float targetHeight);
+
+//------------------------------------------------------------------------------
+// converts the full vertices to the compact layout
+//------------------------------------------------------------------------------
+void buildFurCompact(const Vertex* data, size_t numVertices, const FurParams& params, std::vector<VertexCompact>& vertices,
+                     std::vector<FurStrandAttr>& attribs, FurBounds& bounds);
+
+//------------------------------------------------------------------------------
+// Procedural expansion: the strand is drawn as a non-indexed triangle list of
+// furProceduralVerticesPerStrand() vertices, one instance per strand.
+// furProceduralPosition() is the CPU version of GLSL_fur_procedural.vert
+//------------------------------------------------------------------------------
+inline size_t furProceduralVerticesPerStrand(int nsteps)
+{
+  return size_t(nsteps + 1) * 6;
+}
+FurStrandControl furMakeStrandControl(const FurStrand& s);
+void             buildFurControl(std::vector<FurStrandControl>& controls, const FurParams& params);
+glm::vec3        furProceduralPosition(const FurStrandControl& c, int nsteps, int vertexIndex);
+// checks furProceduralPosition() against buildStrand()
+bool furValidateProcedural(const FurParams& params, float tolerance);
+
+//------------------------------------------------------------------------------
+// checks what GLSL_fur_gen.comp wrote against the CPU: random words and indices
+// must be identical, vertices may differ by tolerance (GPU trigonometry)
+//------------------------------------------------------------------------------
+bool furValidateGenerated(const FurParams& params, const uint32_t* randomWords, const Vertex* vertices,
+                          const uint32_t* indices, float tolerance);
@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2016-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2016-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+//--------------------------------------------------------------------
+// AVX strand expansion kernel (8 lanes)
+//
+// This file alone is compiled with AVX enabled (see CMakeLists.txt):
+// furBestKernel() only picks it when the CPU has AVX. Nothing but the kernel
+// of fur_builder_simd.h belongs here
+//--------------------------------------------------------------------
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+#include "fur_builder_simd.h"
+
+#if defined(__AVX__)
+struct FurLanesAVX
+{
+  typedef __m256 T;
+  enum
+  {
+    W = 8
+  };
+  static T    set1(float f) { return _mm256_set1_ps(f); }
+  static T    load(const float* p) { return _mm256_loadu_ps(p); }
+  static void store(float* p, T v) { _mm256_storeu_ps(p, v); }
+  static T    add(T a, T b) { return _mm256_add_ps(a, b); }
+  static T    sub(T a, T b) { return _mm256_sub_ps(a, b); }
+  static T    mul(T a, T b) { return _mm256_mul_ps(a, b); }
+};
+
+bool furAVXBuilt()
+{
+  return true;
+}
+
+void buildStrandsAVX(Vertex* data, const FurStrand* strands, int count, int nsteps, size_t vertsPerStrand)
+{
+  FurKernel<FurLanesAVX>::buildAll(data, strands, count, nsteps, vertsPerStrand);
+}
+#else
+// not an x86 target, or built without AVX enabled
+bool furAVXBuilt()
+{
+  return false;
+}
+
+void buildStrandsAVX(Vertex* data, const FurStrand* strands, int count, int nsteps, size_t vertsPerStrand) {}
+#endif
@@ -0,0 +1,275 @@
+/*
+ * Copyright (c) 2016-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2016-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+//--------------------------------------------------------------------
+// Vectorized strand expansion, see fur_builder_simd.h
+//
+// The kernel is instantiated for SSE or NEON (4 lanes) and plain floats
+// (1 lane), the latter being the scalar reference path. The AVX one (8
+// lanes) is in fur_builder_avx.cpp, and only used when the CPU has AVX.
+//--------------------------------------------------------------------
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#define FUR_SIMD_SSE
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define FUR_SIMD_NEON
+#endif
+
+#include "nvh/nvprint.hpp"
+#include "fur_builder_simd.h"
+
+//------------------------------------------------------------------------------
+// lane abstractions
+//------------------------------------------------------------------------------
+struct FurLanesScalar
+{
+  typedef float T;
+  enum
+  {
+    W = 1
+  };
+  static T    set1(float f) { return f; }
+  static T    load(const float* p) { return *p; }
+  static void store(float* p, T v) { *p = v; }
+  static T    add(T a, T b) { return a + b; }
+  static T    sub(T a, T b) { return a - b; }
+  static T    mul(T a, T b) { return a * b; }
+};
+
+#ifdef FUR_SIMD_SSE
+struct FurLanesSSE
+{
+  typedef __m128 T;
+  enum
+  {
+    W = 4
+  };
+  static T    set1(float f) { return _mm_set1_ps(f); }
+  static T    load(const float* p) { return _mm_loadu_ps(p); }
+  static void store(float* p, T v) { _mm_storeu_ps(p, v); }
+  static T    add(T a, T b) { return _mm_add_ps(a, b); }
+  static T    sub(T a, T b) { return _mm_sub_ps(a, b); }
+  static T    mul(T a, T b) { return _mm_mul_ps(a, b); }
+};
+#endif
+
+#ifdef FUR_SIMD_NEON
+struct FurLanesNEON
+{
+  typedef float32x4_t T;
+  enum
+  {
+    W = 4
+  };
+  static T    set1(float f) { return vdupq_n_f32(f); }
+  static T    load(const float* p) { return vld1q_f32(p); }
+  static void store(float* p, T v) { vst1q_f32(p, v); }
+  static T    add(T a, T b) { return vaddq_f32(a, b); }
+  static T    sub(T a, T b) { return vsubq_f32(a, b); }
+  static T    mul(T a, T b) { return vmulq_f32(a, b); }
+};
+#endif
+
+//------------------------------------------------------------------------------
+// the strand descriptors, transposed into lanes
+//------------------------------------------------------------------------------
+void furStrandLanes(float* soa, int lanes, const FurStrand* strands, int count, int nsteps)
+{
+  for(int l = 0; l < lanes; l++)
+  {
+    const FurStrand& s = strands[std::min(l, count - 1)];
+    // the rotation glm applies with dvec * q is the one of inverse(q)
+    glm::quat q         = glm::inverse(glm::angleAxis(s.curve * glm::pi<float>() / 180.0f, s.nvec));
+    soa[0 * lanes + l]  = s.pos.x;
+    soa[1 * lanes + l]  = s.pos.y;
+    soa[2 * lanes + l]  = s.pos.z;
+    soa[3 * lanes + l]  = s.dvec.x;
+    soa[4 * lanes + l]  = s.dvec.y;
+    soa[5 * lanes + l]  = s.dvec.z;
+    soa[6 * lanes + l]  = s.nvec.x;
+    soa[7 * lanes + l]  = s.nvec.y;
+    soa[8 * lanes + l]  = s.nvec.z;
+    soa[9 * lanes + l]  = q.x;
+    soa[10 * lanes + l] = q.y;
+    soa[11 * lanes + l] = q.z;
+    soa[12 * lanes + l] = q.w;
+    soa[13 * lanes + l] = s.thick;
+    soa[14 * lanes + l] = s.length / (float)nsteps;
+    soa[15 * lanes + l] = s.color.x;
+    soa[16 * lanes + l] = s.color.y;
+    soa[17 * lanes + l] = s.color.z;
+  }
+}
+
+//------------------------------------------------------------------------------
+// the AVX kernel needs the CPU, and the OS saving the YMM registers
+//------------------------------------------------------------------------------
+static bool furCpuHasAVX()
+{
+#if defined(FUR_SIMD_SSE) && defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 1);
+  bool avx     = (info[2] & (1 << 28)) != 0;
+  bool osxsave = (info[2] & (1 << 27)) != 0;
+  return avx && osxsave && ((_xgetbv(0) & 6) == 6);
+#elif defined(FUR_SIMD_SSE)
+  return __builtin_cpu_supports("avx") != 0;
+#else
+  return false;
+#endif
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+const char* furKernelName(FurKernelType kernel)
+{
+  switch(kernel)
+  {
+    case FUR_KERNEL_SCALAR:
+      return "scalar";
+    case FUR_KERNEL_SSE:
+      return "SSE";
+    case FUR_KERNEL_NEON:
+      return "NEON";
+    case FUR_KERNEL_AVX:
+      return "AVX";
+    default:
+      return "reference";
+  }
+}
+
+bool furKernelAvailable(FurKernelType kernel)
+{
+  switch(kernel)
+  {
+    case FUR_KERNEL_REFERENCE:
+    case FUR_KERNEL_SCALAR:
+      return true;
+#ifdef FUR_SIMD_SSE
+    case FUR_KERNEL_SSE:
+      return true;
+#endif
+#ifdef FUR_SIMD_NEON
+    case FUR_KERNEL_NEON:
+      return true;
+#endif
+    case FUR_KERNEL_AVX:
+    {
+      static bool avx = furAVXBuilt() && furCpuHasAVX();
+      return avx;
+    }
+    default:
+      return false;
+  }
+}
+
+FurKernelType furBestKernel()
+{
+  if(furKernelAvailable(FUR_KERNEL_AVX))
+    return FUR_KERNEL_AVX;
+#if defined(FUR_SIMD_SSE)
+  return FUR_KERNEL_SSE;
+#elif defined(FUR_SIMD_NEON)
+  return FUR_KERNEL_NEON;
+#else
+  return FUR_KERNEL_SCALAR;
+#endif
+}
+
+void buildStrands(Vertex* data, const FurStrand* strands, int count, int nsteps, FurKernelType kernel)
+{
+  size_t vertsPerStrand = furVerticesPerStrand(nsteps);
+  switch(kernel)
+  {
+    case FUR_KERNEL_AVX:
+      // callers check furKernelAvailable()
+      buildStrandsAVX(data, strands, count, nsteps, vertsPerStrand);
+      return;
+#ifdef FUR_SIMD_SSE
+    case FUR_KERNEL_SSE:
+      FurKernel<FurLanesSSE>::buildAll(data, strands, count, nsteps, vertsPerStrand);
+      return;
+#endif
+#ifdef FUR_SIMD_NEON
+    case FUR_KERNEL_NEON:
+      FurKernel<FurLanesNEON>::buildAll(data, strands, count, nsteps, vertsPerStrand);
+      return;
+#endif
+    case FUR_KERNEL_SCALAR:
+      FurKernel<FurLanesScalar>::buildAll(data, strands, count, nsteps, vertsPerStrand);
+      return;
+    default:
+      for(int i = 0; i < count; i++)
+      {
+        const FurStrand& s = strands[i];
+        glm::vec3        color(s.color);
+        glm::vec2        sz(s.thick, s.length / (float)nsteps);
+        data = buildStrand(data, s.pos, s.dvec, s.nvec, sz, nsteps, s.curve, color);
+      }
+      return;
+  }
+}
+
+//------------------------------------------------------------------------------
+// compares every available kernel against the original buildStrand()
+//------------------------------------------------------------------------------
+bool furValidateKernels(const FurParams& params, float tolerance)
+{
+  std::vector<Vertex> reference;
+  buildFur(reference, params, 0, FUR_KERNEL_REFERENCE);
+  bool ok = true;
+  for(int k = FUR_KERNEL_SCALAR; k < FUR_KERNEL_COUNT; k++)
+  {
+    if(!furKernelAvailable((FurKernelType)k))
+      continue;
+    std::vector<Vertex> data;
+    buildFur(data, params, 0, (FurKernelType)k);
+    float  maxErr = 0.0f;
+    size_t worst  = 0;
+    for(size_t i = 0; i < data.size(); i++)
+    {
+      glm::vec3 d = data[i].pos - reference[i].pos;
+      float     e = std::max(fabsf(d.x), std::max(fabsf(d.y), fabsf(d.z)));
+      if(memcmp(&data[i].n, &reference[i].n, sizeof(glm::vec3) + sizeof(glm::vec4)))
+        e = 1e30f;
+      if(e > maxErr)
+      {
+        maxErr = e;
+        worst  = i;
+      }
+    }
+    if(maxErr > tolerance)
+    {
+      LOGE("Fur kernel %s: max error %g at vertex %d (tolerance %g)\n", furKernelName((FurKernelType)k), maxErr,
+           (int)worst, tolerance);
+      ok = false;
+    }
+    else
+      LOGOK("Fur kernel %s: max error %g\n", furKernelName((FurKernelType)k), maxErr);
+  }
+  return ok;
+}
@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2016-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2016-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+//--------------------------------------------------------------------
+// Vectorized strand expansion: the kernel shared by the translation units
+// of each instruction set (fur_builder_simd.cpp, fur_builder_avx.cpp)
+//
+// W strands are advanced together, one SIMD lane per strand: positions,
+// directions, normals... are kept as structure-of-arrays registers and only
+// get interleaved back into Vertex when written to the output buffer.
+//
+// Only the lane operations are called from here: no glm or std function.
+// fur_builder_avx.cpp is compiled with AVX enabled, and the copy of an
+// inline function it emits could be the one the linker keeps for the whole
+// program. What needs glm (the rotation of each strand) is done beforehand
+// by furStrandLanes(), in fur_builder_simd.cpp
+//--------------------------------------------------------------------
+#pragma once
+#include "fur_builder.h"
+
+// rows of furStrandLanes(): pos, dvec, nvec, rotation (x y z w), thickness,
+// step length, color
+#define FUR_LANE_ROWS 18
+
+// transposes strands[0, count) into FUR_LANE_ROWS rows of lanes floats, at
+// soa[row * lanes + lane]. Lanes past count replicate the last strand
+void furStrandLanes(float* soa, int lanes, const FurStrand* strands, int count, int nsteps);
+
+// fur_builder_avx.cpp. false: this build has no AVX kernel
+bool furAVXBuilt();
+void buildStrandsAVX(Vertex* data, const FurStrand* strands, int count, int nsteps, size_t vertsPerStrand);
+
+template <class L>
+struct FurKernel
+{
+  typedef typename L::T T;
+  struct V3
+  {
+    T x, y, z;
+  };
+  // same operation order as glm::cross
+  static V3 cross(const V3& a, const V3& b)
+  {
+    V3 r;
+    r.x = L::sub(L::mul(a.y, b.z), L::mul(b.y, a.z));
+    r.y = L::sub(L::mul(a.z, b.x), L::mul(b.z, a.x));
+    r.z = L::sub(L::mul(a.x, b.y), L::mul(b.x, a.y));
+    return r;
+  }
+  static V3 add(const V3& a, const V3& b) { return {L::add(a.x, b.x), L::add(a.y, b.y), L::add(a.z, b.z)}; }
+  static V3 sub(const V3& a, const V3& b) { return {L::sub(a.x, b.x), L::sub(a.y, b.y), L::sub(a.z, b.z)}; }
+  static V3 mul(const V3& a, T s) { return {L::mul(a.x, s), L::mul(a.y, s), L::mul(a.z, s)}; }
+
+  //
+  // expands count <= W strands at once. Unused lanes replicate the last strand
+  // but never get written
+  //
+  static void build(Vertex* data, const FurStrand* strands, int count, int nsteps, size_t vertsPerStrand)
+  {
+    float soa[FUR_LANE_ROWS][L::W];
+    furStrandLanes(&soa[0][0], L::W, strands, count, nsteps);
+    V3 pos   = {L::load(soa[0]), L::load(soa[1]), L::load(soa[2])};
+    V3 dvec  = {L::load(soa[3]), L::load(soa[4]), L::load(soa[5])};
+    V3 nvec  = {L::load(soa[6]), L::load(soa[7]), L::load(soa[8])};
+    V3 qv    = {L::load(soa[9]), L::load(soa[10]), L::load(soa[11])};
+    T  qw    = L::load(soa[12]);
+    T  szx   = L::load(soa[13]);
+    T  szy   = L::load(soa[14]);
+    T  two   = L::set1(2.0f);
+    T  taper = L::set1(0.8f);
+
+    float out[3][3][L::W];
+    for(int i = 0; i <= nsteps; i++)
+    {
+      float alpha = 1.0 - ((float)i / (float)nsteps);
+      V3    tvec  = mul(cross(dvec, nvec), szx);
+      szx         = L::mul(szx, taper);
+      V3 pos2     = add(pos, mul(dvec, szy));
+      // rotate dvec (same formula as glm's quat * vec3)
+      V3 uv  = cross(qv, dvec);
+      V3 uuv = cross(qv, uv);
+      dvec   = add(dvec, mul(add(mul(uv, qw), uuv), two));
+
+      // the row of this step, plus the tip for the last one
+      int nv = (i == nsteps) ? 3 : 2;
+      V3  vtx[3];
+      vtx[0] = add(pos, tvec);
+      vtx[1] = sub(pos, tvec);
+      vtx[2] = add(pos, mul(dvec, szy));
+      for(int v = 0; v < nv; v++)
+      {
+        L::store(out[v][0], vtx[v].x);
+        L::store(out[v][1], vtx[v].y);
+        L::store(out[v][2], vtx[v].z);
+      }
+      // interleave back into Vertex, in the same order as buildStrand()
+      for(int l = 0; l < count; l++)
+      {
+        Vertex* dst = data + vertsPerStrand * l + i * 2;
+        for(int v = 0; v < nv; v++)
+        {
+          dst[v].pos.x = out[v][0][l];
+          dst[v].pos.y = out[v][1][l];
+          dst[v].pos.z = out[v][2][l];
+          dst[v].n.x   = soa[6][l];
+          dst[v].n.y   = soa[7][l];
+          dst[v].n.z   = soa[8][l];
+          dst[v].col.x = soa[15][l];
+          dst[v].col.y = soa[16][l];
+          dst[v].col.z = soa[17][l];
+          dst[v].col.w = alpha;
+        }
+      }
+      pos = pos2;
+    }
+  }
+
+  static void buildAll(Vertex* data, const FurStrand* strands, int count, int nsteps, size_t vertsPerStrand)
+  {
+    for(int i = 0; i < count; i += L::W)
+    {
+      int n = count - i < (int)L::W ? count - i : (int)L::W;
+      build(data + vertsPerStrand * i, strands + i, n, nsteps, vertsPerStrand);
+    }
+  }
+};
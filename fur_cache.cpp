@@ -0,0 +1,330 @@
+/*
+ * Copyright (c) 2016-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2016-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <stdio.h>
+#include <string.h>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "nvh/nvprint.hpp"
+#include "fur_cache.h"
+
+//------------------------------------------------------------------------------
+// FNV-1a
+//------------------------------------------------------------------------------
+static uint64_t furFnv64(const void* data, size_t size, uint64_t h = 14695981039346656037ull)
+{
+  for(size_t i = 0; i < size; i++)
+    h = (h ^ ((const uint8_t*)data)[i]) * 1099511628211ull;
+  return h;
+}
+static uint32_t furHeaderChecksum(const FurCacheHeader& header)
+{
+  FurCacheHeader h = header;
+  h.checksum       = 0;
+  uint64_t v       = furFnv64(&h, sizeof(h));
+  return (uint32_t)(v ^ (v >> 32));
+}
+static uint64_t furAlign(uint64_t v)
+{
+  return (v + FUR_CACHE_ALIGNMENT - 1) & ~uint64_t(FUR_CACHE_ALIGNMENT - 1);
+}
+
+static bool furSeek(FILE* fd, uint64_t offset)
+{
+#ifdef _WIN32
+  return _fseeki64(fd, (__int64)offset, SEEK_SET) == 0;
+#else
+  return fseeko(fd, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+uint64_t furCacheHash(const FurParams& params)
+{
+  uint32_t key[6] = {FUR_CACHE_VERSION, params.seed, (uint32_t)params.numStrands, (uint32_t)params.nsteps,
+                     (uint32_t)sizeof(Vertex), 0};
+  memcpy(&key[5], &params.radius, sizeof(float));
+  return furFnv64(key, sizeof(key));
+}
+
+std::string furCachePath(const std::string& dir, const FurParams& params)
+{
+  char name[64];
+  snprintf(name, sizeof(name), "fur_%016llx.bin", (unsigned long long)furCacheHash(params));
+  return dir.empty() ? std::string(name) : dir + "/" + name;
+}
+
+bool furCacheWrite(const std::string& path, const FurParams& params, const std::vector<Vertex>& data)
+{
+  FurCacheWriter writer;
+  return writer.open(path, params) && writer.write(0, params.numStrands, data.data()) && writer.close();
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+FurCacheWriter::FurCacheWriter()
+    : m_fd(NULL)
+{
+}
+FurCacheWriter::~FurCacheWriter()
+{
+  abort();
+}
+
+bool FurCacheWriter::open(const std::string& path, const FurParams& params)
+{
+  abort();
+  size_t numVertices = furVerticesPerStrand(params.nsteps) * params.numStrands;
+  size_t numIndices  = furIndicesPerStrand(params.nsteps) * params.numStrands;
+  memset(&m_header, 0, sizeof(m_header));
+  m_header.magic          = FUR_CACHE_MAGIC;
+  m_header.version        = FUR_CACHE_VERSION;
+  m_header.paramsHash     = furCacheHash(params);
+  m_header.seed           = params.seed;
+  m_header.numStrands     = params.numStrands;
+  m_header.nsteps         = params.nsteps;
+  m_header.vertexSize     = sizeof(Vertex);
+  m_header.radius         = params.radius;
+  m_header.verticesOffset = furAlign(sizeof(FurCacheHeader));
+  m_header.numVertices    = numVertices;
+  m_header.indicesOffset  = furAlign(m_header.verticesOffset + numVertices * sizeof(Vertex));
+  m_header.numIndices     = numIndices;
+  m_header.fileSize       = m_header.indicesOffset + numIndices * sizeof(uint32_t);
+  m_header.checksum       = furHeaderChecksum(m_header);
+  m_params                = params;
+  m_path                  = path;
+
+  m_fd = fopen((path + ".tmp").c_str(), "wb");
+  if(!m_fd)
+  {
+    LOGW("Fur cache: can't write %s.tmp\n", path.c_str());
+    return false;
+  }
+  static const uint8_t zeros[FUR_CACHE_ALIGNMENT] = {};
+  m_written                                       = 0;
+  if(fwrite(&m_header, sizeof(m_header), 1, m_fd) != 1
+     || fwrite(zeros, 1, m_header.verticesOffset - sizeof(m_header), m_fd) != m_header.verticesOffset - sizeof(m_header))
+  {
+    abort();
+    return false;
+  }
+  return true;
+}
+
+bool FurCacheWriter::write(int first, int count, const Vertex* vertices)
+{
+  if(!m_fd)
+    return false;
+  if(count <= 0)
+    return true;
+  size_t vertsPerStrand = furVerticesPerStrand(m_params.nsteps);
+  size_t idxPerStrand   = furIndicesPerStrand(m_params.nsteps);
+  m_indices.resize(idxPerStrand * count);
+  buildFurIndices(&m_indices[0], m_params.nsteps, first, count);
+  bool ok = furSeek(m_fd, m_header.verticesOffset + uint64_t(first) * vertsPerStrand * sizeof(Vertex))
+            && fwrite(vertices, sizeof(Vertex), vertsPerStrand * count, m_fd) == vertsPerStrand * count
+            && furSeek(m_fd, m_header.indicesOffset + uint64_t(first) * idxPerStrand * sizeof(uint32_t))
+            && fwrite(&m_indices[0], sizeof(uint32_t), m_indices.size(), m_fd) == m_indices.size();
+  if(!ok)
+  {
+    LOGW("Fur cache: failed writing %s.tmp\n", m_path.c_str());
+    abort();
+  }
+  m_written += count;
+  return ok;
+}
+
+bool FurCacheWriter::close()
+{
+  if(!m_fd)
+    return false;
+  // ranges don't overlap: all the strands got written once the count is reached
+  bool ok = (m_written == m_params.numStrands);
+  ok      = (fclose(m_fd) == 0) && ok;
+  m_fd    = NULL;
+  std::string tmpPath = m_path + ".tmp";
+  if(ok)
+  {
+#ifdef _WIN32
+    remove(m_path.c_str()); // rename() doesn't replace on Windows
+#endif
+    ok = rename(tmpPath.c_str(), m_path.c_str()) == 0;
+  }
+  if(!ok)
+  {
+    remove(tmpPath.c_str());
+    LOGW("Fur cache: failed writing %s\n", m_path.c_str());
+    return false;
+  }
+  LOGI("Fur cache: wrote %s (%.2f MB)\n", m_path.c_str(), m_header.fileSize / (1024.0 * 1024.0));
+  return true;
+}
+
+void FurCacheWriter::abort()
+{
+  if(!m_fd)
+    return;
+  fclose(m_fd);
+  m_fd = NULL;
+  remove((m_path + ".tmp").c_str());
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+FurCacheFile::FurCacheFile()
+    : m_ptr(NULL)
+    , m_header(NULL)
+    , m_size(0)
+#ifdef _WIN32
+    , m_file(INVALID_HANDLE_VALUE)
+    , m_mapping(NULL)
+#else
+    , m_fd(-1)
+#endif
+{
+}
+FurCacheFile::~FurCacheFile()
+{
+  unmap();
+}
+
+bool FurCacheFile::map(const std::string& path, const FurParams& params)
+{
+  unmap();
+#ifdef _WIN32
+  m_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                       FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if(m_file == INVALID_HANDLE_VALUE)
+    return false;
+  LARGE_INTEGER size;
+  if(!GetFileSizeEx(m_file, &size) || size.QuadPart < (LONGLONG)sizeof(FurCacheHeader))
+  {
+    unmap();
+    return false;
+  }
+  m_size    = (size_t)size.QuadPart;
+  m_mapping = CreateFileMappingA(m_file, NULL, PAGE_READONLY, 0, 0, NULL);
+  if(m_mapping)
+    m_ptr = (const uint8_t*)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+  m_fd = open(path.c_str(), O_RDONLY);
+  if(m_fd < 0)
+    return false;
+  struct stat st;
+  if(fstat(m_fd, &st) != 0 || st.st_size < (off_t)sizeof(FurCacheHeader))
+  {
+    unmap();
+    return false;
+  }
+  m_size    = (size_t)st.st_size;
+  void* ptr = mmap(NULL, m_size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+  m_ptr     = (ptr == MAP_FAILED) ? NULL : (const uint8_t*)ptr;
+#endif
+  if(!m_ptr)
+  {
+    LOGW("Fur cache: can't map %s\n", path.c_str());
+    unmap();
+    return false;
+  }
+  m_header = (const FurCacheHeader*)m_ptr;
+
+  const FurCacheHeader& h = *m_header;
+  uint64_t vertsSize = h.numVertices * sizeof(Vertex);
+  uint64_t idxSize   = h.numIndices * sizeof(uint32_t);
+  bool     valid     = (h.magic == FUR_CACHE_MAGIC) && (h.version == FUR_CACHE_VERSION) && (h.checksum == furHeaderChecksum(h))
+               && (h.fileSize == m_size) && (h.vertexSize == sizeof(Vertex))
+               && (h.verticesOffset % FUR_CACHE_ALIGNMENT == 0) && (h.indicesOffset % FUR_CACHE_ALIGNMENT == 0)
+               && (h.verticesOffset >= sizeof(FurCacheHeader)) && (h.verticesOffset + vertsSize <= h.indicesOffset)
+               && (h.indicesOffset + idxSize <= m_size);
+  bool     matching  = valid && (h.paramsHash == furCacheHash(params)) && (h.seed == params.seed) && (h.radius == params.radius)
+                  && (h.numStrands == params.numStrands) && (h.nsteps == params.nsteps)
+                  && (h.numVertices == furVerticesPerStrand(params.nsteps) * params.numStrands)
+                  && (h.numIndices == furIndicesPerStrand(params.nsteps) * params.numStrands);
+  if(!matching)
+  {
+    LOGW("Fur cache: %s is %s, rebuilding\n", path.c_str(), valid ? "for other parameters" : "invalid");
+    unmap();
+    return false;
+  }
+  return true;
+}
+
+void FurCacheFile::unmap()
+{
+#ifdef _WIN32
+  if(m_ptr)
+    UnmapViewOfFile(m_ptr);
+  if(m_mapping)
+    CloseHandle(m_mapping);
+  if(m_file != INVALID_HANDLE_VALUE)
+    CloseHandle(m_file);
+  m_mapping = NULL;
+  m_file    = INVALID_HANDLE_VALUE;
+#else
+  if(m_ptr)
+    munmap((void*)m_ptr, m_size);
+  if(m_fd >= 0)
+    close(m_fd);
+  m_fd = -1;
+#endif
+  m_ptr    = NULL;
+  m_header = NULL;
+  m_size   = 0;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+void FurGeometry::acquire(const FurParams& params, int numThreads, const std::string& cacheDir)
+{
+  release();
+  std::string path;
+  if(!cacheDir.empty())
+  {
+    path     = furCachePath(cacheDir, params);
+    m_mapped = m_file.map(path, params);
+    if(m_mapped)
+    {
+      LOGI("Fur cache: mapped %s (%d vertices, %d indices)\n", path.c_str(), (int)numVertices(), (int)numIndices());
+      return;
+    }
+  }
+  buildFur(m_data, params, numThreads);
+  buildFurIndices(m_indices, params);
+  if(!path.empty())
+    furCacheWrite(path, params, m_data);
+}
+
+void FurGeometry::release()
+{
+  m_file.unmap();
+  m_mapped = false;
+  m_data.clear();
+  m_data.shrink_to_fit();
+  m_indices.clear();
+  m_indices.shrink_to_fit();
+}
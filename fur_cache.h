@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2016-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2016-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+//--------------------------------------------------------------------
+// On-disk cache of the generated fur
+//
+// The file is the memory image of the geometry: a header, then the
+// FUR_FORMAT_FULL vertices and the strip indices at aligned offsets. It is
+// mapped read-only and its pointers go straight to the buffer uploads: no
+// parsing, no copy. Only the header is checked (checksum, parameters), so
+// opening a big cache costs a page-in rather than a rebuild.
+//--------------------------------------------------------------------
+#pragma once
+#include <string>
+
+#include "fur_builder.h"
+
+#define FUR_CACHE_MAGIC 0x43525546 // "FURC"
+#define FUR_CACHE_VERSION 2       // bump whenever the generation changes its output
+#define FUR_CACHE_ALIGNMENT 256
+
+struct FurCacheHeader
+{
+  uint32_t magic;
+  uint32_t version;
+  uint64_t paramsHash; // furCacheHash()
+  uint32_t seed;
+  int32_t  numStrands;
+  int32_t  nsteps;
+  uint32_t vertexSize;
+  float    radius;
+  uint32_t pad;
+  uint64_t verticesOffset;
+  uint64_t numVertices;
+  uint64_t indicesOffset;
+  uint64_t numIndices;
+  uint64_t fileSize;
+  uint32_t checksum; // of the header, with checksum == 0
+  uint32_t pad2;
+};
+
+// hash of what the geometry depends on
+uint64_t    furCacheHash(const FurParams& params);
+std::string furCachePath(const std::string& dir, const FurParams& params);
+bool        furCacheWrite(const std::string& path, const FurParams& params, const std::vector<Vertex>& data);
+
+//
+// Writes a cache file strand range by strand range, for fur that is streamed
+// and never entirely in memory. Indices are derived from params. The file
+// is written under a temporary name and only renamed by close(), so that a
+// cache file is either complete or absent
+//
+class FurCacheWriter
+{
+public:
+  FurCacheWriter();
+  ~FurCacheWriter();
+  bool open(const std::string& path, const FurParams& params);
+  // vertices of strands [first, first+count)
+  bool write(int first, int count, const Vertex* vertices);
+  bool close();
+  void abort();
+  bool isOpen() const { return m_fd != NULL; }
+
+private:
+  FILE*                 m_fd;
+  std::string           m_path;
+  FurCacheHeader        m_header;
+  FurParams             m_params;
+  int                   m_written; // strands
+  std::vector<uint32_t> m_indices;
+};
+
+//
+// Read-only mapping of a cache file
+//
+class FurCacheFile
+{
+public:
+  FurCacheFile();
+  ~FurCacheFile();
+  // false when the file is missing or doesn't hold the fur of params
+  bool map(const std::string& path, const FurParams& params);
+  void unmap();
+
+  const Vertex*   vertices() const { return (const Vertex*)(m_ptr + m_header->verticesOffset); }
+  size_t          numVertices() const { return (size_t)m_header->numVertices; }
+  const uint32_t* indices() const { return (const uint32_t*)(m_ptr + m_header->indicesOffset); }
+  size_t          numIndices() const { return (size_t)m_header->numIndices; }
+
+private:
+  const uint8_t*        m_ptr;
+  const FurCacheHeader* m_header;
+  size_t                m_size;
+#ifdef _WIN32
+  void* m_file;
+  void* m_mapping;
+#else
+  int m_fd;
+#endif
+};
+
+//
+// Vertices and indices of the fur, mapped from the cache when it is valid,
+// built (then written to the cache) otherwise. cacheDir empty: no cache
+//
+class FurGeometry
+{
+public:
+  void acquire(const FurParams& params, int numThreads, const std::string& cacheDir);
+  void release();
+
+  const Vertex*   vertices() const { return m_mapped ? m_file.vertices() : m_data.data(); }
+  size_t          numVertices() const { return m_mapped ? m_file.numVertices() : m_data.size(); }
+  const uint32_t* indices() const { return m_mapped ? m_file.indices() : m_indices.data(); }
+  size_t          numIndices() const { return m_mapped ? m_file.numIndices() : m_indices.size(); }
+
+private:
+  FurCacheFile          m_file;
+  bool                  m_mapped = false;
+  std::vector<Vertex>   m_data;
+  std::vector<uint32_t> m_indices;
+};
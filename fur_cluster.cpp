@@ -0,0 +1,333 @@
+/*
+ * Copyright (c) 2016-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2016-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <float.h>
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define FUR_CULL_SSE
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define FUR_CULL_NEON
+#endif
+
+#include "fur_cluster.h"
+#include "fur_sort.h"
+
+//------------------------------------------------------------------------------
+// major axis gives the face, the other two the cell in it
+//------------------------------------------------------------------------------
+int furClusterCell(const glm::vec3& dir, int grid)
+{
+  glm::vec3 a = glm::abs(dir);
+  int       face;
+  float     u, v, m;
+  if(a.x >= a.y && a.x >= a.z)
+  {
+    face = dir.x >= 0.0f ? 0 : 1;
+    u    = dir.y;
+    v    = dir.z;
+    m    = a.x;
+  }
+  else if(a.y >= a.z)
+  {
+    face = dir.y >= 0.0f ? 2 : 3;
+    u    = dir.x;
+    v    = dir.z;
+    m    = a.y;
+  }
+  else
+  {
+    face = dir.z >= 0.0f ? 4 : 5;
+    u    = dir.x;
+    v    = dir.y;
+    m    = a.z;
+  }
+  if(m <= 0.0f)
+    return 0;
+  int cu = std::min(grid - 1, std::max(0, (int)((u / m * 0.5f + 0.5f) * grid)));
+  int cv = std::min(grid - 1, std::max(0, (int)((v / m * 0.5f + 0.5f) * grid)));
+  return (face * grid + cv) * grid + cu;
+}
+
+//------------------------------------------------------------------------------
+// counting sort of the strands by cell; empty cells make no cluster
+//------------------------------------------------------------------------------
+void FurClusterBuilder::begin(const FurParams& params, int level, const uint32_t* strandIds, int first, int count)
+{
+  const int numCells = 6 * FUR_CLUSTER_GRID * FUR_CLUSTER_GRID;
+  m_nsteps           = furLodSteps(params.nsteps, level);
+  std::vector<uint32_t> cellCount(numCells, 0);
+  std::vector<uint32_t> strandCell(count);
+  for(int i = 0; i < count; i++)
+  {
+    uint32_t strand = strandIds ? strandIds[i] : (uint32_t)(first + i);
+    // the root direction: furMakeStrand() starts dvec along the root position
+    strandCell[i] = (uint32_t)furClusterCell(furMakeStrand(params, strand).dvec, FUR_CLUSTER_GRID);
+    cellCount[strandCell[i]]++;
+  }
+  std::vector<uint32_t> cellCluster(numCells);
+  m_clusterFirst.clear();
+  m_clusterCount.clear();
+  uint32_t offset = 0;
+  for(int c = 0; c < numCells; c++)
+  {
+    cellCluster[c] = (uint32_t)m_clusterFirst.size();
+    if(cellCount[c] == 0)
+      continue;
+    m_clusterFirst.push_back(offset);
+    m_clusterCount.push_back(cellCount[c]);
+    offset += cellCount[c];
+  }
+  m_order.resize(count);
+  m_strandCluster.resize(count);
+  std::vector<uint32_t> fill(m_clusterFirst);
+  for(int i = 0; i < count; i++)
+  {
+    uint32_t cluster     = cellCluster[strandCell[i]];
+    m_strandCluster[i]   = cluster;
+    m_order[fill[cluster]++] = (uint32_t)i;
+  }
+  m_bmin.assign(m_clusterFirst.size(), glm::vec3(FLT_MAX));
+  m_bmax.assign(m_clusterFirst.size(), glm::vec3(-FLT_MAX));
+}
+
+void FurClusterBuilder::addVertices(const Vertex* vertices, int first, int count)
+{
+  size_t vertsPerStrand = furVerticesPerStrand(m_nsteps);
+  for(int i = 0; i < count; i++)
+  {
+    uint32_t  cluster = m_strandCluster[first + i];
+    glm::vec3 bmin    = m_bmin[cluster];
+    glm::vec3 bmax    = m_bmax[cluster];
+    for(size_t v = 0; v < vertsPerStrand; v++)
+    {
+      bmin = glm::min(bmin, vertices->pos);
+      bmax = glm::max(bmax, vertices->pos);
+      vertices++;
+    }
+    m_bmin[cluster] = bmin;
+    m_bmax[cluster] = bmax;
+  }
+}
+
+void FurClusterBuilder::end(FurClusters& clusters, uint32_t baseIndex, int32_t baseVertex)
+{
+  uint32_t idxPerStrand = (uint32_t)furIndicesPerStrand(m_nsteps);
+  uint32_t n            = (uint32_t)m_clusterFirst.size();
+  uint32_t padded       = (n + 3) & ~3u;
+  clusters.baseIndex    = baseIndex;
+  clusters.baseVertex   = baseVertex;
+  clusters.firstIndex.resize(n);
+  clusters.indexCount.resize(n);
+  for(int a = 0; a < 3; a++)
+  {
+    // padding: empty boxes, never drawn (no index)
+    clusters.center[a].assign(padded, 0.0f);
+    clusters.extent[a].assign(padded, 0.0f);
+  }
+  for(uint32_t c = 0; c < n; c++)
+  {
+    clusters.firstIndex[c] = m_clusterFirst[c] * idxPerStrand;
+    clusters.indexCount[c] = m_clusterCount[c] * idxPerStrand;
+    glm::vec3 center       = (m_bmin[c] + m_bmax[c]) * 0.5f;
+    glm::vec3 extent       = (m_bmax[c] - m_bmin[c]) * 0.5f;
+    for(int a = 0; a < 3; a++)
+    {
+      clusters.center[a][c] = center[a];
+      clusters.extent[a][c] = extent[a];
+    }
+  }
+  m_strandCluster.clear();
+  m_bmin.clear();
+  m_bmax.clear();
+}
+
+uint32_t* buildFurClusterIndices(uint32_t* indices, const uint32_t* order, int count, int nsteps)
+{
+  uint32_t vertsPerStrand = (uint32_t)furVerticesPerStrand(nsteps);
+  for(int i = 0; i < count; i++)
+  {
+    uint32_t base = vertsPerStrand * order[i];
+    for(uint32_t v = 0; v < vertsPerStrand; v++)
+      *indices++ = base + v;
+    *indices++ = FUR_PRIMITIVE_RESTART;
+  }
+  return indices;
+}
+
+//------------------------------------------------------------------------------
+// Gribb & Hartmann: the planes are sums of the rows of viewProj
+//------------------------------------------------------------------------------
+void furFrustumPlanes(glm::vec4 planes[6], const glm::mat4& viewProj)
+{
+  glm::vec4 row[4];
+  for(int r = 0; r < 4; r++)
+    row[r] = glm::vec4(viewProj[0][r], viewProj[1][r], viewProj[2][r], viewProj[3][r]);
+  planes[0] = row[3] + row[0];
+  planes[1] = row[3] - row[0];
+  planes[2] = row[3] + row[1];
+  planes[3] = row[3] - row[1];
+  planes[4] = row[3] + row[2];
+  planes[5] = row[3] - row[2];
+}
+
+//------------------------------------------------------------------------------
+// a box is out when it is entirely on the negative side of one plane:
+// dot(n, center) + w + dot(|n|, extent) < 0
+//------------------------------------------------------------------------------
+static inline void furEmitDraw(FurDrawIndexed* draws, uint32_t& numDraws, const FurClusters& clusters, uint32_t c)
+{
+  uint32_t firstIndex = clusters.baseIndex + clusters.firstIndex[c];
+  if(numDraws && (draws[numDraws - 1].firstIndex + draws[numDraws - 1].indexCount == firstIndex))
+  {
+    // contiguous with the previous visible cluster: same draw
+    draws[numDraws - 1].indexCount += clusters.indexCount[c];
+    return;
+  }
+  FurDrawIndexed& draw = draws[numDraws++];
+  draw.indexCount      = clusters.indexCount[c];
+  draw.instanceCount   = 1;
+  draw.firstIndex      = firstIndex;
+  draw.vertexOffset    = clusters.baseVertex;
+  draw.firstInstance   = 0;
+}
+
+// bit l set when cluster i + l is in
+static inline int furCullMask4(const FurClusters& clusters, uint32_t i, const glm::vec4 planes[6])
+{
+  int mask;
+#if defined(FUR_CULL_SSE)
+  __m128 cx = _mm_loadu_ps(&clusters.center[0][i]);
+  __m128 cy = _mm_loadu_ps(&clusters.center[1][i]);
+  __m128 cz = _mm_loadu_ps(&clusters.center[2][i]);
+  __m128 ex = _mm_loadu_ps(&clusters.extent[0][i]);
+  __m128 ey = _mm_loadu_ps(&clusters.extent[1][i]);
+  __m128 ez = _mm_loadu_ps(&clusters.extent[2][i]);
+  __m128 in = _mm_castsi128_ps(_mm_set1_epi32(-1));
+  for(int p = 0; p < 6; p++)
+  {
+    const glm::vec4& pl = planes[p];
+    __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cx, _mm_set1_ps(pl.x)), _mm_mul_ps(cy, _mm_set1_ps(pl.y))),
+                          _mm_add_ps(_mm_mul_ps(cz, _mm_set1_ps(pl.z)), _mm_set1_ps(pl.w)));
+    __m128 r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ex, _mm_set1_ps(fabsf(pl.x))), _mm_mul_ps(ey, _mm_set1_ps(fabsf(pl.y)))),
+                          _mm_mul_ps(ez, _mm_set1_ps(fabsf(pl.z))));
+    in       = _mm_and_ps(in, _mm_cmpge_ps(_mm_add_ps(d, r), _mm_setzero_ps()));
+  }
+  mask = _mm_movemask_ps(in);
+#elif defined(FUR_CULL_NEON)
+  float32x4_t cx = vld1q_f32(&clusters.center[0][i]);
+  float32x4_t cy = vld1q_f32(&clusters.center[1][i]);
+  float32x4_t cz = vld1q_f32(&clusters.center[2][i]);
+  float32x4_t ex = vld1q_f32(&clusters.extent[0][i]);
+  float32x4_t ey = vld1q_f32(&clusters.extent[1][i]);
+  float32x4_t ez = vld1q_f32(&clusters.extent[2][i]);
+  uint32x4_t  in = vdupq_n_u32(0xFFFFFFFF);
+  for(int p = 0; p < 6; p++)
+  {
+    const glm::vec4& pl = planes[p];
+    float32x4_t d = vaddq_f32(vaddq_f32(vmulq_n_f32(cx, pl.x), vmulq_n_f32(cy, pl.y)), vaddq_f32(vmulq_n_f32(cz, pl.z), vdupq_n_f32(pl.w)));
+    float32x4_t r = vaddq_f32(vaddq_f32(vmulq_n_f32(ex, fabsf(pl.x)), vmulq_n_f32(ey, fabsf(pl.y))), vmulq_n_f32(ez, fabsf(pl.z)));
+    in            = vandq_u32(in, vcgeq_f32(vaddq_f32(d, r), vdupq_n_f32(0.0f)));
+  }
+  mask = (vgetq_lane_u32(in, 0) & 1) | (vgetq_lane_u32(in, 1) & 2) | (vgetq_lane_u32(in, 2) & 4) | (vgetq_lane_u32(in, 3) & 8);
+#else
+  mask = 0;
+  for(int l = 0; l < 4; l++)
+  {
+    bool in = true;
+    for(int p = 0; p < 6 && in; p++)
+    {
+      const glm::vec4& pl = planes[p];
+      float d = clusters.center[0][i + l] * pl.x + clusters.center[1][i + l] * pl.y + clusters.center[2][i + l] * pl.z + pl.w;
+      float r = clusters.extent[0][i + l] * fabsf(pl.x) + clusters.extent[1][i + l] * fabsf(pl.y)
+                + clusters.extent[2][i + l] * fabsf(pl.z);
+      in = (d + r >= 0.0f);
+    }
+    mask |= in ? (1 << l) : 0;
+  }
+#endif
+  return mask;
+}
+
+uint32_t furCullClusters(FurDrawIndexed* draws, const FurClusters& clusters, const glm::vec4 planes[6], uint32_t& visible,
+                         const uint32_t* order)
+{
+  uint32_t n        = clusters.size();
+  uint32_t numDraws = 0;
+  visible           = 0;
+  if(order)
+  {
+    // test them all first, in memory order, then emit in the requested one
+    std::vector<uint8_t> masks((n + 3) / 4, 0xF);
+    if(planes)
+    {
+      for(uint32_t i = 0; i < n; i += 4)
+        masks[i / 4] = (uint8_t)furCullMask4(clusters, i, planes);
+    }
+    for(uint32_t k = 0; k < n; k++)
+    {
+      uint32_t c = order[k];
+      if(masks[c / 4] & (1 << (c % 4)))
+      {
+        furEmitDraw(draws, numDraws, clusters, c);
+        visible++;
+      }
+    }
+    return numDraws;
+  }
+  for(uint32_t i = 0; i < n; i += 4)
+  {
+    int mask = planes ? furCullMask4(clusters, i, planes) : 0xF;
+    for(uint32_t l = 0; l < 4 && i + l < n; l++)
+    {
+      if(mask & (1 << l))
+      {
+        furEmitDraw(draws, numDraws, clusters, i + l);
+        visible++;
+      }
+    }
+  }
+  return numDraws;
+}
+
+//------------------------------------------------------------------------------
+// squared distances are positive floats: their bits sort like them
+//------------------------------------------------------------------------------
+bool FurClusterSorter::update(const FurClusters& clusters, const glm::vec3& eye, float threshold, int numThreads)
+{
+  uint32_t n = clusters.size();
+  if(m_valid && (m_order.size() == n) && (glm::length(eye - m_eye) <= threshold))
+    return false;
+  std::vector<uint32_t> keys(n);
+  m_order.resize(n);
+  for(uint32_t c = 0; c < n; c++)
+  {
+    glm::vec3 d = glm::vec3(clusters.center[0][c], clusters.center[1][c], clusters.center[2][c]) - eye;
+    float     dist2 = glm::dot(d, d);
+    memcpy(&keys[c], &dist2, sizeof(float));
+    m_order[c] = c;
+  }
+  furRadixSort(keys, m_order, numThreads);
+  m_eye   = eye;
+  m_valid = true;
+  return true;
+}
@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2016-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2016-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+//--------------------------------------------------------------------
+// Fur clusters
+//
+// The strands of a block are grouped by the cell of their root direction on
+// a cube map (6 * FUR_CLUSTER_GRID^2 cells): strands growing the same way end
+// up in the same cluster, and the indices of a cluster are made contiguous.
+// Only the index buffer changes order, the vertices stay where buildFur() put
+// them. Every cluster gets the AABB of its vertices; the culler tests them
+// against the frustum, 4 at a time with SSE or NEON, and writes a compacted
+// list of indexed draws for the indirect draw calls.
+//--------------------------------------------------------------------
+#pragma once
+#include <stdint.h>
+#include <vector>
+
+#include "fur_builder.h"
+
+#define FUR_CLUSTER_GRID 8
+
+//
+// same layout as VkDrawIndexedIndirectCommand and GL's DrawElementsIndirectCommand
+//
+struct FurDrawIndexed
+{
+  uint32_t indexCount;
+  uint32_t instanceCount;
+  uint32_t firstIndex;
+  int32_t  vertexOffset;
+  uint32_t firstInstance;
+};
+
+struct FurClusters
+{
+  uint32_t              baseIndex;  // added to firstIndex: where the block starts in its index buffer
+  int32_t               baseVertex; // vertexOffset of the draws
+  std::vector<uint32_t> firstIndex;
+  std::vector<uint32_t> indexCount;
+  // AABB as center and half extent, structure of arrays padded to 4 for the culler
+  std::vector<float> center[3];
+  std::vector<float> extent[3];
+
+  FurClusters()
+      : baseIndex(0)
+      , baseVertex(0)
+  {
+  }
+  uint32_t size() const { return (uint32_t)firstIndex.size(); }
+};
+
+//------------------------------------------------------------------------------
+// Builds the clusters of a block while its vertices are being streamed:
+//   begin() sorts the strands by cluster,
+//   addVertices() grows the bounds, chunk by chunk, in strand order,
+//   end() writes the clusters.
+// The indices of the block come from buildFurClusterIndices() on order()
+//------------------------------------------------------------------------------
+class FurClusterBuilder
+{
+public:
+  // strandIds: fur strand index of every strand of the block (NULL: first + i,
+  // as in level 0). level only picks the amount of steps
+  void begin(const FurParams& params, int level, const uint32_t* strandIds, int first, int count);
+  // vertices of the block strands [first, first + count)
+  void addVertices(const Vertex* vertices, int first, int count);
+  void end(FurClusters& clusters, uint32_t baseIndex = 0, int32_t baseVertex = 0);
+
+  // block strands in cluster order
+  const std::vector<uint32_t>& order() const { return m_order; }
+
+private:
+  int                    m_nsteps;
+  std::vector<uint32_t>  m_order;
+  std::vector<uint32_t>  m_strandCluster;
+  std::vector<uint32_t>  m_clusterFirst; // in m_order
+  std::vector<uint32_t>  m_clusterCount;
+  std::vector<glm::vec3> m_bmin;
+  std::vector<glm::vec3> m_bmax;
+};
+
+// cube map cell of a direction, in [0, 6 * grid * grid)
+int furClusterCell(const glm::vec3& dir, int grid);
+// strip indices of the block strands order[0..count), restart index after each one
+uint32_t* buildFurClusterIndices(uint32_t* indices, const uint32_t* order, int count, int nsteps);
+
+//------------------------------------------------------------------------------
+// Frustum culling
+//------------------------------------------------------------------------------
+// planes (inside: dot(plane, vec4(p, 1)) >= 0) of viewProj, with GL's [-1, 1]
+// depth range: also conservative for Vulkan's [0, 1]
+void furFrustumPlanes(glm::vec4 planes[6], const glm::mat4& viewProj);
+// writes one draw per run of consecutive visible clusters, returns the amount
+// of draws. visible gets the amount of clusters that passed. planes NULL: all
+// of them pass. order: the clusters in the order to draw them (NULL: as they
+// are in the index buffer)
+uint32_t furCullClusters(FurDrawIndexed* draws, const FurClusters& clusters, const glm::vec4 planes[6], uint32_t& visible,
+                         const uint32_t* order = NULL);
+
+//------------------------------------------------------------------------------
+// Front-to-back order: the clusters by increasing distance of their center to
+// the eye, so that the depth test rejects most of what lies behind. The order
+// only has to be roughly right: it is kept until the eye has moved by more
+// than a threshold. The distance, unlike the view depth, doesn't change when
+// the camera only turns
+//------------------------------------------------------------------------------
+#define FUR_SORT_THRESHOLD 0.05f
+
+class FurClusterSorter
+{
+public:
+  FurClusterSorter()
+      : m_eye(0.0f)
+      , m_valid(false)
+  {
+  }
+  // sorts again if needed, returns whether it did
+  bool update(const FurClusters& clusters, const glm::vec3& eye, float threshold = FUR_SORT_THRESHOLD, int numThreads = 0);
+  void invalidate() { m_valid = false; }
+  const uint32_t* order() const { return m_order.empty() ? NULL : &m_order[0]; }
+
+private:
+  std::vector<uint32_t> m_order;
+  glm::vec3             m_eye;
+  bool                  m_valid;
+};
@@ -0,0 +1,154 @@
+/*
+ * Copyright (c) 2016-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2016-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <algorithm>
+#include <chrono>
+
+#include "nvh/nvprint.hpp"
+#include "fur_sort.h"
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static inline uint32_t furSpreadBits(uint32_t v)
+{
+  // 10 bits -> every third bit
+  v &= 0x3FF;
+  v = (v | (v << 16)) & 0x030000FF;
+  v = (v | (v << 8)) & 0x0300F00F;
+  v = (v | (v << 4)) & 0x030C30C3;
+  v = (v | (v << 2)) & 0x09249249;
+  return v;
+}
+
+uint32_t furMorton3(uint32_t x, uint32_t y, uint32_t z)
+{
+  return furSpreadBits(x) | (furSpreadBits(y) << 1) | (furSpreadBits(z) << 2);
+}
+
+uint32_t furStrandMorton(const FurParams& params, uint32_t strand)
+{
+  // the roots are params.radius * dvec: same order as the unit directions,
+  // which still works for a radius of 0
+  glm::vec3 q = glm::clamp((furMakeStrand(params, strand).dvec * 0.5f + 0.5f) * 1024.0f, 0.0f, 1023.0f);
+  return furMorton3(uint32_t(q.x), uint32_t(q.y), uint32_t(q.z));
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+void furRadixSort(std::vector<uint32_t>& keys, std::vector<uint32_t>& values, int numThreads)
+{
+  int count = (int)keys.size();
+  if(count <= 1)
+    return;
+  if(numThreads <= 0)
+    numThreads = std::max(1u, std::thread::hardware_concurrency());
+  // small sorts aren't worth the threads
+  numThreads = std::max(1, std::min(numThreads, count / 16384));
+  int perThread = (count + numThreads - 1) / numThreads;
+  numThreads    = (count + perThread - 1) / perThread;
+
+  std::vector<uint32_t> keysTmp(count);
+  std::vector<uint32_t> valuesTmp(count);
+  std::vector<uint32_t> hist(numThreads * 256);
+  uint32_t              allOr  = 0;
+  uint32_t              allAnd = ~0u;
+  for(int i = 0; i < count; i++)
+  {
+    allOr |= keys[i];
+    allAnd &= keys[i];
+  }
+  for(int shift = 0; shift < 32; shift += 8)
+  {
+    // same digit everywhere: the pass wouldn't move anything
+    if((((allOr ^ allAnd) >> shift) & 0xFF) == 0)
+      continue;
+    const uint32_t* srcKeys   = keys.data();
+    const uint32_t* srcValues = values.data();
+    uint32_t*       dstKeys   = keysTmp.data();
+    uint32_t*       dstValues = valuesTmp.data();
+    uint32_t*       h         = hist.data();
+    furParallel(numThreads, numThreads, [=](int offset, int n) {
+      for(int t = offset; t < offset + n; t++)
+      {
+        uint32_t* ht = h + t * 256;
+        memset(ht, 0, 256 * sizeof(uint32_t));
+        int end = std::min(count, (t + 1) * perThread);
+        for(int i = t * perThread; i < end; i++)
+          ht[(srcKeys[i] >> shift) & 0xFF]++;
+      }
+    });
+    // exclusive prefix, digit major then thread: keeps the sort stable
+    uint32_t sum = 0;
+    for(int d = 0; d < 256; d++)
+    {
+      for(int t = 0; t < numThreads; t++)
+      {
+        uint32_t c     = h[t * 256 + d];
+        h[t * 256 + d] = sum;
+        sum += c;
+      }
+    }
+    furParallel(numThreads, numThreads, [=](int offset, int n) {
+      for(int t = offset; t < offset + n; t++)
+      {
+        uint32_t* ht  = h + t * 256;
+        int       end = std::min(count, (t + 1) * perThread);
+        for(int i = t * perThread; i < end; i++)
+        {
+          uint32_t dst   = ht[(srcKeys[i] >> shift) & 0xFF]++;
+          dstKeys[dst]   = srcKeys[i];
+          dstValues[dst] = srcValues[i];
+        }
+      }
+    });
+    keys.swap(keysTmp);
+    values.swap(valuesTmp);
+  }
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+void furLayoutStrands(std::vector<uint32_t>& strands, const FurParams& params, int level, int layout, int numThreads)
+{
+  strands.clear();
+  if(level > 0)
+    furLodStrands(strands, params, level);
+  else if(layout == FUR_LAYOUT_MORTON)
+  {
+    strands.resize(std::max(0, params.numStrands));
+    for(size_t i = 0; i < strands.size(); i++)
+      strands[i] = (uint32_t)i;
+  }
+  if((layout != FUR_LAYOUT_MORTON) || strands.empty())
+    return;
+  auto                  t0 = std::chrono::high_resolution_clock::now();
+  std::vector<uint32_t> keys(strands.size());
+  uint32_t*             k = keys.data();
+  const uint32_t*       s = strands.data();
+  furParallel((int)strands.size(), numThreads, [=, &params](int offset, int n) {
+    for(int i = offset; i < offset + n; i++)
+      k[i] = furStrandMorton(params, s[i]);
+  });
+  furRadixSort(keys, strands, numThreads);
+  auto t1 = std::chrono::high_resolution_clock::now();
+  LOGI("Fur LOD %d: %d strands in Morton order in %.2f ms\n", level, (int)strands.size(),
+       std::chrono::duration<double, std::milli>(t1 - t0).count());
+}
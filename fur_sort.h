@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2016-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2016-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+//--------------------------------------------------------------------
+// Strand layout
+//
+// buildFur() writes strands in the order they are generated: neighbours in
+// the buffers are anywhere on the sphere. The Morton layout sorts them by the
+// Morton code (Z-order curve) of their root instead, so that consecutive
+// strands, hence consecutive vertices and triangles, are close on screen.
+// A layout is a list of strand indices: the buffers are filled in its order
+// and every per-strand buffer goes through the same permutation.
+//--------------------------------------------------------------------
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#include "fur_builder.h"
+
+enum FurStrandLayout
+{
+  FUR_LAYOUT_RANDOM = 0, // generation order
+  FUR_LAYOUT_MORTON,     // by the Morton code of the root
+};
+
+// interleaves the 10 low bits of x, y and z: x in bits 0, 3, 6...
+uint32_t furMorton3(uint32_t x, uint32_t y, uint32_t z);
+// Morton code of the root of a strand, quantized on the bounding cube of the sphere
+uint32_t furStrandMorton(const FurParams& params, uint32_t strand);
+
+//------------------------------------------------------------------------------
+// stable LSD radix sort of values by keys, 8 bits per pass; passes where all
+// the keys share the digit are skipped. Each thread histograms then scatters
+// its own contiguous slice (numThreads == 0 : all the cores)
+//------------------------------------------------------------------------------
+void furRadixSort(std::vector<uint32_t>& keys, std::vector<uint32_t>& values, int numThreads = 0);
+
+//------------------------------------------------------------------------------
+// strands of level in layout: empty for level 0 in FUR_LAYOUT_RANDOM, which
+// is plain strand order
+//------------------------------------------------------------------------------
+void furLayoutStrands(std::vector<uint32_t>& strands, const FurParams& params, int level, int layout, int numThreads = 0);
+
+//------------------------------------------------------------------------------
+// dst[i] = src[strands[i]], perStrand elements at a time: applies a layout to
+// a buffer in strand order (vertices, strand attributes, controls...)
+//------------------------------------------------------------------------------
+template <typename T>
+void furPermuteStrands(T* dst, const T* src, const uint32_t* strands, int count, size_t perStrand)
+{
+  for(int i = 0; i < count; i++)
+    memcpy(dst + perStrand * i, src + perStrand * strands[i], perStrand * sizeof(T));
+}
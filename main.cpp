@@ -19,6 +19,7 @@
 
 #define DEFAULT_RENDERER 1
 #include "renderer_base.h"
+#include "NVK.h"
 
 #include <imgui/backends/imgui_impl_gl.h>
 #include <nvgl/contextwindow_gl.hpp>
@@ -36,6 +37,10 @@ private:
 public:
   ImGuiH::Registry    m_guiRegistry;
   nvgl::ContextWindow m_contextWindowGL;
+  bool                m_furChanged = false; // g_furParams edited in the UI
+  // resize events and SS changes since the last frame: the render-targets are
+  // rebuilt once, by the next onWindowRefresh()
+  bool                m_viewportChanged = false;
 
   MyWindow();
 
@@ -75,6 +80,29 @@ const char* g_sampleHelpCmdLine =
     "-s 0 or 1 : stats\n"
     "-q <msaa> : MSAA\n"
     "-r <ss_val> : supersampling (1.0,1.5,2.0)\n"
+    "-t <threads> : threads for fur generation (0 = all the cores)\n"
+    "-n <strands> : amount of fur strands (10000)\n"
+    "-k <steps> : steps per strand (20)\n"
+    "-R <radius> : radius of the sphere the strands grow from (0.1)\n"
+    "-f <format> : fur vertex format (0: full 40 bytes; 1: compact 8 bytes; 2: procedural)\n"
+    "-g <generator> : fur generation (0: CPU; 1: GPU compute shader, Vulkan and full format)\n"
+    "-m <layout> : fur strand layout (0: generation order; 1: Morton order of the roots)\n"
+    "-c <dir> : directory of the fur geometry cache and of the Vulkan pipeline cache ('-' : no cache)\n"
+    "-l <lod> : forces the fur level of detail (0, 1, 2; -1 : from the projected size)\n"
+    "-C 0 or 1 : frustum culling of the fur clusters\n"
+    "-G 0 or 1 : Vulkan culls the fur clusters in a compute shader\n"
+    "-O 0 or 1 : GPU culling also tests the depth of the previous frame (occlusion)\n"
+    "-o 0 or 1 : draws the fur clusters front to back (CPU culling)\n"
+    "-P 0 or 1 : Vulkan submits a scene command-buffer recorded once per render-target\n"
+    "-F <frames> : Vulkan frames in flight (1 to 4; 2)\n"
+    "-W <threads> : Vulkan workers recording the draws in secondary command-buffers (1 to 8; 1)\n"
+    "-M <frames> : Vulkan command-buffer cost per frame, tracked pool vs. frame-scoped pool\n"
+    "-A : checks the Vulkan memory sub-allocator on the CPU, against a fake device, before any is created; quits on a failure\n"
+    "-T <mode> : Vulkan transient MSAA attachments (0: none; 1: color; 2: color and depth, no occlusion culling)\n"
+    "-K <mode> : Vulkan pipeline cache (0: none; 1: saved in the -c directory; 2: also times the pipelines without it)\n"
+    "-V 0 or 1 : Vulkan builds the fur pipelines of every MSAA and fur format on worker threads at startup\n"
+    "-b <frames> : GPU frame time of each strand layout at every SS x MSAA setting, then quits\n"
+    "-v <tolerance> : checks the SIMD fur kernels and the GPU generation against buildStrand() (e.g. 1e-5); quits on a CPU mismatch\n"
     "----------------------------------------\n";
 
 //-----------------------------------------------------------------------------
@@ -92,6 +120,34 @@ int                g_MSAA             = 8;
 float              g_Supersampling    = 1.5;
 int                g_downSamplingMode = 1;
 MatrixBufferGlobal g_globalMatrices;
+FurParams          g_furParams;
+int                g_furThreads   = 0;
+int                g_furFormat    = FUR_FORMAT_FULL;
+int                g_furGenerator = FUR_GEN_CPU;
+int                g_furLayout    = FUR_LAYOUT_RANDOM;
+float              g_furValidate  = 0.0f;
+std::string        g_furCacheDir  = ".";
+int                g_furLod       = -1;
+int                g_furLodLevel  = 0;
+bool               g_furCulling   = true;
+int                g_furClusters  = 0;
+int                g_furClustersVisible = 0;
+bool               g_furGpuCulling = false;
+bool               g_furOcclusion  = true;
+int                g_furClustersOccluded = 0;
+bool               g_furSortClusters = false;
+uint64_t           g_furFragments    = 0;
+bool               g_vkStaticCmd     = true;
+int                g_vkFrames        = 2;
+float              g_vkFramesBlocked = 0.0f;
+float              g_vkBlockedMs     = 0.0f;
+int                g_vkRecordThreads = 1;
+float              g_vkRecordMs[MAX_RECORD_THREADS] = {};
+int                g_vkPoolBenchmark = 0;
+bool               g_vkAllocatorTest = false;
+int                g_vkTransient     = 1;
+int                g_vkPipelineCache = 1;
+bool               g_vkPipelineVariants = true;
 bool               g_helpText = false;
 bool               g_bUseUI   = true;
 #define HELPDURATION 5.0
@@ -112,6 +168,10 @@ struct CameraAnim
 #define COMBO_SS 1
 #define COMBO_DS 2
 #define COMBO_RENDERER 3
+#define COMBO_FURFORMAT 4
+#define COMBO_FURGEN 5
+#define COMBO_FURLOD 6
+#define COMBO_FURLAYOUT 7
 void MyWindow::processUI(int width, int height, double dt)
 {
   // Update imgui configuration
@@ -136,6 +196,26 @@ void MyWindow::processUI(int width, int height, double dt)
     m_guiRegistry.enumCombobox(COMBO_SS, "SuperSampling", &g_Supersampling);
     m_guiRegistry.enumCombobox(COMBO_DS, "DownSampling Mode", &g_downSamplingMode);
     ImGui::Separator();
+    m_guiRegistry.enumCombobox(COMBO_FURFORMAT, "Fur Vertex Format", &g_furFormat);
+    m_guiRegistry.enumCombobox(COMBO_FURGEN, "Fur Generation", &g_furGenerator);
+    m_guiRegistry.enumCombobox(COMBO_FURLAYOUT, "Fur Strand Layout", &g_furLayout);
+    if(ImGui::InputInt("Strands", &g_furParams.numStrands, 10000, 100000, ImGuiInputTextFlags_EnterReturnsTrue))
+    {
+      g_furParams.numStrands = std::max(0, g_furParams.numStrands);
+      m_furChanged           = true;
+    }
+    if(ImGui::SliderInt("Strand Steps", &g_furParams.nsteps, 1, 64))
+      m_furChanged = true;
+    if(ImGui::SliderFloat("Root Radius", &g_furParams.radius, 0.0f, 1.0f))
+      m_furChanged = true;
+    m_guiRegistry.enumCombobox(COMBO_FURLOD, "Fur LOD", &g_furLod);
+    ImGui::Checkbox("Cluster Culling", &g_furCulling);
+    ImGui::Checkbox("GPU Culling (Vulkan)", &g_furGpuCulling);
+    ImGui::Checkbox("Occlusion Culling", &g_furOcclusion);
+    ImGui::Checkbox("Front-to-Back Clusters", &g_furSortClusters);
+    ImGui::Checkbox("Reused Scene Cmd-Buffer (Vulkan)", &g_vkStaticCmd);
+    ImGui::SliderInt("Record Threads (Vulkan)", &g_vkRecordThreads, 1, MAX_RECORD_THREADS);
+    ImGui::Separator();
 
     ImGui::Text("('h' to toggle help)");
     if(g_helpText)
@@ -166,6 +246,22 @@ void MyWindow::processUI(int width, int height, double dt)
     ImGui::ProgressBar(gpuTimeF / maxTimeF, ImVec2(0.0f, 0.0f));
     ImGui::Text("Scene CPU [ms]: %2.3f", cpuTimeF / 1000.0f);
     ImGui::ProgressBar(cpuTimeF / maxTimeF, ImVec2(0.0f, 0.0f));
+    ImGui::Text("Fur LOD: %d", g_furLodLevel);
+    if(g_furCulling)
+      ImGui::Text("Fur clusters: %d visible, %d culled (%d occluded)", g_furClustersVisible, g_furClusters - g_furClustersVisible,
+                  g_furClustersOccluded);
+    ImGui::Text("Fur fragments: %.2f M", g_furFragments / 1000000.0);
+    ImGui::Text("CPU blocked (Vulkan): %d%% of the frames, %.2f ms per frame, %d in flight", (int)(g_vkFramesBlocked * 100.0f + 0.5f),
+                g_vkBlockedMs, g_vkFrames);
+    if(g_vkRecordThreads > 1)
+    {
+      ImGui::Text("Recorded command-buffers (Vulkan) [ms]:");
+      for(int t = 0; t < g_vkRecordThreads; t++)
+      {
+        ImGui::SameLine();
+        ImGui::Text("%.3f", g_vkRecordMs[t]);
+      }
+    }
   }
   ImGui::End();
 }
@@ -195,6 +291,17 @@ bool MyWindow::open(int posX, int posY, int width, int height, const char* title
   m_guiRegistry.enumAdd(COMBO_DS, 0, "1 Tap");
   m_guiRegistry.enumAdd(COMBO_DS, 1, "5 Taps");
   m_guiRegistry.enumAdd(COMBO_DS, 2, "9 Taps on Alpha");
+  m_guiRegistry.enumAdd(COMBO_FURFORMAT, FUR_FORMAT_FULL, "Full (40 bytes)");
+  m_guiRegistry.enumAdd(COMBO_FURFORMAT, FUR_FORMAT_COMPACT, "Compact (8 bytes)");
+  m_guiRegistry.enumAdd(COMBO_FURFORMAT, FUR_FORMAT_PROCEDURAL, "Procedural (Vulkan)");
+  m_guiRegistry.enumAdd(COMBO_FURGEN, FUR_GEN_CPU, "CPU");
+  m_guiRegistry.enumAdd(COMBO_FURGEN, FUR_GEN_GPU, "GPU Compute (Vulkan)");
+  m_guiRegistry.enumAdd(COMBO_FURLAYOUT, FUR_LAYOUT_RANDOM, "Generation order");
+  m_guiRegistry.enumAdd(COMBO_FURLAYOUT, FUR_LAYOUT_MORTON, "Morton order");
+  m_guiRegistry.enumAdd(COMBO_FURLOD, -1, "Auto (projected size)");
+  m_guiRegistry.enumAdd(COMBO_FURLOD, 0, "0: all strands");
+  m_guiRegistry.enumAdd(COMBO_FURLOD, 1, "1: 1/2 strands, 1/2 steps");
+  m_guiRegistry.enumAdd(COMBO_FURLOD, 2, "2: 1/4 strands, 1/4 steps");
   for(int i = 0; i < g_numRenderers; i++)
   {
     m_guiRegistry.enumAdd(COMBO_RENDERER, i, g_renderers[i]->getName());
@@ -233,7 +340,7 @@ void MyWindow::onWindowResize(int w, int h)
     //
     // update the token buffer in which the viewport setup happens for token rendering
     //
-    g_pCurRenderer->updateViewport(0, 0, w, h, g_Supersampling);
+    m_viewportChanged = true;
   }
 }
 
@@ -301,6 +408,11 @@ void MyWindow::onWindowRefresh()
   {
     return;
   }
+  if(m_viewportChanged)
+  {
+    m_viewportChanged = false;
+    g_pCurRenderer->updateViewport(0, 0, getWidth(), getHeight(), g_Supersampling);
+  }
 
   AppWindowCameraInertia::onWindowRefresh();
 
@@ -336,6 +448,69 @@ void MyWindow::onWindowRefresh()
   m_contextWindowGL.swapBuffers();
   g_profiler.endFrame();
 }
+//------------------------------------------------------------------------------
+// -b: renders the fur in each strand layout at every SS x MSAA setting, the
+// camera untouched, and logs the average GPU time of the frames
+//------------------------------------------------------------------------------
+struct LayoutBenchmark
+{
+  int    frames  = 0;  // per setting; 0 : no benchmark
+  int    setting = -1; // layout major, then SS, then MSAA
+  int    left    = 0;  // frames to render for the current setting
+  double gpuTime[2][3][3];
+
+  bool step(MyWindow& window);
+};
+LayoutBenchmark g_layoutBenchmark;
+
+// false once every setting got its frames
+bool LayoutBenchmark::step(MyWindow& window)
+{
+  static const int   layouts[2] = {FUR_LAYOUT_RANDOM, FUR_LAYOUT_MORTON};
+  static const float ss[3]      = {1.0f, 1.5f, 2.0f};
+  static const int   msaa[3]    = {1, 4, 8};
+  window.m_renderCnt            = 1;
+  if(left > 0)
+  {
+    left--;
+    return true;
+  }
+  if(setting >= 0)
+  {
+    nvh::Profiler::TimerInfo info;
+    g_profiler.getTimerInfo("frame", info);
+    gpuTime[setting / 9][(setting / 3) % 3][setting % 3] = info.gpu.average;
+  }
+  if(++setting == 18)
+  {
+    LOGI("Fur strand layout: average GPU frame time [ms] over %d frames, %d strands\n", frames, g_furParams.numStrands);
+    LOGI("  SS   MSAA  generation  Morton   speedup\n");
+    for(int s = 0; s < 3; s++)
+    {
+      for(int m = 0; m < 3; m++)
+      {
+        LOGI("  %.1f  %dx    %8.3f  %8.3f  %6.2fx\n", ss[s], msaa[m], gpuTime[0][s][m] / 1000.0, gpuTime[1][s][m] / 1000.0,
+             gpuTime[0][s][m] / std::max(gpuTime[1][s][m], 0.001));
+      }
+    }
+    return false;
+  }
+  int layout = layouts[setting / 9];
+  if(layout != g_furLayout)
+  {
+    g_furLayout = layout;
+    g_pCurRenderer->updateFur();
+  }
+  g_Supersampling = ss[(setting / 3) % 3];
+  g_MSAA          = msaa[setting % 3];
+  g_pCurRenderer->updateMSAA(g_MSAA);
+  window.m_viewportChanged = true;
+  // the first frames after a change aren't counted
+  g_profiler.reset(1);
+  left = frames;
+  return true;
+}
+
 //------------------------------------------------------------------------------
 // Main initialization point
 //------------------------------------------------------------------------------
@@ -390,6 +565,99 @@ int main(int argc, char** argv)
         g_Supersampling = atof(argv[++i]);
         LOGI("g_Supersampling set to %.2f\n", g_Supersampling);
         break;
+      case 't':
+        g_furThreads = atoi(argv[++i]);
+        LOGI("g_furThreads set to %d\n", g_furThreads);
+        break;
+      case 'f':
+        g_furFormat = atoi(argv[++i]);
+        LOGI("g_furFormat set to %d\n", g_furFormat);
+        break;
+      case 'n':
+        g_furParams.numStrands = std::max(0, atoi(argv[++i]));
+        LOGI("g_furParams.numStrands set to %d\n", g_furParams.numStrands);
+        break;
+      case 'k':
+        g_furParams.nsteps = std::max(1, atoi(argv[++i]));
+        LOGI("g_furParams.nsteps set to %d\n", g_furParams.nsteps);
+        break;
+      case 'R':
+        g_furParams.radius = (float)atof(argv[++i]);
+        LOGI("g_furParams.radius set to %.3f\n", g_furParams.radius);
+        break;
+      case 'g':
+        g_furGenerator = atoi(argv[++i]);
+        LOGI("g_furGenerator set to %d\n", g_furGenerator);
+        break;
+      case 'm':
+        g_furLayout = atoi(argv[++i]) ? FUR_LAYOUT_MORTON : FUR_LAYOUT_RANDOM;
+        LOGI("g_furLayout set to %d\n", g_furLayout);
+        break;
+      case 'b':
+        g_layoutBenchmark.frames = std::max(1, atoi(argv[++i]));
+        LOGI("layout benchmark: %d frames per setting\n", g_layoutBenchmark.frames);
+        break;
+      case 'c':
+        g_furCacheDir = argv[++i];
+        if(g_furCacheDir == "-")
+          g_furCacheDir.clear();
+        LOGI("g_furCacheDir set to '%s'\n", g_furCacheDir.c_str());
+        break;
+      case 'C':
+        g_furCulling = atoi(argv[++i]) ? true : false;
+        LOGI("g_furCulling set to %d\n", g_furCulling);
+        break;
+      case 'G':
+        g_furGpuCulling = atoi(argv[++i]) ? true : false;
+        LOGI("g_furGpuCulling set to %d\n", g_furGpuCulling);
+        break;
+      case 'O':
+        g_furOcclusion = atoi(argv[++i]) ? true : false;
+        LOGI("g_furOcclusion set to %d\n", g_furOcclusion);
+        break;
+      case 'o':
+        g_furSortClusters = atoi(argv[++i]) ? true : false;
+        LOGI("g_furSortClusters set to %d\n", g_furSortClusters);
+        break;
+      case 'P':
+        g_vkStaticCmd = atoi(argv[++i]) ? true : false;
+        LOGI("g_vkStaticCmd set to %d\n", g_vkStaticCmd);
+        break;
+      case 'F':
+        g_vkFrames = std::max(1, std::min(atoi(argv[++i]), MAX_FRAMES_IN_FLIGHT));
+        LOGI("g_vkFrames set to %d\n", g_vkFrames);
+        break;
+      case 'W':
+        g_vkRecordThreads = std::max(1, std::min(atoi(argv[++i]), MAX_RECORD_THREADS));
+        LOGI("g_vkRecordThreads set to %d\n", g_vkRecordThreads);
+        break;
+      case 'M':
+        g_vkPoolBenchmark = std::max(1, atoi(argv[++i]));
+        LOGI("command-pool benchmark: %d frames\n", g_vkPoolBenchmark);
+        break;
+      case 'A':
+        g_vkAllocatorTest = true;
+        break;
+      case 'T':
+        g_vkTransient = std::max(0, std::min(atoi(argv[++i]), 2));
+        LOGI("g_vkTransient set to %d\n", g_vkTransient);
+        break;
+      case 'K':
+        g_vkPipelineCache = std::max(0, std::min(atoi(argv[++i]), 2));
+        LOGI("g_vkPipelineCache set to %d\n", g_vkPipelineCache);
+        break;
+      case 'V':
+        g_vkPipelineVariants = atoi(argv[++i]) ? true : false;
+        LOGI("g_vkPipelineVariants set to %d\n", g_vkPipelineVariants);
+        break;
+      case 'l':
+        g_furLod = std::min(atoi(argv[++i]), FUR_LOD_LEVELS - 1);
+        LOGI("g_furLod set to %d\n", g_furLod);
+        break;
+      case 'v':
+        // checked once all the fur parameters are known
+        g_furValidate = (float)atof(argv[++i]);
+        break;
       case 'd':
         break;
       default:
@@ -400,6 +668,28 @@ int main(int argc, char** argv)
     }
   }
 
+  // the fur of this run, on the CPU. The GPU generation is checked by the
+  // renderer, once it has a device
+  if(g_furValidate > 0.0f)
+  {
+    bool valid = furValidateKernels(g_furParams, g_furValidate);
+    if(!valid)
+      LOGE("Fur kernels validation failed\n");
+    if(!furValidateProcedural(g_furParams, g_furValidate))
+    {
+      LOGE("Fur procedural expansion validation failed\n");
+      valid = false;
+    }
+    if(!valid)
+      return EXIT_FAILURE;
+  }
+  // no device yet: the sub-allocator runs against a fake one
+  if(g_vkAllocatorTest && !NVK::MemoryAllocator::selfTest())
+  {
+    LOGE("Vulkan memory allocator self-test failed\n");
+    return EXIT_FAILURE;
+  }
+
   Renderer* renderer = g_renderers[g_curRenderer];
   renderer->initGraphics(myWindow.getWidth(), myWindow.getHeight(), g_Supersampling, g_MSAA);
   renderer->setDownSamplingMode(g_downSamplingMode);
@@ -421,6 +711,15 @@ int main(int argc, char** argv)
       myWindow.m_renderCnt--;
       myWindow.onWindowRefresh();
     }
+    if(g_layoutBenchmark.frames > 0)
+    {
+      if(!g_layoutBenchmark.step(myWindow))
+      {
+        myWindow.onWindowClose();
+        break;
+      }
+      continue;
+    }
     if(myWindow.m_guiRegistry.checkValueChange(COMBO_MSAA))
     {
       g_profiler.reset(1);
@@ -429,13 +728,22 @@ int main(int argc, char** argv)
     if(myWindow.m_guiRegistry.checkValueChange(COMBO_SS))
     {
       g_profiler.reset(1);
-      g_pCurRenderer->updateViewport(0, 0, myWindow.getWidth(), myWindow.getHeight(), g_Supersampling);
+      myWindow.m_viewportChanged = true;
     }
     if(myWindow.m_guiRegistry.checkValueChange(COMBO_DS))
     {
       g_profiler.reset(1);
       g_pCurRenderer->setDownSamplingMode(g_downSamplingMode);
     }
+    bool furFormatChanged = myWindow.m_guiRegistry.checkValueChange(COMBO_FURFORMAT);
+    bool furGenChanged    = myWindow.m_guiRegistry.checkValueChange(COMBO_FURGEN);
+    bool furLayoutChanged = myWindow.m_guiRegistry.checkValueChange(COMBO_FURLAYOUT);
+    if(furFormatChanged || furGenChanged || furLayoutChanged || myWindow.m_furChanged)
+    {
+      myWindow.m_furChanged = false;
+      g_profiler.reset(1);
+      g_pCurRenderer->updateFur();
+    }
     if(myWindow.m_guiRegistry.checkValueChange(COMBO_RENDERER))
     {
       g_pCurRenderer->terminateGraphics();
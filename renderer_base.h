@@ -19,6 +19,8 @@
 //--------------------------------------------------------------------
 #define USE_NVFBOBOX
 #define MAXCMDBUFFERS 100
+#define MAX_FRAMES_IN_FLIGHT 4 // Vulkan, see g_vkFrames
+#define MAX_RECORD_THREADS 8   // Vulkan, see g_vkRecordThreads
 
 #include <assert.h>
 #include "nvpwindow.hpp"
@@ -26,6 +28,11 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/quaternion.hpp>
 
+#include "fur_builder.h"
+#include "fur_cache.h"
+#include "fur_cluster.h"
+#include "fur_sort.h"
+
 #include "GLSLShader.h"
 #include "nvh/profiler.hpp"
 
@@ -52,6 +59,8 @@
 #define DSET_GLOBAL 0
 #define BINDING_MATRIX 0
 #define BINDING_LIGHT 1
+#define BINDING_STRANDATTR 2
+#define BINDING_STRANDCTRL 3
 
 #define DSET_OBJECT 1
 #define BINDING_MATRIXOBJ 0
@@ -59,6 +68,23 @@
 
 #define DSET_TOTALAMOUNT 2
 //
+// Fur generation compute shader (its own, single descriptor set)
+//
+#define BINDING_FURGEN_PARAMS 0
+#define BINDING_FURGEN_VERTICES 1
+#define BINDING_FURGEN_INDICES 2
+#define BINDING_FURGEN_RANDOM 3
+//
+// Fur cluster culling compute shaders (GPU-driven path of Vulkan)
+//
+#define BINDING_FURCULL_PARAMS 0
+#define BINDING_FURCULL_CLUSTERS 1
+#define BINDING_FURCULL_DRAWS 2
+#define BINDING_FURCULL_STATS 3
+#define BINDING_FURCULL_HIZ 4
+#define BINDING_HIZ_SRC 0
+#define BINDING_HIZ_DST 1
+//
 // For the case where we just assign UBO bindings (cmd-list)
 //
 #define UBO_MATRIX 0
@@ -66,6 +92,7 @@
 #define UBO_MATERIAL 2
 #define UBO_LIGHT 3
 #define NUM_UBOS 4
+#define SSBO_STRANDATTR 0
 
 #define TOSTR_(x) #x
 #define TOSTR(x) TOSTR_(x)
@@ -76,9 +103,54 @@
 NV_ALIGN(
     256,
     struct MatrixBufferGlobal {
-      glm::mat4 mV;
-      glm::mat4 mP;
+      glm::mat4  mV;
+      glm::mat4  mP;
+      glm::vec4  furCenter;     // FUR_FORMAT_COMPACT: dequantization of positions
+      glm::vec4  furHalfExtent;
+      glm::ivec4 furInfo;       // x: vertices per strand; y: nsteps (per frame for FUR_FORMAT_PROCEDURAL); z: nsteps of LOD 0
     });
+//
+// The transformation of an object: one per draw that has its own, in the
+// uniform ring of the Vulkan renderer
+//
+NV_ALIGN(
+    256,
+    struct MatrixBufferObject {
+      glm::mat4  mO;
+    });
+struct FurGenParams
+{
+  uint32_t seed;
+  uint32_t numStrands;
+  uint32_t nsteps;
+  uint32_t writeRandom; // 1: GLSL_fur_gen.comp also writes the furRandom() words, for validation
+  float    radius;
+  float    pad[3];
+};
+// GLSL_fur_cull.comp
+struct FurCullParams
+{
+  glm::vec4  planes[6];    // furFrustumPlanes()
+  glm::mat4  prevViewProj; // of the frame the hierarchical-Z comes from
+  glm::uvec4 info;         // x: first cluster; y: amount of clusters; z: 1 to test the occlusion; w: HiZ mip levels
+  glm::vec4  hizSize;      // xy: size of the depth-buffer
+};
+// one cluster, as GLSL_fur_cull.comp reads it
+struct FurClusterGPU
+{
+  float    center[3];
+  uint32_t firstIndex;
+  float    extent[3];
+  uint32_t indexCount;
+};
+// counters of GLSL_fur_cull.comp, read back a frame later
+struct FurCullStats
+{
+  uint32_t visible;
+  uint32_t frustumCulled;
+  uint32_t occluded;
+  uint32_t pad;
+};
 
 //
 // Externs
@@ -92,12 +164,33 @@ extern GLuint g_MaxBOSz;
 
 extern MatrixBufferGlobal g_globalMatrices;
 
-struct Vertex
-{
-  glm::vec3 pos;
-  glm::vec3 n;
-  glm::vec4 col;
-};
+extern FurParams g_furParams;
+extern int       g_furThreads; // 0 : as many as the cores
+extern int       g_furFormat;  // FurVertexFormat
+extern int       g_furGenerator; // FurGenerator
+extern int       g_furLayout;    // FurStrandLayout
+extern float     g_furValidate;  // tolerance of the -v checks; 0 : no check
+extern std::string g_furCacheDir; // where the fur geometry cache lives; empty : no cache
+extern int       g_furLod;      // forced LOD level; -1 : picked from the projected size
+extern int       g_furLodLevel; // level drawn at the last frame
+extern bool      g_furCulling;  // frustum culling of the fur clusters
+extern int       g_furClusters;        // clusters of the level drawn at the last frame
+extern int       g_furClustersVisible; // how many of them passed the culling
+extern bool      g_furGpuCulling;      // Vulkan: the clusters are culled by GLSL_fur_cull.comp
+extern bool      g_furOcclusion;       // GPU culling also tests the hierarchical-Z of the previous frame
+extern int       g_furClustersOccluded; // how many failed the occlusion test
+extern bool      g_furSortClusters;     // the clusters are drawn front to back
+extern uint64_t  g_furFragments;        // fragment shader invocations of the fur (pipeline statistics)
+extern bool      g_vkStaticCmd;         // Vulkan: the scene command-buffer is recorded once and submitted again
+extern int       g_vkFrames;            // Vulkan: frames in flight, 1 to MAX_FRAMES_IN_FLIGHT
+extern float     g_vkFramesBlocked;     // how many of them had the CPU wait for the GPU
+extern float     g_vkBlockedMs;         // average wait of a frame
+extern int       g_vkRecordThreads;     // Vulkan: workers recording the draws of the scene, 1 to MAX_RECORD_THREADS
+extern float     g_vkRecordMs[MAX_RECORD_THREADS]; // average time the recording of each of their command-buffers took
+extern int       g_vkPoolBenchmark;     // frames of the -M command-pool benchmark; 0 : not run
+extern int       g_vkTransient;         // Vulkan MSAA attachments: 0 backed; 1 transient color; 2 transient color and depth
+extern int       g_vkPipelineCache;     // 0 none; 1 VkPipelineCache saved in g_furCacheDir; 2 also times the pipelines without it
+extern bool      g_vkPipelineVariants;  // Vulkan: the fur pipelines of every MSAA and format are built ahead, on worker threads
 
 
 //------------------------------------------------------------------------------
@@ -122,85 +215,10 @@ public:
   virtual bool bFlipViewport() { return false; }
 
   virtual void setDownSamplingMode(int i) = 0;
+
+  // rebuilds the fur after a change of g_furParams, g_furFormat or g_furLayout
+  virtual void updateFur() {}
 };
 extern Renderer* g_renderers[10];
 extern int       g_numRenderers;
 
-inline void buildStrand(std::vector<Vertex>& data, glm::vec3 pos, glm::vec3 dvec, glm::vec3 nvec, glm::vec2& sz, int nsteps, float curve, glm::vec3& color)
-{
-  for(int i = 0; i <= nsteps; i++)
-  {
-    float     alpha = 1.0 - ((float)i / (float)nsteps);
-    glm::vec3 tvec  = cross(dvec, nvec);
-    tvec *= sz.x;
-    sz.x *= 0.8;
-    glm::vec3 pos2 = pos + (dvec * sz.y);
-
-
-    glm::quat q = glm::angleAxis(curve * glm::pi<float>() / 180.0f, nvec);
-    dvec        = dvec * q;
-
-    glm::vec3 tvec2 = cross(dvec, nvec);
-    tvec2 *= sz.x;
-    Vertex vtx[4];
-    vtx[0].pos = pos + tvec;
-    vtx[0].n   = nvec;
-    vtx[0].col = glm::vec4(color, alpha);
-    vtx[1].pos = pos - tvec;
-    vtx[1].n   = nvec;
-    vtx[1].col = glm::vec4(color, alpha);
-    if(i == nsteps)
-    {
-      vtx[2].pos = pos + dvec * sz.y;
-      vtx[2].n   = nvec;
-      vtx[2].col = glm::vec4(color, alpha);
-      vtx[3].pos = pos + dvec * sz.y;
-      vtx[3].n   = nvec;
-      vtx[3].col = glm::vec4(color, alpha);
-    }
-    else
-    {
-      vtx[2].pos = pos2 + tvec2;
-      vtx[2].n   = nvec;
-      vtx[2].col = glm::vec4(color, alpha);
-      vtx[3].pos = pos2 - tvec2;
-      vtx[3].n   = nvec;
-      vtx[3].col = glm::vec4(color, alpha);
-    }
-    data.push_back(vtx[0]);
-    data.push_back(vtx[1]);
-    data.push_back(vtx[2]);
-    data.push_back(vtx[1]);
-    data.push_back(vtx[3]);
-    data.push_back(vtx[2]);
-
-    pos = pos2;
-  }
-}
-inline void buildFur(std::vector<Vertex>& data)
-{
-  glm::vec3 pos;
-  glm::vec3 dvec;
-  glm::vec3 nvec;
-  float     nsteps = 20;
-  srand(10);
-  for(int i = 0; i < 10000; i++)
-  {
-    float     alpha  = glm::two_pi<float>() * float(rand() & 0x1FFF) / (float)0x1FFF;
-    float     beta   = glm::two_pi<float>() * float(rand() & 0x1FFF) / (float)0x1FFF;
-    float     curve  = 10.0 * (float(rand() & 0x1F) / (float)0x1F) - 5.0;
-    float     length = 2.0 * (float(rand() & 0x1F) / (float)0x1F);
-    float     thick  = 0.03 * (float(rand() & 0x1F) / (float)0x1F);
-    glm::vec3 color(0.5 + 0.5 * float(rand() & 0x1F) / (float)0x1F, 0.5 + 0.5 * float(rand() & 0x1F) / (float)0x1F,
-                    0.5 + 0.5 * float(rand() & 0x1F) / (float)0x1F);
-    float     r = cos(beta);
-    pos.x       = r * cos(alpha);
-    pos.z       = r * sin(alpha);
-    pos.y       = sin(beta);
-    dvec        = pos;
-    pos *= 0.1;
-    nvec = normalize(cross(dvec, glm::vec3(0, 1, 0)));
-    glm::vec2 sz(thick, length / nsteps);
-    buildStrand(data, pos, dvec, nvec, sz, nsteps, curve, color);
-  }
-}
@@ -52,6 +52,43 @@ namespace glstandard
     "   outCol = vec4(diff * col.rgb, col.a);\n"
     "}\n"
     ;
+  // FUR_FORMAT_COMPACT: see GLSL_fur_compact.vert
+  static const char *g_glslv_fur_compact =
+    "#version 430\n"
+    "#extension GL_ARB_separate_shader_objects : enable\n"
+    "layout(std140,binding=" TOSTR(UBO_MATRIX) ") uniform matrixBuffer {\n"
+    "   uniform mat4 mV;\n"
+    "   uniform mat4 mP;\n"
+    "   uniform vec4 furCenter;\n"
+    "   uniform vec4 furHalfExtent;\n"
+    "   uniform ivec4 furInfo;\n"
+    "} matrix;\n"
+    "struct StrandAttr {\n"
+    "   vec4 n;\n"
+    "   vec4 col;\n"
+    "};\n"
+    "layout(std430,binding=" TOSTR(SSBO_STRANDATTR) ") readonly buffer strandAttrBuffer {\n"
+    "   StrandAttr strands[];\n"
+    "};\n"
+    "layout(location=0) in  vec4 Pq;\n"
+    "layout(location=0) out vec4 outCol;\n"
+
+    "out gl_PerVertex {\n"
+    "    vec4  gl_Position;\n"
+    "};\n"
+    "void main() {\n"
+    "   int vertsPerStrand = matrix.furInfo.x;\n"
+    "   int nsteps = matrix.furInfo.y;\n"
+    "   int strand = gl_VertexID / vertsPerStrand;\n"
+    "   int row = min((gl_VertexID % vertsPerStrand) / 2, nsteps);\n"
+    "   float alpha = 1.0 - float(row) / float(nsteps);\n"
+    "   vec3 P = matrix.furCenter.xyz + Pq.xyz * matrix.furHalfExtent.xyz;\n"
+    "   gl_Position = matrix.mP * (matrix.mV * ( vec4(P, 1.0)));\n"
+    "   vec3 NV = (matrix.mV * ( vec4(strands[strand].n.xyz, 0.0))).xyz;\n"
+    "   float diff = abs(NV.x);\n"
+    "   outCol = vec4(diff * strands[strand].col.rgb, alpha);\n"
+    "}\n"
+    ;
   static const char *g_glslf_fur =
     "#version 430\n"
     "#extension GL_ARB_separate_shader_objects : enable\n"
@@ -63,6 +100,7 @@ namespace glstandard
     "}\n"
     ;
   GLSLShader	s_shaderfur;
+  GLSLShader	s_shaderfurCompact;
 
   struct BO {
     GLuint      Id;
@@ -74,10 +112,93 @@ namespace glstandard
 
   static GLuint      s_vbofur;
   static GLuint      s_vbofurSz;
-  static GLuint      s_nElmts;
+  static GLuint      s_ibofur;
+  static GLuint      s_ssbofurAttr; // FUR_FORMAT_COMPACT
+  static int         s_furFormat;
+  // LOD levels are ranges of the same buffers: switching only changes the draw
+  struct FurLodRange {
+    GLuint      firstIndex;
+    GLuint      nElmts; // amount of indices
+    GLint       baseVertex;
+  };
+  static FurLodRange s_furLods[FUR_LOD_LEVELS];
+  static int         s_numFurLods;
+  // clusters of each level, culled at every frame into s_furDraws
+  static FurClusters                 s_furClusters[FUR_LOD_LEVELS];
+  static std::vector<FurDrawIndexed> s_furDraws;
+  static GLuint                      s_furIndirect;
+  static FurClusterSorter            s_furSorters[FUR_LOD_LEVELS]; // front-to-back order of s_furClusters
+  // fragment shader invocations of the fur, read 2 frames later so that
+  // nothing waits. 0: not supported (needs GL 4.6)
+  static GLuint                      s_furStatsQueries[2];
+  static bool                        s_furStatsPending[2];
+  static int                         s_furStatsIdx;
 
   static GLuint      s_vao = 0;
 
+  //------------------------------------------------------------------------------
+  // Staging ring: one persistently mapped buffer in client memory, cut in
+  // slots. The fur is built straight into a slot, then copied by the GPU into
+  // its buffer; a slot is only waited for when it comes back around.
+  // Readable and cached, unlike a write-only mapping: the cluster bounds and
+  // the cache file read the vertices back
+  //------------------------------------------------------------------------------
+  #define STAGING_SLOTS 3
+  #define STAGING_SLOT_SIZE (8 << 20)
+  struct StagingRing {
+    GLuint              buffer;
+    char*               ptr;
+    GLsync              fences[STAGING_SLOTS];
+    int                 next;
+    size_t              slotSize;
+
+    void init(size_t sz) {
+      const GLbitfield access = GL_MAP_READ_BIT | GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+      slotSize = sz;
+      next = 0;
+      glCreateBuffers(1, &buffer);
+      glNamedBufferStorage(buffer, slotSize * STAGING_SLOTS, NULL, access | GL_CLIENT_STORAGE_BIT);
+      ptr = (char*)glMapNamedBufferRange(buffer, 0, slotSize * STAGING_SLOTS, access);
+      for (int i = 0; i < STAGING_SLOTS; i++)
+        fences[i] = NULL;
+    }
+    void deinit() {
+      if (!buffer)
+        return;
+      flush();
+      glUnmapNamedBuffer(buffer);
+      glDeleteBuffers(1, &buffer);
+      buffer = 0;
+      ptr = NULL;
+    }
+    void wait(int slot) {
+      if (!fences[slot])
+        return;
+      while (glClientWaitSync(fences[slot], GL_SYNC_FLUSH_COMMANDS_BIT, 100000000) == GL_TIMEOUT_EXPIRED)
+        LOGW(">>>>>> TIMEOUT ON WAIT FENCE\n");
+      glDeleteSync(fences[slot]);
+      fences[slot] = NULL;
+    }
+    // next slot, ready to be written
+    int acquire() {
+      int slot = next;
+      next = (next + 1) % STAGING_SLOTS;
+      wait(slot);
+      return slot;
+    }
+    void* slotPtr(int slot) { return ptr + slotSize * slot; }
+    // the first size bytes of slot to dst
+    void copy(int slot, GLuint dst, size_t dstOffset, size_t size) {
+      glCopyNamedBufferSubData(buffer, dst, slotSize * slot, dstOffset, size);
+      fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+    void flush() {
+      for (int i = 0; i < STAGING_SLOTS; i++)
+        wait(i);
+    }
+  };
+  static StagingRing s_staging;
+
   //------------------------------------------------------------------------------
   // Renderer: can be OpenGL or other
   //------------------------------------------------------------------------------
@@ -87,6 +208,7 @@ namespace glstandard
     bool                             m_bValid;
 
     bool initResourcesfur();
+    void initResourcesfurIndirect();
     bool deleteResourcesfur();
 
     NVFBOBox::DownSamplingTechnique downsamplingMode;
@@ -112,6 +234,8 @@ namespace glstandard
     virtual void updateViewport(GLint x, GLint y, GLsizei width, GLsizei height, float SSFactor);
 
     virtual void setDownSamplingMode(int i) { downsamplingMode = (NVFBOBox::DownSamplingTechnique)i; }
+
+    virtual void updateFur();
   };
 
   RendererStandard s_renderer;
@@ -123,21 +247,191 @@ namespace glstandard
   bool RendererStandard::initResourcesfur()
   {
     glCreateBuffers(1, &s_vbofur);
-    std::vector<Vertex> data;
+    glCreateBuffers(1, &s_ibofur);
 
-    buildFur(data);
-
-    s_nElmts = data.size();
-    s_vbofurSz = data.size() * sizeof(Vertex);
-    glNamedBufferData(s_vbofur, s_vbofurSz, &(data[0]), GL_STATIC_DRAW);
+    s_furFormat = g_furFormat;
+    if (s_furFormat == FUR_FORMAT_PROCEDURAL)
+    {
+      LOGW("Procedural fur is only available in Vulkan: using the full vertex format\n");
+      s_furFormat = FUR_FORMAT_FULL;
+    }
+    if (g_furGenerator == FUR_GEN_GPU)
+      LOGW("Fur GPU generation is only available in Vulkan: using the CPU\n");
+    size_t vertsPerStrand = furVerticesPerStrand(g_furParams.nsteps);
+    size_t idxPerStrand = furIndicesPerStrand(g_furParams.nsteps);
+    s_numFurLods = 1;
+    s_furLods[0].firstIndex = 0;
+    s_furLods[0].nElmts = idxPerStrand * g_furParams.numStrands;
+    s_furLods[0].baseVertex = 0;
+    g_globalMatrices.furInfo = glm::ivec4((int)vertsPerStrand, g_furParams.nsteps, 0, 0);
+    if (s_furFormat == FUR_FORMAT_COMPACT)
+    {
+      // needs the bounds of the whole fur before quantizing: built in one go
+      FurGeometry geometry;
+      geometry.acquire(g_furParams, g_furThreads, g_furCacheDir);
+      std::vector<VertexCompact> compact;
+      std::vector<FurStrandAttr> attribs;
+      FurBounds bounds;
+      buildFurCompact(geometry.vertices(), geometry.numVertices(), g_furParams, compact, attribs, bounds);
+      g_globalMatrices.furCenter = glm::vec4(bounds.center, 1.0f);
+      g_globalMatrices.furHalfExtent = glm::vec4(bounds.halfExtent, 0.0f);
+      // strand #i of the buffers is strands[i]: vertices and attributes go
+      // through the same permutation, so GLSL_fur_compact.vert still finds
+      // the attributes of a vertex from its index
+      std::vector<uint32_t> strands;
+      furLayoutStrands(strands, g_furParams, 0, g_furLayout, g_furThreads);
+      if (!strands.empty())
+      {
+        std::vector<VertexCompact> layoutCompact(compact.size());
+        std::vector<FurStrandAttr> layoutAttribs(attribs.size());
+        furPermuteStrands(&layoutCompact[0], &compact[0], &strands[0], g_furParams.numStrands, vertsPerStrand);
+        furPermuteStrands(&layoutAttribs[0], &attribs[0], &strands[0], g_furParams.numStrands, 1);
+        compact.swap(layoutCompact);
+        attribs.swap(layoutAttribs);
+      }
+      // no strands: empty buffers, like the full format
+      s_vbofurSz = compact.size() * sizeof(VertexCompact);
+      glNamedBufferData(s_vbofur, s_vbofurSz, compact.empty() ? NULL : &(compact[0]), GL_STATIC_DRAW);
+      glCreateBuffers(1, &s_ssbofurAttr);
+      glNamedBufferData(s_ssbofurAttr, attribs.size() * sizeof(FurStrandAttr), attribs.empty() ? NULL : &(attribs[0]), GL_STATIC_DRAW);
+      // the vertices are in layout order, only the indices are in cluster order
+      FurClusterBuilder clusterBuilder;
+      clusterBuilder.begin(g_furParams, 0, strands.empty() ? NULL : &strands[0], 0, g_furParams.numStrands);
+      if (strands.empty())
+        clusterBuilder.addVertices(geometry.vertices(), 0, g_furParams.numStrands);
+      else
+      {
+        for (int i = 0; i < g_furParams.numStrands; i++)
+          clusterBuilder.addVertices(geometry.vertices() + vertsPerStrand * strands[i], i, 1);
+      }
+      std::vector<uint32_t> indices(geometry.numIndices());
+      if (g_furParams.numStrands > 0)
+        buildFurClusterIndices(&indices[0], &clusterBuilder.order()[0], g_furParams.numStrands, g_furParams.nsteps);
+      clusterBuilder.end(s_furClusters[0]);
+      glNamedBufferData(s_ibofur, indices.size() * sizeof(uint32_t), indices.empty() ? NULL : &indices[0], GL_STATIC_DRAW);
+      initResourcesfurIndirect();
+      return true;
+    }
+    //
+    // full format: built (or read from the cache) straight into s_staging,
+    // chunk by chunk, so that the whole fur never sits in host memory. The LOD
+    // levels follow level 0 in the same buffers, with indices relative to
+    // their first vertex, in cluster order. Strands are in the order of
+    // g_furLayout: an empty list is plain strand order (level 0 in
+    // FUR_LAYOUT_RANDOM)
+    //
+    std::vector<uint32_t> layoutStrands[FUR_LOD_LEVELS];
+    size_t numVertices = 0;
+    size_t numIndices = 0;
+    for (int level = 0; level < FUR_LOD_LEVELS; level++)
+    {
+      int nsteps = furLodSteps(g_furParams.nsteps, level);
+      furLayoutStrands(layoutStrands[level], g_furParams, level, g_furLayout, g_furThreads);
+      size_t numStrands = (level || !layoutStrands[0].empty()) ? layoutStrands[level].size() : g_furParams.numStrands;
+      s_furLods[level].firstIndex = (GLuint)numIndices;
+      s_furLods[level].nElmts = (GLuint)(furIndicesPerStrand(nsteps) * numStrands);
+      s_furLods[level].baseVertex = (GLint)numVertices;
+      numVertices += furVerticesPerStrand(nsteps) * numStrands;
+      numIndices += s_furLods[level].nElmts;
+    }
+    s_numFurLods = FUR_LOD_LEVELS;
+    s_vbofurSz = numVertices * sizeof(Vertex);
+    // only written by the copies from s_staging: can live in video memory
+    glNamedBufferStorage(s_vbofur, std::max((size_t)s_vbofurSz, sizeof(Vertex)), NULL, 0);
+    glNamedBufferStorage(s_ibofur, std::max(numIndices, (size_t)1) * sizeof(uint32_t), NULL, 0);
+    FurCacheFile cache;
+    FurCacheWriter cacheWriter;
+    bool cached = false;
+    bool inOrder = layoutStrands[0].empty();
+    if (!g_furCacheDir.empty())
+    {
+      std::string path = furCachePath(g_furCacheDir, g_furParams);
+      cached = cache.map(path, g_furParams);
+      // the file is written in strand ranges: not from another layout
+      if (!cached && inOrder)
+        cacheWriter.open(path, g_furParams);
+    }
+    for (int level = 0; level < FUR_LOD_LEVELS; level++)
+    {
+      int nsteps = furLodSteps(g_furParams.nsteps, level);
+      vertsPerStrand = furVerticesPerStrand(nsteps);
+      idxPerStrand = furIndicesPerStrand(nsteps);
+      int chunkStrands = std::max(1, (int)(s_staging.slotSize / (vertsPerStrand * sizeof(Vertex))));
+      int idxChunkStrands = std::max(1, (int)(s_staging.slotSize / (idxPerStrand * sizeof(uint32_t))));
+      const uint32_t* strands = layoutStrands[level].empty() ? NULL : layoutStrands[level].data();
+      int numStrands = (level || !inOrder) ? (int)layoutStrands[level].size() : g_furParams.numStrands;
+      FurClusterBuilder clusterBuilder;
+      clusterBuilder.begin(g_furParams, level, strands, 0, numStrands);
+      for (int first = 0; first < numStrands; first += chunkStrands)
+      {
+        int count = std::min(chunkStrands, numStrands - first);
+        int slot = s_staging.acquire();
+        Vertex* vertices = (Vertex*)s_staging.slotPtr(slot);
+        if (level > 0)
+        {
+          // the LOD subsets are never cached: they are a fraction of level 0
+          buildFurLod(vertices, g_furParams, level, strands + first, count, g_furThreads);
+        }
+        else if (cached && inOrder)
+          memcpy(vertices, cache.vertices() + vertsPerStrand * first, vertsPerStrand * count * sizeof(Vertex));
+        else if (cached)
+          furPermuteStrands(vertices, cache.vertices(), strands + first, count, vertsPerStrand);
+        else if (!inOrder)
+          buildFurLod(vertices, g_furParams, 0, strands + first, count, g_furThreads);
+        else
+        {
+          buildFur(vertices, g_furParams, first, count, g_furThreads);
+          cacheWriter.write(first, count, vertices);
+        }
+        clusterBuilder.addVertices(vertices, first, count);
+        s_staging.copy(slot, s_vbofur, (s_furLods[level].baseVertex + vertsPerStrand * first) * sizeof(Vertex),
+          vertsPerStrand * count * sizeof(Vertex));
+      }
+      for (int first = 0; first < numStrands; first += idxChunkStrands)
+      {
+        int count = std::min(idxChunkStrands, numStrands - first);
+        int slot = s_staging.acquire();
+        buildFurClusterIndices((uint32_t*)s_staging.slotPtr(slot), &clusterBuilder.order()[first], count, nsteps);
+        s_staging.copy(slot, s_ibofur, (s_furLods[level].firstIndex + idxPerStrand * first) * sizeof(uint32_t),
+          idxPerStrand * count * sizeof(uint32_t));
+      }
+      clusterBuilder.end(s_furClusters[level], s_furLods[level].firstIndex, s_furLods[level].baseVertex);
+    }
+    if (cacheWriter.isOpen())
+      cacheWriter.close();
+    initResourcesfurIndirect();
     return true;
   }
   //------------------------------------------------------------------------------
+  // room for the draws of the biggest level
+  //------------------------------------------------------------------------------
+  void RendererStandard::initResourcesfurIndirect()
+  {
+    uint32_t maxDraws = 0;
+    for (int level = 0; level < s_numFurLods; level++)
+      maxDraws = std::max(maxDraws, s_furClusters[level].size());
+    s_furDraws.resize(maxDraws);
+    glCreateBuffers(1, &s_furIndirect);
+    glNamedBufferData(s_furIndirect, std::max(1u, maxDraws) * sizeof(FurDrawIndexed), NULL, GL_STREAM_DRAW);
+  }
+  //------------------------------------------------------------------------------
   //
   //------------------------------------------------------------------------------
   bool RendererStandard::deleteResourcesfur()
   {
     glDeleteBuffers(1, &s_vbofur);
+    glDeleteBuffers(1, &s_ibofur);
+    if (s_ssbofurAttr)
+      glDeleteBuffers(1, &s_ssbofurAttr);
+    s_ssbofurAttr = 0;
+    if (s_furIndirect)
+      glDeleteBuffers(1, &s_furIndirect);
+    s_furIndirect = 0;
+    for (int level = 0; level < FUR_LOD_LEVELS; level++)
+    {
+      s_furClusters[level] = FurClusters();
+      s_furSorters[level].invalidate();
+    }
     return true;
   }
   //------------------------------------------------------------------------------
@@ -166,25 +460,97 @@ namespace glstandard
     // ------------------------------------------------------------------------------------------
     // Case of regular rendering
     //
-    s_shaderfur.bindShader();
-    glEnableVertexAttribArray(0);
-    glEnableVertexAttribArray(1);
-    glEnableVertexAttribArray(2);
+    if (s_furFormat == FUR_FORMAT_COMPACT)
+    {
+      // positions only; normal and color fetched by strand from the SSBO
+      s_shaderfurCompact.bindShader();
+      glEnableVertexAttribArray(0);
+      glBindBufferBase(GL_UNIFORM_BUFFER, UBO_MATRIX, g_uboMatrix.Id);
+      glBindBufferBase(GL_SHADER_STORAGE_BUFFER, SSBO_STRANDATTR, s_ssbofurAttr);
+      glBindVertexBuffer(0, s_vbofur, 0, sizeof(VertexCompact));
+      glVertexAttribFormat(0, 4, GL_SHORT, GL_TRUE, 0);
+    }
+    else
+    {
+      s_shaderfur.bindShader();
+      glEnableVertexAttribArray(0);
+      glEnableVertexAttribArray(1);
+      glEnableVertexAttribArray(2);
 
-    // --------------------------------------------------------------------------------------
-  // Using regular VBO
-  //
-    glBindBufferBase(GL_UNIFORM_BUFFER, UBO_MATRIX, g_uboMatrix.Id);
-    glBindVertexBuffer(0, s_vbofur, 0, sizeof(Vertex));
-    glBindVertexBuffer(1, s_vbofur, 0, sizeof(Vertex));
-    glBindVertexBuffer(2, s_vbofur, 0, sizeof(Vertex));
-    glVertexAttribFormat(0, 3, GL_FLOAT, GL_FALSE, 0);
-    glVertexAttribFormat(1, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3));
-    glVertexAttribFormat(2, 4, GL_FLOAT, GL_FALSE, 2 * sizeof(glm::vec3));
+      // --------------------------------------------------------------------------------------
+      // Using regular VBO
+      //
+      glBindBufferBase(GL_UNIFORM_BUFFER, UBO_MATRIX, g_uboMatrix.Id);
+      glBindVertexBuffer(0, s_vbofur, 0, sizeof(Vertex));
+      glBindVertexBuffer(1, s_vbofur, 0, sizeof(Vertex));
+      glBindVertexBuffer(2, s_vbofur, 0, sizeof(Vertex));
+      glVertexAttribFormat(0, 3, GL_FLOAT, GL_FALSE, 0);
+      glVertexAttribFormat(1, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3));
+      glVertexAttribFormat(2, 4, GL_FLOAT, GL_FALSE, 2 * sizeof(glm::vec3));
+    }
     //
     // Draw!
     //
-    glDrawArrays(GL_TRIANGLES, 0, s_nElmts);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, s_ibofur);
+    // switching level only changes the range drawn
+    int lod = (g_furLod >= 0) ? g_furLod : furSelectLod(g_furParams, camera.m4_view, projection, (float)m_fboBox.getBufferHeight());
+    lod = std::min(lod, s_numFurLods - 1);
+    g_furLodLevel = lod;
+    const FurLodRange& range = s_furLods[lod];
+    const FurClusters& clusters = s_furClusters[lod];
+    glEnable(GL_PRIMITIVE_RESTART_FIXED_INDEX);
+    // g_furGpuCulling is Vulkan only: the clusters are always culled here
+    g_furClusters = 0;
+    g_furClustersVisible = 0;
+    g_furClustersOccluded = 0;
+    if (s_furStatsQueries[s_furStatsIdx])
+    {
+      GLuint available = GL_FALSE;
+      if (s_furStatsPending[s_furStatsIdx])
+        glGetQueryObjectuiv(s_furStatsQueries[s_furStatsIdx], GL_QUERY_RESULT_AVAILABLE, &available);
+      if (available)
+      {
+        GLuint64 fragments = 0;
+        glGetQueryObjectui64v(s_furStatsQueries[s_furStatsIdx], GL_QUERY_RESULT, &fragments);
+        g_furFragments = fragments;
+      }
+      glBeginQuery(GL_FRAGMENT_SHADER_INVOCATIONS, s_furStatsQueries[s_furStatsIdx]);
+    }
+    if ((g_furCulling || g_furSortClusters) && clusters.size())
+    {
+      glm::vec4 planes[6];
+      furFrustumPlanes(planes, projection * camera.m4_view);
+      const uint32_t* order = NULL;
+      if (g_furSortClusters)
+      {
+        s_furSorters[lod].update(clusters, glm::vec3(glm::inverse(camera.m4_view)[3]), FUR_SORT_THRESHOLD, g_furThreads);
+        order = s_furSorters[lod].order();
+      }
+      uint32_t visible;
+      uint32_t numDraws = furCullClusters(&s_furDraws[0], clusters, g_furCulling ? planes : NULL, visible, order);
+      g_furClusters = clusters.size();
+      g_furClustersVisible = visible;
+      if (numDraws)
+      {
+        glNamedBufferSubData(s_furIndirect, 0, numDraws * sizeof(FurDrawIndexed), &s_furDraws[0]);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, s_furIndirect);
+        glMultiDrawElementsIndirect(GL_TRIANGLE_STRIP, GL_UNSIGNED_INT, NULL, numDraws, sizeof(FurDrawIndexed));
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+      }
+    }
+    else
+    {
+      // the restart index is compared before baseVertex is added
+      glDrawElementsBaseVertex(GL_TRIANGLE_STRIP, range.nElmts, GL_UNSIGNED_INT, (const void*)(range.firstIndex * sizeof(uint32_t)), range.baseVertex);
+    }
+    if (s_furStatsQueries[s_furStatsIdx])
+    {
+      glEndQuery(GL_FRAGMENT_SHADER_INVOCATIONS);
+      s_furStatsPending[s_furStatsIdx] = true;
+      s_furStatsIdx ^= 1;
+    }
+    glDisable(GL_PRIMITIVE_RESTART_FIXED_INDEX);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 
     glDisableVertexAttribArray(0);
     glDisableVertexAttribArray(1);
@@ -222,6 +588,16 @@ namespace glstandard
   //------------------------------------------------------------------------------
   //
   //------------------------------------------------------------------------------
+  void RendererStandard::updateFur()
+  {
+    if (!m_bValid)
+      return;
+    deleteResourcesfur();
+    initResourcesfur();
+  }
+  //------------------------------------------------------------------------------
+  //
+  //------------------------------------------------------------------------------
   bool RendererStandard::initGraphics(int w, int h, float SSScale, int MSAA)
   {
     //
@@ -238,6 +614,12 @@ namespace glstandard
       return false;
     if (!s_shaderfur.link())
       return false;
+    if (!s_shaderfurCompact.addVertexShaderFromString(g_glslv_fur_compact))
+      return false;
+    if (!s_shaderfurCompact.addFragmentShaderFromString(g_glslf_fur))
+      return false;
+    if (!s_shaderfurCompact.link())
+      return false;
 
     //
     // Create some UBO for later share their 64 bits
@@ -251,11 +633,23 @@ namespace glstandard
     glClearColor(0.0f, 0.1f, 0.15f, 1.0f);
     glGenVertexArrays(1, &s_vao);
     glBindVertexArray(s_vao);
+    s_staging.init(STAGING_SLOT_SIZE);
     //
     // fur
     //
     if (!initResourcesfur())
       return false;
+    // pipeline statistics queries are core since 4.6
+    GLint major = 0;
+    GLint minor = 0;
+    glGetIntegerv(GL_MAJOR_VERSION, &major);
+    glGetIntegerv(GL_MINOR_VERSION, &minor);
+    if ((major > 4) || ((major == 4) && (minor >= 6)))
+      glCreateQueries(GL_FRAGMENT_SHADER_INVOCATIONS, 2, s_furStatsQueries);
+    else
+      LOGW("No pipeline statistics queries: the fur fragments won't be counted\n");
+    s_furStatsPending[0] = s_furStatsPending[1] = false;
+    s_furStatsIdx = 0;
     
     m_profilerGL = nvgl::ProfilerGL(&g_profiler);
     m_profilerGL.init();
@@ -271,11 +665,16 @@ namespace glstandard
   {
     m_fboBox.Finish();
     deleteResourcesfur();
+    s_staging.deinit();
+    if (s_furStatsQueries[0])
+      glDeleteQueries(2, s_furStatsQueries);
+    s_furStatsQueries[0] = s_furStatsQueries[1] = 0;
     glDeleteVertexArrays(1, &s_vao);
     s_vao = 0;
     glDeleteBuffers(1, &g_uboMatrix.Id);
     g_uboMatrix.Id = 0;
     s_shaderfur.cleanup();
+    s_shaderfurCompact.cleanup();
     m_profilerGL.deinit();
     m_bValid = false;
     return true;
@@ -30,6 +30,11 @@
 #include "NVK.h"
 #include "NVFBOBoxVK.h"
 #include <queue>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
 #include <nvvk/profiler_vk.hpp>
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -44,7 +49,7 @@ namespace vk
   //------------------------------------------------------------------------------
   struct BufO {
     VkBuffer        buffer;
-    VkDeviceMemory  bufferMem;
+    NVK::Allocation* bufferMem;
     size_t          Sz;
     void release() {
       if (buffer)       nvk.destroyBuffer(buffer);
@@ -53,6 +58,440 @@ namespace vk
       memset(this, 0, sizeof(BufO));
     }
   };
+  //------------------------------------------------------------------------------
+  // The fur can be bigger than what one allocation can hold: it is split in
+  // blocks of whole strands, each with its own buffers and draw call. The
+  // blocks of all the LOD levels are resident: only the ones of the current
+  // level are drawn
+  //------------------------------------------------------------------------------
+  #define FUR_MAX_BUFFER_SIZE (256 << 20) // well below the 1 GB maxMemoryAllocationSize all devices have
+  struct FurBlock {
+    BufO            vertices;
+    BufO            indices;
+    GLuint          nElmts; // amount of indices
+    int             lod;    // level of detail of the strands inside
+    FurClusters     clusters;   // empty: drawn whole
+    uint32_t        drawOffset; // of its draws in m_furIndirect
+    FurClusterSorter sorter;    // front-to-back order of the clusters
+    // its room in m_furIndirect: one draw per cluster, or the whole block
+    uint32_t numDraws() const { return clusters.size() ? (uint32_t)clusters.size() : 1; }
+  };
+  //------------------------------------------------------------------------------
+  // Uniform ring: a persistently mapped host buffer, a region per frame in
+  // flight. What the frame's shaders read (matrices, per-object data, the
+  // procedural draw) is written by the CPU in its region and addressed with
+  // dynamic offsets: no transfer in the command-buffers, which can then be
+  // submitted again. A region is only reused once the fence of its frame is
+  // passed; a frame that needs more makes the ring grow (see reserveUniforms())
+  //------------------------------------------------------------------------------
+  #define UNIFORM_RING_REGION_SIZE (64 << 10)
+  struct UniformRing {
+    BufO                buffer;
+    unsigned char*      ptr;
+    int                 regions;
+    size_t              regionSize;
+    size_t              align;  // minUniformBufferOffsetAlignment
+    size_t              base;   // region of the frame being written
+    size_t              used;
+
+    void init(int n, size_t sz, size_t alignment) {
+      regions = n;
+      align = alignment;
+      regionSize = aligned(sz);
+      buffer.Sz = regionSize * regions;
+      buffer.buffer = nvk.createBuffer(NVK::BufferCreateInfo(buffer.Sz, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT));
+      buffer.bufferMem = nvk.utAllocMemAndBindBuffer(buffer.buffer, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+      ptr = (unsigned char*)nvk.mapMemory(buffer.bufferMem, 0, buffer.Sz, 0);
+      base = 0;
+      used = 0;
+    }
+    void deinit() {
+      if (!buffer.buffer)
+        return;
+      nvk.unmapMemory(buffer.bufferMem);
+      buffer.release();
+      ptr = NULL;
+    }
+    size_t aligned(size_t sz) const { return ((sz + align - 1) / align) * align; }
+    // the fence of frame idx must have been waited for
+    void begin(int idx) {
+      base = regionSize * idx;
+      used = 0;
+    }
+    // NULL when the region is full. The allocations of a frame come in the
+    // same order at every frame: so do their offsets
+    void* alloc(size_t sz, uint32_t& offset) {
+      if (used + sz > regionSize)
+        return NULL;
+      offset = (uint32_t)(base + used);
+      used += aligned(sz);
+      return ptr + offset;
+    }
+  };
+  // where the frame's data went in the uniform ring. The pre-recorded scene
+  // has them in its commands: recorded again when they change
+  struct FrameOffsets {
+    uint32_t matrix;   // MatrixBufferGlobal
+    uint32_t object;   // MatrixBufferObject of the fur
+    uint32_t procDraw; // VkDrawIndirectCommand of FUR_FORMAT_PROCEDURAL: the steps depend on the LOD
+  };
+  //------------------------------------------------------------------------------
+  // A run of draws of a block, the unit the recording workers share. Cut at
+  // any draw: a worker may get the end of a block and the start of the next
+  //------------------------------------------------------------------------------
+  struct FurDrawSpan {
+    FurBlock*       block;
+    VkBuffer        indirect; // FurDrawIndexed. NULL: the whole block in one draw
+    uint32_t        first;    // in draws of indirect
+    uint32_t        count;
+  };
+  //------------------------------------------------------------------------------
+  // Staging ring: persistently mapped host buffers, each with its command
+  // buffer and fence. The CPU fills a slot while the copies of the previous
+  // ones run; a slot is only waited for when it comes back around. Cached
+  // memory when there is some: the fur is then built straight into the slots
+  // and read back from there (cluster bounds, cache file). Write-combined
+  // memory is too slow to read
+  //------------------------------------------------------------------------------
+  #define STAGING_SLOTS 3
+  #define STAGING_SLOT_SIZE (8 << 20)
+  struct StagingRing {
+    struct Slot {
+      BufO              buffer;
+      void*             ptr;
+      VkCommandBuffer   cmd;
+      VkFence           fence;
+      bool              busy;
+    };
+    Slot                slots[STAGING_SLOTS];
+    int                 next;
+    size_t              slotSize;
+    bool                cached;
+
+    void init(NVK::CommandPool* cmdPool, size_t sz) {
+      VkFlags memProps = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+      slotSize = sz;
+      next = 0;
+      cached = nvk.utHasMemoryType(memProps | VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
+      if (cached)
+        memProps |= VK_MEMORY_PROPERTY_HOST_CACHED_BIT;
+      for (int i = 0; i < STAGING_SLOTS; i++) {
+        Slot& slot = slots[i];
+        slot.buffer.Sz = slotSize;
+        slot.buffer.buffer = nvk.createBuffer(NVK::BufferCreateInfo(slotSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT));
+        slot.buffer.bufferMem = nvk.utAllocMemAndBindBuffer(slot.buffer.buffer, memProps);
+        slot.ptr = nvk.mapMemory(slot.buffer.bufferMem, 0, slotSize, 0);
+        slot.cmd = cmdPool->utRequestCmdBuffer(true);
+        slot.fence = nvk.createFence();
+        slot.busy = false;
+      }
+    }
+    void deinit(NVK::CommandPool* cmdPool) {
+      flush();
+      for (int i = 0; i < STAGING_SLOTS; i++) {
+        Slot& slot = slots[i];
+        if (!slot.buffer.buffer)
+          continue;
+        nvk.unmapMemory(slot.buffer.bufferMem);
+        slot.buffer.release();
+        cmdPool->utFreeCommandBuffer(slot.cmd);
+        nvk.destroyFence(slot.fence);
+        memset(&slot, 0, sizeof(Slot));
+      }
+    }
+    void wait(Slot& slot) {
+      if (!slot.busy)
+        return;
+      while (nvk.waitForFences(1, &slot.fence, VK_TRUE, 100000000) == false)
+        LOGW(">>>>>> TIMEOUT ON WAIT FENCE\n");
+      nvk.resetFences(1, &slot.fence);
+      slot.busy = false;
+    }
+    // next slot, ready to be written and with its command-buffer begun
+    Slot& acquire() {
+      Slot& slot = slots[next];
+      next = (next + 1) % STAGING_SLOTS;
+      wait(slot);
+      NVK::CommandBuffer(slot.cmd).beginCommandBuffer(true);
+      return slot;
+    }
+    void submit(Slot& slot) {
+      vkEndCommandBuffer(slot.cmd);
+      nvk.queueSubmit(NVK::SubmitInfo(0, NULL, NULL, 1, &slot.cmd, 0, NULL), slot.fence);
+      slot.busy = true;
+    }
+    void flush() {
+      for (int i = 0; i < STAGING_SLOTS; i++)
+        wait(slots[i]);
+    }
+  };
+
+  //------------------------------------------------------------------------------
+  // Fur pipelines of every MSAA setting and fur format. start() has worker
+  // threads build them ahead, one thread per format; the first pipeline built
+  // of a format is the base of the others (derivatives). get() hands out a
+  // built one, waits for the worker on it, or builds it right away when no
+  // worker got to it. The viewport and the supersampling factor are dynamic:
+  // they don't make variants
+  //------------------------------------------------------------------------------
+  #define PIPELINE_VARIANT_SLOTS 7 // 1 to 64 samples
+  struct FurPipelineVariants {
+    enum Kind { KIND_FULL, KIND_COMPACT, KIND_PROCEDURAL, KIND_COUNT };
+    enum State { STATE_NONE, STATE_QUEUED, STATE_BUILDING, STATE_READY };
+    struct Variant {
+      VkPipeline        pipeline;
+      State             state;
+    };
+    // what the pipelines are made of: must not change while workers run
+    VkPipelineLayout    layout;
+    VkShaderModule      vert[KIND_COUNT];
+    VkShaderModule      frag;
+    const NVK::PipelineRasterizationStateCreateInfo*  raster;
+    const NVK::PipelineColorBlendStateCreateInfo*     colorBlend;
+    const NVK::PipelineDepthStencilStateCreateInfo*   depthStencil;
+    const NVK::PipelineDynamicStateCreateInfo*        dynamicState;
+    NVFBOBoxVK*         fbo;
+
+    Variant             variants[KIND_COUNT][PIPELINE_VARIANT_SLOTS];
+    VkPipeline          bases[KIND_COUNT];
+    VkRenderPass        passes[PIPELINE_VARIANT_SLOTS]; // compatible with the scene pass of this MSAA
+    std::vector<int>    samples;    // what the workers build, in this order
+    std::vector<std::thread> workers;
+    std::mutex          mutex;
+    std::condition_variable built;
+    std::chrono::high_resolution_clock::time_point startTime;
+    double              workersMs;  // from start() to the last one built by a worker
+    int                 numPrebuilt;
+    int                 numWaited;
+    int                 numOnDemand;
+    bool                stop;       // destroy(): what is still queued is dropped
+
+    static int slot(int numSamples) {
+      int s = 0;
+      while (((1 << s) < numSamples) && (s < PIPELINE_VARIANT_SLOTS - 1))
+        s++;
+      return s;
+    }
+    void init(NVFBOBoxVK* fbo_) {
+      fbo = fbo_;
+      memset(variants, 0, sizeof(variants));
+      memset(bases, 0, sizeof(bases));
+      memset(passes, 0, sizeof(passes));
+      samples.clear();
+      workersMs = 0.0;
+      numPrebuilt = numWaited = numOnDemand = 0;
+      stop = false;
+    }
+    // main thread: the workers only use the passes made by start()
+    VkRenderPass pass(int numSamples) {
+      VkRenderPass& p = passes[slot(numSamples)];
+      if (!p)
+        p = fbo->createScenePass(numSamples);
+      return p;
+    }
+    VkPipeline build(Kind kind, int numSamples, VkRenderPass renderPass, VkPipeline base) {
+      // we don't care about the viewport... will be dynamcically setup
+      NVK::PipelineViewportStateCreateInfo viewportState(
+        NVK::Viewport(0.0f, 0.0f, (float)100, (float)100, 0.0f, 1.0f),
+        NVK::Rect2DArray(0.0f, 0.0f, (float)100, (float)100)
+      );
+      ::VkSampleMask sampleMask = 0xFFFF;
+      NVK::PipelineMultisampleStateCreateInfo multisampleState(
+        (VkSampleCountFlagBits)numSamples /*rasterSamples*/, VK_FALSE /*sampleShadingEnable*/, 1.0 /*minSampleShading*/, &sampleMask /*sampleMask*/, VK_FALSE, VK_FALSE);
+      NVK::VertexInputBindingDescription vertexBinding;
+      NVK::VertexInputAttributeDescription vertexAttributes;
+      if (kind == KIND_COMPACT)
+      {
+        // normal and color come from BINDING_STRANDATTR
+        vertexBinding = NVK::VertexInputBindingDescription(0/*binding*/, sizeof(VertexCompact)/*stride*/, VK_VERTEX_INPUT_RATE_VERTEX);
+        vertexAttributes = NVK::VertexInputAttributeDescription(0/*location*/, 0/*binding*/, VK_FORMAT_R16G16B16A16_SNORM, 0); // pos
+      }
+      else if (kind == KIND_FULL)
+      {
+        vertexBinding = NVK::VertexInputBindingDescription(0/*binding*/, sizeof(Vertex)/*stride*/, VK_VERTEX_INPUT_RATE_VERTEX);
+        vertexAttributes = NVK::VertexInputAttributeDescription(0/*location*/, 0/*binding*/, VK_FORMAT_R32G32B32_SFLOAT, 0) // pos
+          (1/*location*/, 0/*binding*/, VK_FORMAT_R32G32B32_SFLOAT, sizeof(glm::vec3)) // normal
+          (2/*location*/, 0/*binding*/, VK_FORMAT_R32G32B32A32_SFLOAT, 2 * sizeof(glm::vec3)); // color
+      }
+      // KIND_PROCEDURAL: no vertex input, strands come from BINDING_STRANDCTRL
+      bool procedural = kind == KIND_PROCEDURAL;
+      VkPipelineCreateFlags flags = base ? VK_PIPELINE_CREATE_DERIVATIVE_BIT : VK_PIPELINE_CREATE_ALLOW_DERIVATIVES_BIT;
+      return nvk.createGraphicsPipeline(NVK::GraphicsPipelineCreateInfo
+      (layout, renderPass,/*subpass*/0,/*basePipelineHandle*/base,/*basePipelineIndex*/-1, flags)
+        (NVK::PipelineVertexInputStateCreateInfo(vertexBinding, vertexAttributes))
+        (NVK::PipelineInputAssemblyStateCreateInfo(procedural ? VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST : VK_PRIMITIVE_TOPOLOGY_TRIANGLE_STRIP,
+          procedural ? VK_FALSE : VK_TRUE/*primitiveRestartEnable*/))
+        (NVK::PipelineShaderStageCreateInfo(VK_SHADER_STAGE_VERTEX_BIT, vert[kind], "main"))
+        (viewportState)
+        (*raster)
+        (multisampleState)
+        (NVK::PipelineShaderStageCreateInfo(VK_SHADER_STAGE_FRAGMENT_BIT, frag, "main"))
+        (*colorBlend)
+        (*depthStencil)
+        (*dynamicState)
+      );
+    }
+    // mutex held
+    void setReady(Kind kind, Variant& v, VkPipeline p) {
+      v.pipeline = p;
+      v.state = STATE_READY;
+      if (!bases[kind])
+        bases[kind] = p;
+      built.notify_all();
+    }
+    void work(Kind kind) {
+      for (size_t i = 0; i < samples.size(); i++)
+      {
+        Variant& v = variants[kind][slot(samples[i])];
+        VkPipeline base;
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          if (stop)
+            return;
+          if (v.state != STATE_QUEUED) // get() took it
+            continue;
+          v.state = STATE_BUILDING;
+          base = bases[kind];
+        }
+        VkPipeline p = build(kind, samples[i], passes[slot(samples[i])], base);
+        std::lock_guard<std::mutex> lock(mutex);
+        setReady(kind, v, p);
+        numPrebuilt++;
+        workersMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - startTime).count();
+      }
+    }
+    void start(const std::vector<int>& prebuilt) {
+      samples = prebuilt;
+      for (size_t i = 0; i < samples.size(); i++)
+      {
+        pass(samples[i]);
+        for (int k = 0; k < KIND_COUNT; k++)
+          variants[k][slot(samples[i])].state = STATE_QUEUED;
+      }
+      startTime = std::chrono::high_resolution_clock::now();
+      for (int k = 0; k < KIND_COUNT && !samples.empty(); k++)
+        workers.push_back(std::thread(&FurPipelineVariants::work, this, (Kind)k));
+    }
+    VkPipeline get(Kind kind, int numSamples) {
+      Variant& v = variants[kind][slot(numSamples)];
+      std::unique_lock<std::mutex> lock(mutex);
+      if (v.state == STATE_BUILDING)
+      {
+        // a worker is on it: sooner than starting over
+        numWaited++;
+        built.wait(lock, [&v] { return v.state == STATE_READY; });
+      }
+      if (v.state == STATE_READY)
+        return v.pipeline;
+      // still queued, or not one of the prebuilt samples: blocking compile
+      v.state = STATE_BUILDING;
+      VkPipeline base = bases[kind];
+      lock.unlock();
+      VkPipeline p = build(kind, numSamples, pass(numSamples), base);
+      lock.lock();
+      setReady(kind, v, p);
+      numOnDemand++;
+      return p;
+    }
+    // the device must be idle
+    void destroy() {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+      }
+      for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+      workers.clear();
+      if (numPrebuilt || numOnDemand)
+        LOGI("Pipeline variants: %d built ahead in %.2f ms, %d waited for; %d built on demand\n", numPrebuilt, workersMs, numWaited, numOnDemand);
+      for (int k = 0; k < KIND_COUNT; k++)
+        for (int s = 0; s < PIPELINE_VARIANT_SLOTS; s++)
+          if (variants[k][s].pipeline)
+            vkDestroyPipeline(nvk.m_device, variants[k][s].pipeline, NULL);
+      for (int s = 0; s < PIPELINE_VARIANT_SLOTS; s++)
+        if (passes[s])
+          vkDestroyRenderPass(nvk.m_device, passes[s], NULL);
+      init(fbo);
+    }
+  };
+
+  //------------------------------------------------------------------------------
+  // the threads culling the blocks and recording the draws of the scene: made
+  // once for g_vkRecordThreads workers, the calling thread being one of them.
+  // run() hands them the jobs [0, count) of a frame and returns once all are done
+  //------------------------------------------------------------------------------
+  struct RecordWorkers {
+    std::vector<std::thread> threads;
+    std::mutex          mutex;
+    std::condition_variable wake; // a run() has jobs, or stop
+    std::condition_variable done; // the jobs of the run() are all done
+    const std::function<void(int)>* job;
+    int                 numJobs;
+    int                 nextJob;
+    int                 pendingJobs;
+    uint64_t            generation; // of the run(): a worker may sleep through one
+    bool                stop;
+
+    RecordWorkers() : job(NULL), numJobs(0), nextJob(0), pendingJobs(0), generation(0), stop(false) {}
+    int size() const { return (int)threads.size() + 1; }
+    // mutex held: takes jobs until none is left
+    void drain(std::unique_lock<std::mutex>& lock) {
+      while (nextJob < numJobs)
+      {
+        int k = nextJob++;
+        const std::function<void(int)>& f = *job;
+        lock.unlock();
+        f(k);
+        lock.lock();
+        if (--pendingJobs == 0)
+          done.notify_all();
+      }
+    }
+    void work() {
+      std::unique_lock<std::mutex> lock(mutex);
+      uint64_t seen = generation;
+      for (;;)
+      {
+        wake.wait(lock, [&] { return stop || (generation != seen); });
+        if (stop)
+          return;
+        seen = generation;
+        drain(lock);
+      }
+    }
+    void init(int numWorkers) {
+      destroy();
+      for (int t = 1; t < numWorkers; t++)
+        threads.push_back(std::thread(&RecordWorkers::work, this));
+    }
+    void run(int count, const std::function<void(int)>& f) {
+      std::unique_lock<std::mutex> lock(mutex);
+      job = &f;
+      numJobs = count;
+      nextJob = 0;
+      pendingJobs = count;
+      generation++;
+      if (!threads.empty())
+        wake.notify_all();
+      drain(lock);
+      done.wait(lock, [this] { return pendingJobs == 0; });
+      job = NULL;
+      numJobs = nextJob = 0;
+    }
+    void destroy() {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+      }
+      wake.notify_all();
+      for (size_t i = 0; i < threads.size(); i++)
+        threads[i].join();
+      threads.clear();
+      stop = false;
+    }
+  };
+
+  #define FRAME_STATS_WINDOW 64 // frames between 2 updates of g_vkFramesBlocked
 
   //------------------------------------------------------------------------------
   // Renderer: can be OpenGL or other
@@ -69,41 +508,155 @@ namespace vk
 
     VkDescriptorSetLayout       m_descriptorSetLayouts[DSET_TOTALAMOUNT]; // general layout and objects layout
     VkDescriptorSet             m_descriptorSetGlobal; // descriptor set for general part
+    VkDescriptorSet             m_descriptorSetObject; // in m_uniforms too, at the offsets of the draw
 
     VkPipelineLayout            m_pipelineLayout;
 
+    // both come from m_furPipelines, which owns them
     VkPipeline                  m_pipelinefur;
+    VkPipeline                  m_pipelinefurProcedural; // FUR_FORMAT_PROCEDURAL: vertex pulling
+    FurPipelineVariants         m_furPipelines;
+
+    // FUR_GEN_GPU: GLSL_fur_gen.comp writes the buffers of m_furBlocks[0]
+    VkDescriptorSetLayout       m_descriptorSetLayoutFurGen;
+    VkDescriptorSet             m_descriptorSetFurGen;
+    VkPipelineLayout            m_pipelineLayoutFurGen;
+    VkPipeline                  m_pipelineFurGen;
+    bool                        m_furGenPending; // the next frame must dispatch GLSL_fur_gen.comp first
+
+    // GPU-driven culling: GLSL_fur_cull.comp writes the draws of the clusters. Its
+    // occlusion test reads m_hiz: the depth-buffer of the previous frame, reduced
+    // by GLSL_fur_hiz*.comp to the farthest depth of each texel footprint
+    VkDescriptorSetLayout       m_descriptorSetLayoutFurCull;
+    VkDescriptorSet             m_descriptorSetFurCull;
+    VkPipelineLayout            m_pipelineLayoutFurCull;
+    VkPipeline                  m_pipelineFurCull;
+    VkDescriptorSetLayout       m_descriptorSetLayoutHiZ;
+    VkPipelineLayout            m_pipelineLayoutHiZ;
+    VkPipeline                  m_pipelineHiZ;
+    VkPipeline                  m_pipelineHiZMs; // level 0 from the multisampled depth-buffer
+    VkDescriptorPool            m_descPoolHiZ;   // one set per level and m_descriptorSetFurCull: made again with the render-target
+    std::vector<VkDescriptorSet> m_descriptorSetsHiZ;
+    std::vector<VkImageView>    m_hizLevelViews;
+    VkImageView                 m_hizView;       // all the levels, for GLSL_fur_cull.comp
+    VkImage                     m_hiz;
+    NVK::Allocation*            m_hizMem;
+    int                         m_hizLevels;
+    VkSampler                   m_samplerNearest;
+    bool                        m_hizValid;      // the depth-buffer holds the frame rendered with m_prevViewProj
+    bool                        m_hizUndefined;  // m_hiz is still in VK_IMAGE_LAYOUT_UNDEFINED
+    glm::mat4                   m_prevViewProj;
 
     NVFBOBoxVK                  m_nvFBOBox; // the super-sampled render-target
     NVFBOBoxVK::DownSamplingTechnique downsamplingMode;
 
     NVK::CommandPool            m_cmdPool;
-    std::vector<VkCommandBuffer> m_cmdBufferQueue[2];
-    VkFence                     m_sceneFence[2];
+    // m_numFrames frames in flight, m_cmdSceneIdx is the one being recorded.
+    // Each has its command-buffers, fence, region of m_uniforms and downsampled image
+    int                         m_numFrames;
+    NVK::CommandPool            m_framePools[MAX_FRAMES_IN_FLIGHT]; // frame-scoped: recycled once their fence is passed
+    std::vector<VkCommandBuffer> m_cmdSubmit;         // what the frame submits, in order
+    VkFence                     m_sceneFence[MAX_FRAMES_IN_FLIGHT];
+    bool                        m_sceneSubmitted[MAX_FRAMES_IN_FLIGHT]; // its fence is yet to be waited for
+    uint64_t                    m_sceneSerial[MAX_FRAMES_IN_FLIGHT];    // of its submission, for nvk.utCollectRetired()
     int                         m_cmdSceneIdx;
+    // how long the CPU waited for the fences, over the last FRAME_STATS_WINDOW frames
+    int                         m_waitFrames;
+    int                         m_blockedFrames;
+    double                      m_blockedMs;
+    // g_vkRecordThreads > 1: workers record the draws in secondary command-buffers,
+    // each from its own pool (pools aren't thread-safe). One per frame and worker,
+    // recorded again once the fence of their frame is passed
+    NVK::CommandPool            m_recordPools[MAX_RECORD_THREADS];
+    VkCommandBuffer             m_recordCmd[MAX_FRAMES_IN_FLIGHT][MAX_RECORD_THREADS];
+    RecordWorkers               m_workers;      // they also cull the blocks, see gatherFurDraws()
+    std::vector<FurDrawSpan>    m_furSpans;     // the draws of the frame, see gatherFurDraws()
+    // how long each worker recorded, over the last FRAME_STATS_WINDOW frames
+    double                      m_recordMs[MAX_RECORD_THREADS];
+    int                         m_recordFrames;
+    int                         m_recordWorkers;
+    // g_vkStaticCmd: the scene, recorded once per render-target and fur. NULL
+    // until the next frame records it again
+    VkCommandBuffer             m_sceneCmd[MAX_FRAMES_IN_FLIGHT];
+    FrameOffsets                m_sceneOffsets[MAX_FRAMES_IN_FLIGHT]; // what m_sceneCmd was recorded with
 
     // Used for merging Vulkan image to OpenGL backbuffer 
     VkSemaphore                 m_semOpenGLReadDone;
     VkSemaphore                 m_semVKRenderingDone;
 
 
-    GLuint                      m_nElmts;
-    BufO                        m_furBuffer;
-    BufO                        m_matrix;
+    int                         m_furFormat;
+    int                         m_furStrands;
+    float                       m_furRadius;
+    int                         m_furLayout;
+    int                         m_furLodLevels; // levels in m_furBlocks (or procedural steps) to pick from
+    std::vector<FurBlock>       m_furBlocks;
+    StagingRing                 m_staging;
+    BufO                        m_furAttrBuffer; // per-strand attributes for FUR_FORMAT_COMPACT
+    BufO                        m_furCtrlBuffer; // per-strand control data for FUR_FORMAT_PROCEDURAL
+    BufO                        m_furGenParams;  // FurGenParams
+    BufO                        m_furRandomBuffer; // furRandom() words written by GLSL_fur_gen.comp, for validation
+    // culled cluster draws, written by the CPU at every frame: one per m_cmdSceneIdx
+    BufO                        m_furIndirect[MAX_FRAMES_IN_FLIGHT];
+    FurDrawIndexed*             m_furIndirectPtr[MAX_FRAMES_IN_FLIGHT];
+    BufO                        m_furCullParams;    // FurCullParams
+    BufO                        m_furClusterBuffer; // FurClusterGPU of all the blocks, at their drawOffset
+    BufO                        m_furCullDraws;     // one per cluster, written by GLSL_fur_cull.comp
+    BufO                        m_furCullStats;     // FurCullStats
+    // copies of m_furCullStats, read once the fence of their m_cmdSceneIdx is passed
+    BufO                        m_furCullReadback[MAX_FRAMES_IN_FLIGHT];
+    FurCullStats*               m_furCullReadbackPtr[MAX_FRAMES_IN_FLIGHT];
+    bool                        m_furCullPending[MAX_FRAMES_IN_FLIGHT];
+    // fragment shader invocations of the fur, one query per m_cmdSceneIdx.
+    // NULL when pipelineStatisticsQuery isn't supported
+    VkQueryPool                 m_furStatsQueries;
+    bool                        m_furStatsPending[MAX_FRAMES_IN_FLIGHT];
+    UniformRing                 m_uniforms;     // BINDING_MATRIX, BINDING_MATRIXOBJ and BINDING_MATERIAL
+    glm::mat4                   m_furObject;    // MatrixBufferObject of the fur
 
     nvvk::ProfilerVK            m_profilerVK;
 
     std::string                 m_spv_GLSL_fur_frag;
     std::string                 m_spv_GLSL_fur_vert;
+    std::string                 m_spv_GLSL_fur_compact_vert;
+    std::string                 m_spv_GLSL_fur_procedural_vert;
+    std::string                 m_spv_GLSL_fur_gen_comp;
+    std::string                 m_spv_GLSL_fur_cull_comp;
+    std::string                 m_spv_GLSL_fur_hiz_comp;
+    std::string                 m_spv_GLSL_fur_hiz_ms_comp;
     int                         m_MSAA;
 
     NVK::PipelineDynamicStateCreateInfo       m_dynamicStateCreateInfo;
     NVK::PipelineRasterizationStateCreateInfo m_vkPipelineRasterStateCreateInfo;
     NVK::PipelineColorBlendStateCreateInfo    m_vkPipelineColorBlendStateCreateInfo;
     NVK::PipelineDepthStencilStateCreateInfo  m_vkPipelineDepthStencilStateCreateInfo;
-    NVK::PipelineMultisampleStateCreateInfo   m_vkPipelineMultisampleStateCreateInfo;
 
+    void initFurPipelines();
     void initRenderPassRelated();
+    void initFur();
+    void deleteFur();
+    void streamFur(int level);
+    void initFurIndirect();
+    void cmdFurGen(VkCommandBuffer cmd, bool writeRandom);
+    void validateFurGen();
+    void initHiZ();
+    void deleteHiZ();
+    void cmdFurCull(VkCommandBuffer cmd, uint32_t firstCluster, uint32_t numClusters, const glm::mat4& viewProj, const glm::vec4 planes[6]);
+    void cullFurBlocks(FurBlock* const* blocks, int numBlocks, FurDrawIndexed* draws, const glm::vec4 planes[6], const glm::vec3& eye,
+      uint32_t* numDraws);
+    void writeFurDraws(int lod, const glm::vec4 planes[6], const glm::vec3& eye);
+    void gatherFurDraws(int lod, bool gpuCulling, const glm::vec4 planes[6], const glm::vec3& eye);
+    void cmdFurState(NVK::CommandBuffer cmd, const FrameOffsets& offsets, float w, float h);
+    void cmdDrawFurSpans(NVK::CommandBuffer cmd, const FurDrawSpan* spans, int numSpans);
+    void recordFurParallel(int workers, const FrameOffsets& offsets, bool inheritStats);
+    void writeUniformDescriptors();
+    void writeFurCullDescriptors();
+    void benchmarkCmdPools(int frames);
+    void reserveUniforms(size_t bytes);
+    void recordSceneCmd(int idx, const FrameOffsets& offsets);
+    void releaseSceneCmd();
+    void waitFrame(int idx, bool count);
+    void waitAllFrames();
 
   public:
 
@@ -111,7 +664,24 @@ namespace vk
       m_bValid = false;
       g_renderers[g_numRenderers++] = this;
       m_cmdSceneIdx = 0;
-
+      m_numFrames = 2;
+      m_waitFrames = m_blockedFrames = 0;
+      m_blockedMs = 0.0;
+      m_recordFrames = m_recordWorkers = 0;
+      m_furGenPending = false;
+      m_hizValid = false;
+      m_furStatsQueries = NULL;
+      m_furObject = glm::mat4(1.0f);
+      m_pipelinefur = m_pipelinefurProcedural = NULL;
+      m_furPipelines.init(NULL);
+      for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
+      {
+        m_furCullPending[i] = false;
+        m_furStatsPending[i] = false;
+        m_sceneSubmitted[i] = false;
+        m_sceneSerial[i] = 0;
+        m_sceneCmd[i] = NULL;
+      }
     }
     virtual ~RendererVk() {}
 
@@ -133,6 +703,8 @@ namespace vk
       downsamplingMode = (NVFBOBoxVK::DownSamplingTechnique)i;
     }
 
+    virtual void updateFur();
+
   };
 
   RendererVk s_renderer;
@@ -184,10 +756,14 @@ namespace vk
       return true;
     m_bValid = true;
     m_MSAA = MSAA;
+    m_numFrames = std::max(1, std::min(g_vkFrames, MAX_FRAMES_IN_FLIGHT));
+    m_cmdSceneIdx = 0;
     //--------------------------------------------------------------------------
     // Create the Vulkan device
     //
-    bRes = nvk.utInitialize();
+    // the pipeline cache goes with the fur cache, on disk
+    nvk.m_pipelineCacheCompare = g_vkPipelineCache >= 2;
+    bRes = nvk.utInitialize(NULL, g_vkPipelineCache ? g_furCacheDir.c_str() : NULL);
     assert(bRes);
     //--------------------------------------------------------------------------
     // Get the OpenGL extension for merging VULKAN with OpenGL
@@ -208,6 +784,26 @@ namespace vk
     cmdPoolInfo.queueFamilyIndex = 0;
     cmdPoolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
     nvk.createCommandPool(&cmdPoolInfo, NULL, &m_cmdPool);
+    //
+    // Command pools of the recording workers
+    //
+    for (int t = 0; t < MAX_RECORD_THREADS; t++)
+    {
+      nvk.createCommandPool(&cmdPoolInfo, NULL, &m_recordPools[t]);
+      for (int i = 0; i < m_numFrames; i++)
+        m_recordCmd[i][t] = m_recordPools[t].utAllocateCommandBuffer(false);
+      m_recordMs[t] = 0.0;
+    }
+    m_workers.init(g_vkRecordThreads);
+    //
+    // Command pools of the frames: what a frame records goes away with it
+    //
+    cmdPoolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+    for (int i = 0; i < m_numFrames; i++)
+    {
+      nvk.createCommandPool(&cmdPoolInfo, NULL, &m_framePools[i]);
+      m_framePools[i].utSetFrameScoped(true);
+    }
 
     //--------------------------------------------------------------------------
     m_profilerVK = nvvk::ProfilerVK(&g_profiler);
@@ -265,6 +861,18 @@ namespace vk
       bRes = false;
     if (!load_binary(std::string("GLSL_fur_vert.spv"), m_spv_GLSL_fur_vert))
       bRes = false;
+    if (!load_binary(std::string("GLSL_fur_compact_vert.spv"), m_spv_GLSL_fur_compact_vert))
+      bRes = false;
+    if (!load_binary(std::string("GLSL_fur_procedural_vert.spv"), m_spv_GLSL_fur_procedural_vert))
+      bRes = false;
+    if (!load_binary(std::string("GLSL_fur_gen_comp.spv"), m_spv_GLSL_fur_gen_comp))
+      bRes = false;
+    if (!load_binary(std::string("GLSL_fur_cull_comp.spv"), m_spv_GLSL_fur_cull_comp))
+      bRes = false;
+    if (!load_binary(std::string("GLSL_fur_hiz_comp.spv"), m_spv_GLSL_fur_hiz_comp))
+      bRes = false;
+    if (!load_binary(std::string("GLSL_fur_hiz_ms_comp.spv"), m_spv_GLSL_fur_hiz_ms_comp))
+      bRes = false;
     if (bRes == false)
     {
       LOGE("Failed loading some SPV files\n");
@@ -276,15 +884,43 @@ namespace vk
     //--------------------------------------------------------------------------
     // Buffers for general UBOs
     //
-    m_matrix.Sz = sizeof(glm::vec4) * 4 * 2;
-    m_matrix.buffer = nvk.utCreateAndFillBuffer(&m_cmdPool, m_matrix.Sz, NULL, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, m_matrix.bufferMem);
+    m_uniforms.init(m_numFrames, UNIFORM_RING_REGION_SIZE, (size_t)nvk.m_gpu.properties.limits.minUniformBufferOffsetAlignment);
+    m_staging.init(&m_cmdPool, STAGING_SLOT_SIZE);
+    m_furGenParams.Sz = sizeof(FurGenParams);
+    m_furGenParams.buffer = nvk.utCreateAndFillBuffer(&m_cmdPool, m_furGenParams.Sz, NULL, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, m_furGenParams.bufferMem);
+    m_furCullParams.Sz = sizeof(FurCullParams);
+    m_furCullParams.buffer = nvk.utCreateAndFillBuffer(&m_cmdPool, m_furCullParams.Sz, NULL, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, m_furCullParams.bufferMem);
+    m_furCullStats.Sz = sizeof(FurCullStats);
+    m_furCullStats.buffer = nvk.utCreateAndFillBuffer(&m_cmdPool, m_furCullStats.Sz, NULL,
+      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, m_furCullStats.bufferMem);
+    for (int i = 0; i < m_numFrames; i++)
+    {
+      m_furCullReadback[i].Sz = sizeof(FurCullStats);
+      m_furCullReadback[i].buffer = nvk.createBuffer(NVK::BufferCreateInfo(m_furCullReadback[i].Sz, VK_BUFFER_USAGE_TRANSFER_DST_BIT));
+      m_furCullReadback[i].bufferMem = nvk.utAllocMemAndBindBuffer(m_furCullReadback[i].buffer, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+      m_furCullReadbackPtr[i] = (FurCullStats*)nvk.mapMemory(m_furCullReadback[i].bufferMem, 0, m_furCullReadback[i].Sz, 0);
+      m_furCullPending[i] = false;
+      m_furStatsPending[i] = false;
+    }
+    if (nvk.m_gpu.features2.features.pipelineStatisticsQuery)
+    {
+      VkQueryPoolCreateInfo queryInfo = { VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO };
+      queryInfo.queryType = VK_QUERY_TYPE_PIPELINE_STATISTICS;
+      queryInfo.queryCount = m_numFrames;
+      queryInfo.pipelineStatistics = VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT;
+      nvk.createQueryPool(&queryInfo, NULL, &m_furStatsQueries);
+    }
+    else
+      LOGW("No pipeline statistics queries: the fur fragments won't be counted\n");
     //--------------------------------------------------------------------------
     // descriptor set
     //
     // descriptor layout for general things (projection matrix; view matrix...)
     m_descriptorSetLayouts[DSET_GLOBAL] = nvk.createDescriptorSetLayout(
       NVK::DescriptorSetLayoutCreateInfo(NVK::DescriptorSetLayoutBinding
-      (BINDING_MATRIX, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1, VK_SHADER_STAGE_VERTEX_BIT) // BINDING_MATRIX
+      (BINDING_MATRIX, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 1, VK_SHADER_STAGE_VERTEX_BIT) // BINDING_MATRIX: the slice of the frame
+      (BINDING_STRANDATTR, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_VERTEX_BIT) // BINDING_STRANDATTR
+      (BINDING_STRANDCTRL, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_VERTEX_BIT) // BINDING_STRANDCTRL
       //(0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1, VK_SHADER_STAGE_FRAGMENT_BIT) // BINDING_LIGHT
       ));
     // descriptor layout for object level: buffers related to the object (objec-matrix; material colors...)
@@ -298,23 +934,71 @@ namespace vk
     // PipelineLayout
     //
     m_pipelineLayout = nvk.createPipelineLayout(m_descriptorSetLayouts, DSET_TOTALAMOUNT);
-
     //
-    // Create the buffer with these data
+    // Fur generation compute pipeline: doesn't depend on the render-pass, so made once here
+    //
+    m_descriptorSetLayoutFurGen = nvk.createDescriptorSetLayout(
+      NVK::DescriptorSetLayoutCreateInfo(NVK::DescriptorSetLayoutBinding
+      (BINDING_FURGEN_PARAMS, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT)
+      (BINDING_FURGEN_VERTICES, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT)
+      (BINDING_FURGEN_INDICES, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT)
+      (BINDING_FURGEN_RANDOM, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT)
+      ));
+    m_pipelineLayoutFurGen = nvk.createPipelineLayout(&m_descriptorSetLayoutFurGen, 1);
+    m_pipelineFurGen = nvk.createComputePipeline(m_pipelineLayoutFurGen, NVK::PipelineShaderStageCreateInfo(
+      VK_SHADER_STAGE_COMPUTE_BIT, nvk.createShaderModule(m_spv_GLSL_fur_gen_comp.c_str(), m_spv_GLSL_fur_gen_comp.size()), "main"));
+    //
+    // Fur culling and hierarchical-Z compute pipelines
     //
-    std::vector<Vertex> data;
-    buildFur(data);
-    m_nElmts = data.size();
-    GLuint vbofurSz = data.size() * sizeof(Vertex);
-    m_furBuffer.buffer = nvk.utCreateAndFillBuffer(&m_cmdPool, vbofurSz, &(data[0]), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, m_furBuffer.bufferMem);
+    m_descriptorSetLayoutFurCull = nvk.createDescriptorSetLayout(
+      NVK::DescriptorSetLayoutCreateInfo(NVK::DescriptorSetLayoutBinding
+      (BINDING_FURCULL_PARAMS, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT)
+      (BINDING_FURCULL_CLUSTERS, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT)
+      (BINDING_FURCULL_DRAWS, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT)
+      (BINDING_FURCULL_STATS, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT)
+      (BINDING_FURCULL_HIZ, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1, VK_SHADER_STAGE_COMPUTE_BIT)
+      ));
+    m_pipelineLayoutFurCull = nvk.createPipelineLayout(&m_descriptorSetLayoutFurCull, 1);
+    m_pipelineFurCull = nvk.createComputePipeline(m_pipelineLayoutFurCull, NVK::PipelineShaderStageCreateInfo(
+      VK_SHADER_STAGE_COMPUTE_BIT, nvk.createShaderModule(m_spv_GLSL_fur_cull_comp.c_str(), m_spv_GLSL_fur_cull_comp.size()), "main"));
+    m_descriptorSetLayoutHiZ = nvk.createDescriptorSetLayout(
+      NVK::DescriptorSetLayoutCreateInfo(NVK::DescriptorSetLayoutBinding
+      (BINDING_HIZ_SRC, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1, VK_SHADER_STAGE_COMPUTE_BIT)
+      (BINDING_HIZ_DST, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1, VK_SHADER_STAGE_COMPUTE_BIT)
+      ));
+    m_pipelineLayoutHiZ = nvk.createPipelineLayout(&m_descriptorSetLayoutHiZ, 1);
+    m_pipelineHiZ = nvk.createComputePipeline(m_pipelineLayoutHiZ, NVK::PipelineShaderStageCreateInfo(
+      VK_SHADER_STAGE_COMPUTE_BIT, nvk.createShaderModule(m_spv_GLSL_fur_hiz_comp.c_str(), m_spv_GLSL_fur_hiz_comp.size()), "main"));
+    m_pipelineHiZMs = nvk.createComputePipeline(m_pipelineLayoutHiZ, NVK::PipelineShaderStageCreateInfo(
+      VK_SHADER_STAGE_COMPUTE_BIT, nvk.createShaderModule(m_spv_GLSL_fur_hiz_ms_comp.c_str(), m_spv_GLSL_fur_hiz_ms_comp.size()), "main"));
+    // texelFetch() only: no filtering
+    m_samplerNearest = nvk.createSampler(NVK::SamplerCreateInfo(
+      VK_FILTER_NEAREST,              //magFilter
+      VK_FILTER_NEAREST,              //minFilter
+      VK_SAMPLER_MIPMAP_MODE_NEAREST, //mipMode
+      VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE, //addressU
+      VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE, //addressV
+      VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE, //addressW
+      0.0,                            //mipLodBias
+      VK_FALSE,                       //anisotropyEnable
+      1.0,                            //maxAnisotropy
+      VK_FALSE,                       //compareEnable
+      VK_COMPARE_OP_NEVER,            //compareOp
+      0.0,                            //minLod
+      VK_LOD_CLAMP_NONE,              //maxLod
+      VK_BORDER_COLOR_FLOAT_OPAQUE_WHITE, //borderColor
+      VK_FALSE                        //unnormalizedCoordinates
+    ));
 
     //
     // Descriptor Pool: size is 4 to have enough for global; object and ...
     // TODO: try other VkDescriptorType
     //
     m_descPool = nvk.createDescriptorPool(NVK::DescriptorPoolCreateInfo(
-      3, NVK::DescriptorPoolSize(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 3)
-      (VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 3))
+      5, NVK::DescriptorPoolSize(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 5)
+      (VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 3)
+      (VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 8)
+      (VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1))
     );
     //
     // DescriptorSet allocation
@@ -324,38 +1008,1107 @@ namespace vk
     nvk.allocateDescriptorSets(NVK::DescriptorSetAllocateInfo
     (m_descPool, 1, m_descriptorSetLayouts + DSET_GLOBAL),
       &m_descriptorSetGlobal);
+    nvk.allocateDescriptorSets(NVK::DescriptorSetAllocateInfo
+    (m_descPool, 1, m_descriptorSetLayouts + DSET_OBJECT),
+      &m_descriptorSetObject);
     //
-    // update the descriptorset used for Global
-    // later we will update the ones local to objects
+    // the uniforms of both sets are in m_uniforms: the draws give the offsets
     //
-    NVK::DescriptorBufferInfo descBuffer = NVK::DescriptorBufferInfo(m_matrix.buffer, 0, m_matrix.Sz);
-
+    writeUniformDescriptors();
+    nvk.allocateDescriptorSets(NVK::DescriptorSetAllocateInfo
+    (m_descPool, 1, &m_descriptorSetLayoutFurGen),
+      &m_descriptorSetFurGen);
+    NVK::DescriptorBufferInfo descFurGen = NVK::DescriptorBufferInfo(m_furGenParams.buffer, 0, m_furGenParams.Sz);
     nvk.updateDescriptorSets(NVK::WriteDescriptorSet
-    (m_descriptorSetGlobal, BINDING_MATRIX, 0, descBuffer, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER)
+    (m_descriptorSetFurGen, BINDING_FURGEN_PARAMS, 0, descFurGen, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER)
     );
+    // m_descriptorSetFurCull comes with m_hiz, see initHiZ()
+    //
+    // Create the buffers of the fur
     //
-    // Create a Fence for the primary command-buffer
+    initFur();
     //
-    m_sceneFence[0] = nvk.createFence();
-    m_sceneFence[1] = nvk.createFence(VK_FENCE_CREATE_SIGNALED_BIT);
-    nvk.resetFences(2, m_sceneFence);
+    // Create a Fence for the primary command-buffers of each frame
+    //
+    for (int i = 0; i < m_numFrames; i++)
+    {
+      m_sceneFence[i] = nvk.createFence();
+      m_sceneSubmitted[i] = false;
+    }
+    LOGI("Vulkan: %d frames in flight\n", m_numFrames);
 
     //
     // initialize the super-sampled render-target. But at this stage we don't know the viewport size...
     // TODO: put it somewhere else
     //
     downsamplingMode = NVFBOBoxVK::DS2;
+    m_nvFBOBox.setOutputs(m_numFrames);
+    m_nvFBOBox.setTransient(g_vkTransient >= 1, g_vkTransient >= 2);
     m_nvFBOBox.Initialize(nvk, w, h, SSScale, MSAA);
+    initFurPipelines();
     updateViewport(0, 0, w, h, SSScale);
+    // all the pipelines of the first frame exist: what compiling them cost. The
+    // workers of m_furPipelines may have built other ones already
+    NVK::PipelineStats pipelineStats = nvk.utGetPipelineStats();
+    LOGI("Pipelines: %d created in %.2f ms (cache %s)\n", pipelineStats.created, pipelineStats.ms,
+      nvk.m_pipelineCache == VK_NULL_HANDLE ? "off" : (pipelineStats.loadedBytes ? "warm" : "cold"));
+    if (pipelineStats.compared)
+      LOGI("Pipelines: the same %d take %.2f ms without the cache\n", pipelineStats.compared, pipelineStats.msUncached);
+    if (g_vkPoolBenchmark > 0)
+      benchmarkCmdPools(g_vkPoolBenchmark);
+    NVK::MemoryStats memStats;
+    nvk.utGetMemoryStats(memStats);
+    LOGI("Vulkan memory: %d allocations in %d blocks (%d dedicated); %.2f MB used of %.2f MB\n", memStats.allocations, memStats.blocks,
+      memStats.dedicated, memStats.used / (1024.0 * 1024.0), memStats.allocated / (1024.0 * 1024.0));
     return true;
   }
   //------------------------------------------------------------------------------
+  // builds the fur and creates its buffers, in the format of g_furFormat. A
+  // single buffer has to be bound for FUR_FORMAT_PROCEDURAL and the GPU
+  // generation: too big for a storage descriptor, the fur is built on the CPU
+  //------------------------------------------------------------------------------
+  void RendererVk::initFur()
+  {
+    m_furFormat = g_furFormat;
+    m_furStrands = g_furParams.numStrands;
+    m_furRadius = g_furParams.radius;
+    m_furLayout = g_furLayout;
+    // no LOD for the compact format: its strand attributes are indexed by strand
+    m_furLodLevels = (m_furFormat == FUR_FORMAT_COMPACT) ? 1 : FUR_LOD_LEVELS;
+    // no strands: no blocks and no buffers (zero-sized ones are invalid), the
+    // frames draw no fur
+    if (m_furStrands == 0)
+      return;
+    // what a storage descriptor is sure to address is 128 MB
+    VkDeviceSize maxStorage = std::min((VkDeviceSize)FUR_MAX_BUFFER_SIZE, (VkDeviceSize)nvk.m_gpu.properties.limits.maxStorageBufferRange);
+    size_t controlSize = (size_t)m_furStrands * sizeof(FurStrandControl);
+    if ((m_furFormat == FUR_FORMAT_PROCEDURAL) && (controlSize > maxStorage))
+    {
+      LOGW("Fur procedural strands bind a single buffer, too big here (%.2f MB, %.2f MB at most): full format\n",
+        controlSize / (1024.0 * 1024.0), maxStorage / (1024.0 * 1024.0));
+      m_furFormat = FUR_FORMAT_FULL;
+    }
+    if (m_furFormat == FUR_FORMAT_PROCEDURAL)
+    {
+      // only the strand roots: the vertex shader does the rest
+      std::vector<FurStrandControl> controls;
+      buildFurControl(controls, g_furParams);
+      // one instance per strand: the layout is the order of the instances
+      std::vector<uint32_t> strands;
+      furLayoutStrands(strands, g_furParams, 0, m_furLayout, g_furThreads);
+      if (!strands.empty())
+      {
+        std::vector<FurStrandControl> layoutControls(controls.size());
+        furPermuteStrands(&layoutControls[0], &controls[0], &strands[0], m_furStrands, 1);
+        controls.swap(layoutControls);
+      }
+      m_furCtrlBuffer.Sz = controls.size() * sizeof(FurStrandControl);
+      m_furCtrlBuffer.buffer = nvk.utCreateAndFillBuffer(&m_cmdPool, m_furCtrlBuffer.Sz, &(controls[0]), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, m_furCtrlBuffer.bufferMem);
+      NVK::DescriptorBufferInfo descBuffer = NVK::DescriptorBufferInfo(m_furCtrlBuffer.buffer, 0, m_furCtrlBuffer.Sz);
+      nvk.updateDescriptorSets(NVK::WriteDescriptorSet
+      (m_descriptorSetGlobal, BINDING_STRANDCTRL, 0, descBuffer, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER)
+      );
+      LOGI("Fur buffers: strand control data %.2f KB\n", m_furCtrlBuffer.Sz / 1024.0);
+      return;
+    }
+    // GLSL_fur_gen.comp binds whole buffers, the vertices being the biggest
+    size_t fullSize = furVerticesPerStrand(g_furParams.nsteps) * m_furStrands * sizeof(Vertex);
+    if ((m_furFormat == FUR_FORMAT_FULL) && (g_furGenerator == FUR_GEN_GPU) && (fullSize > maxStorage))
+      LOGW("Fur GPU generation writes a single buffer, too big here (%.2f MB, %.2f MB at most): streaming from the CPU\n",
+        fullSize / (1024.0 * 1024.0), maxStorage / (1024.0 * 1024.0));
+    else if ((m_furFormat == FUR_FORMAT_FULL) && (g_furGenerator == FUR_GEN_GPU))
+    {
+      // nothing built nor uploaded here: GLSL_fur_gen.comp fills the buffers at the next frame
+      size_t vertsPerStrand = furVerticesPerStrand(g_furParams.nsteps);
+      g_globalMatrices.furInfo = glm::ivec4((int)vertsPerStrand, g_furParams.nsteps, 0, 0);
+      m_furBlocks.resize(1);
+      FurBlock& block = m_furBlocks[0];
+      block.lod = 0;
+      block.nElmts = (GLuint)(furIndicesPerStrand(g_furParams.nsteps) * m_furStrands);
+      block.vertices.Sz = vertsPerStrand * m_furStrands * sizeof(Vertex);
+      block.vertices.buffer = nvk.utCreateAndFillBuffer(&m_cmdPool, block.vertices.Sz, NULL,
+        VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, block.vertices.bufferMem);
+      block.indices.Sz = block.nElmts * sizeof(uint32_t);
+      block.indices.buffer = nvk.utCreateAndFillBuffer(&m_cmdPool, block.indices.Sz, NULL,
+        VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, block.indices.bufferMem);
+      // only needed for the -v check; still must be bound
+      m_furRandomBuffer.Sz = (g_furValidate > 0.0f ? m_furStrands : 1) * FUR_RANDOM_PER_STRAND * sizeof(uint32_t);
+      m_furRandomBuffer.buffer = nvk.utCreateAndFillBuffer(&m_cmdPool, m_furRandomBuffer.Sz, NULL,
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, m_furRandomBuffer.bufferMem);
+      NVK::DescriptorBufferInfo descVertices = NVK::DescriptorBufferInfo(block.vertices.buffer, 0, block.vertices.Sz);
+      NVK::DescriptorBufferInfo descIndices = NVK::DescriptorBufferInfo(block.indices.buffer, 0, block.indices.Sz);
+      NVK::DescriptorBufferInfo descRandom = NVK::DescriptorBufferInfo(m_furRandomBuffer.buffer, 0, m_furRandomBuffer.Sz);
+      nvk.updateDescriptorSets(NVK::WriteDescriptorSet
+      (m_descriptorSetFurGen, BINDING_FURGEN_VERTICES, 0, descVertices, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER)
+      (m_descriptorSetFurGen, BINDING_FURGEN_INDICES, 0, descIndices, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER)
+      (m_descriptorSetFurGen, BINDING_FURGEN_RANDOM, 0, descRandom, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER)
+      );
+      LOGI("Fur buffers (GPU generation): vertices %.2f MB; indices %.2f MB\n",
+        block.vertices.Sz / (1024.0 * 1024.0), block.indices.Sz / (1024.0 * 1024.0));
+      m_furGenPending = true;
+      if (g_furValidate > 0.0f)
+        validateFurGen();
+      // the lower levels are small: they come from the CPU. Level 0 has no
+      // clusters: its indices are written in strand order, whatever the layout
+      for (int level = 1; level < FUR_LOD_LEVELS; level++)
+        streamFur(level);
+      initFurIndirect();
+      return;
+    }
+    else if (g_furGenerator == FUR_GEN_GPU)
+      LOGW("Fur GPU generation only builds the full vertex format: using the CPU\n");
+    g_globalMatrices.furInfo = glm::ivec4((int)furVerticesPerStrand(g_furParams.nsteps), g_furParams.nsteps, 0, 0);
+    if (m_furFormat == FUR_FORMAT_FULL)
+    {
+      for (int level = 0; level < FUR_LOD_LEVELS; level++)
+        streamFur(level);
+      initFurIndirect();
+      return;
+    }
+    // the compact format needs the bounds of the whole fur before quantizing: built in one go.
+    // Mapped from the cache file when possible: the uploads read it in place
+    FurGeometry geometry;
+    geometry.acquire(g_furParams, g_furThreads, g_furCacheDir);
+    m_furBlocks.resize(1);
+    FurBlock& block = m_furBlocks[0];
+    block.lod = 0;
+    block.nElmts = (GLuint)geometry.numIndices();
+    std::vector<VertexCompact> compact;
+    std::vector<FurStrandAttr> attribs;
+    FurBounds bounds;
+    buildFurCompact(geometry.vertices(), geometry.numVertices(), g_furParams, compact, attribs, bounds);
+    g_globalMatrices.furCenter = glm::vec4(bounds.center, 1.0f);
+    g_globalMatrices.furHalfExtent = glm::vec4(bounds.halfExtent, 0.0f);
+    // vertices and attributes go through the same permutation: GLSL_fur_compact.vert
+    // still finds the attributes of a vertex from its index
+    std::vector<uint32_t> strands;
+    furLayoutStrands(strands, g_furParams, 0, m_furLayout, g_furThreads);
+    if (!strands.empty())
+    {
+      std::vector<VertexCompact> layoutCompact(compact.size());
+      std::vector<FurStrandAttr> layoutAttribs(attribs.size());
+      furPermuteStrands(&layoutCompact[0], &compact[0], &strands[0], m_furStrands, furVerticesPerStrand(g_furParams.nsteps));
+      furPermuteStrands(&layoutAttribs[0], &attribs[0], &strands[0], m_furStrands, 1);
+      compact.swap(layoutCompact);
+      attribs.swap(layoutAttribs);
+    }
+    block.vertices.Sz = compact.size() * sizeof(VertexCompact);
+    block.vertices.buffer = nvk.utCreateAndFillBuffer(&m_cmdPool, block.vertices.Sz, &(compact[0]), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, block.vertices.bufferMem);
+    m_furAttrBuffer.Sz = attribs.size() * sizeof(FurStrandAttr);
+    m_furAttrBuffer.buffer = nvk.utCreateAndFillBuffer(&m_cmdPool, m_furAttrBuffer.Sz, &(attribs[0]), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, m_furAttrBuffer.bufferMem);
+    NVK::DescriptorBufferInfo descBuffer = NVK::DescriptorBufferInfo(m_furAttrBuffer.buffer, 0, m_furAttrBuffer.Sz);
+    nvk.updateDescriptorSets(NVK::WriteDescriptorSet
+    (m_descriptorSetGlobal, BINDING_STRANDATTR, 0, descBuffer, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER)
+    );
+    // the vertices are in layout order, only the indices are in cluster order
+    FurClusterBuilder clusterBuilder;
+    clusterBuilder.begin(g_furParams, 0, strands.empty() ? NULL : &strands[0], 0, m_furStrands);
+    if (strands.empty())
+      clusterBuilder.addVertices(geometry.vertices(), 0, m_furStrands);
+    else
+    {
+      for (int i = 0; i < m_furStrands; i++)
+        clusterBuilder.addVertices(geometry.vertices() + furVerticesPerStrand(g_furParams.nsteps) * strands[i], i, 1);
+    }
+    std::vector<uint32_t> indices(geometry.numIndices());
+    if (m_furStrands > 0)
+      buildFurClusterIndices(&indices[0], &clusterBuilder.order()[0], m_furStrands, g_furParams.nsteps);
+    clusterBuilder.end(block.clusters);
+    block.indices.Sz = indices.size() * sizeof(uint32_t);
+    block.indices.buffer = nvk.utCreateAndFillBuffer(&m_cmdPool, block.indices.Sz, &(indices[0]), VK_BUFFER_USAGE_INDEX_BUFFER_BIT, block.indices.bufferMem);
+    LOGI("Fur buffers: vertices %.2f MB; indices %.2f MB; strand attributes %.2f MB\n",
+      block.vertices.Sz / (1024.0 * 1024.0), block.indices.Sz / (1024.0 * 1024.0), m_furAttrBuffer.Sz / (1024.0 * 1024.0));
+    initFurIndirect();
+  }
+  //------------------------------------------------------------------------------
+  // room for the draws of all the clusters, in each of the m_numFrames
+  // command-buffer sets in flight. Blocks without clusters get one, for the
+  // pre-recorded scene command-buffer. Persistently mapped: furCullClusters()
+  // writes them in place.
+  // The GPU-driven path has its own draws, written on the device from a copy of
+  // the bounds: nothing per cluster goes through the CPU after this
+  //------------------------------------------------------------------------------
+  void RendererVk::initFurIndirect()
+  {
+    uint32_t numDraws = 0;
+    for (size_t i = 0; i < m_furBlocks.size(); i++)
+    {
+      m_furBlocks[i].drawOffset = numDraws;
+      numDraws += m_furBlocks[i].numDraws();
+    }
+    if (numDraws == 0)
+      return;
+    for (int i = 0; i < m_numFrames; i++)
+    {
+      m_furIndirect[i].Sz = numDraws * sizeof(FurDrawIndexed);
+      m_furIndirect[i].buffer = nvk.createBuffer(NVK::BufferCreateInfo(m_furIndirect[i].Sz, VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT));
+      m_furIndirect[i].bufferMem = nvk.utAllocMemAndBindBuffer(m_furIndirect[i].buffer, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+      m_furIndirectPtr[i] = (FurDrawIndexed*)nvk.mapMemory(m_furIndirect[i].bufferMem, 0, m_furIndirect[i].Sz, 0);
+    }
+    std::vector<FurClusterGPU> clusters(numDraws);
+    for (size_t i = 0; i < m_furBlocks.size(); i++)
+    {
+      const FurClusters& blockClusters = m_furBlocks[i].clusters;
+      for (uint32_t c = 0; c < blockClusters.size(); c++)
+      {
+        FurClusterGPU& cluster = clusters[m_furBlocks[i].drawOffset + c];
+        for (int k = 0; k < 3; k++)
+        {
+          cluster.center[k] = blockClusters.center[k][c];
+          cluster.extent[k] = blockClusters.extent[k][c];
+        }
+        cluster.firstIndex = blockClusters.baseIndex + blockClusters.firstIndex[c];
+        cluster.indexCount = blockClusters.indexCount[c];
+      }
+    }
+    m_furClusterBuffer.Sz = numDraws * sizeof(FurClusterGPU);
+    m_furClusterBuffer.buffer = nvk.utCreateAndFillBuffer(&m_cmdPool, m_furClusterBuffer.Sz, &clusters[0], VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, m_furClusterBuffer.bufferMem);
+    m_furCullDraws.Sz = numDraws * sizeof(FurDrawIndexed);
+    m_furCullDraws.buffer = nvk.utCreateAndFillBuffer(&m_cmdPool, m_furCullDraws.Sz, NULL,
+      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT, m_furCullDraws.bufferMem);
+    // initialization or updateFur(), which waits for the device: the set isn't in use
+    writeFurCullDescriptors();
+  }
+  //------------------------------------------------------------------------------
+  // FUR_FORMAT_FULL from the CPU: strands go through m_staging chunk by chunk,
+  // built (or read from the cache file) straight into the slot of their copy
+  // when it is cached memory, so the whole fur never sits in host memory.
+  // Chunk N+1 is built while chunk N is being copied. Blocks are filled one
+  // after the other: vertices in the order of m_furLayout, then the indices in
+  // cluster order, relative to the block. Levels > 0 are the LOD subsets,
+  // never cached: they are a fraction of level 0
+  //------------------------------------------------------------------------------
+  void RendererVk::streamFur(int level)
+  {
+    auto t0 = std::chrono::high_resolution_clock::now();
+    int nsteps = furLodSteps(g_furParams.nsteps, level);
+    size_t vertsPerStrand = furVerticesPerStrand(nsteps);
+    size_t idxPerStrand = furIndicesPerStrand(nsteps);
+    int strandsPerBlock = std::max(1, (int)(FUR_MAX_BUFFER_SIZE / (vertsPerStrand * sizeof(Vertex))));
+    int strandsPerChunk = std::max(1, (int)(m_staging.slotSize / (vertsPerStrand * sizeof(Vertex))));
+    int strandsPerIdxChunk = std::max(1, (int)(m_staging.slotSize / (idxPerStrand * sizeof(uint32_t))));
+    assert(vertsPerStrand * sizeof(Vertex) <= m_staging.slotSize);
+
+    // empty: plain strand order (level 0 in FUR_LAYOUT_RANDOM)
+    std::vector<uint32_t> strands;
+    furLayoutStrands(strands, g_furParams, level, m_furLayout, g_furThreads);
+    bool inOrder = (level == 0) && strands.empty();
+    int numStrands = inOrder ? m_furStrands : (int)strands.size();
+
+    FurCacheFile cache;
+    FurCacheWriter cacheWriter;
+    bool cached = false;
+    if ((level == 0) && !g_furCacheDir.empty())
+    {
+      std::string path = furCachePath(g_furCacheDir, g_furParams);
+      cached = cache.map(path, g_furParams);
+      // the file is written in strand ranges: not from another layout
+      if (!cached && inOrder)
+        cacheWriter.open(path, g_furParams);
+    }
+    std::vector<Vertex> chunk; // only when m_staging isn't cached
+    int numChunks = 0;
+    int numBlocks = 0;
+    for (int blockFirst = 0; blockFirst < numStrands; blockFirst += strandsPerBlock, numBlocks++)
+    {
+      int blockCount = std::min(strandsPerBlock, numStrands - blockFirst);
+      m_furBlocks.push_back(FurBlock());
+      FurBlock& block = m_furBlocks.back();
+      block.lod = level;
+      block.nElmts = (GLuint)(idxPerStrand * blockCount);
+      block.vertices.Sz = vertsPerStrand * blockCount * sizeof(Vertex);
+      block.vertices.buffer = nvk.utCreateAndFillBuffer(&m_cmdPool, block.vertices.Sz, NULL, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, block.vertices.bufferMem);
+      block.indices.Sz = block.nElmts * sizeof(uint32_t);
+      block.indices.buffer = nvk.utCreateAndFillBuffer(&m_cmdPool, block.indices.Sz, NULL, VK_BUFFER_USAGE_INDEX_BUFFER_BIT, block.indices.bufferMem);
+      FurClusterBuilder clusterBuilder;
+      clusterBuilder.begin(g_furParams, level, inOrder ? NULL : &strands[blockFirst], blockFirst, blockCount);
+      for (int first = blockFirst; first < blockFirst + blockCount; first += strandsPerChunk, numChunks++)
+      {
+        int count = std::min(strandsPerChunk, blockFirst + blockCount - first);
+        StagingRing::Slot& slot = m_staging.acquire();
+        size_t vertSize = vertsPerStrand * count * sizeof(Vertex);
+        const Vertex* vertices;
+        if (cached && inOrder)
+        {
+          vertices = cache.vertices() + vertsPerStrand * first;
+          memcpy(slot.ptr, vertices, vertSize);
+        }
+        else
+        {
+          Vertex* dst = (Vertex*)slot.ptr;
+          if (!m_staging.cached)
+          {
+            chunk.resize(vertsPerStrand * count);
+            dst = &chunk[0];
+          }
+          if (cached)
+            furPermuteStrands(dst, cache.vertices(), &strands[first], count, vertsPerStrand);
+          else if (!inOrder)
+            buildFurLod(dst, g_furParams, level, &strands[first], count, g_furThreads);
+          else
+          {
+            buildFur(dst, g_furParams, first, count, g_furThreads);
+            cacheWriter.write(first, count, dst);
+          }
+          if (dst != slot.ptr)
+            memcpy(slot.ptr, dst, vertSize);
+          vertices = dst;
+        }
+        clusterBuilder.addVertices(vertices, first - blockFirst, count);
+
+        VkBufferCopy region = { 0, vertsPerStrand * (first - blockFirst) * sizeof(Vertex), vertSize };
+        vkCmdCopyBuffer(slot.cmd, slot.buffer.buffer, block.vertices.buffer, 1, &region);
+        m_staging.submit(slot);
+      }
+      const std::vector<uint32_t>& order = clusterBuilder.order();
+      for (int first = 0; first < blockCount; first += strandsPerIdxChunk, numChunks++)
+      {
+        int count = std::min(strandsPerIdxChunk, blockCount - first);
+        StagingRing::Slot& slot = m_staging.acquire();
+        buildFurClusterIndices((uint32_t*)slot.ptr, &order[first], count, nsteps);
+        VkBufferCopy region = { 0, idxPerStrand * first * sizeof(uint32_t), idxPerStrand * count * sizeof(uint32_t) };
+        vkCmdCopyBuffer(slot.cmd, slot.buffer.buffer, block.indices.buffer, 1, &region);
+        m_staging.submit(slot);
+      }
+      clusterBuilder.end(block.clusters);
+    }
+    m_staging.flush();
+    if (cacheWriter.isOpen())
+      cacheWriter.close();
+
+    auto t1 = std::chrono::high_resolution_clock::now();
+    LOGI("Fur LOD %d: %d strands, %d steps %s in %.2f ms: %d chunks, %d blocks (%.2f MB of vertices)\n", level, numStrands, nsteps,
+      cached ? "streamed from the cache" : "built and streamed", std::chrono::duration<double, std::milli>(t1 - t0).count(),
+      numChunks, numBlocks, vertsPerStrand * numStrands * sizeof(Vertex) / (1024.0 * 1024.0));
+  }
+  void RendererVk::deleteFur()
+  {
+    for (size_t i = 0; i < m_furBlocks.size(); i++)
+    {
+      m_furBlocks[i].vertices.release();
+      m_furBlocks[i].indices.release();
+    }
+    m_furBlocks.clear();
+    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
+    {
+      if (m_furIndirect[i].bufferMem)
+        nvk.unmapMemory(m_furIndirect[i].bufferMem);
+      m_furIndirect[i].release();
+      m_furIndirectPtr[i] = NULL;
+    }
+    m_furClusterBuffer.release();
+    m_furCullDraws.release();
+    m_furAttrBuffer.release();
+    m_furCtrlBuffer.release();
+    m_furRandomBuffer.release();
+    m_furGenPending = false;
+  }
+  //------------------------------------------------------------------------------
+  // records GLSL_fur_gen.comp. The buffers are fresh from initFur(): nothing to
+  // wait for before, but vertex input and copies must wait after
+  //------------------------------------------------------------------------------
+  void RendererVk::cmdFurGen(VkCommandBuffer cmd, bool writeRandom)
+  {
+    FurGenParams params = { g_furParams.seed, (uint32_t)m_furStrands, (uint32_t)g_furParams.nsteps, writeRandom ? 1u : 0u, g_furParams.radius };
+    vkCmdUpdateBuffer(cmd, m_furGenParams.buffer, 0, sizeof(params), (uint32_t*)&params);
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, NULL,
+      1, NVK::BufferMemoryBarrier(VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_UNIFORM_READ_BIT,
+        VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, m_furGenParams.buffer, 0, VK_WHOLE_SIZE), 0, NULL);
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipelineFurGen);
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipelineLayoutFurGen, 0, 1, &m_descriptorSetFurGen, 0, NULL);
+    vkCmdDispatch(cmd, (m_furStrands + 63) / 64, 1, 1); // local_size_x = 64
+    NVK::BufferMemoryBarrier barriers(VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_TRANSFER_READ_BIT,
+      VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, m_furBlocks[0].vertices.buffer, 0, VK_WHOLE_SIZE);
+    barriers(VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_INDEX_READ_BIT | VK_ACCESS_TRANSFER_READ_BIT,
+      VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, m_furBlocks[0].indices.buffer, 0, VK_WHOLE_SIZE);
+    barriers(VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT,
+      VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, m_furRandomBuffer.buffer, 0, VK_WHOLE_SIZE);
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL,
+      3, barriers, 0, NULL);
+  }
+  //------------------------------------------------------------------------------
+  // -v : runs GLSL_fur_gen.comp right away, reads everything back and compares
+  // with the CPU. Synchronous, but only done once
+  //------------------------------------------------------------------------------
+  void RendererVk::validateFurGen()
+  {
+    const FurBlock& block = m_furBlocks[0];
+    BufO readback;
+    readback.Sz = m_furRandomBuffer.Sz + block.vertices.Sz + block.indices.Sz;
+    readback.buffer = nvk.createBuffer(NVK::BufferCreateInfo(readback.Sz, VK_BUFFER_USAGE_TRANSFER_DST_BIT));
+    readback.bufferMem = nvk.utAllocMemAndBindBuffer(readback.buffer, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+
+    NVK::CommandBuffer cmd(m_cmdPool.utRequestCmdBuffer(true));
+    cmd.beginCommandBuffer(true);
+    {
+      cmdFurGen(cmd.m_cmdbuffer, true);
+      VkBufferCopy region = { 0, 0, m_furRandomBuffer.Sz };
+      vkCmdCopyBuffer(cmd.m_cmdbuffer, m_furRandomBuffer.buffer, readback.buffer, 1, &region);
+      region.dstOffset += region.size;
+      region.size = block.vertices.Sz;
+      vkCmdCopyBuffer(cmd.m_cmdbuffer, block.vertices.buffer, readback.buffer, 1, &region);
+      region.dstOffset += region.size;
+      region.size = block.indices.Sz;
+      vkCmdCopyBuffer(cmd.m_cmdbuffer, block.indices.buffer, readback.buffer, 1, &region);
+      vkCmdPipelineBarrier(cmd.m_cmdbuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 0, NULL,
+        1, NVK::BufferMemoryBarrier(VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_HOST_READ_BIT,
+          VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, readback.buffer, 0, VK_WHOLE_SIZE), 0, NULL);
+    }
+    cmd.endCommandBuffer();
+    VkFence fence = nvk.createFence();
+    nvk.queueSubmit(NVK::SubmitInfo(0, NULL, NULL, 1, &cmd.m_cmdbuffer, 0, NULL), fence);
+    while (nvk.waitForFences(1, &fence, VK_TRUE, 100000000) == false)
+      LOGW(">>>>>> TIMEOUT ON WAIT FENCE\n");
+    nvk.destroyFence(fence);
+    m_cmdPool.utFreeCommandBuffer(cmd);
+    m_furGenPending = false;
+
+    const char* ptr = (const char*)nvk.mapMemory(readback.bufferMem, 0, readback.Sz, 0);
+    if (!furValidateGenerated(g_furParams, (const uint32_t*)ptr, (const Vertex*)(ptr + m_furRandomBuffer.Sz),
+      (const uint32_t*)(ptr + m_furRandomBuffer.Sz + block.vertices.Sz), g_furValidate))
+      LOGE("Fur GPU generation validation failed\n");
+    nvk.unmapMemory(readback.bufferMem);
+    readback.release();
+  }
+  //------------------------------------------------------------------------------
+  // hierarchical-Z of the render-target: level 0 is half the depth-buffer, each
+  // level has the farthest depth of the 2x2 texels of the previous one
+  //------------------------------------------------------------------------------
+  void RendererVk::initHiZ()
+  {
+    deleteHiZ();
+    m_hizValid = false;
+    m_hizUndefined = true;
+    int w = std::max(1, m_nvFBOBox.getBufferWidth() / 2);
+    int h = std::max(1, m_nvFBOBox.getBufferHeight() / 2);
+    m_hizLevels = 1;
+    while ((w >> m_hizLevels) || (h >> m_hizLevels))
+      m_hizLevels++;
+    m_hiz = nvk.utCreateStorageImage2D(w, h, m_hizMem, VK_FORMAT_R32_SFLOAT, m_hizLevels);
+    m_hizView = nvk.createImageView(NVK::ImageViewCreateInfo(
+      m_hiz, VK_IMAGE_VIEW_TYPE_2D, VK_FORMAT_R32_SFLOAT, NVK::ComponentMapping(),
+      NVK::ImageSubresourceRange(VK_IMAGE_ASPECT_COLOR_BIT, 0, m_hizLevels)));
+    //
+    // the frames in flight still read the previous sets: the new ones come
+    // from a new pool, m_descriptorSetFurCull included
+    //
+    m_descPoolHiZ = nvk.createDescriptorPool(NVK::DescriptorPoolCreateInfo(
+      m_hizLevels + 1, NVK::DescriptorPoolSize(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, m_hizLevels + 1)
+      (VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, m_hizLevels)
+      (VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1)
+      (VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 3))
+    );
+    nvk.allocateDescriptorSets(NVK::DescriptorSetAllocateInfo
+    (m_descPoolHiZ, 1, &m_descriptorSetLayoutFurCull),
+      &m_descriptorSetFurCull);
+    writeFurCullDescriptors();
+    VkImageView depthView = m_nvFBOBox.getDepthSampleView();
+    if (depthView == NULL)
+    {
+      LOGW("The depth-buffer can't be sampled: no occlusion culling of the fur\n");
+      return;
+    }
+    m_hizLevelViews.resize(m_hizLevels);
+    m_descriptorSetsHiZ.resize(m_hizLevels);
+    for (int l = 0; l < m_hizLevels; l++)
+    {
+      m_hizLevelViews[l] = nvk.createImageView(NVK::ImageViewCreateInfo(
+        m_hiz, VK_IMAGE_VIEW_TYPE_2D, VK_FORMAT_R32_SFLOAT, NVK::ComponentMapping(),
+        NVK::ImageSubresourceRange(VK_IMAGE_ASPECT_COLOR_BIT, l, 1)));
+      nvk.allocateDescriptorSets(NVK::DescriptorSetAllocateInfo
+      (m_descPoolHiZ, 1, &m_descriptorSetLayoutHiZ),
+        &m_descriptorSetsHiZ[l]);
+      // level 0 reads the depth-buffer, the others the previous level
+      NVK::DescriptorImageInfo descSrc = (l == 0) ? NVK::DescriptorImageInfo(m_samplerNearest, depthView, VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL)
+        : NVK::DescriptorImageInfo(m_samplerNearest, m_hizLevelViews[l - 1], VK_IMAGE_LAYOUT_GENERAL);
+      NVK::DescriptorImageInfo descDst(NULL, m_hizLevelViews[l], VK_IMAGE_LAYOUT_GENERAL);
+      nvk.updateDescriptorSets(NVK::WriteDescriptorSet
+      (m_descriptorSetsHiZ[l], BINDING_HIZ_SRC, 0, descSrc, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER)
+      (m_descriptorSetsHiZ[l], BINDING_HIZ_DST, 0, descDst, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE)
+      );
+    }
+  }
+  //------------------------------------------------------------------------------
+  // the frames in flight may still build and read the HiZ: retired
+  //------------------------------------------------------------------------------
+  void RendererVk::deleteHiZ()
+  {
+    for (size_t l = 0; l < m_hizLevelViews.size(); l++)
+      nvk.utRetire(VK_OBJECT_TYPE_IMAGE_VIEW, (uint64_t)m_hizLevelViews[l]);
+    m_hizLevelViews.clear();
+    m_descriptorSetsHiZ.clear();
+    if (m_descPoolHiZ)
+      nvk.utRetire(VK_OBJECT_TYPE_DESCRIPTOR_POOL, (uint64_t)m_descPoolHiZ);
+    m_descPoolHiZ = NULL;
+    m_descriptorSetFurCull = NULL;
+    if (m_hizView)
+      nvk.utRetire(VK_OBJECT_TYPE_IMAGE_VIEW, (uint64_t)m_hizView);
+    m_hizView = NULL;
+    if (m_hiz)
+      nvk.utRetire(VK_OBJECT_TYPE_IMAGE, (uint64_t)m_hiz);
+    m_hiz = NULL;
+    if (m_hizMem)
+      nvk.utRetire(m_hizMem);
+    m_hizMem = NULL;
+    m_hizLevels = 0;
+    m_hizValid = false;
+  }
+  //------------------------------------------------------------------------------
+  // records the GPU-driven culling of the clusters [firstCluster, firstCluster +
+  // numClusters): the HiZ is made from what the depth-buffer still holds of the
+  // previous frame, then GLSL_fur_cull.comp writes the draws and the counters.
+  // Everything stays in this command-buffer, before the render-pass clears the
+  // depth. The counters are copied to m_furCullReadback[m_cmdSceneIdx]
+  //------------------------------------------------------------------------------
+  void RendererVk::cmdFurCull(VkCommandBuffer cmd, uint32_t firstCluster, uint32_t numClusters, const glm::mat4& viewProj, const glm::vec4 planes[6])
+  {
+    bool occlusion = g_furOcclusion && m_hizValid && !m_descriptorSetsHiZ.empty();
+    VkImage depthImage = m_nvFBOBox.getDepthImage();
+    FurCullParams params;
+    for (int i = 0; i < 6; i++)
+      params.planes[i] = planes[i];
+    params.prevViewProj = m_prevViewProj;
+    params.info = glm::uvec4(firstCluster, numClusters, occlusion ? 1u : 0u, (uint32_t)m_hizLevels);
+    params.hizSize = glm::vec4((float)m_nvFBOBox.getBufferWidth(), (float)m_nvFBOBox.getBufferHeight(), 0.0f, 0.0f);
+    // the previous frame may still read the draws, the parameters and the counters
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+      VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, NULL, 0, NULL, 0, NULL);
+    vkCmdUpdateBuffer(cmd, m_furCullParams.buffer, 0, sizeof(params), (uint32_t*)&params);
+    vkCmdFillBuffer(cmd, m_furCullStats.buffer, 0, VK_WHOLE_SIZE, 0);
+    NVK::BufferMemoryBarrier bufBarriers(VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_UNIFORM_READ_BIT,
+      VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, m_furCullParams.buffer, 0, VK_WHOLE_SIZE);
+    bufBarriers(VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+      VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, m_furCullStats.buffer, 0, VK_WHOLE_SIZE);
+    NVK::ImageMemoryBarrier imgBarriers(VK_ACCESS_SHADER_READ_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+      m_hizUndefined ? VK_IMAGE_LAYOUT_UNDEFINED : VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_GENERAL,
+      VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, m_hiz, NVK::ImageSubresourceRange(VK_IMAGE_ASPECT_COLOR_BIT, 0, m_hizLevels));
+    if (occlusion)
+      imgBarriers(VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT,
+        VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL,
+        VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, depthImage, NVK::ImageSubresourceRange(VK_IMAGE_ASPECT_DEPTH_BIT | VK_IMAGE_ASPECT_STENCIL_BIT));
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+      VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, NULL, 2, bufBarriers, imgBarriers.size(), imgBarriers);
+    m_hizUndefined = false;
+    if (occlusion)
+    {
+      VkMemoryBarrier levelBarrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER, NULL, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT };
+      int w = m_nvFBOBox.getBufferWidth();
+      int h = m_nvFBOBox.getBufferHeight();
+      for (int l = 0; l < m_hizLevels; l++)
+      {
+        w = std::max(1, w / 2);
+        h = std::max(1, h / 2);
+        vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, ((l == 0) && (m_MSAA > 1)) ? m_pipelineHiZMs : m_pipelineHiZ);
+        vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipelineLayoutHiZ, 0, 1, &m_descriptorSetsHiZ[l], 0, NULL);
+        vkCmdDispatch(cmd, (w + 7) / 8, (h + 7) / 8, 1); // local_size = 8 x 8
+        vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &levelBarrier, 0, NULL, 0, NULL);
+      }
+    }
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipelineFurCull);
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipelineLayoutFurCull, 0, 1, &m_descriptorSetFurCull, 0, NULL);
+    vkCmdDispatch(cmd, (numClusters + 63) / 64, 1, 1); // local_size_x = 64
+    // draws to the indirect draw calls, counters to the copy. The depth goes
+    // back to the render-pass once nothing reads it
+    NVK::BufferMemoryBarrier outBarriers(VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_INDIRECT_COMMAND_READ_BIT,
+      VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, m_furCullDraws.buffer, 0, VK_WHOLE_SIZE);
+    outBarriers(VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT,
+      VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, m_furCullStats.buffer, 0, VK_WHOLE_SIZE);
+    if (occlusion)
+    {
+      NVK::ImageMemoryBarrier depthBarrier(0, VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+        VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+        VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, depthImage, NVK::ImageSubresourceRange(VK_IMAGE_ASPECT_DEPTH_BIT | VK_IMAGE_ASPECT_STENCIL_BIT));
+      vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+        VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT, 0, 0, NULL,
+        2, outBarriers, 1, depthBarrier);
+    }
+    else
+      vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL,
+        2, outBarriers, 0, NULL);
+    VkBufferCopy region = { 0, 0, sizeof(FurCullStats) };
+    vkCmdCopyBuffer(cmd, m_furCullStats.buffer, m_furCullReadback[m_cmdSceneIdx].buffer, 1, &region);
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 0, NULL,
+      1, NVK::BufferMemoryBarrier(VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_HOST_READ_BIT,
+        VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, m_furCullReadback[m_cmdSceneIdx].buffer, 0, VK_WHOLE_SIZE), 0, NULL);
+    m_furCullPending[m_cmdSceneIdx] = true;
+  }
+  //------------------------------------------------------------------------------
+  // without culling nor sorting, a block is drawn whole, in a single draw
+  //------------------------------------------------------------------------------
+  static bool furBlockWhole(const FurBlock& block)
+  {
+    return (!g_furCulling && !g_furSortClusters) || (block.clusters.size() == 0);
+  }
+  //------------------------------------------------------------------------------
+  // culls (and sorts) the clusters of blocks on m_workers, each into its own
+  // range of draws, at their drawOffset. numDraws[k]: what blocks[k] got.
+  // The counters of the CPU culling are of these blocks
+  //------------------------------------------------------------------------------
+  void RendererVk::cullFurBlocks(FurBlock* const* blocks, int numBlocks, FurDrawIndexed* draws, const glm::vec4 planes[6], const glm::vec3& eye,
+    uint32_t* numDraws)
+  {
+    std::vector<uint32_t> visible(numBlocks);
+    // the workers already take the cores
+    int sortThreads = (g_vkRecordThreads > 1) ? 1 : g_furThreads;
+    if (m_workers.size() != g_vkRecordThreads)
+      m_workers.init(g_vkRecordThreads);
+    m_workers.run(numBlocks, [&](int k) {
+      FurBlock& block = *blocks[k];
+      const uint32_t* order = NULL;
+      if (g_furSortClusters)
+      {
+        block.sorter.update(block.clusters, eye, FUR_SORT_THRESHOLD, sortThreads);
+        order = block.sorter.order();
+      }
+      numDraws[k] = furCullClusters(draws + block.drawOffset, block.clusters, g_furCulling ? planes : NULL, visible[k], order);
+    });
+    g_furClusters = 0;
+    g_furClustersVisible = 0;
+    g_furClustersOccluded = 0;
+    for (int k = 0; k < numBlocks; k++)
+    {
+      g_furClusters += blocks[k]->clusters.size();
+      g_furClustersVisible += visible[k];
+    }
+  }
+  //------------------------------------------------------------------------------
+  // the draws of the pre-recorded scene, in m_furIndirect[m_cmdSceneIdx]: every
+  // block has all its room drawn, what isn't used gets no index. The blocks of
+  // the other levels draw nothing
+  //------------------------------------------------------------------------------
+  void RendererVk::writeFurDraws(int lod, const glm::vec4 planes[6], const glm::vec3& eye)
+  {
+    FurDrawIndexed* draws = m_furIndirectPtr[m_cmdSceneIdx];
+    std::vector<FurBlock*> culled;
+    for (size_t i = 0; i < m_furBlocks.size(); i++)
+    {
+      FurBlock& block = m_furBlocks[i];
+      FurDrawIndexed* blockDraws = draws + block.drawOffset;
+      uint32_t numDraws = 0;
+      if ((block.lod == lod) && furBlockWhole(block))
+      {
+        FurDrawIndexed whole = { block.nElmts, 1, 0, 0, 0 };
+        blockDraws[0] = whole;
+        numDraws = 1;
+      }
+      else if (block.lod == lod)
+      {
+        culled.push_back(&block);
+        continue;
+      }
+      memset(blockDraws + numDraws, 0, (block.numDraws() - numDraws) * sizeof(FurDrawIndexed));
+    }
+    std::vector<uint32_t> numDraws(culled.size());
+    cullFurBlocks(culled.data(), (int)culled.size(), draws, planes, eye, numDraws.data());
+    for (size_t k = 0; k < culled.size(); k++)
+    {
+      FurBlock& block = *culled[k];
+      memset(draws + block.drawOffset + numDraws[k], 0, (block.numDraws() - numDraws[k]) * sizeof(FurDrawIndexed));
+    }
+  }
+  //------------------------------------------------------------------------------
+  // the draws of the level lod in m_furSpans, one span per block. Unless
+  // gpuCulling, the blocks are culled (and sorted) on the CPU, see
+  // cullFurBlocks()
+  //------------------------------------------------------------------------------
+  void RendererVk::gatherFurDraws(int lod, bool gpuCulling, const glm::vec4 planes[6], const glm::vec3& eye)
+  {
+    std::vector<int> culled;
+    m_furSpans.clear();
+    for (size_t i = 0; i < m_furBlocks.size(); i++)
+    {
+      FurBlock& block = m_furBlocks[i];
+      if (block.lod != lod)
+        continue;
+      FurDrawSpan span = { &block, NULL, block.drawOffset, 1 };
+      if (furBlockWhole(block))
+      {
+        // the whole block in one draw
+        m_furSpans.push_back(span);
+        continue;
+      }
+      if (gpuCulling)
+      {
+        // one draw per cluster, culled ones have no instance. Written
+        // in place by the device: always in cluster order
+        span.indirect = m_furCullDraws.buffer;
+        span.count = block.clusters.size();
+      }
+      else
+      {
+        span.indirect = m_furIndirect[m_cmdSceneIdx].buffer;
+        culled.push_back((int)m_furSpans.size());
+      }
+      m_furSpans.push_back(span);
+    }
+    // the counters of the GPU culling come with its readback
+    if (gpuCulling)
+      return;
+    std::vector<FurBlock*> blocks(culled.size());
+    std::vector<uint32_t> numDraws(culled.size());
+    for (size_t k = 0; k < culled.size(); k++)
+      blocks[k] = m_furSpans[culled[k]].block;
+    cullFurBlocks(blocks.data(), (int)blocks.size(), m_furIndirectPtr[m_cmdSceneIdx], planes, eye, numDraws.data());
+    for (size_t k = 0; k < culled.size(); k++)
+      m_furSpans[culled[k]].count = numDraws[k];
+  }
+  }
+  //------------------------------------------------------------------------------
+  // what the draws of the scene need: secondary command-buffers inherit none of it
+  //------------------------------------------------------------------------------
+  void RendererVk::cmdFurState(NVK::CommandBuffer cmd, const FrameOffsets& offsets, float w, float h)
+  {
+    vkCmdSetViewport(cmd, 0, 1, NVK::Viewport(0.0, 0.0, w, h, 0.0f, 1.0f));
+    vkCmdSetScissor(cmd, 0, 1, NVK::Rect2D(0.0, 0.0, w, h));
+    uint32_t objectOffsets[2] = { offsets.object, offsets.object };
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineLayout, DSET_GLOBAL, 1, &m_descriptorSetGlobal, 1, &offsets.matrix);
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineLayout, DSET_OBJECT, 1, &m_descriptorSetObject, 2, objectOffsets);
+  }
+  //------------------------------------------------------------------------------
+  // m_pipelinefur must be bound
+  //------------------------------------------------------------------------------
+  void RendererVk::cmdDrawFurSpans(NVK::CommandBuffer cmd, const FurDrawSpan* spans, int numSpans)
+  {
+    // multiDrawIndirect is enabled whenever supported (NVK::utInitialize)
+    bool multiDraw = nvk.m_gpu.features2.features.multiDrawIndirect ? true : false;
+    const FurBlock* bound = NULL;
+    for (int s = 0; s < numSpans; s++)
+    {
+      const FurDrawSpan& span = spans[s];
+      if (span.block != bound)
+      {
+        VkDeviceSize vboffsets[1] = { 0 };
+        vkCmdBindVertexBuffers(cmd, 0, 1, &span.block->vertices.buffer, vboffsets);
+        vkCmdBindIndexBuffer(cmd, span.block->indices.buffer, 0, VK_INDEX_TYPE_UINT32);
+        bound = span.block;
+      }
+      if (!span.indirect)
+      {
+        vkCmdDrawIndexed(cmd, span.block->nElmts, 1, 0, 0, 0);
+        continue;
+      }
+      VkDeviceSize offset = span.first * sizeof(FurDrawIndexed);
+      if (multiDraw)
+        cmd.cmdDrawIndexedIndirect(span.indirect, offset, span.count, sizeof(FurDrawIndexed));
+      else
+      {
+        for (uint32_t d = 0; d < span.count; d++)
+          cmd.cmdDrawIndexedIndirect(span.indirect, offset + d * sizeof(FurDrawIndexed), 1, sizeof(FurDrawIndexed));
+      }
+    }
+  }
+  //------------------------------------------------------------------------------
+  // m_furSpans cut in workers runs of about as many draws, each recorded by a
+  // thread in m_recordCmd[m_cmdSceneIdx][worker]. inheritStats: the fragment
+  // query of the primary command-buffer is active while they execute
+  //------------------------------------------------------------------------------
+  void RendererVk::recordFurParallel(int workers, const FrameOffsets& offsets, bool inheritStats)
+  {
+    uint32_t total = 0;
+    for (size_t i = 0; i < m_furSpans.size(); i++)
+      total += m_furSpans[i].count;
+    uint32_t perWorker = std::max(1u, (total + workers - 1) / workers);
+    std::vector<FurDrawSpan> spans;
+    int first[MAX_RECORD_THREADS + 1];
+    int t = 0;
+    uint32_t room = perWorker;
+    first[0] = 0;
+    for (size_t i = 0; i < m_furSpans.size(); i++)
+    {
+      FurDrawSpan rest = m_furSpans[i];
+      do
+      {
+        if ((room == 0) && (t < workers - 1))
+        {
+          first[++t] = (int)spans.size();
+          room = perWorker;
+        }
+        FurDrawSpan piece = rest;
+        // the last worker takes what remains
+        if (rest.indirect && (t < workers - 1))
+          piece.count = std::min(rest.count, room);
+        spans.push_back(piece);
+        room -= std::min(piece.count, room);
+        rest.first += piece.count;
+        rest.count -= piece.count;
+      } while (rest.count > 0);
+    }
+    for (int k = t + 1; k <= workers; k++)
+      first[k] = (int)spans.size();
+
+    float w = (float)m_nvFBOBox.getBufferWidth();
+    float h = (float)m_nvFBOBox.getBufferHeight();
+    NVK::CommandBufferInheritanceInfo inheritance(m_nvFBOBox.getScenePass(), 0, m_nvFBOBox.getFramebuffer(), VK_FALSE, 0,
+      inheritStats ? VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT : 0);
+    int idx = m_cmdSceneIdx;
+    // the profiler isn't thread-safe: each run times itself, the averages are
+    // published below, once they are all done
+    double ms[MAX_RECORD_THREADS];
+    if (m_workers.size() != g_vkRecordThreads)
+      m_workers.init(g_vkRecordThreads);
+    m_workers.run(workers, [&](int k) {
+      auto t0 = std::chrono::high_resolution_clock::now();
+      NVK::CommandBuffer cmd = m_recordCmd[idx][k];
+      // its previous recording is behind the fence of idx
+      VkCommandBufferBeginInfo beginInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
+      beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT | VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+      beginInfo.pInheritanceInfo = inheritance;
+      vkBeginCommandBuffer(cmd, &beginInfo);
+      cmdFurState(cmd, offsets, w, h);
+      vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelinefur);
+      cmdDrawFurSpans(cmd, spans.data() + first[k], first[k + 1] - first[k]);
+      vkEndCommandBuffer(cmd);
+      auto t1 = std::chrono::high_resolution_clock::now();
+      ms[k] = std::chrono::duration<double, std::milli>(t1 - t0).count();
+    });
+    if (workers != m_recordWorkers)
+    {
+      m_recordWorkers = workers;
+      m_recordFrames = 0;
+      for (int k = 0; k < MAX_RECORD_THREADS; k++)
+        m_recordMs[k] = 0.0;
+    }
+    for (int k = 0; k < workers; k++)
+      m_recordMs[k] += ms[k];
+    if (++m_recordFrames == FRAME_STATS_WINDOW)
+    {
+      for (int k = 0; k < MAX_RECORD_THREADS; k++)
+      {
+        g_vkRecordMs[k] = (float)(m_recordMs[k] / m_recordFrames);
+        m_recordMs[k] = 0.0;
+      }
+      m_recordFrames = 0;
+    }
+  }
+  //------------------------------------------------------------------------------
+  // -M : what the command-buffers of a frame cost the CPU, from the request to
+  // the recycling, with the tracked pool (a set lookup and a free for each) and
+  // with a frame-scoped one (a single reset). Nothing is submitted
+  //------------------------------------------------------------------------------
+  #define POOL_BENCHMARK_CMDS 16 // command-buffers per frame
+  void RendererVk::benchmarkCmdPools(int frames)
+  {
+    VkCommandPoolCreateInfo cmdPoolInfo = { VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO };
+    cmdPoolInfo.queueFamilyIndex = 0;
+    for (int mode = 0; mode < 2; mode++)
+    {
+      bool frameScoped = mode == 1;
+      cmdPoolInfo.flags = frameScoped ? VK_COMMAND_POOL_CREATE_TRANSIENT_BIT : VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+      NVK::CommandPool pool;
+      nvk.createCommandPool(&cmdPoolInfo, NULL, &pool);
+      pool.utSetFrameScoped(frameScoped);
+      VkCommandBuffer cmds[POOL_BENCHMARK_CMDS];
+      double allocMs = 0.0;
+      double recordMs = 0.0;
+      double recycleMs = 0.0;
+      for (int f = 0; f < frames; f++)
+      {
+        auto t0 = std::chrono::high_resolution_clock::now();
+        for (int c = 0; c < POOL_BENCHMARK_CMDS; c++)
+          cmds[c] = pool.utRequestCmdBuffer(true);
+        auto t1 = std::chrono::high_resolution_clock::now();
+        for (int c = 0; c < POOL_BENCHMARK_CMDS; c++)
+        {
+          NVK::CommandBuffer cmd = cmds[c];
+          cmd.beginCommandBuffer(true);
+          vkCmdSetViewport(cmd, 0, 1, NVK::Viewport(0.0, 0.0, 16.0f, 16.0f, 0.0f, 1.0f));
+          vkCmdSetScissor(cmd, 0, 1, NVK::Rect2D(0.0, 0.0, 16.0f, 16.0f));
+          vkEndCommandBuffer(cmd);
+        }
+        auto t2 = std::chrono::high_resolution_clock::now();
+        if (frameScoped)
+          pool.utRecycle();
+        else
+          pool.utFreeCommandBuffers(cmds, POOL_BENCHMARK_CMDS);
+        auto t3 = std::chrono::high_resolution_clock::now();
+        allocMs += std::chrono::duration<double, std::milli>(t1 - t0).count();
+        recordMs += std::chrono::duration<double, std::milli>(t2 - t1).count();
+        recycleMs += std::chrono::duration<double, std::milli>(t3 - t2).count();
+      }
+      LOGI("Command pool (%s): %d command-buffers per frame; allocate %.2f us, record %.2f us, recycle %.2f us, total %.2f us\n",
+        frameScoped ? "frame-scoped" : "tracked", POOL_BENCHMARK_CMDS, allocMs * 1000.0 / frames, recordMs * 1000.0 / frames,
+        recycleMs * 1000.0 / frames, (allocMs + recordMs + recycleMs) * 1000.0 / frames);
+      pool.destroyCommandPool();
+    }
+  }
+  //------------------------------------------------------------------------------
+  // BINDING_MATRIX, BINDING_MATRIXOBJ and BINDING_MATERIAL all point in
+  // m_uniforms, at the dynamic offsets of the draws
+  //------------------------------------------------------------------------------
+  void RendererVk::writeUniformDescriptors()
+  {
+    NVK::DescriptorBufferInfo descMatrix = NVK::DescriptorBufferInfo(m_uniforms.buffer.buffer, 0, sizeof(MatrixBufferGlobal));
+    NVK::DescriptorBufferInfo descObject = NVK::DescriptorBufferInfo(m_uniforms.buffer.buffer, 0, sizeof(MatrixBufferObject));
+    // no material yet: it only has to be valid
+    NVK::DescriptorBufferInfo descMaterial = NVK::DescriptorBufferInfo(m_uniforms.buffer.buffer, 0, sizeof(MatrixBufferObject));
+    nvk.updateDescriptorSets(NVK::WriteDescriptorSet
+    (m_descriptorSetGlobal, BINDING_MATRIX, 0, descMatrix, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC)
+    (m_descriptorSetObject, BINDING_MATRIXOBJ, 0, descObject, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC)
+    (m_descriptorSetObject, BINDING_MATERIAL, 0, descMaterial, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC)
+    );
+  }
+  //------------------------------------------------------------------------------
+  // what m_descriptorSetFurCull reads: the clusters and the draws once the fur
+  // has some, m_hiz once initHiZ() made it
+  //------------------------------------------------------------------------------
+  void RendererVk::writeFurCullDescriptors()
+  {
+    if (!m_descriptorSetFurCull)
+      return;
+    NVK::DescriptorBufferInfo descCullParams = NVK::DescriptorBufferInfo(m_furCullParams.buffer, 0, m_furCullParams.Sz);
+    NVK::DescriptorBufferInfo descCullStats = NVK::DescriptorBufferInfo(m_furCullStats.buffer, 0, m_furCullStats.Sz);
+    nvk.updateDescriptorSets(NVK::WriteDescriptorSet
+    (m_descriptorSetFurCull, BINDING_FURCULL_PARAMS, 0, descCullParams, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER)
+    (m_descriptorSetFurCull, BINDING_FURCULL_STATS, 0, descCullStats, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER)
+    );
+    if (m_furClusterBuffer.buffer)
+    {
+      NVK::DescriptorBufferInfo descClusters = NVK::DescriptorBufferInfo(m_furClusterBuffer.buffer, 0, m_furClusterBuffer.Sz);
+      NVK::DescriptorBufferInfo descDraws = NVK::DescriptorBufferInfo(m_furCullDraws.buffer, 0, m_furCullDraws.Sz);
+      nvk.updateDescriptorSets(NVK::WriteDescriptorSet
+      (m_descriptorSetFurCull, BINDING_FURCULL_CLUSTERS, 0, descClusters, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER)
+      (m_descriptorSetFurCull, BINDING_FURCULL_DRAWS, 0, descDraws, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER)
+      );
+    }
+    if (m_hizView)
+    {
+      NVK::DescriptorImageInfo descHiZ(m_samplerNearest, m_hizView, VK_IMAGE_LAYOUT_GENERAL);
+      nvk.updateDescriptorSets(NVK::WriteDescriptorSet
+      (m_descriptorSetFurCull, BINDING_FURCULL_HIZ, 0, descHiZ, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER)
+      );
+    }
+  }
+
+  //------------------------------------------------------------------------------
+  // a frame needs more of m_uniforms than a region holds: the ring is made
+  // again with bigger regions, once all the frames are done with it
+  //------------------------------------------------------------------------------
+  void RendererVk::reserveUniforms(size_t bytes)
+  {
+    if (bytes <= m_uniforms.regionSize)
+      return;
+    size_t regionSize = m_uniforms.regionSize;
+    while (regionSize < bytes)
+      regionSize *= 2;
+    LOGI("Uniform ring: %d regions of %d KB\n", m_numFrames, (int)(regionSize >> 10));
+    waitAllFrames();
+    size_t align = m_uniforms.align;
+    m_uniforms.deinit();
+    m_uniforms.init(m_numFrames, regionSize, align);
+    writeUniformDescriptors();
+    // they have the old offsets, and the sets were updated
+    releaseSceneCmd();
+  }
+  //------------------------------------------------------------------------------
+  // the scene command-buffer of m_cmdSceneIdx == idx, submitted again at every
+  // frame until the render-target, the pipelines or the fur change: the matrices
+  // and the procedural draw come from the region idx of m_uniforms, the other
+  // draws from m_furIndirect[idx]
+  //------------------------------------------------------------------------------
+  void RendererVk::recordSceneCmd(int idx, const FrameOffsets& offsets)
+  {
+    float w = (float)m_nvFBOBox.getBufferWidth();
+    float h = (float)m_nvFBOBox.getBufferHeight();
+    VkRenderPass    renderPass = m_nvFBOBox.getScenePass();
+    VkFramebuffer   framebuffer = m_nvFBOBox.getFramebuffer();
+    NVK::Rect2D   viewRect = m_nvFBOBox.getViewRect();
+    NVK::CommandBuffer cmdScene = m_cmdPool.utRequestCmdBuffer(true);
+    m_sceneCmd[idx] = cmdScene.m_cmdbuffer;
+    m_sceneOffsets[idx] = offsets;
+    // no single-shot: it is submitted again
+    cmdScene.beginCommandBuffer(false);
+    if (m_furStatsQueries)
+      cmdScene.cmdResetQueryPool(m_furStatsQueries, idx, 1);
+    vkCmdBeginRenderPass(cmdScene,
+      NVK::RenderPassBeginInfo(
+        renderPass, framebuffer, viewRect,
+        NVK::ClearValue(NVK::ClearColorValue(0.0f, 0.1f, 0.15f, 1.0f))
+        (NVK::ClearDepthStencilValue(1.0, 0))
+        (NVK::ClearColorValue(0.0f, 0.1f, 0.15f, 1.0f))
+      ),
+      VK_SUBPASS_CONTENTS_INLINE);
+    vkCmdSetViewport(cmdScene, 0, 1, NVK::Viewport(0.0, 0.0, w, h, 0.0f, 1.0f));
+    vkCmdSetScissor(cmdScene, 0, 1, NVK::Rect2D(0.0, 0.0, w, h));
+    // the CPU wrote them before the submission: visible without barrier
+    uint32_t objectOffsets[2] = { offsets.object, offsets.object };
+    vkCmdBindDescriptorSets(cmdScene, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineLayout, DSET_GLOBAL, 1, &m_descriptorSetGlobal, 1, &offsets.matrix);
+    vkCmdBindDescriptorSets(cmdScene, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineLayout, DSET_OBJECT, 1, &m_descriptorSetObject, 2, objectOffsets);
+    if (m_furStatsQueries)
+      cmdScene.cmdBeginQuery(m_furStatsQueries, idx, 0);
+    if (m_furFormat == FUR_FORMAT_PROCEDURAL)
+    {
+      // no strands: BINDING_STRANDCTRL has no buffer
+      if (m_furStrands > 0)
+      {
+        vkCmdBindPipeline(cmdScene, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelinefurProcedural);
+        vkCmdDrawIndirect(cmdScene, m_uniforms.buffer.buffer, offsets.procDraw, 1, sizeof(VkDrawIndirectCommand));
+      }
+    }
+    else
+    {
+      vkCmdBindPipeline(cmdScene, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelinefur);
+      bool multiDraw = nvk.m_gpu.features2.features.multiDrawIndirect ? true : false;
+      for (size_t i = 0; i < m_furBlocks.size(); i++)
+      {
+        FurBlock& block = m_furBlocks[i];
+        VkDeviceSize vboffsets[1] = { 0 };
+        vkCmdBindVertexBuffers(cmdScene, 0, 1, &block.vertices.buffer, vboffsets);
+        vkCmdBindIndexBuffer(cmdScene, block.indices.buffer, 0, VK_INDEX_TYPE_UINT32);
+        VkDeviceSize offset = block.drawOffset * sizeof(FurDrawIndexed);
+        if (multiDraw)
+          cmdScene.cmdDrawIndexedIndirect(m_furIndirect[idx].buffer, offset, block.numDraws(), sizeof(FurDrawIndexed));
+        else
+        {
+          for (uint32_t d = 0; d < block.numDraws(); d++)
+            cmdScene.cmdDrawIndexedIndirect(m_furIndirect[idx].buffer, offset + d * sizeof(FurDrawIndexed), 1, sizeof(FurDrawIndexed));
+        }
+      }
+    }
+    if (m_furStatsQueries)
+      cmdScene.cmdEndQuery(m_furStatsQueries, idx);
+    vkCmdEndRenderPass(cmdScene);
+    vkEndCommandBuffer(cmdScene);
+  }
+  //------------------------------------------------------------------------------
+  // drops m_sceneCmd when what it was recorded with goes away. The GPU isn't
+  // idle: the command-buffers are retired, freed once the frames in flight are
+  // done with them
+  //------------------------------------------------------------------------------
+  void RendererVk::releaseSceneCmd()
+  {
+    // the frames in flight may still execute them
+    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
+    {
+      nvk.utRetire(&m_cmdPool, m_sceneCmd[i]);
+      m_sceneCmd[i] = NULL;
+    }
+  }
+  //------------------------------------------------------------------------------
+  //
+  //------------------------------------------------------------------------------
+  void RendererVk::updateFur()
+  {
+    if (m_bValid == false) return;
+    // procedural strands pick nsteps up at every frame
+    if ((m_furFormat == FUR_FORMAT_PROCEDURAL) && (g_furFormat == FUR_FORMAT_PROCEDURAL) && (m_furStrands == g_furParams.numStrands) && (m_furRadius == g_furParams.radius)
+        && (m_furLayout == g_furLayout))
+      return;
+    // deliberately blocking, unlike a resize: the fur is rebuilt in place, in
+    // buffers and descriptor sets the frames in flight still read. A rebuild
+    // takes far longer than the wait
+    nvk.deviceWaitIdle();
+    deleteFur();
+    initFur();
+    initRenderPassRelated();
+  }
+  //------------------------------------------------------------------------------
   //
   //------------------------------------------------------------------------------
   void RendererVk::display(const InertiaCamera& camera, const glm::mat4& projection)
   {
     float w, h;
-    std::vector<VkCommandBuffer> &cmdBufferQueue = m_cmdBufferQueue[m_cmdSceneIdx];
+    NVK::CommandPool &framePool = m_framePools[m_cmdSceneIdx];
+    m_cmdSubmit.clear();
     {
       if (m_bValid == false) return;
       //NXPROFILEFUNC(__FUNCTION__);
@@ -366,81 +2119,194 @@ namespace vk
       g_globalMatrices.mP = projection;
       w = (float)m_nvFBOBox.getBufferWidth();
       h = (float)m_nvFBOBox.getBufferHeight();
+      // switching level only changes what is drawn
+      int lod = (g_furLod >= 0) ? g_furLod : furSelectLod(g_furParams, camera.m4_view, projection, h);
+      lod = std::min(lod, m_furLodLevels - 1);
+      g_furLodLevel = lod;
+      int procSteps = furLodSteps(std::max(1, g_furParams.nsteps), lod);
+      if (m_furFormat == FUR_FORMAT_PROCEDURAL)
+      {
+        g_globalMatrices.furInfo.y = procSteps;
+        g_globalMatrices.furInfo.z = std::max(1, g_furParams.nsteps);
+      }
       VkRenderPass    renderPass = m_nvFBOBox.getScenePass();
       VkFramebuffer   framebuffer = m_nvFBOBox.getFramebuffer();
       NVK::Rect2D   viewRect = m_nvFBOBox.getViewRect();
+      // the clusters are in the space of the fur: so are the planes and the eye
+      glm::mat4 viewProj = projection * camera.m4_view * m_furObject;
+      glm::vec4 planes[6];
+      furFrustumPlanes(planes, viewProj);
+      glm::vec3 eye = glm::vec3(glm::inverse(camera.m4_view * m_furObject)[3]);
+      // the blocks of a level are contiguous in m_furBlocks: so are their draws
+      uint32_t firstCluster = 0;
+      uint32_t numClusters = 0;
+      for (size_t i = 0; i < m_furBlocks.size(); i++)
+      {
+        if ((m_furBlocks[i].lod != lod) || (m_furBlocks[i].clusters.size() == 0))
+          continue;
+        if (numClusters == 0)
+          firstCluster = m_furBlocks[i].drawOffset;
+        numClusters += m_furBlocks[i].clusters.size();
+      }
+      bool gpuCulling = g_furCulling && g_furGpuCulling && (m_furFormat != FUR_FORMAT_PROCEDURAL) && (numClusters > 0);
+      // the pre-recorded scene has nothing of the frame in its commands: neither
+      // the GPU culling nor the generation, dispatched from the frame, fit in
+      bool staticCmd = g_vkStaticCmd && !gpuCulling && !m_furGenPending;
       //
-      // Create the primary command buffer
+      // what the shaders read of the frame, in its region of m_uniforms: the
+      // fence of m_cmdSceneIdx was waited for after the previous submission
       //
-      NVK::CommandBuffer cmdScene = m_cmdPool.utRequestCmdBuffer(true);
-      cmdBufferQueue.push_back(cmdScene.m_cmdbuffer);
-
-      cmdScene.beginCommandBuffer(false, NVK::CommandBufferInheritanceInfo(renderPass, 0, framebuffer, VK_FALSE, 0, 0));
-
-      {
-        const nvvk::ProfilerVK::Section profile(m_profilerVK, "frame", cmdScene.m_cmdbuffer);
-        vkCmdUpdateBuffer(cmdScene, m_matrix.buffer, 0, sizeof(g_globalMatrices), (uint32_t*)&g_globalMatrices);
-        vkCmdBeginRenderPass(cmdScene,
-          NVK::RenderPassBeginInfo(
-            renderPass, framebuffer, viewRect,
-            NVK::ClearValue(NVK::ClearColorValue(0.0f, 0.1f, 0.15f, 1.0f))
-            (NVK::ClearDepthStencilValue(1.0, 0))
-            (NVK::ClearColorValue(0.0f, 0.1f, 0.15f, 1.0f))
-          ),
-          VK_SUBPASS_CONTENTS_INLINE);
-        //
-        // render the mesh
-        //
-        vkCmdBindPipeline(cmdScene, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelinefur);
-        vkCmdSetViewport(cmdScene, 0, 1, NVK::Viewport(0.0, 0.0, w, h, 0.0f, 1.0f));
-        vkCmdSetScissor(cmdScene, 0, 1, NVK::Rect2D(0.0, 0.0, w, h));
-        VkDeviceSize vboffsets[1] = { 0 };
-        vkCmdBindVertexBuffers(cmdScene, 0, 1, &m_furBuffer.buffer, vboffsets);
+      reserveUniforms(m_uniforms.aligned(sizeof(MatrixBufferGlobal)) + m_uniforms.aligned(sizeof(MatrixBufferObject))
+        + m_uniforms.aligned(sizeof(VkDrawIndirectCommand)));
+      FrameOffsets offsets = {};
+      m_uniforms.begin(m_cmdSceneIdx);
+      *(MatrixBufferGlobal*)m_uniforms.alloc(sizeof(MatrixBufferGlobal), offsets.matrix) = g_globalMatrices;
+      ((MatrixBufferObject*)m_uniforms.alloc(sizeof(MatrixBufferObject), offsets.object))->mO = m_furObject;
+      if (staticCmd)
+      {
+        VkDrawIndirectCommand& procDraw = *(VkDrawIndirectCommand*)m_uniforms.alloc(sizeof(VkDrawIndirectCommand), offsets.procDraw);
+        procDraw.vertexCount = (uint32_t)furProceduralVerticesPerStrand(procSteps);
+        procDraw.instanceCount = m_furStrands;
+        procDraw.firstVertex = 0;
+        procDraw.firstInstance = 0;
+        if (m_furFormat != FUR_FORMAT_PROCEDURAL)
+          writeFurDraws(lod, planes, eye);
+        if (m_sceneCmd[m_cmdSceneIdx] && memcmp(&m_sceneOffsets[m_cmdSceneIdx], &offsets, sizeof(FrameOffsets)))
+        {
+          // its last submission is behind the fence of m_cmdSceneIdx
+          m_cmdPool.utFreeCommandBuffer(m_sceneCmd[m_cmdSceneIdx]);
+          m_sceneCmd[m_cmdSceneIdx] = NULL;
+        }
+        if (!m_sceneCmd[m_cmdSceneIdx])
+          recordSceneCmd(m_cmdSceneIdx, offsets);
+        // the timestamps of the profiler change at every frame: they go in
+        // tiny command-buffers around the scene
+        NVK::CommandBuffer cmdBegin = framePool.utRequestCmdBuffer(true);
+        NVK::CommandBuffer cmdEnd = framePool.utRequestCmdBuffer(true);
+        cmdBegin.beginCommandBuffer(true);
+        nvvk::ProfilerVK::SectionID section = m_profilerVK.beginSection("frame", cmdBegin.m_cmdbuffer);
+        vkEndCommandBuffer(cmdBegin);
+        cmdEnd.beginCommandBuffer(true);
+        m_profilerVK.endSection(section, cmdEnd.m_cmdbuffer);
+        vkEndCommandBuffer(cmdEnd);
+        m_cmdSubmit.push_back(cmdBegin.m_cmdbuffer);
+        m_cmdSubmit.push_back(m_sceneCmd[m_cmdSceneIdx]);
+        m_cmdSubmit.push_back(cmdEnd.m_cmdbuffer);
+        m_furStatsPending[m_cmdSceneIdx] = m_furStatsQueries ? true : false;
+        m_prevViewProj = viewProj;
+        m_hizValid = true;
+      }
+      else
+      {
         //
-        // bind the descriptor set for global stuff
+        // Create the primary command buffer
         //
-        vkCmdBindDescriptorSets(cmdScene, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineLayout, DSET_GLOBAL, 1, &m_descriptorSetGlobal, 0, NULL);
+        NVK::CommandBuffer cmdScene = framePool.utRequestCmdBuffer(true);
 
-        vkCmdDraw(cmdScene, m_nElmts, 1, 0, 0);
-        //
-        //
-        //
-        vkCmdEndRenderPass(cmdScene);
+        cmdScene.beginCommandBuffer(false, NVK::CommandBufferInheritanceInfo(renderPass, 0, framebuffer, VK_FALSE, 0, 0));
+
+        {
+          const nvvk::ProfilerVK::Section profile(m_profilerVK, "frame", cmdScene.m_cmdbuffer);
+          if (m_furGenPending)
+          {
+            const nvvk::ProfilerVK::Section profileGen(m_profilerVK, "furgen", cmdScene.m_cmdbuffer);
+            cmdFurGen(cmdScene.m_cmdbuffer, false);
+            m_furGenPending = false;
+          }
+          if (gpuCulling)
+          {
+            const nvvk::ProfilerVK::Section profileCull(m_profilerVK, "furcull", cmdScene.m_cmdbuffer);
+            cmdFurCull(cmdScene.m_cmdbuffer, firstCluster, numClusters, viewProj, planes);
+          }
+          bool procedural = m_furFormat == FUR_FORMAT_PROCEDURAL;
+          if (!procedural)
+            gatherFurDraws(lod, gpuCulling, planes, eye);
+          // several workers: the render pass only executes their secondary
+          // command-buffers, the fragments are counted if they can inherit the query
+          int workers = procedural ? 1 : std::min(g_vkRecordThreads, (int)m_furSpans.size());
+          bool parallel = workers > 1;
+          bool query = m_furStatsQueries && (!parallel || nvk.m_gpu.features2.features.inheritedQueries);
+          if (parallel)
+          {
+            const nvvk::ProfilerVK::Section profileRecord(m_profilerVK, "record", cmdScene.m_cmdbuffer);
+            recordFurParallel(workers, offsets, query);
+          }
+          // must happen outside of the render pass
+          if (query)
+            cmdScene.cmdResetQueryPool(m_furStatsQueries, m_cmdSceneIdx, 1);
+          if (query && parallel)
+            cmdScene.cmdBeginQuery(m_furStatsQueries, m_cmdSceneIdx, 0);
+          vkCmdBeginRenderPass(cmdScene,
+            NVK::RenderPassBeginInfo(
+              renderPass, framebuffer, viewRect,
+              NVK::ClearValue(NVK::ClearColorValue(0.0f, 0.1f, 0.15f, 1.0f))
+              (NVK::ClearDepthStencilValue(1.0, 0))
+              (NVK::ClearColorValue(0.0f, 0.1f, 0.15f, 1.0f))
+            ),
+            parallel ? VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS : VK_SUBPASS_CONTENTS_INLINE);
+          if (parallel)
+            cmdScene.cmdExecuteCommands(workers, m_recordCmd[m_cmdSceneIdx]);
+          else
+          {
+            //
+            // render the mesh
+            //
+            cmdFurState(cmdScene, offsets, w, h);
+            if (query)
+              cmdScene.cmdBeginQuery(m_furStatsQueries, m_cmdSceneIdx, 0);
+            if (procedural && (m_furStrands > 0))
+            {
+              // no vertex buffer: one instance per strand
+              vkCmdBindPipeline(cmdScene, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelinefurProcedural);
+              vkCmdDraw(cmdScene, (uint32_t)furProceduralVerticesPerStrand(procSteps), m_furStrands, 0, 0);
+            }
+            else if (!procedural)
+            {
+              vkCmdBindPipeline(cmdScene, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelinefur);
+              cmdDrawFurSpans(cmdScene, m_furSpans.data(), (int)m_furSpans.size());
+            }
+            if (query)
+              cmdScene.cmdEndQuery(m_furStatsQueries, m_cmdSceneIdx);
+          }
+          vkCmdEndRenderPass(cmdScene);
+          if (query && parallel)
+            cmdScene.cmdEndQuery(m_furStatsQueries, m_cmdSceneIdx);
+          m_furStatsPending[m_cmdSceneIdx] = query;
+          // the next frame finds the depth of this one
+          m_prevViewProj = viewProj;
+          m_hizValid = true;
+        }
+        vkEndCommandBuffer(cmdScene);
+        m_cmdSubmit.push_back(cmdScene.m_cmdbuffer);
       }
-      vkEndCommandBuffer(cmdScene);
     }
     //
     // this is going to issue another command-buffer
     //
-    VkCommandBuffer cmdDownSample = m_nvFBOBox.Draw(downsamplingMode);
+    // kept by m_nvFBOBox: submitted, never freed here. Each frame downsamples
+    // into its own image: OpenGL may still read the one of the previous frame
+    VkCommandBuffer cmdDownSample = m_nvFBOBox.Draw(downsamplingMode, 0, 0, m_cmdSceneIdx);
     if (cmdDownSample)
-      cmdBufferQueue.push_back(cmdDownSample);
+      m_cmdSubmit.push_back(cmdDownSample);
 
-    VkCommandBuffer *arrayCmdBuffer = &cmdBufferQueue[0];
+    VkCommandBuffer *arrayCmdBuffer = &m_cmdSubmit[0];
     const VkPipelineStageFlags waitStages = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
 
     nvk.queueSubmit(NVK::SubmitInfo(
       1, &m_semOpenGLReadDone, &waitStages,
-      cmdBufferQueue.size(), arrayCmdBuffer,
+      m_cmdSubmit.size(), arrayCmdBuffer,
       0, NULL/*&m_semVKRenderingDone*/),
       m_sceneFence[m_cmdSceneIdx]
     );
+    m_sceneSubmitted[m_cmdSceneIdx] = true;
+    m_sceneSerial[m_cmdSceneIdx] = nvk.utFrameSubmitted();
+    int displayIdx = m_cmdSceneIdx;
     //
-    // pingpong between 2 cmd-buffers to avoid waiting for them to be done
+    // round robin between the frames in flight: only the oldest one is waited
+    // for, before it gets recorded again
     //
-    m_cmdSceneIdx ^= 1;
-    std::vector<VkCommandBuffer> &cmdBufferQueue2 = m_cmdBufferQueue[m_cmdSceneIdx];
-    if (!cmdBufferQueue2.empty())
-    {
-      while (nvk.waitForFences(1, &m_sceneFence[m_cmdSceneIdx], VK_TRUE, 100000000) == false)
-      {
-        LOGW(">>>>>> TIMEOUT ON WAIT FENCE\n");
-        break;
-      }
-      nvk.resetFences(1, &m_sceneFence[m_cmdSceneIdx]);
-      m_cmdPool.utFreeCommandBuffers(&cmdBufferQueue2[0], cmdBufferQueue2.size() - (cmdDownSample ? 1 : 0));  // -1 bcause the last one comes from m_nvFBOBox and must be kept intact
-      cmdBufferQueue2.clear();
-    }
+    m_cmdSceneIdx = (m_cmdSceneIdx + 1) % m_numFrames;
+    waitFrame(m_cmdSceneIdx, true);
 
     w = m_nvFBOBox.getWidth();
     h = m_nvFBOBox.getHeight();
@@ -453,7 +2319,7 @@ namespace vk
     //
     // Blit the image
     //
-    glDrawVkImageNV((GLuint64)m_nvFBOBox.getColorImage(), 0, 0, 0, w, h, 0, 0, 1, 1, 0);
+    glDrawVkImageNV((GLuint64)m_nvFBOBox.getColorImage(displayIdx), 0, 0, 0, w, h, 0, 0, 1, 1, 0);
     //
     // Signal m_semOpenGLReadDone to tell the VK rendering queue that it can render the next one
     //
@@ -464,75 +2330,119 @@ namespace vk
     glEnable(GL_DEPTH_TEST);
   }
 
+  //------------------------------------------------------------------------------
+  // waits for the frame idx if it was submitted, then recycles its command-buffers
+  // and reads what it counted. count: the wait goes in the statistics of how
+  // often the CPU is blocked by the GPU
+  //------------------------------------------------------------------------------
+  void RendererVk::waitFrame(int idx, bool count)
+  {
+    if (!m_sceneSubmitted[idx])
+      return;
+    bool blocked = nvk.getFenceStatus(m_sceneFence[idx]) == VK_NOT_READY;
+    auto t0 = std::chrono::high_resolution_clock::now();
+    while (nvk.waitForFences(1, &m_sceneFence[idx], VK_TRUE, 100000000) == false)
+      LOGW(">>>>>> TIMEOUT ON WAIT FENCE\n");
+    if (count)
+    {
+      auto t1 = std::chrono::high_resolution_clock::now();
+      m_waitFrames++;
+      if (blocked)
+      {
+        m_blockedFrames++;
+        m_blockedMs += std::chrono::duration<double, std::milli>(t1 - t0).count();
+      }
+      if (m_waitFrames == FRAME_STATS_WINDOW)
+      {
+        g_vkFramesBlocked = (float)m_blockedFrames / (float)m_waitFrames;
+        g_vkBlockedMs = (float)(m_blockedMs / m_waitFrames);
+        m_waitFrames = m_blockedFrames = 0;
+        m_blockedMs = 0.0;
+      }
+    }
+    nvk.resetFences(1, &m_sceneFence[idx]);
+    m_sceneSubmitted[idx] = false;
+    m_framePools[idx].utRecycle();
+    // and every submission before it: what was retired until then
+    nvk.utCollectRetired(m_sceneSerial[idx]);
+    // counters of the GPU culling of that frame: late, but never waited for
+    if (m_furCullPending[idx])
+    {
+      const FurCullStats& stats = *m_furCullReadbackPtr[idx];
+      g_furClustersVisible = stats.visible;
+      g_furClustersOccluded = stats.occluded;
+      g_furClusters = stats.visible + stats.frustumCulled + stats.occluded;
+      m_furCullPending[idx] = false;
+    }
+    if (m_furStatsPending[idx])
+    {
+      uint64_t fragments = 0;
+      if (nvk.getQueryPoolResults(m_furStatsQueries, idx, 1, sizeof(uint64_t), &fragments, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) == VK_SUCCESS)
+        g_furFragments = fragments;
+      m_furStatsPending[idx] = false;
+    }
+  }
+  void RendererVk::waitAllFrames()
+  {
+    for (int i = 0; i < m_numFrames; i++)
+      waitFrame(i, false);
+  }
   //------------------------------------------------------------------------------
   //
   //------------------------------------------------------------------------------
   void RendererVk::initRenderPassRelated()
   {
+    // recorded with the previous framebuffer, pipelines and fur
+    releaseSceneCmd();
     //
-    // Init 'pipelines'
-    //
-    if (m_pipelinefur)
-      vkDestroyPipeline(nvk.m_device, m_pipelinefur, NULL);
-    m_pipelinefur = NULL;
-    // we don't care about the viewport... will be dynamcically setup
-    NVK::PipelineViewportStateCreateInfo vkPipelineViewportStateCreateInfo(
-      NVK::Viewport(0.0f, 0.0f, (float)100, (float)100, 0.0f, 1.0f),
-      NVK::Rect2DArray(0.0f, 0.0f, (float)100, (float)100)
-    );
-    //
-    // Get the renderpass on which the pipeline will be used
+    // Pick the 'pipelines' up. m_furPipelines keeps the previous ones for the
+    // frames in flight
     //
-    VkRenderPass    renderPass = m_nvFBOBox.getScenePass();
-
-    ::VkSampleMask sampleMask = 0xFFFF;
-    m_vkPipelineMultisampleStateCreateInfo = NVK::PipelineMultisampleStateCreateInfo(
-      (VkSampleCountFlagBits)m_MSAA /*rasterSamples*/, VK_FALSE /*sampleShadingEnable*/, 1.0 /*minSampleShading*/, &sampleMask /*sampleMask*/, VK_FALSE, VK_FALSE);
-    //
-    // Fur gfx pipeline
-    //
-    m_pipelinefur = nvk.createGraphicsPipeline(NVK::GraphicsPipelineCreateInfo
-    (m_pipelineLayout, renderPass,/*subpass*/0,/*basePipelineHandle*/0,/*basePipelineIndex*/0,/*flags*/0)
-      (NVK::PipelineVertexInputStateCreateInfo(
-        NVK::VertexInputBindingDescription(0/*binding*/, sizeof(Vertex)/*stride*/, VK_VERTEX_INPUT_RATE_VERTEX),
-        NVK::VertexInputAttributeDescription(0/*location*/, 0/*binding*/, VK_FORMAT_R32G32B32_SFLOAT, 0) // pos
-        (1/*location*/, 0/*binding*/, VK_FORMAT_R32G32B32_SFLOAT, sizeof(glm::vec3)) // normal
-        (2/*location*/, 0/*binding*/, VK_FORMAT_R32G32B32A32_SFLOAT, 2 * sizeof(glm::vec3)) // color
-      ))
-      (NVK::PipelineInputAssemblyStateCreateInfo(VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST, VK_FALSE))
-      (NVK::PipelineShaderStageCreateInfo(
-        VK_SHADER_STAGE_VERTEX_BIT, nvk.createShaderModule(m_spv_GLSL_fur_vert.c_str(), m_spv_GLSL_fur_vert.size()), "main"))
-        (vkPipelineViewportStateCreateInfo)
-      (m_vkPipelineRasterStateCreateInfo)
-      (m_vkPipelineMultisampleStateCreateInfo)
-      (NVK::PipelineShaderStageCreateInfo(
-        VK_SHADER_STAGE_FRAGMENT_BIT, nvk.createShaderModule(m_spv_GLSL_fur_frag.c_str(), m_spv_GLSL_fur_frag.size()), "main"))
-        (m_vkPipelineColorBlendStateCreateInfo)
-      (m_vkPipelineDepthStencilStateCreateInfo)
-      (m_dynamicStateCreateInfo)
-    );
+    if (m_furFormat == FUR_FORMAT_PROCEDURAL)
+      m_pipelinefurProcedural = m_furPipelines.get(FurPipelineVariants::KIND_PROCEDURAL, m_MSAA);
+    else
+      m_pipelinefur = m_furPipelines.get(m_furFormat == FUR_FORMAT_COMPACT ? FurPipelineVariants::KIND_COMPACT : FurPipelineVariants::KIND_FULL, m_MSAA);
+  }
+  //------------------------------------------------------------------------------
+  // fur pipelines of the MSAA settings of the UI, the current one first: the
+  // first frame doesn't wait for the others. Without g_vkPipelineVariants,
+  // they get built when first needed
+  //------------------------------------------------------------------------------
+  void RendererVk::initFurPipelines()
+  {
+    FurPipelineVariants& v = m_furPipelines;
+    v.init(&m_nvFBOBox);
+    v.layout = m_pipelineLayout;
+    v.vert[FurPipelineVariants::KIND_FULL] = nvk.createShaderModule(m_spv_GLSL_fur_vert.c_str(), m_spv_GLSL_fur_vert.size());
+    v.vert[FurPipelineVariants::KIND_COMPACT] = nvk.createShaderModule(m_spv_GLSL_fur_compact_vert.c_str(), m_spv_GLSL_fur_compact_vert.size());
+    v.vert[FurPipelineVariants::KIND_PROCEDURAL] = nvk.createShaderModule(m_spv_GLSL_fur_procedural_vert.c_str(), m_spv_GLSL_fur_procedural_vert.size());
+    v.frag = nvk.createShaderModule(m_spv_GLSL_fur_frag.c_str(), m_spv_GLSL_fur_frag.size());
+    v.raster = &m_vkPipelineRasterStateCreateInfo;
+    v.colorBlend = &m_vkPipelineColorBlendStateCreateInfo;
+    v.depthStencil = &m_vkPipelineDepthStencilStateCreateInfo;
+    v.dynamicState = &m_dynamicStateCreateInfo;
+    if (!g_vkPipelineVariants)
+      return;
+    static const int uiSamples[] = { 1, 4, 8 }; // COMBO_MSAA of main.cpp
+    std::vector<int> samples(1, m_MSAA);
+    for (int i = 0; i < 3; i++)
+      if (uiSamples[i] != m_MSAA)
+        samples.push_back(uiSamples[i]);
+    v.start(samples);
+    LOGI("Pipeline variants: %d MSAA settings x %d fur formats, on %d threads\n", (int)samples.size(), (int)FurPipelineVariants::KIND_COUNT,
+      (int)v.workers.size());
   }
   //------------------------------------------------------------------------------
   //
   //------------------------------------------------------------------------------
   void RendererVk::updateMSAA(int MSAA)
   {
-    // first, make sure we are done with any Queue
-    nvk.deviceWaitIdle();
-    for (int i = 0; i < 2; i++) {
-      VkResult res = nvk.getFenceStatus(m_sceneFence[i]);
-      if (res != VK_NOT_READY) {
-        while (nvk.waitForFences(1, &m_sceneFence[i], VK_TRUE, 100000000) == false)
-        {
-          LOGW(">>>>>> TIMEOUT ON WAIT FENCE\n");
-          break;
-        }
-        nvk.resetFences(1, &m_sceneFence[i]);
-      }
-    }
+    // no wait for the GPU: the frames in flight keep what they use until
+    // waitFrame() collects it
     m_MSAA = MSAA;
     m_nvFBOBox.setMSAA(MSAA);
     initRenderPassRelated();
+    initHiZ();
 
   }
   //------------------------------------------------------------------------------
@@ -542,23 +2452,13 @@ namespace vk
   {
     if (m_bValid == false) return;
     int prevLineW = m_nvFBOBox.getSSFactor();
-    // first, make sure we are done with any Queue
-    nvk.deviceWaitIdle();
-    for (int i = 0; i < 2; i++) {
-      VkResult res = nvk.getFenceStatus(m_sceneFence[i]);
-      if (res != VK_NOT_READY) {
-        while (nvk.waitForFences(1, &m_sceneFence[i], VK_TRUE, 100000000) == false)
-        {
-          LOGW(">>>>>> TIMEOUT ON WAIT FENCE\n");
-          break;
-        }
-        nvk.resetFences(1, &m_sceneFence[i]);
-      }
-    }
+    // no wait for the GPU: what the frames in flight use is retired, see
+    // NVK::utRetire()
     // resize the intermediate super-sampled render-target
     m_nvFBOBox.resize(width, height, SSFactor);
 
     initRenderPassRelated();
+    initHiZ();
   }
 
   //------------------------------------------------------------------------------
@@ -576,29 +2476,33 @@ namespace vk
     if (!m_bValid)
       return true;
     nvk.deviceWaitIdle();
-    for (int i = 0; i < 2; i++) {
-      VkResult res = nvk.getFenceStatus(m_sceneFence[i]);
-      if (res != VK_NOT_READY) {
-        while (nvk.waitForFences(1, &m_sceneFence[i], VK_TRUE, 100000000) == false)
-        {
-          LOGW(">>>>>> TIMEOUT ON WAIT FENCE\n");
-          break;
-        }
-        nvk.resetFences(1, &m_sceneFence[i]);
-      }
-    }
+    waitAllFrames();
+    m_workers.destroy();
+    // its workers use m_pipelineLayout
+    m_furPipelines.destroy();
+    m_pipelinefur = NULL;
+    m_pipelinefurProcedural = NULL;
     // destroy the super-sampling pass system
+    deleteHiZ();
     m_nvFBOBox.Finish();
-    // destroys commandBuffers: but not really needed since m_cmdPool later gets destroyed
-    for (int i = 0; i < 2; i++)
+    // the command-buffers of the frames were freed by waitAllFrames()
+    for (int i = 0; i < m_numFrames; i++)
     {
       nvk.destroyFence(m_sceneFence[i]);
       m_sceneFence[i] = NULL;
-      if (m_cmdBufferQueue[i].size() > 0)
-        m_cmdPool.utFreeCommandBuffers(&m_cmdBufferQueue[i][0], m_cmdBufferQueue[i].size() - 1); // -1 bcause the last one comes from m_nvFBOBox and must be kept intact
-      m_cmdBufferQueue[i].clear();
     }
+    releaseSceneCmd();
+    nvk.utCollectRetired(~0ull);
+    m_staging.deinit(&m_cmdPool);
     m_cmdPool.destroyCommandPool(); // destroys commands that are inside, obviously
+    for (int i = 0; i < m_numFrames; i++)
+      m_framePools[i].destroyCommandPool();
+    for (int t = 0; t < MAX_RECORD_THREADS; t++)
+    {
+      m_recordPools[t].destroyCommandPool();
+      for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
+        m_recordCmd[i][t] = NULL;
+    }
 
     for (int i = 0; i < DSET_TOTALAMOUNT; i++)
     {
@@ -607,6 +2511,7 @@ namespace vk
     }
     //vkFreeDescriptorSets(nvk.m_device, m_descPool, 1, &m_descriptorSetGlobal); // no really necessary: we will destroy the pool after that
     m_descriptorSetGlobal = NULL;
+    m_descriptorSetObject = NULL;
 
     vkDestroyDescriptorPool(nvk.m_device, m_descPool, NULL);
     m_descPool = NULL;
@@ -614,12 +2519,47 @@ namespace vk
     vkDestroyPipelineLayout(nvk.m_device, m_pipelineLayout, NULL);
     m_pipelineLayout = NULL;
 
-    if (m_pipelinefur)
-      vkDestroyPipeline(nvk.m_device, m_pipelinefur, NULL);
-    m_pipelinefur = NULL;
+    vkDestroyPipeline(nvk.m_device, m_pipelineFurGen, NULL);
+    m_pipelineFurGen = NULL;
+    vkDestroyPipelineLayout(nvk.m_device, m_pipelineLayoutFurGen, NULL);
+    m_pipelineLayoutFurGen = NULL;
+    vkDestroyDescriptorSetLayout(nvk.m_device, m_descriptorSetLayoutFurGen, NULL);
+    m_descriptorSetLayoutFurGen = NULL;
+    m_descriptorSetFurGen = NULL;
+    vkDestroyPipeline(nvk.m_device, m_pipelineFurCull, NULL);
+    m_pipelineFurCull = NULL;
+    vkDestroyPipelineLayout(nvk.m_device, m_pipelineLayoutFurCull, NULL);
+    m_pipelineLayoutFurCull = NULL;
+    vkDestroyDescriptorSetLayout(nvk.m_device, m_descriptorSetLayoutFurCull, NULL);
+    m_descriptorSetLayoutFurCull = NULL;
+    m_descriptorSetFurCull = NULL;
+    vkDestroyPipeline(nvk.m_device, m_pipelineHiZ, NULL);
+    m_pipelineHiZ = NULL;
+    vkDestroyPipeline(nvk.m_device, m_pipelineHiZMs, NULL);
+    m_pipelineHiZMs = NULL;
+    vkDestroyPipelineLayout(nvk.m_device, m_pipelineLayoutHiZ, NULL);
+    m_pipelineLayoutHiZ = NULL;
+    vkDestroyDescriptorSetLayout(nvk.m_device, m_descriptorSetLayoutHiZ, NULL);
+    m_descriptorSetLayoutHiZ = NULL;
+    nvk.destroySampler(m_samplerNearest);
+    m_samplerNearest = NULL;
 
-    m_furBuffer.release();
-    m_matrix.release();
+    deleteFur();
+    m_uniforms.deinit();
+    m_furGenParams.release();
+    m_furCullParams.release();
+    m_furCullStats.release();
+    for (int i = 0; i < m_numFrames; i++)
+    {
+      nvk.unmapMemory(m_furCullReadback[i].bufferMem);
+      m_furCullReadback[i].release();
+      m_furCullReadbackPtr[i] = NULL;
+      m_furCullPending[i] = false;
+      m_furStatsPending[i] = false;
+    }
+    if (m_furStatsQueries)
+      nvk.destroyQueryPool(m_furStatsQueries, NULL);
+    m_furStatsQueries = NULL;
 
     m_profilerVK.deinit();
 
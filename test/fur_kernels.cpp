@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2016-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2016-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+//--------------------------------------------------------------------
+// fur_kernels: the SIMD strand kernels and the procedural expansion,
+// checked against buildStrand(). Run by ctest: fails on any mismatch
+//
+// fur_kernels [tolerance] [strands] [steps]
+//--------------------------------------------------------------------
+#include <stdlib.h>
+
+#include "nvh/nvprint.hpp"
+#include "../fur_builder.h"
+
+int main(int argc, char** argv)
+{
+  float     tolerance = argc > 1 ? (float)atof(argv[1]) : 1e-5f;
+  FurParams params;
+  if(argc > 2)
+    params.numStrands = atoi(argv[2]);
+  if(argc > 3)
+    params.nsteps = atoi(argv[3]);
+  LOGI("Fur kernels: %d strands, %d steps, best kernel %s\n", params.numStrands, params.nsteps, furKernelName(furBestKernel()));
+  bool ok = furValidateKernels(params, tolerance);
+  ok      = furValidateProcedural(params, tolerance) && ok;
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
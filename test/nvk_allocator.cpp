@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2016-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2016-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+//--------------------------------------------------------------------
+// nvk_allocator: NVK::MemoryAllocator against a fake memory-properties
+// table, no device. Run by ctest: fails on any broken check
+//--------------------------------------------------------------------
+#include <stdlib.h>
+
+#include "nvh/nvprint.hpp"
+#include "../NVK.h"
+
+int main(int argc, char** argv)
+{
+  bool ok = NVK::MemoryAllocator::selfTest();
+  if(!ok)
+    LOGE("Vulkan memory allocator self-test failed\n");
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}